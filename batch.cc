@@ -0,0 +1,335 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Cody
+#include "internal.hh"
+// C++
+#include <chrono>
+#include <deque>
+// C
+#include <cstring>
+
+// Automatically corking client code
+
+// Each request has a slot, numbered by a serial.  The slots of the
+// queued requests are at the end, and get their responses when the
+// queue is sent.  Slots are retired from the front once their
+// responses are taken, or their Futures destroyed.
+
+namespace Cody {
+namespace Detail {
+
+using Clock = std::chrono::steady_clock;
+
+struct Slot
+{
+  Packet response {Client::PC_CORKED};
+  bool taken = false;
+};
+
+class Batch
+{
+public:
+  Client client;
+  std::deque<Slot> slots;
+  uint64_t base = 0;	///< Serial of the first slot
+  size_t queued = 0;	///< Slots not yet sent
+  size_t bytes = 0;	///< Encoded size of the queued requests
+  Clock::time_point oldest;
+
+  unsigned maxCount = 64;
+  size_t maxBytes = 16384;
+  unsigned maxDelay = 500;  ///< Microseconds
+
+  uint64_t requests = 0;
+  uint64_t blocks = 0;
+
+public:
+  Batch (Client &&c)
+    : client (std::move (c))
+  {
+  }
+
+public:
+  uint64_t Queue (unsigned code, char const *str, Flags flags, size_t len);
+  void Flush ();
+  int Poll ();
+
+public:
+  bool IsReady (uint64_t serial) const
+  {
+    return serial - base < slots.size () - queued;
+  }
+  Packet Take (uint64_t serial);
+  void Drop (uint64_t serial);
+
+private:
+  void Retire ();
+};
+
+// Make a request of the corked client, and send the queue if it has
+// reached a limit.
+
+uint64_t Batch::Queue (unsigned code, char const *str, Flags flags,
+		       size_t len)
+{
+  if (!queued)
+    {
+      client.Cork ();
+      oldest = Clock::now ();
+    }
+
+  switch (code)
+    {
+    case RC_MODULE_REPO:
+      client.ModuleRepo ();
+      break;
+
+    case RC_MODULE_EXPORT:
+      client.ModuleExport (str, flags, len);
+      break;
+
+    case RC_MODULE_IMPORT:
+      client.ModuleImport (str, flags, len);
+      break;
+
+    case RC_MODULE_COMPILED:
+      client.ModuleCompiled (str, flags, len);
+      break;
+
+    case RC_INCLUDE_TRANSLATE:
+      client.IncludeTranslate (str, flags, len);
+      break;
+    }
+
+  uint64_t serial = base + slots.size ();
+  slots.emplace_back ();
+  queued++;
+  requests++;
+  // The verb, name and separators, ignoring quoting
+  bytes += strlen (schemas[code].verb) + len + 2;
+
+  if ((maxCount && queued >= maxCount)
+      || (maxBytes && bytes >= maxBytes))
+    Flush ();
+  else
+    Poll ();
+
+  return serial;
+}
+
+void Batch::Flush ()
+{
+  if (!queued)
+    return;
+
+  blocks++;
+  auto responses = client.Uncork ();
+  size_t first = slots.size () - queued;
+  if (responses.size () != queued)
+    {
+      // A communication error, which every request gets
+      Packet &error = responses[0];
+      for (size_t ix = first; ix != slots.size (); ix++)
+	slots[ix].response = Packet (error.GetCode (), error.GetString ());
+    }
+  else
+    for (size_t ix = first; ix != slots.size (); ix++)
+      if (!slots[ix].taken)
+	slots[ix].response = std::move (responses[ix - first]);
+  queued = 0;
+  bytes = 0;
+
+  Retire ();
+}
+
+int Batch::Poll ()
+{
+  if (!queued || !maxDelay)
+    return -1;
+
+  auto waited = std::chrono::duration_cast<std::chrono::microseconds>
+    (Clock::now () - oldest).count ();
+  if (waited < maxDelay)
+    return int (maxDelay - waited);
+
+  Flush ();
+  return -1;
+}
+
+Packet Batch::Take (uint64_t serial)
+{
+  if (!IsReady (serial))
+    Flush ();
+
+  Slot &slot = slots[serial - base];
+  Packet response (std::move (slot.response));
+  slot.taken = true;
+  Retire ();
+
+  return response;
+}
+
+void Batch::Drop (uint64_t serial)
+{
+  slots[serial - base].taken = true;
+  Retire ();
+}
+
+// Forget the taken slots at the front, that have been sent
+
+void Batch::Retire ()
+{
+  while (slots.size () > queued && slots.front ().taken)
+    {
+      slots.pop_front ();
+      base++;
+    }
+}
+
+}
+
+BatchClient::Future::Future (Future &&src)
+  : batch (src.batch), serial (src.serial)
+{
+  src.batch = nullptr;
+}
+
+BatchClient::Future &BatchClient::Future::operator= (Future &&src)
+{
+  if (this != &src)
+    {
+      if (batch)
+	batch->Drop (serial);
+      batch = src.batch;
+      serial = src.serial;
+      src.batch = nullptr;
+    }
+
+  return *this;
+}
+
+BatchClient::Future::~Future ()
+{
+  if (batch)
+    batch->Drop (serial);
+}
+
+bool BatchClient::Future::IsReady () const
+{
+  return batch && batch->IsReady (serial);
+}
+
+Packet BatchClient::Future::Get ()
+{
+  if (!batch)
+    return Packet (Client::PC_ERROR, u8"response already taken");
+
+  Detail::Batch *b = batch;
+  batch = nullptr;
+
+  return b->Take (serial);
+}
+
+BatchClient::BatchClient (Server *s)
+  : impl (new Detail::Batch (Client (s)))
+{
+}
+
+BatchClient::BatchClient (int from, int to)
+  : impl (new Detail::Batch (Client (from, to)))
+{
+}
+
+BatchClient::~BatchClient ()
+{
+}
+
+Client &BatchClient::GetClient ()
+{
+  return impl->client;
+}
+
+void BatchClient::SetLimits (unsigned count, size_t bytes, unsigned usecs)
+{
+  impl->maxCount = count;
+  impl->maxBytes = bytes;
+  impl->maxDelay = usecs;
+}
+
+uint64_t BatchClient::GetRequests () const
+{
+  return impl->requests;
+}
+
+uint64_t BatchClient::GetBlocks () const
+{
+  return impl->blocks;
+}
+
+Packet BatchClient::Connect (char const *agent, char const *ident,
+			     size_t alen, size_t ilen)
+{
+  impl->Flush ();
+
+  return impl->client.Connect (agent, ident, alen, ilen);
+}
+
+BatchClient::Future BatchClient::ModuleRepo ()
+{
+  return Future (impl.get (), impl->Queue (Detail::RC_MODULE_REPO,
+					   nullptr, Flags::None, 0));
+}
+
+// The requests naming a module or header
+
+static uint64_t Named (Detail::Batch *impl, unsigned code,
+		       char const *str, Flags flags, size_t len)
+{
+  if (len == ~size_t (0))
+    len = strlen (str);
+
+  return impl->Queue (code, str, flags, len);
+}
+
+BatchClient::Future BatchClient::ModuleExport (char const *str, Flags flags,
+					       size_t len)
+{
+  return Future (impl.get (), Named (impl.get (), Detail::RC_MODULE_EXPORT,
+				     str, flags, len));
+}
+
+BatchClient::Future BatchClient::ModuleImport (char const *str, Flags flags,
+					       size_t len)
+{
+  return Future (impl.get (), Named (impl.get (), Detail::RC_MODULE_IMPORT,
+				     str, flags, len));
+}
+
+BatchClient::Future BatchClient::ModuleCompiled (char const *str, Flags flags,
+						 size_t len)
+{
+  return Future (impl.get (), Named (impl.get (), Detail::RC_MODULE_COMPILED,
+				     str, flags, len));
+}
+
+BatchClient::Future BatchClient::IncludeTranslate (char const *str,
+						   Flags flags, size_t len)
+{
+  return Future (impl.get (),
+		 Named (impl.get (), Detail::RC_INCLUDE_TRANSLATE,
+			str, flags, len));
+}
+
+void BatchClient::Flush ()
+{
+  impl->Flush ();
+}
+
+int BatchClient::Poll ()
+{
+  return impl->Poll ();
+}
+
+}
@@ -0,0 +1,662 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Benchmarks.  Results are written to stdout as JSON, one object
+// per benchmark in a "results" array.  Usage:
+//   cody-bench [-s $scale] [$name...]
+// $scale multiplies the iteration counts, and $names select the
+// benchmarks whose name begins with one of them.
+
+// Cody
+#include "cody.hh"
+// C++
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+// C
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+// OS
+#include <netinet/in.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+using namespace Cody;
+
+// Allocation counting.  Every allocation in the process is counted,
+// so measure nothing else in the timed regions.
+
+static std::atomic<size_t> allocs (0);
+static std::atomic<size_t> allocBytes (0);
+
+void *operator new (size_t size)
+{
+  allocs.fetch_add (1, std::memory_order_relaxed);
+  allocBytes.fetch_add (size, std::memory_order_relaxed);
+  if (void *ptr = malloc (size ? size : 1))
+    return ptr;
+  abort ();
+}
+
+void operator delete (void *ptr) noexcept
+{
+  free (ptr);
+}
+
+void operator delete (void *ptr, size_t) noexcept
+{
+  free (ptr);
+}
+
+using Clock = std::chrono::steady_clock;
+
+static uint64_t Nanoseconds (Clock::duration d)
+{
+  return uint64_t (std::chrono::duration_cast<std::chrono::nanoseconds>
+		   (d).count ());
+}
+
+// One benchmark's result, emitted as a JSON object
+class Result
+{
+  std::string fields;
+
+public:
+  Result (char const *name, size_t iterations)
+  {
+    fields.append (u8"\"name\": \"").append (name).append (u8"\"");
+    Add ("iterations", double (iterations));
+  }
+
+public:
+  void Add (char const *key, double value)
+  {
+    char buf[64];
+    snprintf (buf, sizeof (buf), "%.6g", value);
+    fields.append (u8", \"").append (key).append (u8"\": ").append (buf);
+  }
+  void Add (char const *key, char const *value)
+  {
+    fields.append (u8", \"").append (key).append (u8"\": \"")
+      .append (value).append (u8"\"");
+  }
+
+public:
+  std::string const &GetFields () const
+  {
+    return fields;
+  }
+};
+
+// Time FN over ITERATIONS operations, adding the rate and allocation
+// counts to RESULT.
+
+static void Measure (Result &result, size_t iterations,
+		     std::function<void ()> const &fn)
+{
+  size_t a = allocs, b = allocBytes;
+  auto start = Clock::now ();
+  fn ();
+  uint64_t ns = Nanoseconds (Clock::now () - start);
+
+  result.Add ("ns_per_op", double (ns) / iterations);
+  result.Add ("ops_per_s", iterations * 1e9 / (ns ? ns : 1));
+  result.Add ("allocs_per_op", double (allocs - a) / iterations);
+  result.Add ("alloc_bytes_per_op", double (allocBytes - b) / iterations);
+}
+
+// Add latency percentiles of SAMPLES to RESULT
+
+static void Percentiles (Result &result, std::vector<uint64_t> &samples)
+{
+  std::sort (samples.begin (), samples.end ());
+  uint64_t total = 0;
+  for (auto sample : samples)
+    total += sample;
+
+  result.Add ("mean_ns", double (total) / samples.size ());
+  static char const *const names[] = {"p50_ns", "p90_ns", "p99_ns", "p999_ns"};
+  static double const ranks[] = {0.5, 0.9, 0.99, 0.999};
+  for (unsigned ix = 0; ix != 4; ix++)
+    result.Add (names[ix],
+		double (samples[size_t (ranks[ix] * (samples.size () - 1))]));
+  result.Add ("max_ns", double (samples.back ()));
+}
+
+// Encode a representative request block of COUNT lines
+
+static void Encode (Detail::MessageBuffer &buffer, unsigned count)
+{
+  static char const *const names[] =
+    {"std.core", "./include/widget.h", "/usr/include/c++/vector",
+     "frob:part", "a module name with spaces"};
+
+  for (unsigned ix = 0; ix != count; ix++)
+    {
+      buffer.BeginLine ();
+      buffer.AppendWord (ix & 1 ? u8"INCLUDE-TRANSLATE" : u8"MODULE-IMPORT");
+      buffer.AppendWord (names[ix % 5], true);
+      buffer.EndLine ();
+    }
+}
+
+// Requests are processed in blocks of this many lines
+constexpr unsigned Block = 64;
+
+static Result EncodeBench (size_t n)
+{
+  n = (n + Block - 1) / Block * Block;
+  Result result ("encode", n);
+  Detail::MessageBuffer buffer;
+  size_t bytes = 0;
+  Measure (result, n, [&] ()
+	   {
+	     for (size_t done = 0; done != n; done += Block)
+	       {
+		 buffer.PrepareToRead ();
+		 Encode (buffer, Block);
+		 bytes += buffer.GetSize ();
+	       }
+	   });
+  result.Add ("bytes_per_op", double (bytes) / n);
+
+  return result;
+}
+
+static Result LexBench (size_t n)
+{
+  n = (n + Block - 1) / Block * Block;
+  Result result ("lex", n);
+  std::vector<Detail::MessageBuffer> buffers (n / Block);
+  for (auto &buffer : buffers)
+    {
+      Encode (buffer, Block);
+      buffer.PrepareToWrite ();
+    }
+
+  std::vector<std::string> words;
+  Measure (result, n, [&] ()
+	   {
+	     for (auto &buffer : buffers)
+	       while (!buffer.IsAtEnd ())
+		 buffer.Lex (words);
+	   });
+
+  return result;
+}
+
+// The server's resolver.  Everything is already built, so this
+// measures the library, not the file system.
+
+class Quick final : public Resolver
+{
+public:
+  virtual int IncludeTranslateRequest (Server *s, Flags, std::string &)
+  {
+    s->BoolResponse (false);
+    return 0;
+  }
+};
+
+// Dispatch through the type-erased Server, or a BasicServer bound to
+// the resolver
+
+template<typename ServerT>
+static Result DispatchBench (char const *name, size_t n)
+{
+  constexpr unsigned Batch = 8;
+  n = (n + Batch - 1) / Batch * Batch;
+  Result result (name, n);
+  Quick r;
+  ServerT server (&r);
+  Detail::MessageBuffer from, to;
+
+  // Handshake first
+  from.BeginLine ();
+  from.AppendWord (u8"HELLO");
+  from.AppendInteger (Version);
+  from.AppendWord (u8"BENCH");
+  from.AppendWord (u8"IDENT");
+  from.PrepareToWrite ();
+  server.DirectProcess (from, to);
+
+  Measure (result, n, [&] ()
+	   {
+	     for (size_t done = 0; done != n; done += Batch)
+	       {
+		 from.PrepareToRead ();
+		 Encode (from, Batch);
+		 from.PrepareToWrite ();
+		 to.PrepareToRead ();
+		 server.DirectProcess (from, to);
+	       }
+	   });
+
+  return result;
+}
+
+static Result DispatchBench (size_t n)
+{
+  return DispatchBench<Server> ("dispatch", n);
+}
+
+static Result BasicDispatchBench (size_t n)
+{
+  return DispatchBench<BasicServer<Quick>> ("dispatch.basic", n);
+}
+
+// Dispatch with the buffers allocated from an arena, reset after
+// each batch
+
+static Result ArenaDispatchBench (size_t n)
+{
+  constexpr unsigned Batch = 8;
+  n = (n + Batch - 1) / Batch * Batch;
+  Result result ("dispatch.arena", n);
+  ArenaResource arena;
+  Quick r;
+  Server server (&r);
+  server.SetMemoryResource (&arena);
+  Detail::MessageBuffer from (&arena), to (&arena);
+
+  // Handshake first
+  from.BeginLine ();
+  from.AppendWord (u8"HELLO");
+  from.AppendInteger (Version);
+  from.AppendWord (u8"BENCH");
+  from.AppendWord (u8"IDENT");
+  from.PrepareToWrite ();
+  server.DirectProcess (from, to);
+
+  Measure (result, n, [&] ()
+	   {
+	     for (size_t done = 0; done != n; done += Batch)
+	       {
+		 from.PrepareToRead ();
+		 Encode (from, Batch);
+		 from.PrepareToWrite ();
+		 to.PrepareToRead ();
+		 server.DirectProcess (from, to);
+
+		 // Release everything, then reset
+		 server.SetMemoryResource (&arena);
+		 from = Detail::MessageBuffer (&arena);
+		 to = Detail::MessageBuffer (&arena);
+		 arena.Reset ();
+	       }
+	   });
+
+  return result;
+}
+
+// Serve one connection until end of file
+
+static void Serve (Resolver *r, int from, int to)
+{
+  Server server (r, from, to);
+
+  for (;;)
+    {
+      int err;
+      server.PrepareToRead ();
+      while ((err = server.Read ()) == EAGAIN || err == EINTR)
+	continue;
+      if (err)
+	break;
+      server.ProcessRequests ();
+      server.PrepareToWrite ();
+      while ((err = server.Write ()) == EAGAIN || err == EINTR)
+	continue;
+      if (err)
+	break;
+    }
+}
+
+// Single request round trip latency over CLIENT
+
+static void RoundTrips (Result &result, Client &client, size_t n)
+{
+  client.Connect ("BENCH", "IDENT");
+
+  std::vector<uint64_t> samples;
+  samples.reserve (n);
+  size_t a = allocs;
+  for (size_t ix = 0; ix != n; ix++)
+    {
+      auto start = Clock::now ();
+      auto packet = client.ModuleImport ("std.core");
+      samples.push_back (Nanoseconds (Clock::now () - start));
+      if (packet.GetCode () != Client::PC_PATHNAME)
+	{
+	  result.Add ("error", "unexpected response");
+	  return;
+	}
+    }
+  result.Add ("allocs_per_op", double (allocs - a) / n);
+  Percentiles (result, samples);
+}
+
+static Result DirectBench (size_t n)
+{
+  Result result ("rtt.direct", n);
+  Quick r;
+  Server server (&r);
+  Client client (&server);
+  RoundTrips (result, client, n);
+
+  return result;
+}
+
+// Round trips over a connected pair of fds, SERVER & CLIENT.  The
+// server end is closed after use.
+
+static Result FDBench (char const *name, size_t n, int sfrom, int sto,
+		       int cfrom, int cto)
+{
+  Result result (name, n);
+  Quick r;
+  std::thread thread (Serve, &r, sfrom, sto);
+  {
+    Client client (cfrom, cto);
+    RoundTrips (result, client, n);
+  }
+  close (cto);
+  if (cfrom != cto)
+    close (cfrom);
+  thread.join ();
+  close (sfrom);
+  if (sto != sfrom)
+    close (sto);
+
+  return result;
+}
+
+static Result PipeBench (size_t n)
+{
+  int up[2], down[2];
+  if (pipe (up) < 0 || pipe (down) < 0)
+    {
+      Result result ("rtt.pipe", n);
+      result.Add ("error", strerror (errno));
+      return result;
+    }
+
+  return FDBench ("rtt.pipe", n, up[0], down[1], down[0], up[1]);
+}
+
+static Result SocketPairBench (size_t n)
+{
+  int fds[2];
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+      Result result ("rtt.socketpair", n);
+      result.Add ("error", strerror (errno));
+      return result;
+    }
+
+  return FDBench ("rtt.socketpair", n, fds[0], fds[0], fds[1], fds[1]);
+}
+
+// Round trips over a listening socket, accepting one connection
+
+static Result ListenBench (char const *name, size_t n, int listener,
+			   std::function<int ()> const &connector)
+{
+  int client = listener >= 0 ? connector () : -1;
+  int server = client >= 0 ? accept (listener, nullptr, nullptr) : -1;
+  if (server < 0)
+    {
+      Result result (name, n);
+      result.Add ("error", strerror (errno));
+      if (client >= 0)
+	close (client);
+      if (listener >= 0)
+	close (listener);
+      return result;
+    }
+  close (listener);
+
+  return FDBench (name, n, server, server, client, client);
+}
+
+static Result LocalBench (size_t n)
+{
+  std::string path (u8"/tmp/cody-bench-");
+  path.append (std::to_string (getpid ()));
+  int listener = ListenLocal (nullptr, path.c_str ());
+  auto result = ListenBench ("rtt.unix", n, listener, [&] ()
+			     {
+			       return OpenLocal (nullptr, path.c_str ());
+			     });
+  unlink (path.c_str ());
+
+  return result;
+}
+
+static Result TCPBench (size_t n)
+{
+  sockaddr_in addr;
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  int listener = ListenSocket (nullptr, (sockaddr *)&addr, sizeof (addr), 0);
+  socklen_t len = sizeof (addr);
+  if (listener >= 0 && getsockname (listener, (sockaddr *)&addr, &len) < 0)
+    {
+      close (listener);
+      listener = -1;
+    }
+
+  return ListenBench ("rtt.tcp", n, listener, [&] ()
+		      {
+			return OpenSocket (nullptr, (sockaddr *)&addr,
+					   sizeof (addr));
+		      });
+}
+
+// Many connections served by one ServerLoop on BACKEND, each client
+// on its own thread.  The loop's system calls are counted too.
+
+static Result LoopBench (char const *name, ServerLoop::Backend backend,
+			 size_t n)
+{
+  unsigned const clients = 8;
+  Result result (name, n);
+  Quick r;
+  ServerLoop loop (&r);
+  if (int err = loop.SetBackend (backend))
+    {
+      result.Add ("error", strerror (err));
+      return result;
+    }
+
+  std::vector<int> fds;
+  for (unsigned ix = clients; ix--;)
+    {
+      int pair[2];
+      if (socketpair (AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+	{
+	  result.Add ("error", strerror (errno));
+	  for (int fd : fds)
+	    close (fd);
+	  return result;
+	}
+      loop.AddConnection (pair[0]);
+      fds.push_back (pair[1]);
+    }
+
+  size_t each = (n + clients - 1) / clients;
+  std::atomic<size_t> errors (0);
+  Measure (result, each * clients, [&] ()
+    {
+      std::vector<std::thread> threads;
+      for (int fd : fds)
+	threads.emplace_back ([&, fd] ()
+	  {
+	    {
+	      Client client (fd, fd);
+	      client.Connect ("BENCH", "IDENT");
+	      for (size_t ix = 0; ix != each; ix++)
+		if (client.ModuleImport ("std.core").GetCode ()
+		    != Client::PC_PATHNAME)
+		  {
+		    errors++;
+		    break;
+		  }
+	    }
+	    close (fd);
+	  });
+      loop.Run ();
+      for (auto &thread : threads)
+	thread.join ();
+    });
+  result.Add ("connections", double (clients));
+  result.Add ("syscalls_per_op",
+	      double (loop.GetSyscallCount ()) / (each * clients));
+  if (errors)
+    result.Add ("error", "unexpected response");
+
+  return result;
+}
+
+static Result PollLoopBench (size_t n)
+{
+  return LoopBench ("loop.poll", ServerLoop::POLL, n);
+}
+
+static Result URingLoopBench (size_t n)
+{
+  return LoopBench ("loop.uring", ServerLoop::URING, n);
+}
+
+// Running a trivial command, by asking the builder with INVOKE, and
+// by the compiler forking it itself.
+
+static char const *const command[] = {"true", nullptr};
+
+static Result InvokeBench (size_t n)
+{
+  Result result ("invoke.pool", n);
+  Resolver r;
+  SubProcessPool pool (1);
+  r.SetSubProcessPool (&pool);
+  Server server (&r);
+  Client client (&server);
+  client.Connect ("BENCH", "IDENT");
+
+  std::vector<uint64_t> samples;
+  for (size_t ix = 0; ix != n; ix++)
+    {
+      auto start = Clock::now ();
+      auto packet = client.InvokeSubProcess (command, 1);
+      samples.push_back (Nanoseconds (Clock::now () - start));
+      if (packet.GetCode () != Client::PC_OK)
+	{
+	  result.Add ("error", "unexpected response");
+	  return result;
+	}
+    }
+  Percentiles (result, samples);
+
+  return result;
+}
+
+static Result ForkBench (size_t n)
+{
+  Result result ("invoke.fork", n);
+  std::vector<uint64_t> samples;
+  for (size_t ix = 0; ix != n; ix++)
+    {
+      auto start = Clock::now ();
+      pid_t pid = fork ();
+      if (!pid)
+	{
+	  execvp (command[0], const_cast<char *const *> (command));
+	  _exit (127);
+	}
+      int status = 0;
+      if (pid > 0)
+	waitpid (pid, &status, 0);
+      samples.push_back (Nanoseconds (Clock::now () - start));
+      if (pid < 0 || !WIFEXITED (status) || WEXITSTATUS (status))
+	{
+	  result.Add ("error", pid < 0 ? strerror (errno) : "command failed");
+	  return result;
+	}
+    }
+  Percentiles (result, samples);
+
+  return result;
+}
+
+static struct
+{
+  char const *name;
+  Result (*fn) (size_t);
+  size_t iterations;
+} const benches[] =
+  {
+    {"encode", EncodeBench, 1000000},
+    {"lex", LexBench, 1000000},
+    {"dispatch", DispatchBench, 200000},
+    {"dispatch.basic", BasicDispatchBench, 200000},
+    {"dispatch.arena", ArenaDispatchBench, 200000},
+    {"rtt.direct", DirectBench, 100000},
+    {"rtt.pipe", PipeBench, 20000},
+    {"rtt.socketpair", SocketPairBench, 20000},
+    {"rtt.unix", LocalBench, 20000},
+    {"rtt.tcp", TCPBench, 20000},
+    {"loop.poll", PollLoopBench, 100000},
+    {"loop.uring", URingLoopBench, 100000},
+    {"invoke.pool", InvokeBench, 200},
+    {"invoke.fork", ForkBench, 200},
+  };
+
+int main (int argc, char *argv[])
+{
+  double scale = 1;
+  std::vector<char const *> selected;
+
+  for (int ix = 1; ix < argc; ix++)
+    if (!strcmp (argv[ix], "-s") && ix + 1 < argc)
+      scale = atof (argv[++ix]);
+    else if (argv[ix][0] == '-')
+      {
+	fprintf (stderr, "Usage: %s [-s SCALE] [BENCHMARK...]\n", argv[0]);
+	return 1;
+      }
+    else
+      selected.push_back (argv[ix]);
+
+  std::string json (u8"{\n  \"version\": ");
+  json.append (std::to_string (Version));
+  json.append (u8",\n  \"results\": [");
+  bool first = true;
+  for (auto &bench : benches)
+    {
+      bool wanted = selected.empty ();
+      for (auto name : selected)
+	if (!strncmp (bench.name, name, strlen (name)))
+	  wanted = true;
+      if (!wanted)
+	continue;
+
+      size_t n = size_t (bench.iterations * scale);
+      auto result = bench.fn (n ? n : 1);
+      json.append (first ? u8"\n" : u8",\n");
+      json.append (u8"    {").append (result.GetFields ()).append (u8"}");
+      first = false;
+    }
+  json.append (u8"\n  ]\n}\n");
+  fputs (json.c_str (), stdout);
+
+  return 0;
+}
@@ -0,0 +1,325 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Load generator.  Emulates a parallel build, with a number of
+// concurrent compilers each compiling a sequence of translation
+// units.  Results are written to stdout as JSON.  Usage:
+//   cody-load [options] (-u $socket | -i $host:$port | --serve)
+// Options:
+//   -c $n	concurrent compilers (64)
+//   -n $n	translation units (8 per compiler)
+//   -t $usec	think time between requests (0)
+//   -m $n	modules, one is built by each of the first TUs (256)
+//   -d $n	module graph depth, modules import from shallower
+//		layers (8)
+//   -f $n	imports per TU, corked into one block (8)
+//   -H $n	header files (128)
+//   -b $n	include translation queries per TU, uncorked (16)
+//   --serve	serve in-process on a Unix socket, with the default
+//		resolver
+//   -C $log	with --serve, capture the traffic for cody-replay
+
+// Cody
+#include "cody.hh"
+// C++
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <thread>
+// C
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+// OS
+#include <unistd.h>
+
+using namespace Cody;
+using Clock = std::chrono::steady_clock;
+
+struct Config
+{
+  unsigned compilers = 64;
+  unsigned units = 0;
+  unsigned think = 0;
+  unsigned modules = 256;
+  unsigned depth = 8;
+  unsigned fanout = 8;
+  unsigned headers = 128;
+  unsigned burst = 16;
+  std::string local;
+  std::string host;
+  int port = 0;
+  char const *capture = nullptr;
+};
+
+// Server loop capturing each connection
+class CapturingLoop : public ServerLoop
+{
+  Capture *capture;
+
+public:
+  CapturingLoop (Resolver *r, Capture *c)
+    : ServerLoop (r), capture (c)
+  {
+  }
+
+protected:
+  virtual void Connected (Server *s)
+  {
+    s->SetCapture (capture);
+  }
+};
+
+// Per-compiler tallies
+struct Tally
+{
+  std::vector<uint64_t> samples;  ///< Round trip latencies
+  size_t requests = 0;
+  size_t units = 0;
+  size_t connectErrors = 0;
+  size_t ioErrors = 0;
+  size_t responseErrors = 0;
+};
+
+static std::string ModuleName (unsigned ix)
+{
+  return std::string (u8"mod") + std::to_string (ix);
+}
+
+static std::string HeaderName (unsigned ix)
+{
+  return std::string (u8"./include/hdr") + std::to_string (ix) + u8".h";
+}
+
+static void Check (Tally &tally, Packet const &packet)
+{
+  if (packet.GetCode () != Client::PC_ERROR)
+    return;
+  if (!packet.GetString ().compare (0, 20, u8"communication error:"))
+    tally.ioErrors++;
+  else
+    tally.responseErrors++;
+}
+
+// Compile translation unit UNIT over a new connection
+
+static void Compile (Config const &config, unsigned unit, Tally &tally)
+{
+  int fd = config.local.empty ()
+    ? OpenInet6 (nullptr, config.host.c_str (), config.port)
+    : OpenLocal (nullptr, config.local.c_str ());
+  if (fd < 0)
+    {
+      tally.connectErrors++;
+      return;
+    }
+
+  std::mt19937 random (unit);
+  Client client (fd);
+  auto trip = [&] (std::function<void ()> const &fn, unsigned requests)
+    {
+      if (config.think)
+	std::this_thread::sleep_for (std::chrono::microseconds (config.think));
+      auto start = Clock::now ();
+      fn ();
+      tally.samples.push_back
+	(uint64_t (std::chrono::duration_cast<std::chrono::nanoseconds>
+		   (Clock::now () - start).count ()));
+      tally.requests += requests;
+    };
+
+  trip ([&] ()
+	{
+	  Check (tally, client.Connect ("LOAD", std::to_string (unit)));
+	}, 1);
+
+  // The first TUs are module interfaces.  A module imports from
+  // shallower layers, other TUs import from anywhere.
+  bool interface = unit < config.modules;
+  unsigned layer = interface ? unit * config.depth / config.modules
+    : config.depth;
+  unsigned limit = layer * config.modules / config.depth;
+  if (interface)
+    trip ([&] ()
+	  {
+	    Check (tally, client.ModuleExport (ModuleName (unit)));
+	  }, 1);
+
+  if (limit && config.fanout)
+    trip ([&] ()
+	  {
+	    client.Cork ();
+	    for (unsigned ix = config.fanout; ix--;)
+	      client.ModuleImport (ModuleName (random () % limit));
+	    for (auto &packet : client.Uncork ())
+	      Check (tally, packet);
+	  }, config.fanout);
+
+  for (unsigned ix = config.burst; ix--;)
+    trip ([&] ()
+	  {
+	    Check (tally, client.IncludeTranslate
+		   (HeaderName (random () % config.headers)));
+	  }, 1);
+
+  if (interface)
+    trip ([&] ()
+	  {
+	    Check (tally, client.ModuleCompiled (ModuleName (unit)));
+	  }, 1);
+
+  close (fd);
+  tally.units++;
+}
+
+static void Usage (char const *prog)
+{
+  fprintf (stderr, "Usage: %s [-c N] [-n N] [-t USEC] [-m N] [-d N] [-f N]"
+	   " [-H N] [-b N] (-u SOCKET | -i HOST:PORT | --serve [-C LOG])\n",
+	   prog);
+  exit (1);
+}
+
+int main (int argc, char *argv[])
+{
+  Config config;
+  bool serve = false;
+
+  for (int ix = 1; ix < argc; ix++)
+    {
+      char const *opt = argv[ix];
+      if (!strcmp (opt, "--serve"))
+	{
+	  serve = true;
+	  continue;
+	}
+      if (opt[0] != '-' || !opt[1] || opt[2] || ix + 1 == argc)
+	Usage (argv[0]);
+
+      char const *arg = argv[++ix];
+      unsigned val = unsigned (atoi (arg));
+      switch (opt[1])
+	{
+	case 'c': config.compilers = val ? val : 1; break;
+	case 'n': config.units = val; break;
+	case 't': config.think = val; break;
+	case 'm': config.modules = val; break;
+	case 'd': config.depth = val ? val : 1; break;
+	case 'f': config.fanout = val; break;
+	case 'H': config.headers = val ? val : 1; break;
+	case 'b': config.burst = val; break;
+	case 'u': config.local = arg; break;
+	case 'C': config.capture = arg; break;
+	case 'i':
+	  {
+	    char const *colon = strrchr (arg, ':');
+	    if (!colon)
+	      Usage (argv[0]);
+	    config.host.assign (arg, colon);
+	    config.port = atoi (colon + 1);
+	  }
+	  break;
+	default:
+	  Usage (argv[0]);
+	}
+    }
+  if (!config.units)
+    config.units = config.compilers * 8;
+  if (!serve && config.local.empty () && config.host.empty ())
+    Usage (argv[0]);
+
+  signal (SIGPIPE, SIG_IGN);
+
+  Resolver resolver;
+  Capture capture;
+  if (config.capture)
+    if (int err = capture.Open (config.capture))
+      {
+	fprintf (stderr, "%s: cannot open '%s': %s\n", argv[0],
+		 config.capture, strerror (err));
+	return 1;
+      }
+  CapturingLoop loop (&resolver, config.capture ? &capture : nullptr);
+  std::thread server;
+  if (serve)
+    {
+      config.local = std::string (u8"/tmp/cody-load-")
+	+ std::to_string (getpid ());
+      char const *errstr = nullptr;
+      int listener = ListenLocal (&errstr, config.local.c_str (), 1024);
+      if (listener < 0)
+	{
+	  fprintf (stderr, "%s: %s: %s\n", argv[0], errstr, strerror (errno));
+	  return 1;
+	}
+      loop.AddListener (listener);
+      server = std::thread ([&] () { loop.Run (); });
+    }
+
+  std::vector<Tally> tallies (config.compilers);
+  std::vector<std::thread> compilers;
+  std::atomic<unsigned> next (0);
+  auto start = Clock::now ();
+  for (unsigned ix = 0; ix != config.compilers; ix++)
+    compilers.emplace_back ([&, ix] ()
+			    {
+			      for (unsigned unit;
+				   (unit = next++) < config.units;)
+				Compile (config, unit, tallies[ix]);
+			    });
+  for (auto &thread : compilers)
+    thread.join ();
+  double elapsed = std::chrono::duration<double> (Clock::now () - start)
+    .count ();
+
+  if (serve)
+    {
+      loop.Stop ();
+      server.join ();
+      unlink (config.local.c_str ());
+    }
+
+  Tally total;
+  for (auto &tally : tallies)
+    {
+      total.samples.insert (total.samples.end (),
+			    tally.samples.begin (), tally.samples.end ());
+      total.requests += tally.requests;
+      total.units += tally.units;
+      total.connectErrors += tally.connectErrors;
+      total.ioErrors += tally.ioErrors;
+      total.responseErrors += tally.responseErrors;
+    }
+  std::sort (total.samples.begin (), total.samples.end ());
+  auto percentile = [&] (double rank)
+    {
+      if (total.samples.empty ())
+	return 0.0;
+      return double (total.samples[size_t (rank
+					   * (total.samples.size () - 1))]);
+    };
+
+  printf ("{\n");
+  printf ("  \"compilers\": %u,\n", config.compilers);
+  printf ("  \"units\": %zu,\n", total.units);
+  printf ("  \"requests\": %zu,\n", total.requests);
+  printf ("  \"round_trips\": %zu,\n", total.samples.size ());
+  printf ("  \"elapsed_s\": %.6g,\n", elapsed);
+  printf ("  \"requests_per_s\": %.6g,\n", total.requests / elapsed);
+  printf ("  \"units_per_s\": %.6g,\n", total.units / elapsed);
+  printf ("  \"p50_ns\": %.6g,\n", percentile (0.5));
+  printf ("  \"p90_ns\": %.6g,\n", percentile (0.9));
+  printf ("  \"p99_ns\": %.6g,\n", percentile (0.99));
+  printf ("  \"p999_ns\": %.6g,\n", percentile (0.999));
+  printf ("  \"max_ns\": %.6g,\n", percentile (1));
+  printf ("  \"connect_errors\": %zu,\n", total.connectErrors);
+  printf ("  \"io_errors\": %zu,\n", total.ioErrors);
+  printf ("  \"response_errors\": %zu\n", total.responseErrors);
+  printf ("}\n");
+
+  return total.connectErrors + total.ioErrors ? 1 : 0;
+}
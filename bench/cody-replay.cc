@@ -0,0 +1,271 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Replay a capture log, as written by a Server given a Capture.
+// Each connection's request blocks are sent again, either to an
+// in-process default Resolver or to a live server, at full speed or
+// at their original times.  Results are written to stdout as JSON.
+// Usage:
+//   cody-replay [options] $log
+// Options:
+//   -o		keep the original timing, rather than full speed
+//   -u $socket	replay to a server on a Unix socket
+//   -i $host:$port	replay to a server on an IPv6 socket
+// The in-process replay is on one thread, in capture order.  A live
+// server gets a thread per connection.
+
+// Cody
+#include "cody.hh"
+// C++
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <thread>
+// C
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+// OS
+#include <unistd.h>
+
+using namespace Cody;
+using Clock = std::chrono::steady_clock;
+
+struct Config
+{
+  bool original = false;
+  std::string local;
+  std::string host;
+  int port = 0;
+};
+
+struct Block
+{
+  unsigned connection;
+  uint64_t time;	///< Offset from the start of the capture
+  std::string const *text;
+};
+
+// Per-connection tallies
+struct Tally
+{
+  std::vector<uint64_t> samples;  ///< Block latencies
+  size_t errors = 0;
+};
+
+static void WaitUntil (Clock::time_point start, uint64_t offset)
+{
+  std::this_thread::sleep_until (start + std::chrono::nanoseconds (offset));
+}
+
+static uint64_t Since (Clock::time_point start)
+{
+  return uint64_t (std::chrono::duration_cast<std::chrono::nanoseconds>
+		   (Clock::now () - start).count ());
+}
+
+// Replay to a default Resolver in this process
+
+static void ReplayDirect (Config const &config,
+			  std::vector<Block> const &blocks, Tally &tally)
+{
+  Resolver resolver;
+  std::map<unsigned, std::unique_ptr<Server>> servers;
+  Detail::MessageBuffer from, to;
+  auto start = Clock::now ();
+
+  for (auto &block : blocks)
+    {
+      auto &server = servers[block.connection];
+      if (!server)
+	server.reset (new Server (&resolver));
+
+      if (config.original)
+	WaitUntil (start, block.time);
+      auto begin = Clock::now ();
+      from.PrepareToRead ();
+      from.Append (block.text->data (), false, block.text->size ());
+      server->DirectProcess (from, to);
+      tally.samples.push_back (Since (begin));
+    }
+}
+
+// Replay one connection's blocks to a live server
+
+static void ReplayConnection (Config const &config, Clock::time_point start,
+			      std::vector<Block const *> const &blocks,
+			      Tally &tally)
+{
+  int fd = config.local.empty ()
+    ? OpenInet6 (nullptr, config.host.c_str (), config.port)
+    : OpenLocal (nullptr, config.local.c_str ());
+  if (fd < 0)
+    {
+      tally.errors++;
+      return;
+    }
+
+  Detail::MessageBuffer request, response;
+  for (auto *block : blocks)
+    {
+      if (config.original)
+	WaitUntil (start, block->time);
+      auto begin = Clock::now ();
+
+      // The block's final newline is added by PrepareToWrite
+      std::string const &text = *block->text;
+      request.Append (text.data (), false,
+		      text.size () - (!text.empty () && text.back () == '\n'));
+      request.PrepareToWrite ();
+      int err;
+      while ((err = request.Write (fd)) == EAGAIN || err == EINTR)
+	continue;
+      if (!err)
+	{
+	  response.PrepareToRead ();
+	  while ((err = response.Read (fd)) == EAGAIN || err == EINTR)
+	    continue;
+	}
+      if (err)
+	{
+	  tally.errors++;
+	  break;
+	}
+      tally.samples.push_back (Since (begin));
+    }
+
+  close (fd);
+}
+
+static void Usage (char const *prog)
+{
+  fprintf (stderr, "Usage: %s [-o] [-u SOCKET | -i HOST:PORT] LOG\n", prog);
+  exit (1);
+}
+
+int main (int argc, char *argv[])
+{
+  Config config;
+  char const *log = nullptr;
+
+  for (int ix = 1; ix < argc; ix++)
+    {
+      char const *opt = argv[ix];
+      if (opt[0] != '-')
+	{
+	  if (log)
+	    Usage (argv[0]);
+	  log = opt;
+	  continue;
+	}
+      if (!strcmp (opt, "-o"))
+	{
+	  config.original = true;
+	  continue;
+	}
+      if (ix + 1 == argc)
+	Usage (argv[0]);
+
+      char const *arg = argv[++ix];
+      if (!strcmp (opt, "-u"))
+	config.local = arg;
+      else if (!strcmp (opt, "-i"))
+	{
+	  char const *colon = strrchr (arg, ':');
+	  if (!colon)
+	    Usage (argv[0]);
+	  config.host.assign (arg, colon);
+	  config.port = atoi (colon + 1);
+	}
+      else
+	Usage (argv[0]);
+    }
+  if (!log)
+    Usage (argv[0]);
+
+  std::vector<Capture::Record> records;
+  if (int err = Capture::Read (log, records))
+    {
+      fprintf (stderr, "%s: cannot read '%s': %s\n", argv[0], log,
+	       strerror (err));
+      return 1;
+    }
+
+  std::vector<Block> blocks;
+  uint64_t first = records.empty () ? 0 : records.front ().time;
+  uint64_t last = first;
+  for (auto &record : records)
+    {
+      last = std::max (last, record.time);
+      if (record.kind == Capture::REQUESTS)
+	blocks.push_back (Block {record.connection, record.time - first,
+				 &record.text});
+    }
+
+  signal (SIGPIPE, SIG_IGN);
+
+  bool live = !config.local.empty () || !config.host.empty ();
+  std::map<unsigned, std::vector<Block const *>> connections;
+  for (auto &block : blocks)
+    connections[block.connection].push_back (&block);
+
+  std::vector<Tally> tallies (live ? connections.size () : 1);
+  auto start = Clock::now ();
+  if (live)
+    {
+      std::vector<std::thread> threads;
+      unsigned ix = 0;
+      for (auto &pair : connections)
+	{
+	  auto *connection = &pair.second;
+	  auto *tally = &tallies[ix++];
+	  threads.emplace_back ([=, &config] ()
+				{
+				  ReplayConnection (config, start,
+						    *connection, *tally);
+				});
+	}
+      for (auto &thread : threads)
+	thread.join ();
+    }
+  else
+    ReplayDirect (config, blocks, tallies[0]);
+  double elapsed = std::chrono::duration<double> (Clock::now () - start)
+    .count ();
+
+  Tally total;
+  for (auto &tally : tallies)
+    {
+      total.samples.insert (total.samples.end (),
+			    tally.samples.begin (), tally.samples.end ());
+      total.errors += tally.errors;
+    }
+  std::sort (total.samples.begin (), total.samples.end ());
+  auto percentile = [&] (double rank)
+    {
+      if (total.samples.empty ())
+	return 0.0;
+      return double (total.samples[size_t (rank
+					   * (total.samples.size () - 1))]);
+    };
+
+  printf ("{\n");
+  printf ("  \"mode\": \"%s\",\n", live ? "live" : "direct");
+  printf ("  \"timing\": \"%s\",\n", config.original ? "original" : "max");
+  printf ("  \"connections\": %zu,\n", connections.size ());
+  printf ("  \"blocks\": %zu,\n", total.samples.size ());
+  printf ("  \"captured_s\": %.6g,\n", double (last - first) * 1e-9);
+  printf ("  \"elapsed_s\": %.6g,\n", elapsed);
+  printf ("  \"blocks_per_s\": %.6g,\n", total.samples.size () / elapsed);
+  printf ("  \"p50_ns\": %.6g,\n", percentile (0.5));
+  printf ("  \"p90_ns\": %.6g,\n", percentile (0.9));
+  printf ("  \"p99_ns\": %.6g,\n", percentile (0.99));
+  printf ("  \"max_ns\": %.6g,\n", percentile (1));
+  printf ("  \"errors\": %zu\n", total.errors);
+  printf ("}\n");
+
+  return total.errors ? 1 : 0;
+}
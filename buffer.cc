@@ -153,15 +153,22 @@ void MessageBuffer::AppendInteger (unsigned u)
 int MessageBuffer::Write (int fd) noexcept
 {
   size_t limit = buffer.size () - lastBol;
+  uint64_t start = MetricsClock ();
   ssize_t count = write (fd, &buffer.data ()[lastBol], limit);
 
-  int err = 0;
-  if (count < 0)
-    err = errno;
-  else
+  int err = count < 0 ? errno : 0;
+  CODY_PROBE3 (write, fd, count, err);
+  RecordWrite (count, err, start);
+
+  return Sent (count, err);
+}
+
+int MessageBuffer::Sent (ssize_t count, int err) noexcept
+{
+  if (!err)
     {
       lastBol += count;
-      if (size_t (count) != limit)
+      if (lastBol != buffer.size ())
 	err = EAGAIN;
     }
 
@@ -186,16 +193,36 @@ int MessageBuffer::Read (int fd) noexcept
   buffer.resize (hwm);
 
   auto iter = buffer.begin () + lwm;
+  uint64_t start = MetricsClock ();
   ssize_t count = read (fd, &*iter, hwm - lwm);
+  int err = count < 0 ? errno : 0;
+  CODY_PROBE3 (read, fd, count, err);
+  RecordRead (count, err, start);
   buffer.resize (lwm + (count >= 0 ? count : 0));
 
   if (count < 0)
-    return errno;
+    return err;
+
+  return Scan (lwm);
+}
 
-  if (!count)
+int MessageBuffer::Received (char const *data, size_t count) noexcept
+{
+  size_t lwm = buffer.size ();
+  buffer.insert (buffer.end (), data, data + count);
+
+  return Scan (lwm);
+}
+
+// Look for the end of the block in the octets from LWM
+
+int MessageBuffer::Scan (size_t lwm) noexcept
+{
+  if (lwm == buffer.size ())
     // End of file
     return -1;
 
+  auto iter = buffer.begin () + lwm;
   bool more = true;
   for (;;)
     {
@@ -220,18 +247,28 @@ int MessageBuffer::Read (int fd) noexcept
   return more ? EAGAIN : 0;
 }
 
-int MessageBuffer::Lex (std::vector<std::string> &result)
+bool MessageBuffer::HasLine () const
 {
-  result.clear ();
+  return lastBol != buffer.size ()
+    && memchr (&buffer[lastBol], S2C(u8"\n"), buffer.size () - lastBol);
+}
 
+int MessageBuffer::Lex (std::vector<std::string> &result)
+{
   int err = ENOENT;
   if (IsAtEnd ())
-    return ENOENT;
+    {
+      result.clear ();
+      return ENOENT;
+    }
 
-  Assert (buffer.back () == S2C(u8"\n"));
+  Assert (HasLine ());
 
   auto iter = buffer.begin () + lastBol;
 
+  // Words are assigned over the previous line's, and the excess
+  // removed at the end
+  size_t count = 0;
   for (std::string *word = nullptr;;)
     {
       char c = *iter;
@@ -260,8 +297,10 @@ int MessageBuffer::Lex (std::vector<std::string> &result)
 
       if (!word)
 	{
-	  result.emplace_back ();
-	  word = &result.back ();
+	  if (count == result.size ())
+	    result.emplace_back ();
+	  word = &result[count++];
+	  word->clear ();
 	}
 
       if (c == S2C(u8"'"))
@@ -274,14 +313,14 @@ int MessageBuffer::Lex (std::vector<std::string> &result)
 	      if (c == S2C(u8"\n"))
 		{
 		malformed:;
-		  result.clear ();
 		  iter = std::find (iter, buffer.end (), S2C(u8"\n"));
 		  auto back = iter;
 		  if (back[-1] == CONTINUE  && back[-2] == S2C(u8" "))
 		    // Smells like a line continuation
 		    back -= 2;
-		  result.emplace_back (&buffer[lastBol],
-				       back - buffer.begin () - lastBol);
+		  result.resize (1);
+		  result[0].assign (&buffer[lastBol],
+				    back - buffer.begin () - lastBol);
 		  ++iter;
 		  lastBol = iter - buffer.begin ();
 		  return EINVAL;
@@ -361,6 +400,7 @@ int MessageBuffer::Lex (std::vector<std::string> &result)
 	word->push_back (c);
     }
   lastBol = iter - buffer.begin ();
+  result.resize (count);
   if (result.empty ())
     return ENOENT;
 
@@ -388,5 +428,23 @@ void MessageBuffer::Space ()
 {
   Append (Detail::S2C(u8" "));
 }
+
+void MessageBuffer::Splice (size_t pos, size_t len, MessageBuffer &from)
+{
+  size_t common = std::min (len, from.buffer.size ());
+  auto iter = buffer.begin () + pos;
+
+  std::copy (from.buffer.begin (), from.buffer.begin () + common, iter);
+  if (len > common)
+    buffer.erase (iter + common, iter + len);
+  else
+    buffer.insert (iter + common,
+		   from.buffer.begin () + common, from.buffer.end ());
+  if (pos < lastBol)
+    lastBol = lastBol + from.buffer.size () - len;
+
+  from.buffer.clear ();
+  from.lastBol = 0;
+}
 } // Detail
 } // Cody
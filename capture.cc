@@ -0,0 +1,143 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Cody
+#include "internal.hh"
+// C++
+#include <atomic>
+// C
+#include <cerrno>
+#include <cstring>
+// OS
+#include <fcntl.h>
+#include <unistd.h>
+
+// Capture log code
+
+// The log begins with a magic string.  Each record is a header of
+//   kind:u8 pad:u8[3] connection:u32 time:u64 length:u32
+// followed by LENGTH octets of block text.  The header is packed, so
+// it is copied field by field.
+
+namespace Cody {
+
+namespace {
+constexpr char magic[8] = {'C', 'O', 'D', 'Y', 'C', 'A', 'P', '1'};
+constexpr size_t headerSize = 20;
+}
+
+// Connection ids are unique within the process
+static std::atomic<unsigned> connections (0);
+
+int Capture::Open (char const *path)
+{
+  Close ();
+
+  int f = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+		0666);
+  if (f < 0)
+    return errno;
+
+  if (write (f, magic, sizeof (magic)) != sizeof (magic))
+    {
+      int err = errno;
+      close (f);
+      return err;
+    }
+
+  fd = f;
+
+  return 0;
+}
+
+void Capture::Close ()
+{
+  if (fd >= 0)
+    close (fd);
+  fd = -1;
+}
+
+unsigned Capture::Connect ()
+{
+  unsigned id = ++connections;
+  Write (OPEN, id, nullptr, 0);
+
+  return id;
+}
+
+void Capture::Write (Kind kind, unsigned connection,
+		     char const *text, size_t len)
+{
+  if (fd < 0)
+    return;
+
+  uint64_t time = Tracer::Now ();
+  uint32_t length = uint32_t (len);
+  uint32_t id = connection;
+  std::string record (headerSize, '\0');
+  record[0] = char (kind);
+  memcpy (&record[4], &id, sizeof (id));
+  memcpy (&record[8], &time, sizeof (time));
+  memcpy (&record[16], &length, sizeof (length));
+  if (len)
+    record.append (text, len);
+
+  (void)!write (fd, record.data (), record.size ());
+}
+
+int Capture::Read (char const *path, std::vector<Record> &records)
+{
+  int f = open (path, O_RDONLY | O_CLOEXEC);
+  if (f < 0)
+    return errno;
+
+  std::string contents;
+  char block[8192];
+  int err = 0;
+  for (;;)
+    {
+      ssize_t count = read (f, block, sizeof (block));
+      if (count < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  err = errno;
+	  break;
+	}
+      if (!count)
+	break;
+      contents.append (block, size_t (count));
+    }
+  close (f);
+  if (err)
+    return err;
+
+  if (contents.size () < sizeof (magic)
+      || memcmp (contents.data (), magic, sizeof (magic)))
+    return EINVAL;
+
+  for (size_t pos = sizeof (magic); pos != contents.size ();)
+    {
+      if (contents.size () - pos < headerSize)
+	return EINVAL;
+
+      uint32_t id, length;
+      uint64_t time;
+      unsigned kind = (unsigned char)contents[pos];
+      memcpy (&id, &contents[pos + 4], sizeof (id));
+      memcpy (&time, &contents[pos + 8], sizeof (time));
+      memcpy (&length, &contents[pos + 16], sizeof (length));
+      pos += headerSize;
+      if (kind > CLOSE || contents.size () - pos < length)
+	return EINVAL;
+
+      records.push_back (Record {Kind (kind), id, time,
+				 contents.substr (pos, length)});
+      pos += length;
+    }
+
+  return 0;
+}
+
+}
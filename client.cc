@@ -4,12 +4,22 @@
 
 // Cody
 #include "internal.hh"
+// C++
+#include <algorithm>
 // C
 #include <cerrno>
 #include <cstring>
+// OS
+#include <fcntl.h>
+#include <poll.h>
 
 // Client code
 
+// A client with shards routes each request to one backend, and
+// notes the route of each corked one.  Its own connection is backend
+// 0, and the shards are Clients of their own, corked and uncorked
+// with it.
+
 namespace Cody {
 
 // These do not need to be members
@@ -17,18 +27,17 @@ static Packet ConnectResponse (std::vector<std::string> &words);
 static Packet PathnameResponse (std::vector<std::string> &words);
 static Packet OKResponse (std::vector<std::string> &words);
 static Packet IncludeTranslateResponse (std::vector<std::string> &words);
+static Packet StatsResponse (std::vector<std::string> &words);
 
-// Must be consistently ordered with the RequestCode enum
-static Packet (*const responseTable[Detail::RC_HWM])
+// Indexed by Detail::ResponseKind
+static Packet (*const decoders[Detail::RK_HWM])
   (std::vector<std::string> &) =
   {
     &ConnectResponse,
     &PathnameResponse,
-    &PathnameResponse,
-    &PathnameResponse,
     &OKResponse,
     &IncludeTranslateResponse,
-    &OKResponse,
+    &StatsResponse,
   };
 
 Client::Client ()
@@ -40,8 +49,23 @@ Client::Client (Client &&src)
   : write (std::move (src.write)),
     read (std::move (src.read)),
     corked (std::move (src.corked)),
+    answered (std::move (src.answered)),
+    filter (src.filter),
+    cache (src.cache),
+    tracer (src.tracer),
+    traceIdent (std::move (src.traceIdent)),
+    memos (std::move (src.memos)),
+    shards (std::move (src.shards)),
+    ring (std::move (src.ring)),
+    routes (std::move (src.routes)),
+    lateWrite (std::move (src.lateWrite)),
+    lateRead (std::move (src.lateRead)),
+    deadline (src.deadline),
+    timeout (src.timeout),
     is_direct (src.is_direct),
-    is_connected (src.is_connected)
+    is_connected (src.is_connected),
+    is_late (src.is_late),
+    is_broken (src.is_broken)
 {
   if (is_direct)
     server = src.server;
@@ -61,8 +85,23 @@ Client &Client::operator= (Client &&src)
   write = std::move (src.write);
   read = std::move (src.read);
   corked = std::move (src.corked);
+  answered = std::move (src.answered);
+  filter = src.filter;
+  cache = src.cache;
+  tracer = src.tracer;
+  traceIdent = std::move (src.traceIdent);
+  memos = std::move (src.memos);
+  shards = std::move (src.shards);
+  ring = std::move (src.ring);
+  routes = std::move (src.routes);
+  lateWrite = std::move (src.lateWrite);
+  lateRead = std::move (src.lateRead);
+  deadline = src.deadline;
+  timeout = src.timeout;
   is_direct = src.is_direct;
   is_connected = src.is_connected;
+  is_late = src.is_late;
+  is_broken = src.is_broken;
   if (is_direct)
     server = src.server;
   else
@@ -82,27 +121,220 @@ int Client::CommunicateWithServer ()
     server->DirectProcess (write, read);
   else
     {
-      // Write the write buffer
-      while (int e = write.Write (fd.to))
-	if (e != EAGAIN && e != EINTR)
-	  return e;
-      // Read the read buffer
-      while (int e = read.Read (fd.from))
-	if (e != EAGAIN && e != EINTR)
-	  return e;
+      uint64_t until = deadline;
+      deadline = 0;
+      if (timeout >= 0)
+	{
+	  uint64_t limit = Tracer::Now () + uint64_t (timeout) * 1000000;
+	  if (!until || limit < until)
+	    until = limit;
+	}
+      return CommunicateWithin (until);
     }
 
   return 0;
 }
 
-static Packet CommunicationError (int err)
+// Wait for FD to become ready for EVENTS, until UNTIL if non-zero
+
+static int Await (int fd, short events, uint64_t until)
+{
+  for (;;)
+    {
+      int wait = -1;
+      if (until)
+	{
+	  uint64_t now = Tracer::Now ();
+	  if (now >= until)
+	    return ETIMEDOUT;
+	  // Round up, so as not to wake just before
+	  wait = int ((until - now + 999999) / 1000000);
+	}
+
+      pollfd pfd;
+      pfd.fd = fd;
+      pfd.events = events;
+      int ready = poll (&pfd, 1, wait);
+      if (ready > 0)
+	return 0;
+      if (!ready)
+	return ETIMEDOUT;
+      if (errno != EINTR)
+	return errno;
+    }
+}
+
+// Write WRITE and read the response to READ, by UNTIL if non-zero.
+// Wait on EAGAIN, which a blocking FD does not give.  SENT is set
+// once any of WRITE has been written.
+
+static int Exchange (Detail::FD const &fd, Detail::MessageBuffer &write,
+		     Detail::MessageBuffer &read, uint64_t until, bool &sent)
+{
+  size_t size = write.GetSize ();
+  while (int e = write.Write (fd.to))
+    {
+      if (e != EAGAIN && e != EINTR)
+	return e;
+      if (write.GetUnprocessed () != size)
+	sent = true;
+      if (e == EAGAIN)
+	if (int err = Await (fd.to, POLLOUT, until))
+	  return err;
+    }
+  sent = true;
+
+  while (int e = read.Read (fd.from))
+    if (e == EAGAIN)
+      {
+	if (int err = Await (fd.from, POLLIN, until))
+	  return err;
+      }
+    else if (e != EINTR)
+      return e;
+
+  return 0;
+}
+
+// Make FD non-blocking, returning the flags to restore, or -1 if
+// there is nothing to restore
+
+static int MakeNonBlocking (int fd)
+{
+  int flags = fcntl (fd, F_GETFL);
+  if (flags < 0 || flags & O_NONBLOCK)
+    return -1;
+  fcntl (fd, F_SETFL, flags | O_NONBLOCK);
+
+  return flags;
+}
+
+// A round trip limited to UNTIL, if non-zero.  One that times out
+// part way is set aside, and finished first next time.  One that
+// fails otherwise part way leaves the stream out of step, so the
+// connection is abandoned.
+
+int Client::CommunicateWithin (uint64_t until)
 {
+  if (is_broken)
+    {
+      write.PrepareToRead ();
+      return ENOTCONN;
+    }
+
+  // A limited round trip must not block.  The FDs may be shared with
+  // others, so their flags are restored afterwards.
+  int flags[2] = {-1, -1};
+  if (until)
+    {
+      flags[0] = MakeNonBlocking (fd.from);
+      if (fd.to != fd.from)
+	flags[1] = MakeNonBlocking (fd.to);
+    }
+
+  int err = 0;
+  if (is_late)
+    {
+      bool sent = true;
+      err = Exchange (fd, lateWrite, lateRead, until, sent);
+      if (err)
+	// Discard this request, it was not sent
+	write.PrepareToRead ();
+      else
+	{
+	  lateRead.PrepareToRead ();
+	  is_late = false;
+	}
+      if (err && err != ETIMEDOUT)
+	is_broken = true;
+    }
+
+  if (!err)
+    {
+      bool sent = false;
+      err = Exchange (fd, write, read, until, sent);
+      if (err && !sent)
+	// Discard this request, it was not sent
+	write.PrepareToRead ();
+      else if (err)
+	{
+	  if (err == ETIMEDOUT)
+	    {
+	      // Finish it next time, the buffers swapped in are empty
+	      std::swap (write, lateWrite);
+	      std::swap (read, lateRead);
+	      is_late = true;
+	    }
+	  else
+	    is_broken = true;
+	}
+    }
+
+  if (is_broken)
+    {
+      lateWrite.PrepareToRead ();
+      lateRead.PrepareToRead ();
+      is_late = false;
+    }
+
+  if (flags[0] >= 0)
+    fcntl (fd.from, F_SETFL, flags[0]);
+  if (flags[1] >= 0)
+    fcntl (fd.to, F_SETFL, flags[1]);
+
+  return err;
+}
+
+Packet Client::CommunicationError (int err)
+{
+  if (err == ETIMEDOUT)
+    {
+      // Distinguished from a broken connection, and from a server's
+      // error with the same text
+      Packet packet (PC_ERROR, u8"timed out");
+      packet.is_timeout = true;
+      return packet;
+    }
+
   std::string e {u8"communication error: "};
   e.append (strerror (err));
 
   return Packet (Client::PC_ERROR, std::move (e));
 }
 
+bool Client::IsTimedOut (Packet const &p)
+{
+  return p.GetCode () == PC_ERROR && p.is_timeout;
+}
+
+void Client::SetTimeout (int msecs)
+{
+  timeout = msecs;
+  for (auto &shard : shards)
+    shard->SetTimeout (msecs);
+}
+
+void Client::SetDeadline (unsigned msecs)
+{
+  deadline = Tracer::Now () + uint64_t (msecs) * 1000000;
+  for (auto &shard : shards)
+    shard->deadline = deadline;
+}
+
+void Client::Reconnect (int from, int to)
+{
+  if (is_direct)
+    return;
+
+  fd.from = from;
+  fd.to = to < 0 ? from : to;
+  lateWrite.PrepareToRead ();
+  lateRead.PrepareToRead ();
+  is_late = false;
+  is_broken = false;
+  is_connected = false;
+}
+
 Packet Client::ProcessResponse (std::vector<std::string> &words,
 			       unsigned code, bool isLast)
 {
@@ -129,7 +361,7 @@ Packet Client::ProcessResponse (std::vector<std::string> &words,
 		   std::string (u8"unexpected extra response"));
 
   Assert (code < Detail::RC_HWM);
-  Packet result (responseTable[code] (words));
+  Packet result (decoders[Detail::schemas[code].response] (words));
   result.SetRequest (code);
   if (result.GetCode () == Client::PC_ERROR && result.GetString ().empty ())
     {
@@ -140,11 +372,90 @@ Packet Client::ProcessResponse (std::vector<std::string> &words,
       result.GetString () = std::move (msg);
     }
   else if (result.GetCode () == Client::PC_CONNECT)
-    is_connected = true;
+    {
+      is_connected = true;
+      if (filter)
+	UpdateFilter (words);
+    }
 
   return result;
 }
 
+// HELLO $version $agent [$flags [$tag [$filter]]]
+// Absence of $tag means the server has no filter.  Absence of
+// $filter means our copy is current.
+
+void Client::UpdateFilter (std::vector<std::string> &words)
+{
+  if (words.size () < 5)
+    filter->Clear ();
+  else
+    {
+      char *eptr;
+      unsigned long val = strtoul (words[4].c_str (), &eptr, 10);
+      unsigned tag = unsigned (val);
+      if (*eptr || tag != val)
+	filter->Clear ();
+      else if (words.size () == 6)
+	filter->Decode (tag, words[5]);
+      else if (tag != filter->GetTag ())
+	filter->Clear ();
+    }
+}
+
+// Provide a response without asking the server.  When corked, it
+// is held until Uncork.
+
+Packet Client::LocalResponse (Packet &&packet, unsigned code)
+{
+  packet.SetRequest (code);
+  if (!IsCorked ())
+    return std::move (packet);
+
+  corked.push_back (Detail::RC_HWM);
+  answered.emplace_back (std::move (packet));
+  return Packet (PC_CORKED);
+}
+
+// Marks a corked request whose response is to be remembered
+constexpr char MEMO = 0x40;
+
+// Only definitive answers are remembered, an error may be transient
+
+static bool IsMemorable (Packet const &packet)
+{
+  return (packet.GetCode () == Client::PC_BOOL
+	  || packet.GetCode () == Client::PC_PATHNAME);
+}
+
+bool Client::Recall (unsigned code, Flags flags, char const *str, size_t len,
+		     Packet &packet)
+{
+  if (!cache || !is_connected)
+    return false;
+
+  return cache->Lookup (code, flags, str, len, packet);
+}
+
+Packet Client::Remember (Packet &&packet, Flags flags,
+			 char const *str, size_t len)
+{
+  if (cache)
+    {
+      if (packet.GetCode () == PC_CORKED)
+	{
+	  // Remember it at Uncork
+	  corked.back () |= MEMO;
+	  memos.emplace_back (std::string (str, len), flags);
+	}
+      else if (IsMemorable (packet))
+	cache->Insert (packet.GetRequest (), flags,
+		       std::string (str, len), packet);
+    }
+
+  return std::move (packet);
+}
+
 Packet Client::MaybeRequest (unsigned code)
 {
   if (IsCorked ())
@@ -153,7 +464,12 @@ Packet Client::MaybeRequest (unsigned code)
       return Packet (PC_CORKED);
     }
 
-  if (int err = CommunicateWithServer ())
+  uint64_t traced = tracer ? Tracer::Now () : 0;
+  int err = CommunicateWithServer ();
+  if (traced && tracer)
+    tracer->Event (Metrics::GetVerbName (code), u8"client", traceIdent, this,
+		   traced);
+  if (err)
     return CommunicationError (err);
 
   std::vector<std::string> words;
@@ -164,30 +480,210 @@ void Client::Cork ()
 {
   if (corked.empty ())
     corked.push_back (-1);
+  for (auto &shard : shards)
+    shard->Cork ();
+}
+
+// Points on the consistent hashing ring per backend, to even out
+// their shares
+constexpr unsigned RingPoints = 64;
+
+// FNV-1a's high bits are poorly mixed for short strings, so finish
+// it as MurmurHash3 does.
+
+static uint64_t RingHash (char const *str, size_t len)
+{
+  uint64_t h = Detail::Hash (str, len);
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccd;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53;
+  h ^= h >> 33;
+
+  return h;
+}
+
+// Add BACKEND's points to RING
+
+static void Place (std::vector<std::pair<uint64_t, unsigned>> &ring,
+		   unsigned backend)
+{
+  for (unsigned ix = 0; ix != RingPoints; ix++)
+    {
+      std::string point (std::to_string (backend));
+      point.push_back ('#');
+      point.append (std::to_string (ix));
+      ring.emplace_back (RingHash (point.data (), point.size ()), backend);
+    }
+}
+
+void Client::AddShard (int from, int to)
+{
+  AddShard (new Client (from, to));
+}
+
+void Client::AddShard (Server *s)
+{
+  AddShard (new Client (s));
+}
+
+void Client::AddShard (Client *shard)
+{
+  shard->cache = cache;
+  shard->tracer = tracer;
+  shards.emplace_back (shard);
+
+  if (ring.empty ())
+    // The client's own connection is backend 0
+    Place (ring, 0);
+  Place (ring, unsigned (shards.size ()));
+  std::sort (ring.begin (), ring.end ());
 }
 
+unsigned Client::GetShard (char const *str, size_t len) const
+{
+  if (ring.empty ())
+    return 0;
+  if (len == ~size_t (0))
+    len = strlen (str);
+
+  // The first point at or after the name's, wrapping around
+  std::pair<uint64_t, unsigned> key (RingHash (str, len), 0);
+  auto iter = std::lower_bound (ring.begin (), ring.end (), key);
+  if (iter == ring.end ())
+    iter = ring.begin ();
+
+  return iter->second;
+}
+
+// The backend for a request naming STR, or for an unnamed request if
+// STR is nullptr.  When corked, the route is noted for Uncork.
+
+Client *Client::Route (char const *str, size_t len)
+{
+  if (shards.empty ())
+    return this;
+
+  unsigned backend = str ? GetShard (str, len) : 0;
+  if (IsCorked ())
+    routes.push_back (backend);
+
+  return backend ? shards[backend - 1].get () : this;
+}
+
+// Marks a corked request sent to every backend
+constexpr unsigned ALL = ~0u;
+
+// Uncork each backend, and merge their responses in request order.
+// A backend that failed has a single error response, which each of
+// its requests gets.
+
 std::vector<Packet> Client::Uncork ()
+{
+  if (shards.empty ())
+    return Flush ();
+
+  std::vector<std::vector<Packet>> results (shards.size () + 1);
+  std::vector<size_t> expected (results.size ()), next (results.size ());
+  results[0] = Flush ();
+  for (unsigned ix = 0; ix != shards.size (); ix++)
+    results[ix + 1] = shards[ix]->Uncork ();
+  for (auto route : routes)
+    if (route == ALL)
+      for (auto &count : expected)
+	count++;
+    else
+      expected[route]++;
+
+  auto take = [&] (unsigned backend) -> Packet
+    {
+      auto &packets = results[backend];
+      if (packets.size () == expected[backend])
+	return std::move (packets[next[backend]++]);
+      Packet &error = packets[0];
+      return Packet (error.GetCode (), error.GetString ());
+    };
+
+  std::vector<Packet> result;
+  for (auto route : routes)
+    if (route != ALL)
+      result.emplace_back (take (route));
+    else
+      {
+	// The handshake succeeds if every backend's does
+	result.emplace_back (take (0));
+	for (unsigned ix = 1; ix != results.size (); ix++)
+	  {
+	    Packet packet = take (ix);
+	    if (packet.GetCode () == PC_ERROR
+		&& result.back ().GetCode () != PC_ERROR)
+	      result.back () = std::move (packet);
+	  }
+      }
+  routes.clear ();
+
+  return result;
+}
+
+// Uncork the client's own connection
+
+std::vector<Packet> Client::Flush ()
 {
   std::vector<Packet> result;
 
   if (corked.size () > 1)
     {
-      if (int err = CommunicateWithServer ())
+      CODY_PROBE1 (uncork, corked.size () - 1);
+
+      // The last request the server responds to
+      auto last = corked.end ();
+      for (auto iter = corked.end (); --iter != corked.begin ();)
+	if (*iter != Detail::RC_HWM)
+	  {
+	    last = iter;
+	    break;
+	  }
+
+      int err = 0;
+      if (last != corked.end ())
+	{
+	  uint64_t traced = tracer ? Tracer::Now () : 0;
+	  err = CommunicateWithServer ();
+	  if (traced && tracer)
+	    tracer->Event (u8"block", u8"client", traceIdent, this, traced,
+			   unsigned (corked.size () - 1 - answered.size ()));
+	}
+      if (err)
 	result.emplace_back (CommunicationError (err));
       else
 	{
 	  std::vector<std::string> words;
-	  for (auto iter = corked.begin () + 1; iter != corked.end ();)
+	  auto local = answered.begin ();
+	  auto memo = memos.begin ();
+	  for (auto iter = corked.begin () + 1; iter != corked.end (); ++iter)
 	    {
 	      char code = *iter;
-	      ++iter;
-	      result.emplace_back (ProcessResponse (words, code,
-						    iter == corked.end ()));
+	      if (code == Detail::RC_HWM)
+		result.emplace_back (std::move (*local++));
+	      else
+		{
+		  result.emplace_back (ProcessResponse (words, code & ~MEMO,
+							iter == last));
+		  if (code & MEMO)
+		    {
+		      if (cache && IsMemorable (result.back ()))
+			cache->Insert (code & ~MEMO, memo->second, memo->first,
+				       result.back ());
+		      ++memo;
+		    }
+		}
 	    }
 	}
     }
 
   corked.clear ();
+  answered.clear ();
+  memos.clear ();
 
   return result;
 }
@@ -198,20 +694,46 @@ std::vector<Packet> Client::Uncork ()
 Packet Client::Connect (char const *agent, char const *ident,
 			  size_t alen, size_t ilen)
 {
+  Packet failed (PC_OK);
+  if (IsCorked () && !shards.empty ())
+    routes.push_back (ALL);
+  for (auto &shard : shards)
+    {
+      Packet packet = shard->Connect (agent, ident, alen, ilen);
+      if (packet.GetCode () == PC_ERROR && failed.GetCode () != PC_ERROR)
+	failed = std::move (packet);
+    }
+
+  if (tracer)
+    {
+      traceIdent.assign (ident, ilen == ~size_t (0) ? strlen (ident) : ilen);
+      tracer->NameTrack (traceIdent, this);
+    }
+
   write.BeginLine ();
-  write.AppendWord (u8"HELLO");
+  write.AppendWord (Detail::schemas[Detail::RC_CONNECT].verb);
   write.AppendInteger (Version);
   write.AppendWord (agent, true, alen);
   write.AppendWord (ident, true, ilen);
+  if (filter)
+    write.AppendInteger (filter->GetTag ());
   write.EndLine ();
 
-  return MaybeRequest (Detail::RC_CONNECT);
+  Packet packet = MaybeRequest (Detail::RC_CONNECT);
+  if (failed.GetCode () == PC_ERROR && packet.GetCode () != PC_ERROR)
+    {
+      // A shard failed
+      is_connected = false;
+      return failed;
+    }
+
+  return packet;
 }
 
-// HELLO $version $agent [$flags]
+// HELLO $version $agent [$flags [$tag [$filter]]]
 Packet ConnectResponse (std::vector<std::string> &words)
 {
-  if (words[0] == u8"HELLO" && (words.size () == 3 || words.size () == 4))
+  if (words[0] == u8"HELLO" && words.size () >= 3 && words.size () <= 6)
     {
       char *eptr;
       unsigned long val = strtoul (words[1].c_str (), &eptr, 10);
@@ -222,7 +744,7 @@ Packet ConnectResponse (std::vector<std::string> &words)
       else
 	{
 	  unsigned flags = 0;
-	  if (words.size () == 4)
+	  if (words.size () >= 4)
 	    {
 	      val = strtoul (words[3].c_str (), &eptr, 10);
 	      flags = unsigned (val);
@@ -237,8 +759,9 @@ Packet ConnectResponse (std::vector<std::string> &words)
 // MODULE-REPO
 Packet Client::ModuleRepo ()
 {
+  Route (nullptr, 0);
   write.BeginLine ();
-  write.AppendWord (u8"MODULE-REPO");
+  write.AppendWord (Detail::schemas[Detail::RC_MODULE_REPO].verb);
   write.EndLine ();
 
   return MaybeRequest (Detail::RC_MODULE_REPO);
@@ -256,16 +779,40 @@ Packet PathnameResponse (std::vector<std::string> &words)
 // INVOKE $args
 Packet Client::InvokeSubProcess (char const *const *argv, size_t argc)
 {
+  Route (nullptr, 0);
   write.BeginLine ();
-  write.AppendWord (u8"INVOKE");
+  write.AppendWord (Detail::schemas[Detail::RC_INVOKE].verb);
 
   for(size_t i = 0; i < argc; i++) 
-    write.AppendWord (argv[i]);
+    write.AppendWord (argv[i], true);
 
   write.EndLine ();
   return MaybeRequest (Detail::RC_INVOKE);
 }
 
+// STATS
+Packet Client::Stats ()
+{
+  Route (nullptr, 0);
+  write.BeginLine ();
+  write.AppendWord (Detail::schemas[Detail::RC_STATS].verb);
+  write.EndLine ();
+
+  return MaybeRequest (Detail::RC_STATS);
+}
+
+// STATS [$name $value]*
+Packet StatsResponse (std::vector<std::string> &words)
+{
+  if (words[0] == u8"STATS" && words.size () % 2)
+    {
+      words.erase (words.begin ());
+      return Packet (Client::PC_STATS, std::move (words));
+    }
+
+  return Packet (Client::PC_ERROR, u8"");
+}
+
 // OK or ERROR
 Packet OKResponse (std::vector<std::string> &words)
 {
@@ -276,15 +823,26 @@ Packet OKResponse (std::vector<std::string> &words)
 		   words.size () == 2 ? std::move (words[1]) : "");
 }
 
-// MODULE-EXPORT $modulename [$flags]
-Packet Client::ModuleExport (char const *module, Flags flags, size_t mlen)
+// $verb $name [$flags]
+void Client::EncodeName (unsigned code, char const *str, Flags flags,
+			 size_t len)
 {
   write.BeginLine ();
-  write.AppendWord (u8"MODULE-EXPORT");
-  write.AppendWord (module, true, mlen);
+  write.AppendWord (Detail::schemas[code].verb);
+  write.AppendWord (str, true, len);
   if (flags != Flags::None)
     write.AppendInteger (unsigned (flags));
   write.EndLine ();
+}
+
+// MODULE-EXPORT $modulename [$flags]
+Packet Client::ModuleExport (char const *module, Flags flags, size_t mlen)
+{
+  Client *shard = Route (module, mlen);
+  if (shard != this)
+    return shard->ModuleExport (module, flags, mlen);
+
+  EncodeName (Detail::RC_MODULE_EXPORT, module, flags, mlen);
 
   return MaybeRequest (Detail::RC_MODULE_EXPORT);
 }
@@ -292,25 +850,31 @@ Packet Client::ModuleExport (char const *module, Flags flags, size_t mlen)
 // MODULE-IMPORT $modulename [$flags]
 Packet Client::ModuleImport (char const *module, Flags flags, size_t mlen)
 {
-  write.BeginLine ();
-  write.AppendWord (u8"MODULE-IMPORT");
-  write.AppendWord (module, true, mlen);
-  if (flags != Flags::None)
-    write.AppendInteger (unsigned (flags));
-  write.EndLine ();
+  Client *shard = Route (module, mlen);
+  if (shard != this)
+    return shard->ModuleImport (module, flags, mlen);
+
+  if (cache && mlen == ~size_t (0))
+    mlen = strlen (module);
 
-  return MaybeRequest (Detail::RC_MODULE_IMPORT);
+  Packet memo (PC_OK);
+  if (Recall (Detail::RC_MODULE_IMPORT, flags, module, mlen, memo))
+    return LocalResponse (std::move (memo), Detail::RC_MODULE_IMPORT);
+
+  EncodeName (Detail::RC_MODULE_IMPORT, module, flags, mlen);
+
+  return Remember (MaybeRequest (Detail::RC_MODULE_IMPORT),
+		   flags, module, mlen);
 }
 
 // MODULE-COMPILED $modulename [$flags]
 Packet Client::ModuleCompiled (char const *module, Flags flags, size_t mlen)
 {
-  write.BeginLine ();
-  write.AppendWord (u8"MODULE-COMPILED");
-  write.AppendWord (module, true, mlen);
-  if (flags != Flags::None)
-    write.AppendInteger (unsigned (flags));
-  write.EndLine ();
+  Client *shard = Route (module, mlen);
+  if (shard != this)
+    return shard->ModuleCompiled (module, flags, mlen);
+
+  EncodeName (Detail::RC_MODULE_COMPILED, module, flags, mlen);
 
   return MaybeRequest (Detail::RC_MODULE_COMPILED);
 }
@@ -318,14 +882,24 @@ Packet Client::ModuleCompiled (char const *module, Flags flags, size_t mlen)
 // INCLUDE-TRANSLATE $includename [$flags]
 Packet Client::IncludeTranslate (char const *include, Flags flags, size_t ilen)
 {
-  write.BeginLine ();
-  write.AppendWord (u8"INCLUDE-TRANSLATE");
-  write.AppendWord (include, true, ilen);
-  if (flags != Flags::None)
-    write.AppendInteger (unsigned (flags));
-  write.EndLine ();
+  Client *shard = Route (include, ilen);
+  if (shard != this)
+    return shard->IncludeTranslate (include, flags, ilen);
+
+  if (filter && is_connected && !filter->MayContain (include, ilen))
+    return LocalResponse (Packet (PC_BOOL, 0), Detail::RC_INCLUDE_TRANSLATE);
+
+  if (cache && ilen == ~size_t (0))
+    ilen = strlen (include);
+
+  Packet memo (PC_OK);
+  if (Recall (Detail::RC_INCLUDE_TRANSLATE, flags, include, ilen, memo))
+    return LocalResponse (std::move (memo), Detail::RC_INCLUDE_TRANSLATE);
+
+  EncodeName (Detail::RC_INCLUDE_TRANSLATE, include, flags, ilen);
 
-  return MaybeRequest (Detail::RC_INCLUDE_TRANSLATE);
+  return Remember (MaybeRequest (Detail::RC_INCLUDE_TRANSLATE),
+		   flags, include, ilen);
 }
 
 // BOOL $knowntextualness
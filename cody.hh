@@ -19,9 +19,12 @@
 // C++
 #include <memory>
 #include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 // C
 #include <cstddef>
+#include <cstdint>
 // OS
 #include <errno.h>
 #include <sys/types.h>
@@ -39,8 +42,165 @@ constexpr unsigned Version = 1;
 // FIXME: I guess we need a file-handle abstraction here
 // Is windows DWORDPTR still?, or should it be FILE *? (ew).
 
+///
+/// A source of memory for message buffers, after C++17's
+/// std::pmr::memory_resource.  Give each connection or thread its
+/// own, to keep buffer allocation away from the global heap.
+class MemoryResource
+{
+public:
+  constexpr MemoryResource () = default;
+  virtual ~MemoryResource () = default;
+  MemoryResource (MemoryResource const &) = delete;
+  MemoryResource &operator= (MemoryResource const &) = delete;
+
+public:
+  /// Allocate memory
+  /// @param size number of octets
+  /// @param align required alignment, a power of 2
+  virtual void *Allocate (size_t size, size_t align) = 0;
+  /// Deallocate memory from Allocate
+  /// @param ptr the memory
+  /// @param size as given to Allocate
+  /// @param align as given to Allocate
+  virtual void Deallocate (void *ptr, size_t size, size_t align) = 0;
+
+public:
+  /// The default resource, using operator new and delete
+  static MemoryResource *GetDefault ();
+};
+
+///
+/// A resource keeping freed blocks for reuse, in power of 2 size
+/// classes.  Larger blocks come directly from upstream.  It is not
+/// thread-safe, so needs no locking.
+class PoolResource : public MemoryResource
+{
+public:
+  static constexpr unsigned MinShift = 6;  ///< Smallest class, 64 octets
+  static constexpr unsigned Classes = 11;  ///< Largest class, 64KiB
+
+private:
+  MemoryResource *upstream;
+  void *pools[Classes] = {};  ///< Free lists, linked through each block
+  size_t freeSize = 0;  ///< Octets in the free lists
+
+public:
+  /// @param up where blocks come from
+  PoolResource (MemoryResource *up = GetDefault ())
+    : upstream (up)
+  {
+  }
+  /// Blocks still in use must not be deallocated afterwards
+  ~PoolResource ()
+  {
+    Release ();
+  }
+
+public:
+  virtual void *Allocate (size_t size, size_t align);
+  virtual void Deallocate (void *ptr, size_t size, size_t align);
+
+public:
+  /// Return the free blocks to upstream
+  void Release ();
+  /// Octets held in free blocks
+  size_t GetFreeSize () const
+  {
+    return freeSize;
+  }
+
+private:
+  static unsigned Class (size_t size);
+};
+
+///
+/// A monotonic resource, allocating sequentially from chunks.
+/// Deallocation does nothing, except for the most recent block.  Reset
+/// it between turns, once nothing allocated from it is in use.
+class ArenaResource : public MemoryResource
+{
+  struct Chunk
+  {
+    Chunk *prev;
+    size_t size;  ///< Including this header
+  };
+
+private:
+  MemoryResource *upstream;
+  Chunk *chunk = nullptr;  ///< Most recent chunk
+  char *next = nullptr;  ///< Free space in it
+  char *limit = nullptr;
+  size_t chunkSize;  ///< Size of the next chunk
+
+public:
+  /// @param size of the first chunk, later ones are larger
+  /// @param up where chunks come from
+  ArenaResource (size_t size = 16384, MemoryResource *up = GetDefault ())
+    : upstream (up), chunkSize (size ? size : 1)
+  {
+  }
+  ~ArenaResource ();
+
+public:
+  virtual void *Allocate (size_t size, size_t align);
+  virtual void Deallocate (void *ptr, size_t size, size_t align);
+
+public:
+  /// Free everything allocated.  The most recent (largest) chunk is
+  /// kept for reuse.
+  void Reset ();
+};
+
 namespace Detail  {
 
+/// A standard allocator for a MemoryResource
+template<typename T>
+class Allocator
+{
+public:
+  using value_type = T;
+  // The resource goes with the memory
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+public:
+  MemoryResource *resource;
+
+public:
+  Allocator (MemoryResource *r = MemoryResource::GetDefault ()) noexcept
+    : resource (r)
+  {
+  }
+  template<typename U>
+  Allocator (Allocator<U> const &other) noexcept
+    : resource (other.resource)
+  {
+  }
+
+public:
+  T *allocate (size_t n)
+  {
+    return static_cast<T *> (resource->Allocate (n * sizeof (T),
+						 alignof (T)));
+  }
+  void deallocate (T *ptr, size_t n)
+  {
+    resource->Deallocate (ptr, n * sizeof (T), alignof (T));
+  }
+};
+
+template<typename T, typename U>
+bool operator== (Allocator<T> const &a, Allocator<U> const &b)
+{
+  return a.resource == b.resource;
+}
+template<typename T, typename U>
+bool operator!= (Allocator<T> const &a, Allocator<U> const &b)
+{
+  return a.resource != b.resource;
+}
+
 // C++11 doesn't have utf8 character literals :(
 
 template<unsigned I>
@@ -54,16 +214,28 @@ constexpr char S2C (char const (&s)[I])
 /// and Lex incoming ones.
 class MessageBuffer
 {
-  std::vector<char> buffer;  ///< buffer holding the message
+  std::vector<char, Allocator<char>> buffer;  ///< buffer holding the message
   size_t lastBol = 0;  ///< location of the most recent Beginning Of
 		       ///< Line, or position we've readed when writing
 
 public:
   MessageBuffer () = default;
+  /// Allocate the buffer from a memory resource
+  explicit MessageBuffer (MemoryResource *m)
+    : buffer (Allocator<char> (m))
+  {
+  }
   ~MessageBuffer () = default;
   MessageBuffer (MessageBuffer &&) = default;
   MessageBuffer &operator= (MessageBuffer &&) = default;
 
+public:
+  /// The resource the buffer is allocated from
+  MemoryResource *GetResource () const
+  {
+    return buffer.get_allocator ().resource;
+  }
+
 public:
   ///
   /// Finalize a buffer to be written.  No more lines can be added to
@@ -133,7 +305,8 @@ private:
   void Append (char c);
 
 public:
-  /// Lex the next input line into a vector of words.
+  /// Lex the next input line into a vector of words.  The strings of
+  /// a previous Lex are reused, to keep their allocations.
   /// @param words filled with a vector of lexed strings
   /// @result 0 if no errors, an errno value on lexxing error such as
   /// there being no next line (ENOENT), or malformed quoting (EINVAL)
@@ -156,6 +329,34 @@ public:
   {
     return lastBol == buffer.size ();
   }
+  /// Octets not yet lexed
+  size_t GetUnprocessed () const
+  {
+    return buffer.size () - lastBol;
+  }
+  /// Detect if there is a complete line to Lex.  Unlike IsAtEnd, this
+  /// may be used while a block is still being read.
+  /// @result True if there is a line
+  bool HasLine () const;
+
+public:
+  /// Current size of the buffer.  Can be used to remember the
+  /// position of a line, for a later Splice.
+  size_t GetSize () const
+  {
+    return buffer.size ();
+  }
+  /// The buffer's contents, GetSize octets.
+  char const *GetData () const
+  {
+    return buffer.data ();
+  }
+  /// Replace part of the buffer with the contents of another buffer.
+  /// The other buffer is emptied.
+  /// @param pos position of the text to be replaced
+  /// @param len length of the text to be replaced
+  /// @param from buffer holding the replacement text
+  void Splice (size_t pos, size_t len, MessageBuffer &from);
 
 public:
   /// Read from end point into a read buffer, as with read(2).  This will
@@ -168,6 +369,15 @@ public:
   /// returns EAGAIN (or possibly EINTR).  If the message is
   /// malformed, returns EINVAL.
   int Read (int fd) noexcept;
+  /// Add octets received by other means, such as io_uring, as if by
+  /// Read.
+  /// @param data the octets
+  /// @param count how many, 0 for end of file
+  /// @result as for Read
+  int Received (char const *data, size_t count) noexcept;
+
+private:
+  int Scan (size_t lwm) noexcept;
 
 public:
   /// Write to an end point from a write buffer, as with write(2).  As
@@ -178,6 +388,20 @@ public:
   /// At end of message returns 0.  If there is more to write
   /// returns EAGAIN (or possibly EINTR).
   int Write (int fd) noexcept;
+  /// The octets still to be written, for sending by other means.
+  /// @param len set to their length
+  /// @result the octets
+  char const *GetUnwritten (size_t &len) const
+  {
+    len = buffer.size () - lastBol;
+    return buffer.data () + lastBol;
+  }
+  /// Note octets from GetUnwritten have been sent by other means, as
+  /// if by Write.
+  /// @param count how many
+  /// @param err errno, if sending failed
+  /// @result as for Write
+  int Sent (ssize_t count, int err) noexcept;
 };
 
 ///
@@ -192,6 +416,7 @@ enum RequestCode
   RC_MODULE_COMPILED,
   RC_INCLUDE_TRANSLATE,
   RC_INVOKE,
+  RC_STATS,
   RC_HWM
 };
 
@@ -226,6 +451,8 @@ inline Flags operator| (Flags a, Flags b)
 /// Uncork call will return a vector of Packets.
 class Packet
 {
+  friend class Client;
+
 public:
   ///
   /// Packet is a variant structure.  These are the possible content types.
@@ -240,6 +467,7 @@ private:
     std::vector<std::string> vector;  ///< Vector of string value
   };
   Category cat : 2;  ///< Discriminator
+  bool is_timeout : 1;  ///< A Client's round trip timed out
 
 private:
   unsigned short code = 0;  ///< Packet type
@@ -247,19 +475,19 @@ private:
 
 public:
   Packet (unsigned c, size_t i = 0)
-    : integer (i), cat (INTEGER), code (c)
+    : integer (i), cat (INTEGER), is_timeout (false), code (c)
   {
   }
   Packet (unsigned c, std::string &&s)
-    : string (std::move (s)), cat (STRING), code (c)
+    : string (std::move (s)), cat (STRING), is_timeout (false), code (c)
   {
   }
   Packet (unsigned c, std::string const &s)
-    : string (s), cat (STRING), code (c)
+    : string (s), cat (STRING), is_timeout (false), code (c)
   {
   }
   Packet (unsigned c, std::vector<std::string> &&v)
-    : vector (std::move (v)), cat (VECTOR), code (c)
+    : vector (std::move (v)), cat (VECTOR), is_timeout (false), code (c)
   {
   }
   // No non-move constructor from a vector.  You should not be doing
@@ -348,6 +576,342 @@ public:
   }
 };
 
+namespace Detail {
+class Filter;
+}
+
+///
+/// Membership filter of the headers a server will translate, sent to
+/// the client at connection.  The client can then answer include
+/// translation queries for other headers without a round trip, with
+/// BOOL FALSE.  So every header the server answers otherwise --
+/// a header unit's CMI, or BOOL TRUE for a known textual header --
+/// must be in the filter, or the client never sees that answer.  It
+/// is a Bloom filter, so may give false positives, which are
+/// resolved by asking the server.  The tag versions the contents, so
+/// that a client holding a current copy need not be resent it.  The
+/// filter may be shared by clients in different threads, as a
+/// ResponseCache may.
+class IncludeFilter
+{
+  std::unique_ptr<Detail::Filter> impl;
+
+public:
+  IncludeFilter ();
+  ~IncludeFilter ();
+
+public:
+  /// Empty the filter and size it for a number of headers.
+  /// @param tag version of the contents, must be non-zero
+  /// @param entries expected number of headers
+  void Reset (unsigned tag, size_t entries);
+  /// Discard the filter.  An invalid filter contains everything.
+  void Clear ();
+
+public:
+  /// Add a header to the filter.
+  /// @param str header name, as given to IncludeTranslate
+  /// @param len length, if known
+  void Add (char const *str, size_t len = ~size_t (0));
+  void Add (std::string const &s)
+  {
+    Add (s.data (), s.size ());
+  }
+  /// Query the filter.
+  /// @param str header name
+  /// @param len length, if known
+  /// @result false if the header is certainly not in the filter
+  bool MayContain (char const *str, size_t len = ~size_t (0)) const;
+  bool MayContain (std::string const &s) const
+  {
+    return MayContain (s.data (), s.size ());
+  }
+
+public:
+  /// Predicate for a filter with contents
+  bool IsValid () const;
+  /// Version of the contents.  0 for an invalid filter
+  unsigned GetTag () const;
+
+public:
+  /// Encode the filter as a single, unquoted, message word
+  /// @param word string to append the encoding to
+  void Encode (std::string &word) const;
+  /// Decode a filter, replacing the contents at once
+  /// @param tag version of the filter
+  /// @param word encoded filter
+  /// @result true if well formed, otherwise the filter is cleared
+  bool Decode (unsigned tag, std::string const &word);
+};
+
+namespace Detail {
+class Memo;
+}
+
+///
+/// Memo of responses to include translation and module import
+/// requests, keyed on the request, its name and flags.  A client
+/// using one answers a repeated query without a round trip.  Error
+/// responses are not remembered.  The memo may be shared by clients
+/// in different threads that talk to the same server, and it is
+/// never invalidated implicitly -- if the server's answer may change
+/// (for instance a module is rebuilt elsewhere), Invalidate it.
+class ResponseCache
+{
+  friend class Client;
+  friend class ProxyResolver;
+  friend class CacheStage;
+
+private:
+  std::unique_ptr<Detail::Memo> impl;
+
+public:
+  ResponseCache ();
+  ~ResponseCache ();
+
+public:
+  /// Forget all responses
+  void Invalidate ();
+  /// Forget the responses for a name.
+  /// @param str module, header-unit or header name
+  /// @param len length, if known
+  void Invalidate (char const *str, size_t len = ~size_t (0));
+  void Invalidate (std::string const &s)
+  {
+    Invalidate (s.data (), s.size ());
+  }
+
+private:
+  bool Lookup (unsigned request, Flags flags, char const *str, size_t len,
+	       Packet &packet) const;
+  void Insert (unsigned request, Flags flags, std::string const &name,
+	       Packet const &packet);
+};
+
+///
+/// Histogram of latencies, in nanoseconds.  The buckets are
+/// log-linear, as an HDR histogram with 3 bits of sub-bucket
+/// precision.  Values below 16 are exact, larger ones are within
+/// 12.5%.
+class Histogram
+{
+public:
+  static constexpr unsigned Buckets = 496;
+
+private:
+  uint64_t counts[Buckets];
+
+public:
+  Histogram ()
+    : counts ()
+  {
+  }
+
+public:
+  /// Bucket holding a value
+  static unsigned Bucket (uint64_t value);
+  /// Largest value in a bucket
+  static uint64_t Value (unsigned bucket);
+
+public:
+  /// Record a value
+  void Record (uint64_t value)
+  {
+    counts[Bucket (value)]++;
+  }
+  /// Add to a bucket's count
+  void Add (unsigned bucket, uint64_t n)
+  {
+    counts[bucket] += n;
+  }
+  /// Add another histogram's counts
+  void Merge (Histogram const &other);
+
+public:
+  /// Count in a bucket
+  uint64_t GetCount (unsigned bucket) const
+  {
+    return counts[bucket];
+  }
+  /// Number of values recorded
+  uint64_t GetCount () const;
+  /// Value at a percentile.  The bucket's largest value is used.
+  /// @param rank 0 to 1, 0.5 for the median
+  /// @result the value, or 0 if the histogram is empty
+  uint64_t GetPercentile (double rank) const;
+};
+
+///
+/// Request and I/O counters, summed over all the Servers and Clients
+/// in the process.  Each thread counts into its own block, so
+/// recording contends on nothing, and Snapshot sums the blocks.
+/// Counting is enabled by default, disabling it saves the clock
+/// reads.
+class Metrics
+{
+public:
+  struct Verb
+  {
+    uint64_t count = 0;
+    uint64_t errors = 0;	///< Requests answered with an error
+    Histogram latency;		///< Lexing to response
+  };
+  struct IO
+  {
+    uint64_t calls = 0;		///< Calls to read or write
+    uint64_t bytes = 0;
+    uint64_t errors = 0;	///< Excluding EAGAIN and EINTR
+    Histogram latency;		///< Of the system call
+  };
+
+public:
+  /// Per request code, the final one is for unrecognized requests
+  Verb verbs[Detail::RC_HWM + 1];
+  IO reads;
+  IO writes;
+
+public:
+  /// Sum the counters of all threads, past and present.
+  /// @param m filled with the sum
+  static void Snapshot (Metrics &m);
+  /// Enable or disable counting
+  static void Enable (bool enable);
+  static bool IsEnabled ();
+
+public:
+  /// Name of a request code's verb
+  /// @param code index into verbs
+  static char const *GetVerbName (unsigned code);
+  /// Flatten into name, value pairs, as sent in a STATS response.
+  /// Verbs that have not been seen are omitted.
+  /// @param pairs appended with the counters
+  void Report (std::vector<std::pair<std::string, uint64_t>> &pairs) const;
+};
+
+///
+/// Writes trace events, in the Chrome trace-event JSON format, as
+/// loaded by chrome://tracing and Perfetto.  A Client or Server given
+/// one records a complete event for each request block and each
+/// request.  Each compilation is a track named by its HELLO ident,
+/// in the compiler's process and the builder's, so waiting in the
+/// one can be lined up with resolving in the other.  Several
+/// processes may append to the same file.  The closing ']' is
+/// omitted, which the viewers permit.
+class Tracer
+{
+  int fd = -1;
+  unsigned pid = 0;
+
+public:
+  Tracer () = default;
+  ~Tracer ()
+  {
+    Close ();
+  }
+  Tracer (Tracer const &) = delete;
+  Tracer &operator= (Tracer const &) = delete;
+
+public:
+  /// Open a trace file to append to, creating it if needed.
+  /// @param path the file
+  /// @result 0 on success, errno on failure
+  int Open (char const *path);
+  /// Stop tracing
+  void Close ();
+  bool IsOpen () const
+  {
+    return fd >= 0;
+  }
+
+public:
+  /// The trace clock, in nanoseconds.  It is common to all the
+  /// processes on a machine.
+  static uint64_t Now ();
+
+public:
+  /// Name the track of a compilation.
+  /// @param ident the compilation's ident
+  /// @param owner the Client or Server, distinguishing empty idents
+  void NameTrack (std::string const &ident, void const *owner);
+  /// Record a complete event on a compilation's track.
+  /// @param name event name
+  /// @param cat event category
+  /// @param ident the compilation's ident
+  /// @param owner as for NameTrack
+  /// @param start start time, from Now
+  /// @param count number of requests, if a block
+  void Event (char const *name, char const *cat, std::string const &ident,
+	      void const *owner, uint64_t start, unsigned count = 0);
+};
+
+///
+/// Log of the message blocks a builder's Servers receive and send,
+/// for later replay.  Each record has a kind, a connection id, a
+/// time (from Tracer::Now) and the block's text.  Records are
+/// written whole, so Servers in different threads may share a log,
+/// but only one process should write to it.  The encoding is in host
+/// byte order.
+class Capture
+{
+public:
+  enum Kind
+  {
+    OPEN,	///< A connection started capturing
+    REQUESTS,	///< Request block received
+    RESPONSES,	///< Response block sent
+    CLOSE	///< Connection ended
+  };
+  struct Record
+  {
+    Kind kind;
+    unsigned connection;
+    uint64_t time;
+    std::string text;
+  };
+
+private:
+  int fd = -1;
+
+public:
+  Capture () = default;
+  ~Capture ()
+  {
+    Close ();
+  }
+  Capture (Capture const &) = delete;
+  Capture &operator= (Capture const &) = delete;
+
+public:
+  /// Create a log, replacing any existing file.
+  /// @param path the file
+  /// @result 0 on success, errno on failure
+  int Open (char const *path);
+  /// Stop capturing
+  void Close ();
+  bool IsOpen () const
+  {
+    return fd >= 0;
+  }
+
+public:
+  /// Allocate a connection id, and record its OPEN.
+  /// @result the id
+  unsigned Connect ();
+  /// Append a record
+  /// @param kind record kind
+  /// @param connection connection id
+  /// @param text block text
+  /// @param len text length
+  void Write (Kind kind, unsigned connection, char const *text, size_t len);
+
+public:
+  /// Read a log.
+  /// @param path the file
+  /// @param records appended with the records, in order
+  /// @result 0 on success, errno on failure, EINVAL if malformed
+  static int Read (char const *path, std::vector<Record> &records);
+};
+
 class Server;
 
 ///
@@ -363,13 +927,31 @@ public:
     PC_ERROR,		///< Packet is error string
     PC_OK,
     PC_BOOL,
-    PC_PATHNAME
+    PC_PATHNAME,
+    PC_STATS		///< Packet is vector of name, value words
   };
 
 private:
   Detail::MessageBuffer write; ///< Outgoing write buffer
   Detail::MessageBuffer read;  ///< Incoming read buffer
   std::string corked; ///< Queued request tags
+  std::vector<Packet> answered; ///< Locally answered corked requests
+  IncludeFilter *filter = nullptr;  ///< Headers the server translates
+  ResponseCache *cache = nullptr;  ///< Memo of previous responses
+  Tracer *tracer = nullptr;
+  std::string traceIdent;  ///< Compilation ident, if tracing
+  /// Names of corked requests to remember the responses of
+  std::vector<std::pair<std::string, Flags>> memos;
+  /// Further backends, the client's own connection being the first
+  std::vector<std::unique_ptr<Client>> shards;
+  /// Consistent hashing ring of (point, backend)
+  std::vector<std::pair<uint64_t, unsigned>> ring;
+  std::vector<unsigned> routes;  ///< Backend of each corked request
+  /// A round trip that timed out, finished before the next one
+  Detail::MessageBuffer lateWrite;
+  Detail::MessageBuffer lateRead;
+  uint64_t deadline = 0;  ///< Of the next round trip, if non-zero
+  int timeout = -1;  ///< Milliseconds, of each round trip
   union
   {
     Detail::FD fd;   ///< FDs connecting to server
@@ -377,6 +959,8 @@ private:
   };
   bool is_direct = false;  ///< Discriminator
   bool is_connected = false;  /// Connection handshake succesful
+  bool is_late = false;  ///< A timed out round trip is unfinished
+  bool is_broken = false;  ///< A round trip failed part way
 
 private:
   Client ();
@@ -440,6 +1024,106 @@ public:
     return is_direct ? server : nullptr;
   }
 
+public:
+  /// Use an include translation filter.  Connect will ask the server
+  /// to send one, and IncludeTranslate will answer BOOL FALSE
+  /// locally for headers not in it.  The filter may be shared between
+  /// clients in a process, in different threads, that talk to the
+  /// same server, it is only resent if the server's version differs.  Servers that predate this
+  /// feature reject a handshake requesting a filter.
+  /// @param f the filter, or nullptr to stop using one
+  void SetIncludeFilter (IncludeFilter *f)
+  {
+    filter = f;
+  }
+  /// Remember the responses to ModuleImport and IncludeTranslate, and
+  /// answer repeated requests locally.  Shared with the shards.
+  /// @param c the memo, or nullptr to stop using one
+  void SetResponseCache (ResponseCache *c)
+  {
+    cache = c;
+    for (auto &shard : shards)
+      shard->cache = c;
+  }
+  /// Record trace events for each round trip to the server.  Set
+  /// before Connect, to name the track with the ident.  Shared with
+  /// the shards.
+  /// @param t the tracer, or nullptr to stop
+  void SetTracer (Tracer *t)
+  {
+    tracer = t;
+    for (auto &shard : shards)
+      shard->tracer = t;
+  }
+  /// Allocate the message buffers from a memory resource.  The
+  /// current buffers are released, so use it between round trips.
+  /// @param m the resource
+  void SetMemoryResource (MemoryResource *m)
+  {
+    write = Detail::MessageBuffer (m);
+    read = Detail::MessageBuffer (m);
+    for (auto &shard : shards)
+      shard->SetMemoryResource (m);
+  }
+
+public:
+  /// Limit each round trip to the server.  One that times out gets
+  /// an error that IsTimedOut recognizes.  The server may still
+  /// answer it, and the next round trip first waits for that late
+  /// response, and discards it.  The FDs are non-blocking during a
+  /// limited round trip, and their flags are restored afterwards.
+  /// Direct connections do not time out.  Shared with the shards.
+  /// @param msecs the limit in milliseconds, or -1 for none
+  void SetTimeout (int msecs);
+  /// Limit the next round trip, which is the next request, or the
+  /// next Uncork, to finish within msecs from now.  It applies as
+  /// well as the timeout.
+  /// @param msecs milliseconds
+  void SetDeadline (unsigned msecs);
+  /// Timed out response predicate.  Only a round trip that this
+  /// client timed out qualifies, not a server's error, whatever its
+  /// text.
+  /// @param p a response
+  static bool IsTimedOut (Packet const &p);
+  /// Use new FDs, for instance when the server stops answering.  Any
+  /// late response is abandoned, and the handshake must be performed
+  /// again.  The old FDs are not closed.  A round trip that fails
+  /// part way, other than by timing out, leaves the connection out of
+  /// step, and later ones fail with ENOTCONN until this is called.
+  /// @param from file descriptor to read from
+  /// @param to file descriptor to write to, defaults to from
+  void Reconnect (int from, int to = -1);
+
+public:
+  /// Shard requests across another backend mapper.  Requests naming
+  /// a module or header go to a backend chosen by consistent hashing
+  /// of the name, so adding a backend moves few names.  Other
+  /// requests go to the client's own connection, and HELLO goes to
+  /// every backend.  Backends are identified by the order they are
+  /// added, so every client of a build must add the same ones in the
+  /// same order.  Add them before Connect.  The include filter is
+  /// only used for the client's own connection.
+  /// @param from file descriptor to read from
+  /// @param to file descriptor to write to, defaults to from
+  void AddShard (int from, int to = -1);
+  /// Shard requests across a directly connected server.
+  /// @param s Server to directly connect
+  void AddShard (Server *s);
+  /// Number of backends, including the client's own connection
+  unsigned GetShardCount () const
+  {
+    return unsigned (shards.size ()) + 1;
+  }
+  /// The backend a name is routed to, 0 being the client's own
+  /// connection, and the shards numbered in the order added.
+  /// @param str module or header name
+  /// @param len length, if known
+  unsigned GetShard (char const *str, size_t len = ~size_t (0)) const;
+  unsigned GetShard (std::string const &s) const
+  {
+    return GetShard (s.data (), s.size ());
+  }
+
 public:
   ///
   /// Perform connection handshake.  All othe requests will result in
@@ -472,6 +1156,11 @@ public:
     return InvokeSubProcess (args.data (), args.size ());
   }
 
+public:
+  /// Request the server's metrics
+  /// @result packet with a vector of alternating names and values
+  Packet Stats ();
+
 public:
   /// Request compiler module repository
   /// @result packet indicating repo
@@ -495,7 +1184,8 @@ public:
   }
 
 public:
-  /// Importation of a module, partition or header-unit
+  /// Importation of a module, partition or header-unit.  A
+  /// remembered response is provided without asking the server.
   /// @param str module or header-unit
   /// @param len name length, if known
   /// @result CMI name (or deferrment/error)
@@ -528,7 +1218,9 @@ public:
     return ModuleCompiled (s.c_str (), flags, s.size ());
   }
 
-  /// Include translation query.
+  /// Include translation query.  If the header is not in the include
+  /// filter, a BOOL FALSE response is provided without asking the
+  /// server, as is a remembered response.
   /// @param str header unit name
   /// @param len name length, if known
   /// @result  Packet indicating include translation boolean, or CMI
@@ -563,38 +1255,274 @@ public:
   }
 
 private:
+  void AddShard (Client *);
+  Client *Route (char const *str, size_t len);
+  std::vector<Packet> Flush ();
   Packet ProcessResponse (std::vector<std::string> &, unsigned code,
 			  bool isLast);
   Packet MaybeRequest (unsigned code);
+  void EncodeName (unsigned code, char const *str, Flags flags, size_t len);
+  Packet LocalResponse (Packet &&, unsigned code);
+  bool Recall (unsigned code, Flags flags, char const *str, size_t len,
+	       Packet &);
+  Packet Remember (Packet &&, Flags flags, char const *str, size_t len);
+  void UpdateFilter (std::vector<std::string> &);
   int CommunicateWithServer ();
+  int CommunicateWithin (uint64_t until);
+  static Packet CommunicationError (int err);
 };
 
-/// This server-side class is used to resolve requests from one or
-/// more clients.  You are expected to derive from it and override the
-/// virtual functions it provides.  The connection resolver may return
-/// a different resolved object to service the remainder of the
-/// connection -- for instance depending on the compiler that is
-/// making the requests.
-class Resolver
+namespace Detail {
+class Shared;
+class Batch;
+}
+
+///
+/// A Client that many threads may use at once, such as the threads
+/// of a compiler that parses or generates code in parallel.  Their
+/// requests share one connection and handshake.  A request waits for
+/// any round trip in progress, and the requests that arrive meanwhile
+/// go to the server together, as one corked block.  Each caller gets
+/// its own response.  Requests are synchronous -- the Client's Cork
+/// is not available, the batching is implicit.
+class SharedClient
 {
+  std::unique_ptr<Detail::Shared> impl;
+
 public:
-  Resolver () = default;
-  virtual ~Resolver ();
+  /// Direct connection constructor.
+  /// @param s Server to directly connect
+  SharedClient (Server *s);
+  /// Communication connection constructor
+  /// @param from file descriptor to read from
+  /// @param to file descriptor to write to, defaults to from
+  SharedClient (int from, int to = -1);
+  ~SharedClient ();
 
-protected:
-  /// Mapping from a module or header-unit name to a CMI file name.
-  /// @param module module name
-  /// @result CMI name
-  virtual std::string GetCMIName (std::string const &module);
+public:
+  /// The underlying Client, to set its include filter, response
+  /// cache, tracer or shards.  Only configure it before the threads
+  /// start making requests.
+  Client &GetClient ();
 
-  /// Return the CMI file suffix to use
-  /// @result CMI suffix, a statically allocated string
-  virtual char const *GetCMISuffix ();
+public:
+  /// Requests made, including any answered locally
+  uint64_t GetRequests () const;
+  /// Blocks the requests were sent in
+  uint64_t GetBlocks () const;
 
 public:
-  /// When the requests of a directly-connected server are processed,
-  /// we may want to wait for the requests to complete (for instance a
-  /// set of subjobs).
+  /// Perform the connection handshake, as Client::Connect.  It waits
+  /// for any block in progress, and goes alone.
+  Packet Connect (char const *agent, char const *ident,
+		  size_t alen = ~size_t (0), size_t ilen = ~size_t (0));
+  Packet Connect (std::string const &agent, std::string const &ident)
+  {
+    return Connect (agent.c_str (), ident.c_str (),
+		    agent.size (), ident.size ());
+  }
+
+public:
+  /// The requests of Client.  Safe to call from any thread.
+  Packet InvokeSubProcess (char const *const *argv, size_t argc);
+  Packet Stats ();
+  Packet ModuleRepo ();
+  Packet ModuleExport (char const *str, Flags flags = Flags::None,
+		       size_t len = ~size_t (0));
+  Packet ModuleExport (std::string const &s, Flags flags = Flags::None)
+  {
+    return ModuleExport (s.c_str (), flags, s.size ());
+  }
+  Packet ModuleImport (char const *str, Flags flags = Flags::None,
+		       size_t len = ~size_t (0));
+  Packet ModuleImport (std::string const &s, Flags flags = Flags::None)
+  {
+    return ModuleImport (s.c_str (), flags, s.size ());
+  }
+  Packet ModuleCompiled (char const *str, Flags flags = Flags::None,
+			 size_t len = ~size_t (0));
+  Packet ModuleCompiled (std::string const &s, Flags flags = Flags::None)
+  {
+    return ModuleCompiled (s.c_str (), flags, s.size ());
+  }
+  Packet IncludeTranslate (char const *str, Flags flags = Flags::None,
+			   size_t len = ~size_t (0));
+  Packet IncludeTranslate (std::string const &s, Flags flags = Flags::None)
+  {
+    return IncludeTranslate (s.c_str (), flags, s.size ());
+  }
+};
+
+///
+/// A Client that corks requests automatically.  Each request is
+/// queued, and returns a Future for its response.  The queue is sent
+/// as one block when it holds enough requests or bytes, when its
+/// oldest request has waited long enough, or when a queued response
+/// is first needed.  So a compiler can make the requests of a
+/// preamble as it reads them, and only wait when it uses a response.
+/// There is no thread of its own, the time limit is checked when a
+/// request is made and by Poll.
+class BatchClient
+{
+  std::unique_ptr<Detail::Batch> impl;
+
+public:
+  /// The response to a queued request.  It must not outlive its
+  /// BatchClient.  Destroying it without Get discards the response.
+  class Future
+  {
+    friend class BatchClient;
+
+    Detail::Batch *batch = nullptr;
+    uint64_t serial = 0;
+
+  private:
+    Future (Detail::Batch *b, uint64_t s)
+      : batch (b), serial (s)
+    {
+    }
+
+  public:
+    Future () = default;
+    Future (Future &&);
+    Future &operator= (Future &&);
+    ~Future ();
+
+  public:
+    /// Valid predicate, false once the response is taken
+    bool IsValid () const
+    {
+      return batch != nullptr;
+    }
+    /// Answered predicate.  Does not send the queue.
+    bool IsReady () const;
+    /// Take the response, sending the queue if it is still queued.
+    /// @result the response, or an error if already taken
+    Packet Get ();
+  };
+
+public:
+  /// Direct connection constructor.
+  /// @param s Server to directly connect
+  BatchClient (Server *s);
+  /// Communication connection constructor
+  /// @param from file descriptor to read from
+  /// @param to file descriptor to write to, defaults to from
+  BatchClient (int from, int to = -1);
+  ~BatchClient ();
+
+public:
+  /// The underlying Client, to set its include filter, response
+  /// cache, tracer or shards.  Flush before making requests of it
+  /// directly.
+  Client &GetClient ();
+  /// When to send the queue.  Zero disables a limit.  The defaults
+  /// are 64 requests, 16KB and 500 microseconds.
+  /// @param count queued requests
+  /// @param bytes encoded size of the queued requests
+  /// @param usecs microseconds since the oldest was queued
+  void SetLimits (unsigned count, size_t bytes, unsigned usecs);
+
+public:
+  /// Requests queued
+  uint64_t GetRequests () const;
+  /// Blocks the requests were sent in
+  uint64_t GetBlocks () const;
+
+public:
+  /// Send the queue, then perform the connection handshake, as
+  /// Client::Connect.
+  Packet Connect (char const *agent, char const *ident,
+		  size_t alen = ~size_t (0), size_t ilen = ~size_t (0));
+  Packet Connect (std::string const &agent, std::string const &ident)
+  {
+    return Connect (agent.c_str (), ident.c_str (),
+		    agent.size (), ident.size ());
+  }
+
+public:
+  /// The requests of Client, queued
+  Future ModuleRepo ();
+  Future ModuleExport (char const *str, Flags flags = Flags::None,
+		       size_t len = ~size_t (0));
+  Future ModuleExport (std::string const &s, Flags flags = Flags::None)
+  {
+    return ModuleExport (s.c_str (), flags, s.size ());
+  }
+  Future ModuleImport (char const *str, Flags flags = Flags::None,
+		       size_t len = ~size_t (0));
+  Future ModuleImport (std::string const &s, Flags flags = Flags::None)
+  {
+    return ModuleImport (s.c_str (), flags, s.size ());
+  }
+  Future ModuleCompiled (char const *str, Flags flags = Flags::None,
+			 size_t len = ~size_t (0));
+  Future ModuleCompiled (std::string const &s, Flags flags = Flags::None)
+  {
+    return ModuleCompiled (s.c_str (), flags, s.size ());
+  }
+  Future IncludeTranslate (char const *str, Flags flags = Flags::None,
+			   size_t len = ~size_t (0));
+  Future IncludeTranslate (std::string const &s, Flags flags = Flags::None)
+  {
+    return IncludeTranslate (s.c_str (), flags, s.size ());
+  }
+
+public:
+  /// Send the queue now, if it is not empty
+  void Flush ();
+  /// Send the queue if its oldest request has waited out the time
+  /// limit.  Call it from an event loop, with the result as its
+  /// timeout.
+  /// @result microseconds until the limit, or -1 if nothing is
+  /// queued or there is no time limit
+  int Poll ();
+};
+
+class SubProcessPool;
+
+/// This server-side class is used to resolve requests from one or
+/// more clients.  You are expected to derive from it and override the
+/// virtual functions it provides.  The connection resolver may return
+/// a different resolved object to service the remainder of the
+/// connection -- for instance depending on the compiler that is
+/// making the requests.
+class Resolver
+{
+  SubProcessPool *pool = nullptr;  ///< Runs INVOKE requests
+
+public:
+  Resolver () = default;
+  virtual ~Resolver ();
+
+public:
+  /// Run INVOKE requests in a pool of sub processes.  Without one,
+  /// they are rejected.
+  /// @param p the pool, or nullptr
+  void SetSubProcessPool (SubProcessPool *p)
+  {
+    pool = p;
+  }
+
+protected:
+  /// Mapping from a module or header-unit name to a CMI file name.
+  /// @param module module name
+  /// @result CMI name
+  virtual std::string GetCMIName (std::string const &module);
+
+  /// Return the CMI file suffix to use
+  /// @result CMI suffix, a statically allocated string
+  virtual char const *GetCMISuffix ();
+
+  /// Return the CMI repository directory
+  /// @result repository name, a statically allocated string
+  virtual char const *GetCMIRepo ();
+
+public:
+  /// When the requests of a directly-connected server are processed,
+  /// we may want to wait for the requests to complete (for instance a
+  /// set of subjobs).  The default waits for the server's sub
+  /// processes.
   /// @param s directly connected server.
   virtual void WaitUntilReady (Server *s);
 
@@ -604,6 +1532,13 @@ public:
   /// @param msg the error message
   virtual void ErrorResponse (Server *s, std::string &&msg);
 
+public:
+  /// The headers this resolver translates, to be sent to clients
+  /// that ask for them at connection.  It must contain every header
+  /// whose translation is not BOOL FALSE.  The default has none.
+  /// @result the filter, or nullptr
+  virtual IncludeFilter const *GetIncludeFilter ();
+
 public:
   /// Connection handshake.  Provide response to server and return new
   /// (or current) resolver, or nullptr.
@@ -631,8 +1566,18 @@ public:
 				       std::string &include);
 
 public:
+  /// Run a command in the sub process pool.  The response is
+  /// deferred until it completes.
+  /// @param s server to provide response to
+  /// @param args the request's words, the command begins at args[1]
   virtual int InvokeSubProcessRequest (Server *s,
 				       std::vector<std::string> &args);
+
+public:
+  /// Report metrics.  The default responds with the process's
+  /// Metrics snapshot.
+  /// @param s server to provide response to
+  virtual int StatsRequest (Server *s);
 };
 
 
@@ -643,6 +1588,18 @@ public:
 /// jobs to build needed artifacts, the PROCESSING state will be brief.
 class Server
 {
+public:
+  /// Dispatch a request, other than HELLO, to the resolver.
+  /// @param s the server
+  /// @param code the request code
+  /// @param words the request's words
+  /// @param values the request's unsigned arguments, parsed according
+  /// to its schema, indexed by argument
+  /// @result as the Resolver request functions
+  using Dispatcher = int (*) (Server *s, unsigned code,
+			      std::vector<std::string> &words,
+			      unsigned const *values);
+
 public:
   enum Direction
   {
@@ -657,8 +1614,24 @@ public:
 private:
   Detail::MessageBuffer write;
   Detail::MessageBuffer read;
+  Detail::MessageBuffer deferred;  ///< Scratch for a deferred response
+  /// Position and length of each deferred response's placeholder
+  std::vector<std::pair<size_t, size_t>> slots;
+  /// Start time and request code of each deferred response, if tracing
+  std::vector<std::pair<uint64_t, unsigned>> deferrals;
   Resolver *resolver;
+  Dispatcher dispatcher;
+  Tracer *tracer = nullptr;
+  Capture *capture = nullptr;
+  unsigned captureId = 0;  ///< Connection id in the capture
+  std::string ident;  ///< Compilation ident from HELLO
+  uint64_t traceStart = 0;  ///< Start of the block being traced
+  unsigned traceRequests = 0;  ///< Requests in the traced block
   Detail::FD fd;
+  unsigned pending = 0;  ///< Number of unfilled deferred responses
+  unsigned filling = ~0u;  ///< Deferred response being filled
+  unsigned filterTag = ~0u;  ///< Client's include filter version
+  unsigned dispatching = Detail::RC_HWM;  ///< Request being processed
   bool is_connected = false;
   Direction direction : 2;
 
@@ -703,6 +1676,42 @@ public:
   {
     return resolver;
   }
+  /// The compilation's ident, as given in HELLO
+  std::string const &GetIdent () const
+  {
+    return ident;
+  }
+  /// Note the compilation's ident
+  void SetIdent (std::string const &i);
+
+public:
+  /// Record trace events for each request block and request.
+  /// @param t the tracer, or nullptr to stop
+  void SetTracer (Tracer *t)
+  {
+    tracer = t;
+  }
+  /// Log the blocks received and sent.
+  /// @param c the log, or nullptr to stop
+  void SetCapture (Capture *c);
+  /// Allocate the message buffers from a memory resource.  The
+  /// current buffers are released, so use it between blocks, for
+  /// instance before resetting an ArenaResource.
+  /// @param m the resource
+  void SetMemoryResource (MemoryResource *m)
+  {
+    write = Detail::MessageBuffer (m);
+    read = Detail::MessageBuffer (m);
+    deferred = Detail::MessageBuffer (m);
+  }
+
+protected:
+  /// Replace the dispatcher, which by default calls the Resolver's
+  /// virtual request functions.
+  void SetDispatcher (Dispatcher d)
+  {
+    dispatcher = d;
+  }
 
 public:
   /// Process requests from a directly-connected client.  This is a
@@ -720,6 +1729,25 @@ public:
   /// wait for all the requests to be ready, or it may be able to
   /// immediately write responses back.
   void ProcessRequests ();
+  /// Process part of the block, so that processing a large one can
+  /// be interleaved with other work.  The first call for a block
+  /// enters the PROCESSING state.
+  /// @param limit most lines to process
+  /// @result true once the whole block is processed
+  bool ProcessRequests (unsigned limit);
+  /// Process the complete request lines read so far, while the rest
+  /// of the block is still arriving, so the resolver's work overlaps
+  /// its receipt.  Responses accumulate as usual, and are written
+  /// once ProcessRequests has processed the remainder.  Remains in
+  /// the READING state.
+  /// @param limit most lines to process
+  /// @result lines processed
+  unsigned ProcessLines (unsigned limit = ~0u);
+  /// Octets of the block read but not yet processed
+  size_t GetBacklog () const
+  {
+    return read.GetUnprocessed ();
+  }
 
 public:
   /// Accumulate an error response.
@@ -746,8 +1774,19 @@ public:
     PathnameResponse (path.data (), path.size ());
   }
 
+  /// Accumulate a statistics response
+  /// @param m the metrics to report
+  void StatsResponse (Metrics const &m);
+
 public:
-  /// Accumulate a (successful) connection response
+  /// Note the client asked for the include filter at connection.
+  /// @param tag the version the client already has, 0 for none
+  void WantIncludeFilter (unsigned tag)
+  {
+    filterTag = tag;
+  }
+  /// Accumulate a (successful) connection response.  If the client
+  /// asked for it, the resolver's include filter is added.
   /// @param agent the server-side agent
   /// @param alen agent length, if known
   void ConnectResponse (char const *agent, size_t alen = ~size_t (0));
@@ -756,6 +1795,26 @@ public:
     ConnectResponse (agent.data (), agent.size ());
   }
 
+public:
+  /// Defer a response.  A placeholder is accumulated in place of the
+  /// response, to be filled in later by BeginDeferred/EndDeferred.
+  /// All deferred responses must be filled before PrepareToWrite,
+  /// any that are not are sent as errors.
+  /// @result token identifying the deferred response
+  unsigned DeferResponse ();
+  /// Begin filling a deferred response.  The next accumulated
+  /// response replaces the placeholder.
+  /// @param token from DeferResponse
+  void BeginDeferred (unsigned token);
+  /// Complete filling a deferred response.
+  void EndDeferred ();
+  ///
+  /// Predicate for no outstanding deferred responses.
+  bool IsReady () const
+  {
+    return !pending;
+  }
+
 public:
   /// Write message block to client.  Semantics as for
   /// MessageBuffer::Write.
@@ -769,9 +1828,21 @@ public:
   void PrepareToWrite ()
   {
     write.PrepareToWrite ();
+    slots.clear ();
+    deferrals.clear ();
+    pending = 0;
     direction = WRITING;
+    if (traceStart)
+      TraceBlock ();
+    if (capture)
+      capture->Write (Capture::RESPONSES, captureId,
+		      write.GetData (), write.GetSize ());
   }
 
+private:
+  void BeginProcessing ();
+  void TraceBlock ();
+
 public:
   /// Read message block from client.  Semantics as for
   /// MessageBuffer::Read.
@@ -786,24 +1857,796 @@ public:
     read.PrepareToRead ();
     direction = READING;
   }
+
+public:
+  /// As Read, with octets received by other means.
+  /// @param data the octets
+  /// @param count how many, 0 for end of file
+  int Received (char const *data, size_t count)
+  {
+    return read.Received (data, count);
+  }
+  /// The octets still to be written, for sending by other means.
+  /// @param len set to their length
+  char const *GetUnwritten (size_t &len) const
+  {
+    return write.GetUnwritten (len);
+  }
+  /// As Write, after octets have been sent by other means.
+  /// @param count how many were sent
+  /// @param err errno, if sending failed
+  int Sent (ssize_t count, int err)
+  {
+    return write.Sent (count, err);
+  }
+};
+
+///
+/// A Server bound to a resolver type known at compile time.  Requests
+/// are dispatched by calling ResolverT's request functions directly,
+/// not virtually, so they may be inlined into the dispatcher.  Use it
+/// when the resolver's dynamic type is ResolverT (mark it final), and
+/// its ConnectRequest does not hand off to a resolver of another type.
+/// It is still a Server, so clients and loops work unchanged.
+template<typename ResolverT>
+class BasicServer : public Server
+{
+public:
+  BasicServer (ResolverT *r)
+    : Server (r)
+  {
+    SetDispatcher (&Dispatch);
+  }
+  BasicServer (ResolverT *r, int from, int to = -1)
+    : Server (r, from, to)
+  {
+    SetDispatcher (&Dispatch);
+  }
+
+public:
+  ResolverT *GetResolver () const
+  {
+    return static_cast<ResolverT *> (Server::GetResolver ());
+  }
+
+private:
+  static int Dispatch (Server *s, unsigned code,
+		       std::vector<std::string> &words,
+		       unsigned const *values);
+};
+
+template<typename ResolverT>
+int BasicServer<ResolverT>::Dispatch (Server *s, unsigned code,
+				      std::vector<std::string> &words,
+				      unsigned const *values)
+{
+  auto *r = static_cast<ResolverT *> (s->GetResolver ());
+
+  // The Server has checked the words against the request's schema
+  switch (code)
+    {
+    case Detail::RC_MODULE_REPO:
+      return r->ResolverT::ModuleRepoRequest (s);
+
+    case Detail::RC_MODULE_EXPORT:
+      return r->ResolverT::ModuleExportRequest (s, Flags (values[1]),
+						words[1]);
+
+    case Detail::RC_MODULE_IMPORT:
+      return r->ResolverT::ModuleImportRequest (s, Flags (values[1]),
+						words[1]);
+
+    case Detail::RC_MODULE_COMPILED:
+      return r->ResolverT::ModuleCompiledRequest (s, Flags (values[1]),
+						  words[1]);
+
+    case Detail::RC_INCLUDE_TRANSLATE:
+      return r->ResolverT::IncludeTranslateRequest (s, Flags (values[1]),
+						    words[1]);
+
+    case Detail::RC_INVOKE:
+      return r->ResolverT::InvokeSubProcessRequest (s, words);
+
+    case Detail::RC_STATS:
+      return r->ResolverT::StatsRequest (s);
+
+    default:
+      return -1;
+    }
+}
+
+namespace Detail {
+class Graph;
+class Scheduler;
+class Spawner;
+class Proxy;
+class Map;
+class Loop;
+}
+
+/// Persistent record of the modules and headers each compilation
+/// uses, keyed by the ident given at connection.  Edges are appended
+/// to a journal file as they are first seen, so a build that is
+/// interrupted loses nothing.  The journal is compacted when it is
+/// opened, if it has accumulated much stale history.  A subsequent
+/// build can predict what a compilation will need before it asks.
+class DepGraph
+{
+public:
+  enum Edge
+  {
+    IMPORT,	///< Compilation imports a module or header-unit
+    EXPORT,	///< Compilation produces a module or header-unit
+    INCLUDE	///< Compilation queries include translation of a header
+  };
+
+private:
+  std::unique_ptr<Detail::Graph> impl;
+
+public:
+  DepGraph ();
+  ~DepGraph ();
+
+public:
+  /// Load a journal, replacing the graph in memory, and append new
+  /// edges to it.  A file that is not empty, and not a journal, is
+  /// left alone.
+  /// @param path journal file, created if needed
+  /// @result 0 on success, EINVAL if not a journal, errno on failure
+  int Open (char const *path);
+  /// Stop appending to the journal.  The graph remains loaded.
+  void Close ();
+
+public:
+  /// Record an edge.  The first edge recorded for an ident replaces
+  /// its edges from previous builds.
+  /// @param ident the compilation
+  /// @param edge kind of edge
+  /// @param name module, header-unit or header name
+  void Record (std::string const &ident, Edge edge, std::string const &name);
+
+public:
+  /// Predict the modules a compilation will import, including those
+  /// needed to build them.  Each is paired with its depth in the
+  /// import graph, 1 for direct imports.
+  /// @param ident the compilation
+  /// @param modules appended with the predicted modules
+  void Predict (std::string const &ident,
+		std::vector<std::pair<std::string, unsigned>> &modules) const;
+  /// Predict the modules needed to build a module, paired with their
+  /// depth below it.
+  /// @param module the module
+  /// @param modules appended with the predicted modules
+  void PredictFrom (std::string const &module,
+		    std::vector<std::pair<std::string, unsigned>> &modules)
+    const;
+};
+
+/// A resolver that builds missing modules.  When an imported
+/// module's CMI is not up to date, a build is queued and the
+/// importing Server's response deferred until the build completes.
+/// Builds are run by a pool of worker threads, sharing one queue.
+/// The build picked next is the one with the most Servers waiting on
+/// it, then the one deepest in the import graph -- a module imported
+/// by a module that is itself being waited for is more urgent.
+///
+/// Request handling, Collect and Cancel must be called from a single
+/// thread.  Only Build is called on the worker threads.
+class BuildScheduler : public Resolver
+{
+  friend class Detail::Scheduler;
+  std::unique_ptr<Detail::Scheduler> impl;
+
+public:
+  /// @param workers number of worker threads, 0 for one per CPU
+  BuildScheduler (unsigned workers = 0);
+  virtual ~BuildScheduler ();
+
+protected:
+  /// Determine whether a module's CMI is up to date.  The default
+  /// checks the CMI exists in the repository, as the default
+  /// include translation does.
+  /// @param module module or header-unit name
+  /// @param cmi CMI name, as from GetCMIName
+  virtual bool IsBuilt (std::string const &module, std::string const &cmi);
+
+  /// Build a module.  Called on a worker thread, possibly
+  /// concurrently with other builds.
+  /// @param module module or header-unit name
+  /// @param cmi CMI name, as from GetCMIName
+  /// @result 0 on success, errno on failure, -1 on unspecific failure
+  virtual int Build (std::string const &module, std::string const &cmi) = 0;
+
+private:
+  /// Queue builds, with no waiters, of predicted modules
+  void Prefetch (std::vector<std::pair<std::string, unsigned>> const &);
+
+public:
+  /// Deliver the responses of completed builds to their waiting
+  /// Servers.  Does not block.
+  /// @result number of responses delivered
+  unsigned Collect ();
+  /// Forget all builds a Server is waiting for, for instance because
+  /// its client disconnected.  The builds themselves continue.
+  /// @param s the server
+  void Cancel (Server *s);
+  /// File descriptor that becomes readable when builds complete, so
+  /// a poll loop knows to call Collect.
+  /// @result the FD
+  int GetNotifyFD () const;
+  /// Wait for running builds and stop the workers.  Queued builds
+  /// are abandoned.  As Build is virtual, a derived class's
+  /// destructor must call this.
+  void Shutdown ();
+  /// Record requests in a dependency graph, and use it to start
+  /// building the modules a compilation is predicted to need, when it
+  /// connects or first imports.
+  /// @param graph the graph, or nullptr to stop
+  void SetDepGraph (DepGraph *graph);
+
+public:
+  /// Wait for all of a Server's builds to complete
+  virtual void WaitUntilReady (Server *s);
+
+  /// Remember the compilation's ident, and prefetch its predicted
+  /// imports.
+  virtual Resolver *ConnectRequest (Server *s, unsigned version,
+				    std::string &agent, std::string &ident);
+  /// Remember the module a Server is building, to determine import
+  /// depth.
+  virtual int ModuleExportRequest (Server *s, Flags flags,
+				   std::string &module);
+  /// Respond immediately if built, otherwise schedule a build.
+  virtual int ModuleImportRequest (Server *s, Flags flags,
+				   std::string &module);
+  /// Record the query in the dependency graph.
+  virtual int IncludeTranslateRequest (Server *s, Flags flags,
+				       std::string &include);
+};
+
+/// Runs the commands of INVOKE requests, with their standard output
+/// and error captured.  At most a given number run concurrently.
+/// If the builder was run by GNU make, it can also take a jobserver
+/// token for each invocation beyond the first, so the machine is not
+/// oversubscribed.  As with BuildScheduler, a poll loop should call
+/// Collect when the notify FD is readable.
+class SubProcessPool
+{
+  std::unique_ptr<Detail::Spawner> impl;
+
+public:
+  /// @param limit concurrent invocations, 0 for one per CPU
+  SubProcessPool (unsigned limit = 0);
+  ~SubProcessPool ();
+
+public:
+  /// Use the GNU make jobserver named in make's flags, before the
+  /// first invocation.  A jobserver pipe that cannot be reopened
+  /// non-blocking, which needs /proc/self/fd, is not used.
+  /// @param makeflags the flags, defaults to the MAKEFLAGS variable
+  /// @result 0 on success, ENOENT if there is no jobserver, EBUSY if
+  /// invocations have started, or errno
+  int UseJobServer (char const *makeflags = nullptr);
+
+public:
+  /// Start (or queue) a command, deferring the Server's response.
+  /// The response is OK if it exits successfully, otherwise an
+  /// ERROR containing its output.
+  /// @param s the server
+  /// @param args the request's words, the command begins at args[1]
+  /// @result 0 on success, -1 if there is no command
+  int Invoke (Server *s, std::vector<std::string> &args);
+
+public:
+  /// Deliver the responses of completed invocations to their
+  /// Servers.  Does not block.
+  /// @result number of responses delivered
+  unsigned Collect ();
+  /// Forget a Server's invocations.  They continue to run.
+  /// @param s the server
+  void Cancel (Server *s);
+  /// File descriptor that becomes readable when invocations
+  /// complete.
+  /// @result the FD
+  int GetNotifyFD () const;
+  /// Wait for all of a Server's invocations to complete
+  /// @param s the server
+  void WaitUntilReady (Server *s);
+};
+
+/// A resolver fronting an upstream mapper, for instance a central
+/// one shared by many build hosts.  Repo, import and include
+/// translation responses are answered from a ResponseCache, and other
+/// requests and misses are forwarded upstream.  Forwarded requests
+/// are deferred, and queued for a pool of upstream connections, each
+/// with its own thread.  An idle connection takes every queued
+/// request as one block, so under load the misses of many local
+/// compilers share a round trip.  Identical misses are forwarded
+/// once.  A module's cached responses are invalidated when it is
+/// reported compiled.  As with BuildScheduler, a poll loop should call
+/// Collect when the notify FD is readable.
+///
+/// HELLO, INVOKE and STATS are handled locally, as by Resolver.  The
+/// upstream mapper sees only the proxy's own connections, each with
+/// a synthetic cody-proxy agent and proxy-N ident.  It does not learn
+/// the compilers' agents or idents, and any state it keeps per
+/// connection is shared by every compiler whose requests go that way.
+class ProxyResolver : public Resolver
+{
+  std::unique_ptr<Detail::Proxy> impl;
+
+public:
+  ProxyResolver ();
+  virtual ~ProxyResolver ();
+
+public:
+  /// Add a connection to the upstream mapper, and perform its
+  /// handshake.  Once it succeeds the proxy owns the FDs, and the
+  /// destructor closes them; otherwise they are left open.  The
+  /// destructor shuts down socket FDs to abandon outstanding round
+  /// trips.  An upstream reached through pipes should be given a
+  /// timeout, or the destructor waits for it to answer.
+  /// @param from file descriptor to read from
+  /// @param to file descriptor to write to, defaults to from
+  /// @param timeout limit of each round trip, as Client::SetTimeout
+  /// @result 0 on success, otherwise the handshake failed
+  int AddUpstream (int from, int to = -1, int timeout = -1);
+  /// The cache, for instance to invalidate a name changed elsewhere.
+  ResponseCache &GetCache ();
+
+public:
+  /// Deliver the upstream responses to their waiting Servers.  Does
+  /// not block.
+  /// @result number of responses delivered
+  unsigned Collect ();
+  /// Forget a Server's forwarded requests, for instance because its
+  /// client disconnected.  They are still forwarded.
+  /// @param s the server
+  void Cancel (Server *s);
+  /// File descriptor that becomes readable when upstream responses
+  /// arrive.
+  /// @result the FD
+  int GetNotifyFD () const;
+
+public:
+  /// Requests answered from the cache
+  uint64_t GetHits () const;
+  /// Requests deferred for an upstream response
+  uint64_t GetMisses () const;
+  /// Requests forwarded upstream, after merging identical misses
+  uint64_t GetForwarded () const;
+  /// Blocks the forwarded requests were sent in
+  uint64_t GetBatches () const;
+
+public:
+  /// Wait for a Server's forwarded requests to be answered
+  virtual void WaitUntilReady (Server *s);
+
+  virtual int ModuleRepoRequest (Server *s);
+  virtual int ModuleExportRequest (Server *s, Flags flags,
+				   std::string &module);
+  virtual int ModuleImportRequest (Server *s, Flags flags,
+				   std::string &module);
+  /// Invalidate the module's cached responses, and forward
+  virtual int ModuleCompiledRequest (Server *s, Flags flags,
+				     std::string &module);
+  virtual int IncludeTranslateRequest (Server *s, Flags flags,
+				       std::string &include);
+
+private:
+  int Forward (Server *s, unsigned code, Flags flags, std::string &name);
+};
+
+/// One stage of a ResolverPipeline.  A stage answers the requests it
+/// can, and passes the others on to the next stage.  The pipeline
+/// counts each stage's hits, the requests it answered, and misses,
+/// the requests it passed.
+class ResolverStage
+{
+  friend class ResolverPipeline;
+
+public:
+  /// The requests a stage is asked to resolve
+  enum Verb
+  {
+    MODULE_REPO,
+    MODULE_EXPORT,
+    MODULE_IMPORT,
+    MODULE_COMPILED,
+    INCLUDE_TRANSLATE
+  };
+  /// What became of a request
+  enum Outcome
+  {
+    PASSED,	///< Ask the next stage
+    ANSWERED,	///< The answer packet was set
+    RESPONDED	///< The stage responded to the Server, perhaps deferring
+  };
+
+private:
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+
+public:
+  ResolverStage () = default;
+  virtual ~ResolverStage ();
+
+public:
+  /// Resolve a request, or pass it on.
+  /// @param s the server, for a stage that responds itself
+  /// @param verb the request
+  /// @param flags its flags
+  /// @param name module, header-unit or header name, empty for
+  /// MODULE_REPO
+  /// @param answer set to a PC_PATHNAME, PC_BOOL, PC_OK or PC_ERROR
+  /// packet when ANSWERED
+  virtual Outcome Resolve (Server *s, Verb verb, Flags flags,
+			   std::string &name, Packet &answer) = 0;
+  /// A later stage answered a request this one passed.  Deferred
+  /// responses are not seen.  The default ignores it.
+  virtual void Learn (Verb verb, Flags flags, std::string const &name,
+		      Packet const &answer);
+  /// Wait for the responses this stage deferred.  The default has
+  /// none.
+  /// @param s directly connected server
+  virtual void WaitUntilReady (Server *s);
+
+public:
+  /// Requests this stage answered
+  uint64_t GetHits () const
+  {
+    return hits;
+  }
+  /// Requests this stage passed on
+  uint64_t GetMisses () const
+  {
+    return misses;
+  }
 };
 
+/// Answers repo, import and include translation requests that a
+/// later stage answered before.  A module's answers are forgotten
+/// when it is reported compiled.  Only synchronous answers are
+/// learnt: a stage that responds to the Server itself, such as a
+/// ForwardStage, is never cached here, so put a cache in front of
+/// its resolver instead, as a ProxyResolver has.
+class CacheStage : public ResolverStage
+{
+  ResponseCache cache;
+
+public:
+  /// The cache, for instance to invalidate a name changed elsewhere.
+  ResponseCache &GetCache ()
+  {
+    return cache;
+  }
+
+public:
+  virtual Outcome Resolve (Server *s, Verb verb, Flags flags,
+			   std::string &name, Packet &answer);
+  virtual void Learn (Verb verb, Flags flags, std::string const &name,
+		      Packet const &answer);
+};
+
+/// Answers from a static map of module and header names to CMI
+/// names.  A header in the map is translated to its header unit.
+class MapStage : public ResolverStage
+{
+  std::unique_ptr<Detail::Map> impl;
+
+public:
+  MapStage ();
+  virtual ~MapStage ();
+
+public:
+  /// Map a name to a CMI, replacing any previous mapping
+  /// @param name module, header-unit or header name
+  /// @param cmi the CMI name
+  void Add (std::string const &name, std::string const &cmi);
+  /// Set the repository directory answered to MODULE-REPO.  Without
+  /// one, those requests are passed on.
+  void SetRepo (std::string const &repo);
+  /// Add the mappings of a map file.  Each line is a name and its
+  /// CMI, separated by white space, or '$root' and the repository.
+  /// Blank lines and those beginning with '#' are ignored.
+  /// @param path the file
+  /// @result 0 on success, EINVAL if a line is malformed, or errno
+  int Load (char const *path);
+  /// Number of names mapped
+  size_t GetSize () const;
+
+public:
+  virtual Outcome Resolve (Server *s, Verb verb, Flags flags,
+			   std::string &name, Packet &answer);
+};
+
+/// Answers with Resolver's default CMI names, for the CMIs present
+/// in a repository directory.  Imports and include translations of
+/// absent CMIs are passed on, as are compilations.
+class RepoStage : public ResolverStage
+{
+  std::string repo;
+  std::string suffix;
+
+public:
+  /// @param r repository directory
+  /// @param s CMI file suffix
+  RepoStage (char const *r = "cmi.cache", char const *s = "cmi")
+    : repo (r), suffix (s)
+  {
+  }
+
+public:
+  virtual Outcome Resolve (Server *s, Verb verb, Flags flags,
+			   std::string &name, Packet &answer);
+};
+
+/// Forwards every request to another resolver, typically a
+/// ProxyResolver for an upstream mapper, which responds to the Server
+/// itself.  The earlier stages do not see its responses, and cannot
+/// learn them.
+class ForwardStage : public ResolverStage
+{
+  Resolver *resolver;
+
+public:
+  /// @param r the resolver, not owned
+  ForwardStage (Resolver *r)
+    : resolver (r)
+  {
+  }
+
+public:
+  virtual Outcome Resolve (Server *s, Verb verb, Flags flags,
+			   std::string &name, Packet &answer);
+  virtual void WaitUntilReady (Server *s);
+};
+
+/// A resolver asking an ordered list of stages to resolve each
+/// repo, export, import, compiled and include translation request.
+/// The first stage to answer or respond ends the request, and a
+/// synchronous answer is offered to the stages before it to learn.
+/// Put cheap stages first, so they absorb most requests before the
+/// expensive ones are asked.  Requests no stage resolves get
+/// Resolver's defaults.  A pipeline is not thread safe, serve its
+/// connections from one thread, for instance with a ServerLoop.
+///
+/// HELLO, INVOKE and STATS are handled as by Resolver.
+class ResolverPipeline : public Resolver
+{
+  std::vector<ResolverStage *> stages;
+
+public:
+  ResolverPipeline () = default;
+  virtual ~ResolverPipeline ();
+
+public:
+  /// Append a stage
+  /// @param stage the stage, not owned
+  void AddStage (ResolverStage *stage)
+  {
+    stages.push_back (stage);
+  }
+
+public:
+  /// Wait for the stages' deferred responses, and the sub processes
+  virtual void WaitUntilReady (Server *s);
+
+  virtual int ModuleRepoRequest (Server *s);
+  virtual int ModuleExportRequest (Server *s, Flags flags,
+				   std::string &module);
+  virtual int ModuleImportRequest (Server *s, Flags flags,
+				   std::string &module);
+  virtual int ModuleCompiledRequest (Server *s, Flags flags,
+				     std::string &module);
+  virtual int IncludeTranslateRequest (Server *s, Flags flags,
+				       std::string &include);
+
+private:
+  int Resolve (Server *s, ResolverStage::Verb verb, Flags flags,
+	       std::string &name);
+};
+
+#if CODY_NETWORKING
+/// Event loop serving many connections on one thread.  Connections
+/// are accepted from listening sockets, or added directly, and each
+/// is given a Server.  A connection's responses are written once it
+/// has no deferred responses.  If the resolver defers them, add its
+/// notify FD and override Notify to collect them.  The FDs are made
+/// non-blocking, and are closed with the connection.  Ignore
+/// SIGPIPE, or a client going away will kill the process.
+class ServerLoop
+{
+  std::unique_ptr<Detail::Loop> impl;
+
+public:
+  /// @param r resolver for new connections
+  ServerLoop (Resolver *r);
+  virtual ~ServerLoop ();
+
+public:
+  /// Accept connections on a listening socket
+  /// @param fd the socket
+  /// @result 0
+  int AddListener (int fd);
+  /// Wake on an FD becoming readable, and call Notify
+  /// @param fd the notifying FD
+  /// @result 0
+  int AddNotifier (int fd);
+  /// Serve an already open connection
+  /// @param from FD to read from
+  /// @param to FD to write to, defaults to from
+  /// @result the connection's Server
+  Server *AddConnection (int from, int to = -1);
+  /// Number of open connections
+  unsigned GetConnectionCount () const;
+
+public:
+  /// I/O backends
+  enum Backend
+  {
+    POLL,	///< epoll where available, otherwise poll, with read & write
+    URING	///< io_uring, on Linux
+  };
+  /// Select the I/O backend, before adding anything to the loop.
+  /// @param b the backend
+  /// @result 0, or errno.  ENOSYS, or another error from io_uring
+  /// setup, if it is unavailable, and the loop stays with POLL.
+  /// EBUSY if listeners, notifiers or connections have been added.
+  int SetBackend (Backend b);
+  /// The I/O backend in use
+  Backend GetBackend () const;
+  /// System calls made by the loop, other than by resolvers, for
+  /// benchmarking
+  uint64_t GetSyscallCount () const;
+
+public:
+  /// Return free buffer memory to the heap once the loop has been
+  /// idle for a while.  Connections' buffers go back to the loop's
+  /// pool after each turn.
+  /// @param ms idle milliseconds, -1 for never
+  void SetIdleTimeout (int ms);
+  /// Buffer memory used by a connection
+  /// @param s the connection's Server
+  size_t GetMemoryUsage (Server const *s) const;
+  /// Buffer memory used by the connections of every ServerLoop
+  static size_t GetMemoryUsage ();
+  /// Limit the buffer memory of the connections of every ServerLoop.
+  /// A connection whose read takes the usage over the limit is
+  /// closed.
+  /// @param bytes the limit, 0 for none
+  static void SetMemoryLimit (size_t bytes);
+
+public:
+  /// Process blocks in slices, so that a large block does not hold
+  /// up other connections.  A connection processes at most this many
+  /// lines, times its weight, then waits its turn while the other
+  /// connections' events and slices are serviced.  Responses are
+  /// still written once the whole block is processed.
+  /// @param lines lines per slice, 0 (the default) for whole blocks
+  void SetSliceLines (unsigned lines);
+  /// Weight a connection's slices, for instance to favour an
+  /// interactive client.
+  /// @param s the connection's Server
+  /// @param weight multiple of the slice, default 1
+  void SetWeight (Server const *s, unsigned weight);
+  /// A connection's weight
+  unsigned GetWeight (Server const *s) const;
+  /// Connections with a partly processed block, waiting for a slice.
+  /// Server::GetBacklog gives the size of each one's remainder.
+  unsigned GetQueueDepth () const;
+  /// The greatest queue depth so far
+  unsigned GetMaxQueueDepth () const;
+  /// Slices processed
+  uint64_t GetSliceCount () const;
+
+public:
+  /// Wait for, and service, one batch of events.
+  /// @param timeout milliseconds to wait, -1 for no limit
+  /// @result 0, or errno on failure
+  int Step (int timeout = -1);
+  /// Step until stopped, or there are neither listeners nor
+  /// connections.
+  /// @result 0, or errno on failure
+  int Run ();
+  /// Stop Run.  May be called from another thread.
+  void Stop ();
+
+protected:
+  /// A connection has been added
+  virtual void Connected (Server *s);
+  /// A connection is closing.  Its resolver should forget it, for
+  /// instance by calling BuildScheduler::Cancel.
+  virtual void Disconnected (Server *s);
+  /// A notifier FD is readable.  Collect completed responses.
+  virtual void Notify (int fd);
+
+private:
+  void Read (Server *);
+  void Received (Server *, int err);
+  void Process (Server *);
+  void Slice (Server *);
+  void Finish (Server *);
+  void Write (Server *);
+  void Sent (Server *, int err);
+  void Close (Server *);
+  void Submit (unsigned kind, int fd, Server *s = nullptr);
+  bool Complete (uint64_t tag, int res, bool more);
+};
+#endif
+
 // Helper network stuff
 
 #if CODY_NETWORKING
+/// Options for the sockets made by the Open and Listen functions.
+/// Options that do not apply to a socket's family are ignored.  A
+/// listening socket's options are inherited by the connections it
+/// accepts.
+struct SocketOptions
+{
+  enum Family
+  {
+    INET6,	///< IPv6 only
+    INET4,	///< IPv4 only
+    DUAL	///< IPv6, listening for IPv4 too, connecting to either
+  };
+
+  Family family = INET6;	///< For the Inet functions
+  /// Send segments immediately, rather than waiting to coalesce them.
+  /// A block written in parts otherwise stalls for the peer's delayed
+  /// acknowledgment.
+  bool noDelay = true;
+  /// TCP Fast Open, sending the first request with the connection's
+  /// SYN.  Fails with ENOPROTOOPT where unsupported.
+  bool fastOpen = false;
+  bool nonBlocking = false;	///< Return a non-blocking socket
+  bool closeOnExec = true;
+  /// Local names are in Linux's abstract namespace, and have no file.
+  /// Fails with EAFNOSUPPORT elsewhere.
+  bool abstract = false;
+  int receiveBuffer = 0;	///< SO_RCVBUF, zero for the default
+  int sendBuffer = 0;		///< SO_SNDBUF, zero for the default
+  unsigned backlog = 0;		///< Listen backlog, zero for SOMAXCONN
+
+public:
+  /// The settings of the functions that take no options: inheritable,
+  /// Nagle's algorithm on, and a backlog of 17.
+  static SocketOptions Legacy ()
+  {
+    SocketOptions options;
+    options.noDelay = false;
+    options.closeOnExec = false;
+    options.backlog = 17;
+    return options;
+  }
+};
+
 // Socket with specific address
 int OpenSocket (char const **, sockaddr const *sock, socklen_t len);
+int OpenSocket (char const **, sockaddr const *sock, socklen_t len,
+		SocketOptions const &);
 int ListenSocket (char const **, sockaddr const *sock, socklen_t len,
 		  unsigned backlog);
+int ListenSocket (char const **, sockaddr const *sock, socklen_t len,
+		  SocketOptions const &);
 
 // Local domain socket (eg AF_UNIX)
 int OpenLocal (char const **, char const *name);
+int OpenLocal (char const **, char const *name, SocketOptions const &);
 int ListenLocal (char const **, char const *name, unsigned backlog = 0);
+int ListenLocal (char const **, char const *name, SocketOptions const &);
 
 // ipv6 socket
 int OpenInet6 (char const **e, char const *name, int port);
 int ListenInet6 (char const **, char const *name, int port,
 		 unsigned backlog = 0);
+
+// ipv4 or ipv6 socket, according to the options' family.  Listen on
+// "::" or "0.0.0.0" for every address.
+int OpenInet (char const **e, char const *name, int port,
+	      SocketOptions const &);
+int ListenInet (char const **, char const *name, int port,
+		SocketOptions const &);
 #endif
 
 // FIXME: Mapping file utilities?
@@ -0,0 +1,454 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Cody
+#include "internal.hh"
+// C++
+#include <algorithm>
+#include <map>
+#include <set>
+// C
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+// OS
+#include <fcntl.h>
+#include <unistd.h>
+
+// Dependency graph
+
+// The journal is a text file, one record per line.  Names are
+// interned, so each is written once:
+//   CODY-DEPS 1		header
+//   N $name		define the next name number (from 0)
+//   R $ident		forget the ident's edges, a new build of it
+//   I $ident $name	ident imports name
+//   E $ident $name	ident exports name
+//   T $ident $name	ident queries include translation of name
+// $ident and $name are name numbers, except in N records, where the
+// name is the remainder of the line.  A malformed line is ignored.
+// A final line truncated by a crash is removed when the journal is
+// opened, so that appended records begin on a line of their own.
+
+namespace Cody {
+namespace Detail {
+
+static char const MAGIC[] = "CODY-DEPS 1\n";
+static char const TAGS[] = "IET";
+
+class Graph
+{
+public:
+  struct Node
+  {
+    std::vector<unsigned> edges[3];	///< Indexed by DepGraph::Edge
+  };
+
+public:
+  std::vector<std::string> names;
+  std::map<std::string, unsigned> ids;
+  std::map<unsigned, Node> nodes;	///< Edges from each ident
+  std::map<unsigned, unsigned> exporters;  ///< Ident exporting a name
+  std::set<unsigned> fresh;	///< Idents recorded in this session
+  unsigned records = 0;		///< Edge records in the journal
+  int fd = -1;
+
+public:
+  unsigned Intern (std::string const &name, bool journal);
+  void Reset (unsigned ident);
+  bool Add (unsigned ident, unsigned edge, unsigned name);
+  void Append (char tag, unsigned a, unsigned b = ~0u);
+  void Load (std::string const &text);
+  int Save (char const *path);
+  void Walk (Node const &node, unsigned depth, std::map<unsigned, unsigned> &)
+    const;
+};
+
+unsigned Graph::Intern (std::string const &name, bool journal)
+{
+  auto iter = ids.find (name);
+  if (iter != ids.end ())
+    return iter->second;
+
+  unsigned id = unsigned (names.size ());
+  names.push_back (name);
+  ids.emplace (name, id);
+  if (journal && fd >= 0)
+    {
+      std::string line (u8"N ");
+      line.append (name);
+      line.push_back ('\n');
+      (void)!write (fd, line.data (), line.size ());
+    }
+
+  return id;
+}
+
+void Graph::Reset (unsigned ident)
+{
+  auto iter = nodes.find (ident);
+  if (iter == nodes.end ())
+    return;
+
+  auto &exports = iter->second.edges[DepGraph::EXPORT];
+  for (auto name : exports)
+    {
+      auto exporter = exporters.find (name);
+      if (exporter != exporters.end () && exporter->second == ident)
+	exporters.erase (exporter);
+    }
+  nodes.erase (iter);
+}
+
+bool Graph::Add (unsigned ident, unsigned edge, unsigned name)
+{
+  auto &edges = nodes[ident].edges[edge];
+  if (std::find (edges.begin (), edges.end (), name) != edges.end ())
+    return false;
+
+  edges.push_back (name);
+  if (edge == DepGraph::EXPORT)
+    exporters[name] = ident;
+  records++;
+
+  return true;
+}
+
+void Graph::Append (char tag, unsigned a, unsigned b)
+{
+  if (fd < 0)
+    return;
+
+  std::string line (1, tag);
+  line.push_back (' ');
+  line.append (std::to_string (a));
+  if (b != ~0u)
+    {
+      line.push_back (' ');
+      line.append (std::to_string (b));
+    }
+  line.push_back ('\n');
+  (void)!write (fd, line.data (), line.size ());
+}
+
+// Return numeric value of STR as an unsigned, updating STR.  Returns
+// ~0u on error.
+static unsigned ParseNumber (char const *&str, char const *end)
+{
+  if (str == end || *str != ' ')
+    return ~0u;
+
+  char *eptr;
+  unsigned long val = strtoul (++str, &eptr, 10);
+  if (eptr == str || eptr > end || unsigned (val) != val)
+    return ~0u;
+  str = eptr;
+
+  return unsigned (val);
+}
+
+void Graph::Load (std::string const &text)
+{
+  for (size_t pos = sizeof (MAGIC) - 1; pos < text.size ();)
+    {
+      size_t eol = text.find ('\n', pos);
+      if (eol == text.npos)
+	// Truncated
+	break;
+
+      char const *ptr = &text[pos];
+      char const *end = &text[eol];
+      char tag = *ptr++;
+      pos = eol + 1;
+
+      if (tag == 'N')
+	{
+	  if (ptr != end && *ptr == ' ')
+	    Intern (std::string (ptr + 1, end), false);
+	  continue;
+	}
+
+      unsigned a = ParseNumber (ptr, end);
+      if (a >= names.size ())
+	continue;
+      if (tag == 'R')
+	{
+	  Reset (a);
+	  continue;
+	}
+
+      unsigned b = ParseNumber (ptr, end);
+      auto edge = strchr (TAGS, tag);
+      if (b < names.size () && edge && tag && ptr == end)
+	Add (a, unsigned (edge - TAGS), b);
+    }
+}
+
+// Write a compacted journal.  Only names that are mentioned by an
+// edge are kept, and they are renumbered.
+
+int Graph::Save (char const *path)
+{
+  std::string tmp (path);
+  tmp.append (u8".tmp");
+  int out = open (tmp.c_str (), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		  0666);
+  if (out < 0)
+    return errno;
+
+  std::vector<unsigned> renumber (names.size (), ~0u);
+  unsigned numbered = 0;
+  std::string text (MAGIC);
+  auto name = [&] (unsigned id)
+    {
+      if (renumber[id] == ~0u)
+	{
+	  renumber[id] = numbered++;
+	  text.append (u8"N ");
+	  text.append (names[id]);
+	  text.push_back ('\n');
+	}
+      return renumber[id];
+    };
+
+  records = 0;
+  for (auto &node : nodes)
+    for (unsigned edge = 0; edge != 3; edge++)
+      for (auto target : node.second.edges[edge])
+	{
+	  unsigned a = name (node.first);
+	  unsigned b = name (target);
+	  text.push_back (TAGS[edge]);
+	  text.push_back (' ');
+	  text.append (std::to_string (a));
+	  text.push_back (' ');
+	  text.append (std::to_string (b));
+	  text.push_back ('\n');
+	  records++;
+	}
+
+  int err = 0;
+  for (size_t pos = 0; !err && pos != text.size ();)
+    {
+      ssize_t count = write (out, &text[pos], text.size () - pos);
+      if (count < 0)
+	err = errno;
+      else
+	pos += count;
+    }
+  if (close (out) < 0 && !err)
+    err = errno;
+  if (!err && rename (tmp.c_str (), path) < 0)
+    err = errno;
+  if (err)
+    {
+      unlink (tmp.c_str ());
+      return err;
+    }
+
+  // Reload, to pick up the renumbering
+  Graph compact;
+  compact.Load (text);
+  std::swap (names, compact.names);
+  std::swap (ids, compact.ids);
+  std::swap (nodes, compact.nodes);
+  std::swap (exporters, compact.exporters);
+
+  return 0;
+}
+
+// Walk the imports of NODE, which are at DEPTH, and the imports
+// needed to build those.  DEPTHS records the greatest depth of each.
+
+void Graph::Walk (Node const &node, unsigned depth,
+		  std::map<unsigned, unsigned> &depths) const
+{
+  if (depth > names.size ())
+    // Cyclic
+    return;
+
+  for (unsigned edge = DepGraph::IMPORT; edge <= DepGraph::INCLUDE; edge++)
+    if (edge != DepGraph::EXPORT)
+      for (auto name : node.edges[edge])
+	{
+	  auto exporter = exporters.find (name);
+	  if (edge == DepGraph::INCLUDE && exporter == exporters.end ())
+	    // Not a header unit
+	    continue;
+
+	  auto &slot = depths[name];
+	  if (slot >= depth)
+	    continue;
+	  slot = depth;
+
+	  if (exporter != exporters.end ())
+	    {
+	      auto builder = nodes.find (exporter->second);
+	      if (builder != nodes.end ())
+		Walk (builder->second, depth + 1, depths);
+	    }
+	}
+}
+
+}
+
+DepGraph::DepGraph ()
+  : impl (new Detail::Graph)
+{
+}
+
+DepGraph::~DepGraph ()
+{
+  Close ();
+}
+
+int DepGraph::Open (char const *path)
+{
+  Close ();
+  // The journal's name numbers are only meaningful in a graph of its
+  // own
+  impl.reset (new Detail::Graph);
+
+  int fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (fd < 0)
+    return errno;
+
+  std::string text;
+  char block[4096];
+  for (;;)
+    {
+      ssize_t count = read (fd, block, sizeof (block));
+      if (count < 0)
+	{
+	  int err = errno;
+	  close (fd);
+	  return err;
+	}
+      if (!count)
+	break;
+      text.append (block, count);
+    }
+
+  bool valid = !text.compare (0, sizeof (Detail::MAGIC) - 1, Detail::MAGIC);
+  if (!valid && !text.empty ())
+    {
+      // Not a journal, leave it alone
+      close (fd);
+      return EINVAL;
+    }
+  if (valid)
+    impl->Load (text);
+  impl->records = 0;
+  for (auto &node : impl->nodes)
+    for (auto &edges : node.second.edges)
+      impl->records += unsigned (edges.size ());
+
+  // Compact if more than half the journal is stale
+  size_t lines = std::count (text.begin (), text.end (), '\n');
+  bool compact = !valid
+    || lines > 2 * (impl->records + impl->names.size ()) + 64;
+  size_t complete = text.rfind ('\n') + 1;
+  if (!compact && complete != text.size ()
+      && ftruncate (fd, off_t (complete)) < 0)
+    // Compaction drops the truncated line too
+    compact = true;
+  if (compact)
+    {
+      close (fd);
+      if (int err = impl->Save (path))
+	return err;
+      fd = open (path, O_WRONLY | O_APPEND | O_CLOEXEC);
+      if (fd < 0)
+	return errno;
+    }
+  else
+    lseek (fd, 0, SEEK_END);
+
+  impl->fd = fd;
+
+  return 0;
+}
+
+void DepGraph::Close ()
+{
+  if (impl->fd >= 0)
+    close (impl->fd);
+  impl->fd = -1;
+}
+
+void DepGraph::Record (std::string const &ident, Edge edge,
+		       std::string const &name)
+{
+  if (name.find ('\n') != name.npos || ident.find ('\n') != ident.npos)
+    // Unrepresentable
+    return;
+
+  unsigned a = impl->Intern (ident, true);
+  if (impl->fresh.insert (a).second)
+    {
+      impl->Reset (a);
+      impl->Append ('R', a);
+    }
+
+  unsigned b = impl->Intern (name, true);
+  if (impl->Add (a, edge, b))
+    impl->Append (Detail::TAGS[edge], a, b);
+}
+
+// Append the predictions, deepest first, as those are needed soonest.
+
+static void
+Predicted (std::vector<std::string> const &names,
+	   std::map<unsigned, unsigned> const &depths,
+	   std::vector<std::pair<std::string, unsigned>> &modules)
+{
+  size_t first = modules.size ();
+  for (auto &pair : depths)
+    modules.emplace_back (names[pair.first], pair.second);
+  std::sort (modules.begin () + first, modules.end (),
+	     [] (std::pair<std::string, unsigned> const &a,
+		 std::pair<std::string, unsigned> const &b)
+	     {
+	       if (a.second != b.second)
+		 return a.second > b.second;
+	       return a.first < b.first;
+	     });
+}
+
+void DepGraph::Predict (std::string const &ident,
+			std::vector<std::pair<std::string, unsigned>> &modules)
+  const
+{
+  auto id = impl->ids.find (ident);
+  if (id == impl->ids.end ())
+    return;
+  auto node = impl->nodes.find (id->second);
+  if (node == impl->nodes.end ())
+    return;
+
+  std::map<unsigned, unsigned> depths;
+  impl->Walk (node->second, 1, depths);
+  Predicted (impl->names, depths, modules);
+}
+
+void DepGraph::PredictFrom (std::string const &module,
+			    std::vector<std::pair<std::string, unsigned>>
+			    &modules) const
+{
+  auto id = impl->ids.find (module);
+  if (id == impl->ids.end ())
+    return;
+  auto exporter = impl->exporters.find (id->second);
+  if (exporter == impl->exporters.end ())
+    return;
+  auto node = impl->nodes.find (exporter->second);
+  if (node == impl->nodes.end ())
+    return;
+
+  std::map<unsigned, unsigned> depths;
+  impl->Walk (node->second, 1, depths);
+  Predicted (impl->names, depths, modules);
+}
+
+}
@@ -0,0 +1,205 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Cody
+#include "internal.hh"
+// C++
+#include <mutex>
+// C
+#include <cstdint>
+#include <cstring>
+
+// Include filter code
+
+// The filter has about 10 bits per entry and 7 hashes, for a false
+// positive rate of about 1%.  The bits are encoded 6 to a character,
+// using an alphabet that needs no quoting in a message.  The first
+// character encodes the number of hashes.
+
+namespace Cody {
+
+static char const ALPHABET[] =
+  u8"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+constexpr unsigned BitsPerEntry = 10;
+constexpr unsigned Hashes = 7;
+// Size granularity, a whole number of bytes and encoded characters
+constexpr size_t Granule = 3;
+
+// FNV-1a.  The two halves provide the double hashing pair.
+uint64_t Detail::Hash (char const *str, size_t len)
+{
+  uint64_t h = 0xcbf29ce484222325;
+  for (size_t ix = 0; ix != len; ix++)
+    {
+      h ^= (unsigned char)str[ix];
+      h *= 0x100000001b3;
+    }
+
+  return h;
+}
+
+namespace Detail {
+
+class Filter
+{
+public:
+  mutable std::mutex mutex;
+  std::vector<unsigned char> bits;
+  unsigned tag = 0;
+  unsigned hashes = 0;
+};
+
+}
+
+IncludeFilter::IncludeFilter ()
+  : impl (new Detail::Filter)
+{
+}
+
+IncludeFilter::~IncludeFilter ()
+{
+}
+
+void IncludeFilter::Reset (unsigned t, size_t entries)
+{
+  Assert (t);
+  size_t bytes = (entries * BitsPerEntry + 7) / 8;
+  bytes = (bytes + Granule - 1) / Granule * Granule;
+  if (!bytes)
+    bytes = Granule;
+
+  std::lock_guard<std::mutex> lock (impl->mutex);
+  impl->bits.assign (bytes, 0);
+  impl->tag = t;
+  impl->hashes = Hashes;
+}
+
+void IncludeFilter::Clear ()
+{
+  std::lock_guard<std::mutex> lock (impl->mutex);
+  impl->bits.clear ();
+  impl->tag = impl->hashes = 0;
+}
+
+void IncludeFilter::Add (char const *str, size_t len)
+{
+  if (len == ~size_t (0))
+    len = strlen (str);
+
+  uint64_t h = Detail::Hash (str, len);
+  uint32_t h1 = uint32_t (h), h2 = uint32_t (h >> 32) | 1;
+  std::lock_guard<std::mutex> lock (impl->mutex);
+  auto &bits = impl->bits;
+  Assert (!bits.empty ());
+  size_t limit = bits.size () * 8;
+  for (unsigned ix = impl->hashes; ix--; h1 += h2)
+    {
+      size_t bit = h1 % limit;
+      bits[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+bool IncludeFilter::MayContain (char const *str, size_t len) const
+{
+  if (len == ~size_t (0))
+    len = strlen (str);
+
+  uint64_t h = Detail::Hash (str, len);
+  uint32_t h1 = uint32_t (h), h2 = uint32_t (h >> 32) | 1;
+  std::lock_guard<std::mutex> lock (impl->mutex);
+  auto &bits = impl->bits;
+  if (bits.empty ())
+    return true;
+
+  size_t limit = bits.size () * 8;
+  for (unsigned ix = impl->hashes; ix--; h1 += h2)
+    {
+      size_t bit = h1 % limit;
+      if (!(bits[bit / 8] & (1 << (bit % 8))))
+	return false;
+    }
+
+  return true;
+}
+
+bool IncludeFilter::IsValid () const
+{
+  std::lock_guard<std::mutex> lock (impl->mutex);
+  return !impl->bits.empty ();
+}
+
+unsigned IncludeFilter::GetTag () const
+{
+  std::lock_guard<std::mutex> lock (impl->mutex);
+  return impl->tag;
+}
+
+void IncludeFilter::Encode (std::string &word) const
+{
+  std::lock_guard<std::mutex> lock (impl->mutex);
+  auto &bits = impl->bits;
+  word.reserve (word.size () + 1 + bits.size () / 3 * 4);
+  word.push_back (ALPHABET[impl->hashes & 63]);
+  for (size_t ix = 0; ix < bits.size (); ix += 3)
+    {
+      unsigned v = bits[ix] | bits[ix + 1] << 8 | bits[ix + 2] << 16;
+      for (unsigned shift = 0; shift != 24; shift += 6)
+	word.push_back (ALPHABET[(v >> shift) & 63]);
+    }
+}
+
+// Decode into a new vector, so that concurrent queries see either the
+// old contents or the new.
+
+bool IncludeFilter::Decode (unsigned t, std::string const &word)
+{
+  std::vector<unsigned char> bits;
+  unsigned hashes = 0;
+  bool ok = t && word.size () >= 5 && !((word.size () - 1) % 4);
+
+  if (ok)
+    bits.reserve ((word.size () - 1) / 4 * 3);
+  for (size_t ix = 0; ok && ix != word.size (); ix++)
+    {
+      char const *pos = strchr (ALPHABET, word[ix]);
+      if (!word[ix] || !pos)
+	{
+	  ok = false;
+	  break;
+	}
+
+      unsigned v = unsigned (pos - ALPHABET);
+      if (!ix)
+	hashes = v;
+      else
+	{
+	  unsigned shift = (ix - 1) % 4 * 6;
+	  if (!shift)
+	    bits.insert (bits.end (), Granule, 0);
+	  size_t bit = (bits.size () - Granule) * 8 + shift;
+	  for (unsigned b = 0; b != 6; b++, bit++)
+	    if (v & (1 << b))
+	      bits[bit / 8] |= 1 << (bit % 8);
+	}
+    }
+  if (!hashes)
+    ok = false;
+
+  std::lock_guard<std::mutex> lock (impl->mutex);
+  if (ok)
+    {
+      impl->bits.swap (bits);
+      impl->tag = t;
+      impl->hashes = hashes;
+    }
+  else
+    {
+      impl->bits.clear ();
+      impl->tag = impl->hashes = 0;
+    }
+
+  return ok;
+}
+
+}
@@ -14,6 +14,33 @@
 #endif
 // C
 #include <cstdio>
+// OS
+#if !defined (CODY_PROBES) && defined (__has_include)
+#if __has_include (<sys/sdt.h>)
+#define CODY_PROBES 1
+#endif
+#endif
+#if CODY_PROBES
+#include <sys/sdt.h>
+#endif
+
+// Static probes, in the 'cody' provider, for bpftrace, perf and
+// systemtap.  A probe is a nop until attached.  Define CODY_PROBES to
+// 0 to omit them.
+//   request (verb, ident)	a request is lexed
+//   response (code, err, ident)	a request is answered, CODE is
+//				RC_HWM if unrecognized
+//   read (fd, count, errno), write (fd, count, errno)
+//   uncork (requests)		a corked block is sent
+#if CODY_PROBES
+#define CODY_PROBE1(N, A) DTRACE_PROBE1 (cody, N, A)
+#define CODY_PROBE2(N, A, B) DTRACE_PROBE2 (cody, N, A, B)
+#define CODY_PROBE3(N, A, B, C) DTRACE_PROBE3 (cody, N, A, B, C)
+#else
+#define CODY_PROBE1(N, A) ((void)0)
+#define CODY_PROBE2(N, A, B) ((void)0)
+#define CODY_PROBE3(N, A, B, C) ((void)0)
+#endif
 
 namespace Cody {
 
@@ -122,4 +149,163 @@ inline void Unreachable () noexcept
 // FIXME: This should be user visible in some way
 void BuildNote (FILE *stream) noexcept;
 
+namespace Detail {
+
+// Message schema, see schema.cc.
+
+// Request argument kinds
+enum ArgKind : unsigned char
+{
+  AK_END,	// No more arguments
+  AK_UNSIGNED,	// Decimal unsigned
+  AK_WORD,	// Any word
+  AK_NAME,	// Non-empty word
+  AK_ARGV	// The remaining words, the first non-empty
+};
+
+// Response kinds, selecting the client's decoder
+enum ResponseKind : unsigned char
+{
+  RK_CONNECT,	// HELLO
+  RK_PATHNAME,	// PATHNAME
+  RK_OK,	// OK
+  RK_TRANSLATE,	// BOOL or PATHNAME
+  RK_STATS,	// STATS
+  RK_HWM
+};
+
+constexpr unsigned MaxArgs = 4;
+
+struct Schema
+{
+  char const *verb;
+  unsigned char required;	// Number of required arguments
+  ArgKind args[MaxArgs];	// Optional arguments follow required
+  ResponseKind response;
+};
+
+extern Schema const schemas[RC_HWM];
+
+// Check a request's words against its schema, parsing the unsigned
+// arguments into VALUES.  Absent ones are zero.  Returns 0 if well
+// formed, -1 otherwise.
+int ParseRequest (unsigned code, std::vector<std::string> const &words,
+		  unsigned (&values)[MaxArgs]);
+
+#if CODY_NETWORKING
+// Create a socket of FAMILY with OPTIONS applied, for connecting or
+// LISTENING, see netclient.cc.  Returns the fd, or -1 with errno set
+// and *ERRSTR describing the failing step.
+int NewSocket (char const **errstr, int family, SocketOptions const &options,
+	       bool listening);
+// Set ADDR to the local socket NAME, returning its length, or 0 with
+// errno set.
+socklen_t LocalAddress (sockaddr_storage &addr, char const *name,
+			bool abstract);
+
+// io_uring submission and completion queues, see uring.cc.  Each
+// request carries a caller-chosen nonzero tag, returned with its
+// completions.  Read buffers are slots of a region registered with
+// the ring, when possible.
+class Ring
+{
+public:
+  struct Completion
+  {
+    uint64_t tag;
+    int res;	// Result, or -errno
+    bool more;	// A multishot request continues
+  };
+
+public:
+  static constexpr size_t SlotSize = 16384;
+
+private:
+  int fd = -1;
+  void *rings = nullptr;	// The SQ and CQ rings
+  size_t ringsSize = 0;
+  void *sqes = nullptr;
+  size_t sqesSize = 0;
+  unsigned *sqHead, *sqTail, *sqArray;
+  unsigned *cqHead, *cqTail;
+  void *cqes;
+  unsigned sqMask = 0, cqMask = 0, entries = 0;
+  unsigned queued = 0;	// In the SQ, but not yet submitted
+  char *slots = nullptr;
+  unsigned slotCount = 0;
+  bool registered = false;
+  std::vector<unsigned> freeSlots;
+
+public:
+  uint64_t calls = 0;	// System calls made
+
+public:
+  Ring () = default;
+  ~Ring ();
+  Ring (Ring const &) = delete;
+  Ring &operator= (Ring const &) = delete;
+
+public:
+  // Create the ring, with ENTRIES submission slots and SLOTS read
+  // buffers.  Returns 0, or errno (ENOSYS if io_uring is unavailable).
+  int Open (unsigned entries, unsigned slots);
+
+public:
+  // Queue requests.  They are submitted by Wait.
+  void Accept (int fd, uint64_t tag, bool multishot);
+  void Poll (int fd, uint64_t tag, bool multishot);
+  void Read (int fd, unsigned slot, uint64_t tag);
+  void Write (int fd, void const *data, size_t len, uint64_t tag);
+  void Cancel (uint64_t tag);
+
+public:
+  // Submit queued requests, and wait up to TIMEOUT ms (-1 for no
+  // limit) for completions, appending them to DONE.
+  int Wait (int timeout, std::vector<Completion> &done);
+  // Submit queued requests, without waiting
+  int Submit ()
+  {
+    return queued ? Enter (queued, 0, 0) : 0;
+  }
+
+public:
+  // Read buffer slots.  GetSlot returns false if none are free.
+  bool GetSlot (unsigned &slot);
+  char const *GetSlotData (unsigned slot) const
+  {
+    return slots + slot * SlotSize;
+  }
+  void FreeSlot (unsigned slot)
+  {
+    freeSlots.push_back (slot);
+  }
+
+private:
+  void *GetSqe ();
+  int Enter (unsigned submit, unsigned wait, unsigned flags,
+	     void const *arg = nullptr, size_t argSize = 0);
+};
+#endif
+
+// Provide a Client's RESPONSE packet to S, see server.cc.
+void Respond (Server *s, Packet const &response);
+
+// The default CMI name of a module or header unit, and whether that
+// CMI is in the REPO directory, see resolver.cc.
+std::string CMIName (std::string const &module, char const *suffix);
+bool IsCMI (char const *repo, std::string const &cmi);
+
+// FNV-1a hash of a string, see filter.cc.  Stable across processes
+// and hosts.
+uint64_t Hash (char const *str, size_t len);
+
+// Metrics recording, see metrics.cc.  MetricsClock returns zero when
+// counting is disabled, and the Record functions ignore a zero START.
+uint64_t MetricsClock () noexcept;
+void RecordRequest (unsigned code, bool error, uint64_t start) noexcept;
+void RecordRead (ssize_t count, int err, uint64_t start) noexcept;
+void RecordWrite (ssize_t count, int err, uint64_t start) noexcept;
+
+}
+
 }
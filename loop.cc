@@ -0,0 +1,954 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Cody
+#include "internal.hh"
+#if CODY_NETWORKING
+// C++
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <set>
+// C
+#include <cerrno>
+// OS
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#if defined (__linux__)
+#include <sys/epoll.h>
+#define HAVE_EPOLL 1
+#else
+#define HAVE_EPOLL 0
+#endif
+
+// Server event loop
+
+// Each connection's Server is in one of the three directions.
+// READING connections wait for their read FD to become readable,
+// WRITING ones for their write FD to become writable.  PROCESSING
+// connections have deferred responses, and wait for nothing.  They
+// are checked after a notifier FD is serviced.
+
+// With the io_uring backend, listeners and notifiers have multishot
+// accept and poll requests, and each connection has one read or write
+// request outstanding, according to its direction.  A request is
+// found from its completion's tag.  Reads are into the ring's
+// registered slots, falling back to a poll and Server::Read if all
+// are in use.  Requests queued while servicing one batch of
+// completions are submitted together, at the end of the step.
+
+// With slicing, a connection whose block is complete joins the run
+// queue, and processes a slice of it each step, round robin.  While
+// any are queued, the loop only looks for events rather than waiting
+// for them, so other connections are serviced between slices.
+
+// Connections' buffers are allocated from the loop's pool, through
+// an account per connection, and released after each turn.  The
+// pool's free blocks go back to the heap when the loop is idle.
+
+namespace Cody {
+namespace Detail {
+
+// Readiness of a set of FDs, with epoll when available, otherwise
+// poll.
+
+class Poller
+{
+  std::map<int, short> masks;
+#if HAVE_EPOLL
+  int epfd = -1;
+  std::vector<epoll_event> events;
+#else
+  std::vector<pollfd> fds;
+#endif
+
+public:
+  uint64_t calls = 0;	///< System calls made
+
+public:
+  Poller ();
+  ~Poller ();
+
+public:
+  /// Set the events to wait for on FD, 0 to stop waiting.
+  void Watch (int fd, short mask);
+  /// Wait for events, appending the ready FDs to READY
+  int Wait (int timeout, std::vector<std::pair<int, short>> &ready);
+};
+
+Poller::Poller ()
+{
+#if HAVE_EPOLL
+  epfd = epoll_create1 (EPOLL_CLOEXEC);
+#endif
+}
+
+Poller::~Poller ()
+{
+#if HAVE_EPOLL
+  if (epfd >= 0)
+    close (epfd);
+#endif
+}
+
+void Poller::Watch (int fd, short mask)
+{
+  auto iter = masks.find (fd);
+  short old = iter == masks.end () ? 0 : iter->second;
+  if (old == mask)
+    return;
+
+  if (mask)
+    masks[fd] = mask;
+  else
+    masks.erase (iter);
+
+#if HAVE_EPOLL
+  epoll_event event;
+  event.events = ((mask & POLLIN ? unsigned (EPOLLIN) : 0u)
+		  | (mask & POLLOUT ? unsigned (EPOLLOUT) : 0u));
+  event.data.fd = fd;
+  calls++;
+  epoll_ctl (epfd, !mask ? EPOLL_CTL_DEL : !old ? EPOLL_CTL_ADD
+	     : EPOLL_CTL_MOD, fd, &event);
+#endif
+}
+
+int Poller::Wait (int timeout, std::vector<std::pair<int, short>> &ready)
+{
+#if HAVE_EPOLL
+  if (epfd < 0)
+    return EBADF;
+
+  events.resize (std::max (masks.size (), size_t (16)));
+  calls++;
+  int count = epoll_wait (epfd, events.data (), int (events.size ()),
+			  timeout);
+  if (count < 0)
+    return errno;
+
+  for (int ix = 0; ix != count; ix++)
+    {
+      unsigned e = events[ix].events;
+      short mask = ((e & (EPOLLIN | EPOLLHUP | EPOLLERR) ? POLLIN : 0)
+		    | (e & (EPOLLOUT | EPOLLERR) ? POLLOUT : 0));
+      int fd = events[ix].data.fd;
+      ready.emplace_back (fd, mask);
+    }
+#else
+  fds.clear ();
+  for (auto &pair : masks)
+    fds.push_back ({pair.first, pair.second, 0});
+
+  calls++;
+  int count = poll (fds.data (), fds.size (), timeout);
+  if (count < 0)
+    return errno;
+
+  for (auto &pfd : fds)
+    if (pfd.revents)
+      {
+	short mask = ((pfd.revents & (POLLIN | POLLHUP | POLLERR) ? POLLIN : 0)
+		      | (pfd.revents & (POLLOUT | POLLERR) ? POLLOUT : 0));
+	ready.emplace_back (pfd.fd, mask);
+      }
+#endif
+
+  return 0;
+}
+
+// Buffer memory of every loop's connections
+static std::atomic<size_t> memoryUsage (0);
+static std::atomic<size_t> memoryLimit (0);
+
+// A connection's buffer memory
+
+class Account : public MemoryResource
+{
+  MemoryResource *upstream;
+  size_t used = 0;
+
+public:
+  Account (MemoryResource *up)
+    : upstream (up)
+  {
+  }
+
+public:
+  virtual void *Allocate (size_t size, size_t align)
+  {
+    used += size;
+    memoryUsage.fetch_add (size, std::memory_order_relaxed);
+    return upstream->Allocate (size, align);
+  }
+  virtual void Deallocate (void *ptr, size_t size, size_t align)
+  {
+    used -= size;
+    memoryUsage.fetch_sub (size, std::memory_order_relaxed);
+    upstream->Deallocate (ptr, size, align);
+  }
+
+public:
+  size_t GetUsed () const
+  {
+    return used;
+  }
+};
+
+using Clock = std::chrono::steady_clock;
+
+// An outstanding io_uring request
+
+struct Pending
+{
+  enum Kind
+  {
+    ACCEPT,	// Listener
+    NOTIFY,	// Notifier or wake pipe
+    READ,	// Read into a slot
+    READABLE,	// Poll for a read
+    WRITE
+  };
+
+  Kind kind;
+  int fd;
+  Server *server;	///< Connection, nullptr once closed
+  unsigned slot;	///< Read slot
+  uint64_t start;	///< For metrics
+};
+
+// A closed connection whose ring request was cancelled.  Its buffer
+// and FDs are kept until the request completes.
+
+struct Zombie
+{
+  Server *server;
+  std::unique_ptr<Account> account;
+};
+
+class Loop
+{
+public:
+  Resolver *resolver;
+  Poller poller;
+  std::unique_ptr<Ring> ring;  ///< io_uring, if in use
+  std::map<uint64_t, Pending> pending;  ///< Ring requests, by tag
+  std::map<Server const *, uint64_t> inflight;  ///< Connection's request
+  std::map<uint64_t, Zombie> zombies;  ///< By their cancelled request
+  std::vector<Ring::Completion> done;
+  uint64_t tags = 0;
+  uint64_t calls = 0;  ///< System calls, other than poller and ring
+  bool multishot = true;  ///< Multishot accept works
+  PoolResource pool;
+  std::map<Server const *, std::unique_ptr<Account>> accounts;
+  Clock::time_point active;  ///< Last event
+  int idle = -1;  ///< Milliseconds before trimming the pool
+  std::set<int> listeners;
+  std::set<int> notifiers;
+  std::map<int, Server *> fds;	///< Both FDs of each connection
+  std::vector<Server *> parked;	///< Connections with deferred responses
+  std::deque<Server *> runnable;  ///< Connections waiting for a slice
+  std::map<Server const *, unsigned> weights;  ///< If not 1
+  unsigned slice = 0;	///< Lines, 0 for whole blocks
+  unsigned maxDepth = 0;  ///< Of runnable
+  uint64_t slices = 0;
+  std::vector<std::pair<int, short>> ready;
+  int wake[2];
+  std::atomic<bool> stopping;
+  unsigned connections = 0;
+
+public:
+  Loop (Resolver *r);
+  ~Loop ();
+
+public:
+  /// Lines a connection may process at a time
+  unsigned GetQuota (Server const *s) const
+  {
+    if (!slice)
+      return ~0u;
+    auto iter = weights.find (s);
+    unsigned weight = iter == weights.end () ? 1 : iter->second;
+
+    return slice > ~0u / weight ? ~0u : slice * weight;
+  }
+  void Reap (uint64_t tag);
+  void Enqueue (Server *s)
+  {
+    runnable.push_back (s);
+    if (runnable.size () > maxDepth)
+      maxDepth = unsigned (runnable.size ());
+  }
+};
+
+Loop::Loop (Resolver *r)
+  : resolver (r), active (Clock::now ()), stopping (false)
+{
+  if (pipe (wake) < 0)
+    wake[0] = wake[1] = -1;
+  else
+    {
+      for (unsigned ix = 2; ix--;)
+	{
+	  fcntl (wake[ix], F_SETFL, fcntl (wake[ix], F_GETFL) | O_NONBLOCK);
+	  fcntl (wake[ix], F_SETFD, FD_CLOEXEC);
+	}
+      poller.Watch (wake[0], POLLIN);
+    }
+}
+
+// Free the closed connection whose request, TAG, has completed
+
+void Loop::Reap (uint64_t tag)
+{
+  auto iter = zombies.find (tag);
+  if (iter == zombies.end ())
+    return;
+
+  Server *s = iter->second.server;
+  close (s->GetFDRead ());
+  if (s->GetFDWrite () != s->GetFDRead ())
+    close (s->GetFDWrite ());
+  delete s;
+  // The account outlives the Server's buffers
+  zombies.erase (iter);
+}
+
+Loop::~Loop ()
+{
+  if (wake[0] >= 0)
+    {
+      close (wake[0]);
+      close (wake[1]);
+    }
+}
+
+static void NonBlocking (int fd)
+{
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+}
+
+}
+
+ServerLoop::ServerLoop (Resolver *r)
+  : impl (new Detail::Loop (r))
+{
+}
+
+ServerLoop::~ServerLoop ()
+{
+  // Wait for the requests of closed connections, which may use their
+  // buffers.  Closing the ring cancels the others.
+  while (!impl->zombies.empty ())
+    {
+      auto &done = impl->done;
+      done.clear ();
+      if (impl->ring->Wait (1000, done) || done.empty ())
+	break;
+      for (auto &completion : done)
+	if (!completion.more)
+	  impl->Reap (completion.tag);
+    }
+  impl->ring.reset ();
+  for (auto &pair : impl->fds)
+    if (pair.first == pair.second->GetFDRead ())
+      {
+	Server *s = pair.second;
+	close (s->GetFDRead ());
+	if (s->GetFDWrite () != s->GetFDRead ())
+	  close (s->GetFDWrite ());
+	delete s;
+      }
+}
+
+int ServerLoop::SetBackend (Backend b)
+{
+  if (b == GetBackend ())
+    return 0;
+  if (impl->connections || !impl->listeners.empty ()
+      || !impl->notifiers.empty () || !impl->zombies.empty ())
+    return EBUSY;
+
+  if (b == POLL)
+    {
+      impl->ring.reset ();
+      impl->pending.clear ();
+      if (impl->wake[0] >= 0)
+	impl->poller.Watch (impl->wake[0], POLLIN);
+      return 0;
+    }
+
+  std::unique_ptr<Detail::Ring> ring (new Detail::Ring);
+  if (int err = ring->Open (256, 64))
+    return err;
+
+  impl->ring = std::move (ring);
+  if (impl->wake[0] >= 0)
+    {
+      impl->poller.Watch (impl->wake[0], 0);
+      Submit (Detail::Pending::NOTIFY, impl->wake[0]);
+    }
+
+  return 0;
+}
+
+ServerLoop::Backend ServerLoop::GetBackend () const
+{
+  return impl->ring ? URING : POLL;
+}
+
+uint64_t ServerLoop::GetSyscallCount () const
+{
+  return impl->calls + impl->poller.calls
+    + (impl->ring ? impl->ring->calls : 0);
+}
+
+// Queue a ring request of KIND on FD
+
+void ServerLoop::Submit (unsigned kind, int fd, Server *s)
+{
+  auto &ring = *impl->ring;
+  uint64_t tag = ++impl->tags;
+  Detail::Pending pending {Detail::Pending::Kind (kind), fd, s, 0, 0};
+
+  switch (pending.kind)
+    {
+    case Detail::Pending::ACCEPT:
+      ring.Accept (fd, tag, impl->multishot);
+      break;
+
+    case Detail::Pending::NOTIFY:
+      ring.Poll (fd, tag, true);
+      break;
+
+    case Detail::Pending::READ:
+      if (!ring.GetSlot (pending.slot))
+	{
+	  // Wait for it to be readable instead
+	  pending.kind = Detail::Pending::READABLE;
+	  ring.Poll (fd, tag, false);
+	  break;
+	}
+      pending.start = Detail::MetricsClock ();
+      ring.Read (fd, pending.slot, tag);
+      break;
+
+    case Detail::Pending::READABLE:
+      ring.Poll (fd, tag, false);
+      break;
+
+    case Detail::Pending::WRITE:
+      {
+	size_t len;
+	char const *data = s->GetUnwritten (len);
+	pending.start = Detail::MetricsClock ();
+	ring.Write (fd, data, len, tag);
+      }
+      break;
+    }
+
+  impl->pending.emplace (tag, pending);
+  if (s)
+    impl->inflight[s] = tag;
+}
+
+int ServerLoop::AddListener (int fd)
+{
+  Detail::NonBlocking (fd);
+  impl->listeners.insert (fd);
+  if (impl->ring)
+    Submit (Detail::Pending::ACCEPT, fd);
+  else
+    impl->poller.Watch (fd, POLLIN);
+
+  return 0;
+}
+
+int ServerLoop::AddNotifier (int fd)
+{
+  impl->notifiers.insert (fd);
+  if (impl->ring)
+    Submit (Detail::Pending::NOTIFY, fd);
+  else
+    impl->poller.Watch (fd, POLLIN);
+
+  return 0;
+}
+
+Server *ServerLoop::AddConnection (int from, int to)
+{
+  if (to < 0)
+    to = from;
+  Detail::NonBlocking (from);
+  if (to != from)
+    Detail::NonBlocking (to);
+
+  auto *s = new Server (impl->resolver, from, to);
+  auto *account = new Detail::Account (&impl->pool);
+  impl->accounts[s].reset (account);
+  s->SetMemoryResource (account);
+  impl->fds[from] = s;
+  impl->fds[to] = s;
+  impl->connections++;
+  s->PrepareToRead ();
+  if (impl->ring)
+    Submit (Detail::Pending::READ, from, s);
+  else
+    impl->poller.Watch (from, POLLIN);
+  Connected (s);
+
+  return s;
+}
+
+unsigned ServerLoop::GetConnectionCount () const
+{
+  return impl->connections;
+}
+
+void ServerLoop::SetIdleTimeout (int ms)
+{
+  impl->idle = ms;
+}
+
+size_t ServerLoop::GetMemoryUsage (Server const *s) const
+{
+  auto iter = impl->accounts.find (s);
+
+  return iter == impl->accounts.end () ? 0 : iter->second->GetUsed ();
+}
+
+size_t ServerLoop::GetMemoryUsage ()
+{
+  return Detail::memoryUsage.load (std::memory_order_relaxed);
+}
+
+void ServerLoop::SetMemoryLimit (size_t bytes)
+{
+  Detail::memoryLimit = bytes;
+}
+
+void ServerLoop::SetSliceLines (unsigned lines)
+{
+  impl->slice = lines;
+}
+
+void ServerLoop::SetWeight (Server const *s, unsigned weight)
+{
+  if (weight > 1)
+    impl->weights[s] = weight;
+  else
+    impl->weights.erase (s);
+}
+
+unsigned ServerLoop::GetWeight (Server const *s) const
+{
+  auto iter = impl->weights.find (s);
+
+  return iter == impl->weights.end () ? 1 : iter->second;
+}
+
+unsigned ServerLoop::GetQueueDepth () const
+{
+  return unsigned (impl->runnable.size ());
+}
+
+unsigned ServerLoop::GetMaxQueueDepth () const
+{
+  return impl->maxDepth;
+}
+
+uint64_t ServerLoop::GetSliceCount () const
+{
+  return impl->slices;
+}
+
+void ServerLoop::Stop ()
+{
+  impl->stopping = true;
+  if (impl->wake[1] >= 0)
+    (void)!write (impl->wake[1], "", 1);
+}
+
+void ServerLoop::Connected (Server *)
+{
+}
+
+void ServerLoop::Disconnected (Server *)
+{
+}
+
+void ServerLoop::Notify (int)
+{
+}
+
+void ServerLoop::Close (Server *s)
+{
+  int from = s->GetFDRead (), to = s->GetFDWrite ();
+  // The account outlives the Server's buffers
+  std::unique_ptr<Detail::Account> account (std::move (impl->accounts[s]));
+  impl->accounts.erase (s);
+  bool zombie = false;
+  auto inflight = impl->inflight.find (s);
+  if (inflight != impl->inflight.end ())
+    {
+      // Its completion is ignored, other than to free the slot and
+      // the connection
+      auto iter = impl->pending.find (inflight->second);
+      if (iter != impl->pending.end ())
+	{
+	  iter->second.server = nullptr;
+	  impl->ring->Cancel (inflight->second);
+	  impl->zombies[inflight->second] = {s, std::move (account)};
+	  zombie = true;
+	}
+      impl->inflight.erase (inflight);
+    }
+  auto &runnable = impl->runnable;
+  runnable.erase (std::remove (runnable.begin (), runnable.end (), s),
+		  runnable.end ());
+  impl->weights.erase (s);
+
+  impl->poller.Watch (from, 0);
+  impl->poller.Watch (to, 0);
+  impl->fds.erase (from);
+  impl->fds.erase (to);
+  impl->connections--;
+  Disconnected (s);
+
+  if (zombie)
+    // The request may still use its buffer or FDs
+    return;
+  close (from);
+  if (to != from)
+    close (to);
+  delete s;
+}
+
+// Process a complete request block, or queue it to be processed in
+// slices.
+
+void ServerLoop::Process (Server *s)
+{
+  if (!impl->ring)
+    impl->poller.Watch (s->GetFDRead (), 0);
+  if (impl->slice)
+    impl->Enqueue (s);
+  else
+    {
+      s->ProcessRequests ();
+      Finish (s);
+    }
+}
+
+// Process a slice of a block, requeuing it if there is more
+
+void ServerLoop::Slice (Server *s)
+{
+  impl->slices++;
+  if (s->ProcessRequests (impl->GetQuota (s)))
+    Finish (s);
+  else
+    impl->Enqueue (s);
+}
+
+// Write a processed block's responses, unless some are deferred
+
+void ServerLoop::Finish (Server *s)
+{
+  if (s->IsReady ())
+    {
+      s->PrepareToWrite ();
+      Write (s);
+    }
+  else
+    impl->parked.push_back (s);
+}
+
+void ServerLoop::Read (Server *s)
+{
+  impl->calls++;
+  Received (s, s->Read ());
+}
+
+// Continue after ERR from reading
+
+void ServerLoop::Received (Server *s, int err)
+{
+  size_t limit = Detail::memoryLimit.load (std::memory_order_relaxed);
+  if (limit && GetMemoryUsage () > limit)
+    {
+      Close (s);
+      return;
+    }
+  if (err == EAGAIN || err == EINTR)
+    {
+      // Start on the lines so far
+      s->ProcessLines (impl->GetQuota (s));
+      if (impl->ring)
+	Submit (Detail::Pending::READ, s->GetFDRead (), s);
+      return;
+    }
+
+  // A malformed block is processed, to respond with errors
+  if (!err || err == EINVAL)
+    Process (s);
+  else
+    Close (s);
+}
+
+void ServerLoop::Write (Server *s)
+{
+  if (impl->ring)
+    {
+      Submit (Detail::Pending::WRITE, s->GetFDWrite (), s);
+      return;
+    }
+
+  impl->calls++;
+  Sent (s, s->Write ());
+}
+
+// Continue after ERR from writing
+
+void ServerLoop::Sent (Server *s, int err)
+{
+  if (err == EAGAIN || err == EINTR)
+    {
+      if (impl->ring)
+	Submit (Detail::Pending::WRITE, s->GetFDWrite (), s);
+      else
+	impl->poller.Watch (s->GetFDWrite (), POLLOUT);
+    }
+  else if (err)
+    Close (s);
+  else
+    {
+      if (!impl->ring && s->GetFDWrite () != s->GetFDRead ())
+	impl->poller.Watch (s->GetFDWrite (), 0);
+      // The turn is over, return its buffers to the pool
+      s->SetMemoryResource (impl->accounts[s].get ());
+      s->PrepareToRead ();
+      if (impl->ring)
+	Submit (Detail::Pending::READ, s->GetFDRead (), s);
+      else
+	impl->poller.Watch (s->GetFDRead (), POLLIN);
+    }
+}
+
+// Handle a ring completion.  Returns true if a notifier fired.
+
+bool ServerLoop::Complete (uint64_t tag, int res, bool more)
+{
+  auto iter = impl->pending.find (tag);
+  if (iter == impl->pending.end ())
+    return false;
+
+  Detail::Pending pending = iter->second;
+  if (!more)
+    impl->pending.erase (iter);
+  Server *s = pending.server;
+  if (s && !more)
+    impl->inflight.erase (s);
+  if (!s && !more)
+    impl->Reap (tag);
+
+  switch (pending.kind)
+    {
+    case Detail::Pending::ACCEPT:
+      if (res >= 0)
+	AddConnection (res);
+      else if (res == -EINVAL && impl->multishot)
+	// Multishot accept is unsupported
+	impl->multishot = false;
+      if (!more && impl->listeners.count (pending.fd))
+	Submit (Detail::Pending::ACCEPT, pending.fd);
+      return false;
+
+    case Detail::Pending::NOTIFY:
+      if (!more)
+	Submit (Detail::Pending::NOTIFY, pending.fd);
+      if (pending.fd == impl->wake[0])
+	{
+	  char drain[64];
+	  while (read (pending.fd, drain, sizeof (drain)) > 0)
+	    impl->calls++;
+	  return false;
+	}
+      Notify (pending.fd);
+      return true;
+
+    case Detail::Pending::READ:
+      {
+	char const *data = impl->ring->GetSlotData (pending.slot);
+	int err = res < 0 ? -res : 0;
+	CODY_PROBE3 (read, pending.fd, res, err);
+	Detail::RecordRead (res, err, pending.start);
+	if (s)
+	  {
+	    if (err == EAGAIN || err == EINTR)
+	      Submit (Detail::Pending::READ, pending.fd, s);
+	    else
+	      Received (s, err ? err : s->Received (data, size_t (res)));
+	  }
+	impl->ring->FreeSlot (pending.slot);
+      }
+      return false;
+
+    case Detail::Pending::READABLE:
+      if (s)
+	Read (s);
+      return false;
+
+    case Detail::Pending::WRITE:
+      {
+	int err = res < 0 ? -res : 0;
+	CODY_PROBE3 (write, pending.fd, res, err);
+	Detail::RecordWrite (res, err, pending.start);
+	if (s)
+	  Sent (s, s->Sent (res, err));
+      }
+      return false;
+    }
+
+  return false;
+}
+
+int ServerLoop::Step (int timeout)
+{
+  auto &ready = impl->ready;
+  ready.clear ();
+
+  // Wake to trim the pool, if it has free blocks
+  bool trim = impl->idle >= 0 && impl->pool.GetFreeSize ();
+  int wait = timeout;
+  if (trim)
+    {
+      auto since = std::chrono::duration_cast<std::chrono::milliseconds>
+	(Detail::Clock::now () - impl->active).count ();
+      int left = since >= impl->idle ? 0 : int (impl->idle - since);
+      if (wait < 0 || wait > left)
+	wait = left;
+    }
+  // Slices are waiting, so do not block
+  if (!impl->runnable.empty ())
+    wait = 0;
+
+  bool notified = false;
+  bool any;
+  if (impl->ring)
+    {
+      auto &done = impl->done;
+      done.clear ();
+      if (int err = impl->ring->Wait (wait, done))
+	return err == EINTR ? 0 : err;
+      any = !done.empty ();
+      for (auto &completion : done)
+	if (Complete (completion.tag, completion.res, completion.more))
+	  notified = true;
+    }
+  else
+    {
+      if (int err = impl->poller.Wait (wait, ready))
+	return err == EINTR ? 0 : err;
+      any = !ready.empty ();
+    }
+
+  if (any)
+    impl->active = Detail::Clock::now ();
+  else if (trim && Detail::Clock::now () - impl->active
+	   >= std::chrono::milliseconds (impl->idle))
+    impl->pool.Release ();
+
+  for (auto &pair : ready)
+    {
+      int fd = pair.first;
+
+      if (fd == impl->wake[0])
+	{
+	  char drain[64];
+	  while (read (fd, drain, sizeof (drain)) > 0)
+	    impl->calls++;
+	}
+      else if (impl->listeners.count (fd))
+	{
+	  for (;;)
+	    {
+	      impl->calls++;
+	      int client = accept (fd, nullptr, nullptr);
+	      if (client < 0)
+		break;
+	      fcntl (client, F_SETFD, FD_CLOEXEC);
+	      AddConnection (client);
+	    }
+	}
+      else if (impl->notifiers.count (fd))
+	{
+	  Notify (fd);
+	  notified = true;
+	}
+      else
+	{
+	  // An earlier event may have closed it
+	  auto iter = impl->fds.find (fd);
+	  if (iter == impl->fds.end ())
+	    continue;
+
+	  Server *s = iter->second;
+	  if (s->GetDirection () == Server::READING && fd == s->GetFDRead ()
+	      && (pair.second & POLLIN))
+	    Read (s);
+	  else if (s->GetDirection () == Server::WRITING
+		   && fd == s->GetFDWrite () && (pair.second & POLLOUT))
+	    Write (s);
+	}
+    }
+
+  if (notified)
+    {
+      auto &parked = impl->parked;
+      for (size_t ix = 0; ix != parked.size ();)
+	if (parked[ix]->IsReady ())
+	  {
+	    Server *s = parked[ix];
+	    parked.erase (parked.begin () + ix);
+	    s->PrepareToWrite ();
+	    Write (s);
+	  }
+	else
+	  ix++;
+    }
+
+  // A slice for each connection waiting, including those just queued
+  for (size_t count = impl->runnable.size (); count--;)
+    {
+      Server *s = impl->runnable.front ();
+      impl->runnable.pop_front ();
+      Slice (s);
+    }
+
+  // Submit the batch's requests together
+  if (impl->ring)
+    if (int err = impl->ring->Submit ())
+      return err;
+
+  return 0;
+}
+
+int ServerLoop::Run ()
+{
+  while (!impl->stopping
+	 && (impl->connections || !impl->listeners.empty ()))
+    if (int err = Step (-1))
+      return err;
+  impl->stopping = false;
+
+  return 0;
+}
+
+}
+#endif
@@ -0,0 +1,121 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Cody
+#include "internal.hh"
+// C++
+#include <mutex>
+#include <unordered_map>
+// C
+#include <cstring>
+
+// Response cache code
+
+// Responses are filed under their name, so that invalidating a name
+// is a single erasure.  There are seldom more than a couple of
+// responses per name, so those are a vector.
+
+namespace Cody {
+namespace Detail {
+
+class Memo
+{
+public:
+  struct Response
+  {
+    std::string string;		///< Payload, if a string
+    size_t integer;		///< Payload, if an integer
+    Flags flags;
+    unsigned char request;
+    unsigned short code;	///< Packet code
+    bool is_string;
+  };
+
+public:
+  mutable std::mutex mutex;
+  std::unordered_map<std::string, std::vector<Response>> names;
+};
+
+}
+
+ResponseCache::ResponseCache ()
+  : impl (new Detail::Memo)
+{
+}
+
+ResponseCache::~ResponseCache ()
+{
+}
+
+void ResponseCache::Invalidate ()
+{
+  std::lock_guard<std::mutex> lock (impl->mutex);
+  impl->names.clear ();
+}
+
+void ResponseCache::Invalidate (char const *str, size_t len)
+{
+  if (len == ~size_t (0))
+    len = strlen (str);
+
+  std::lock_guard<std::mutex> lock (impl->mutex);
+  impl->names.erase (std::string (str, len));
+}
+
+bool ResponseCache::Lookup (unsigned request, Flags flags,
+			    char const *str, size_t len, Packet &packet) const
+{
+  std::string name (str, len);
+  std::lock_guard<std::mutex> lock (impl->mutex);
+  auto iter = impl->names.find (name);
+  if (iter == impl->names.end ())
+    return false;
+
+  for (auto &response : iter->second)
+    if (response.request == request && response.flags == flags)
+      {
+	if (response.is_string)
+	  packet = Packet (response.code, response.string);
+	else
+	  packet = Packet (response.code, response.integer);
+	return true;
+      }
+
+  return false;
+}
+
+void ResponseCache::Insert (unsigned request, Flags flags,
+			    std::string const &name, Packet const &packet)
+{
+  Assert (packet.GetCategory () != Packet::VECTOR);
+
+  std::lock_guard<std::mutex> lock (impl->mutex);
+  auto &responses = impl->names[name];
+  Detail::Memo::Response *slot = nullptr;
+  for (auto &response : responses)
+    if (response.request == request && response.flags == flags)
+      {
+	slot = &response;
+	break;
+      }
+  if (!slot)
+    {
+      responses.emplace_back ();
+      slot = &responses.back ();
+      slot->request = (unsigned char)request;
+      slot->flags = flags;
+    }
+
+  slot->code = (unsigned short)packet.GetCode ();
+  slot->is_string = packet.GetCategory () == Packet::STRING;
+  if (slot->is_string)
+    slot->string = packet.GetString ();
+  else
+    {
+      slot->string.clear ();
+      slot->integer = packet.GetInteger ();
+    }
+}
+
+}
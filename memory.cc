@@ -0,0 +1,169 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Cody
+#include "internal.hh"
+// C++
+#include <new>
+// C
+#include <cstdint>
+
+// Memory resource code
+
+namespace Cody {
+
+namespace {
+
+class NewDelete : public MemoryResource
+{
+public:
+  constexpr NewDelete () = default;
+
+public:
+  virtual void *Allocate (size_t size, size_t)
+  {
+    return ::operator new (size);
+  }
+  virtual void Deallocate (void *ptr, size_t, size_t)
+  {
+    ::operator delete (ptr);
+  }
+};
+
+// operator new's alignment
+constexpr size_t maxAlign = alignof (std::max_align_t);
+
+// The default resource is constant initialized, so it needs no guard
+// when threads first reach it at once, and it exists before any
+// dynamic initializer may use it.  The union keeps it from being
+// destroyed, so buffers freed by later destructors still reach it.
+union Default
+{
+  NewDelete resource;
+
+  constexpr Default ()
+    : resource ()
+  {
+  }
+  ~Default ()
+  {
+  }
+};
+
+Default defaultResource;
+
+}
+
+MemoryResource *MemoryResource::GetDefault ()
+{
+  return &defaultResource.resource;
+}
+
+// The size class of SIZE, Classes if too large.
+
+unsigned PoolResource::Class (size_t size)
+{
+  unsigned ix = 0;
+  for (size_t limit = size_t (1) << MinShift; limit < size; limit <<= 1)
+    if (++ix == Classes)
+      break;
+
+  return ix;
+}
+
+void *PoolResource::Allocate (size_t size, size_t align)
+{
+  unsigned ix = Class (size);
+  if (ix == Classes || align > maxAlign)
+    return upstream->Allocate (size, align);
+
+  if (void *block = pools[ix])
+    {
+      pools[ix] = *static_cast<void **> (block);
+      freeSize -= size_t (1) << (ix + MinShift);
+      return block;
+    }
+
+  return upstream->Allocate (size_t (1) << (ix + MinShift), maxAlign);
+}
+
+void PoolResource::Deallocate (void *ptr, size_t size, size_t align)
+{
+  unsigned ix = Class (size);
+  if (ix == Classes || align > maxAlign)
+    upstream->Deallocate (ptr, size, align);
+  else
+    {
+      *static_cast<void **> (ptr) = pools[ix];
+      pools[ix] = ptr;
+      freeSize += size_t (1) << (ix + MinShift);
+    }
+}
+
+void PoolResource::Release ()
+{
+  for (unsigned ix = 0; ix != Classes; ix++)
+    while (void *block = pools[ix])
+      {
+	pools[ix] = *static_cast<void **> (block);
+	upstream->Deallocate (block, size_t (1) << (ix + MinShift), maxAlign);
+      }
+  freeSize = 0;
+}
+
+ArenaResource::~ArenaResource ()
+{
+  while (Chunk *c = chunk)
+    {
+      chunk = c->prev;
+      upstream->Deallocate (c, c->size, maxAlign);
+    }
+}
+
+void *ArenaResource::Allocate (size_t size, size_t align)
+{
+  uintptr_t pos = (uintptr_t (next) + align - 1) & ~uintptr_t (align - 1);
+  if (!next || pos + size > uintptr_t (limit))
+    {
+      // A new chunk, at least doubling
+      size_t need = sizeof (Chunk) + size + align;
+      while (chunkSize < need)
+	chunkSize *= 2;
+      Chunk *c = static_cast<Chunk *>
+	(upstream->Allocate (chunkSize, maxAlign));
+      c->prev = chunk;
+      c->size = chunkSize;
+      chunk = c;
+      next = reinterpret_cast<char *> (c + 1);
+      limit = reinterpret_cast<char *> (c) + chunkSize;
+      chunkSize *= 2;
+      pos = (uintptr_t (next) + align - 1) & ~uintptr_t (align - 1);
+    }
+
+  next = reinterpret_cast<char *> (pos + size);
+
+  return reinterpret_cast<void *> (pos);
+}
+
+void ArenaResource::Deallocate (void *ptr, size_t size, size_t)
+{
+  // Only the most recent block can be given back
+  if (static_cast<char *> (ptr) + size == next)
+    next = static_cast<char *> (ptr);
+}
+
+void ArenaResource::Reset ()
+{
+  if (!chunk)
+    return;
+
+  while (Chunk *c = chunk->prev)
+    {
+      chunk->prev = c->prev;
+      upstream->Deallocate (c, c->size, maxAlign);
+    }
+  next = reinterpret_cast<char *> (chunk + 1);
+}
+
+}
@@ -0,0 +1,349 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Cody
+#include "internal.hh"
+// C++
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+// C
+#include <cerrno>
+
+// Metrics code
+
+// Each thread that records something gets a Block of counters.  Only
+// that thread writes them, so an increment is a relaxed load and
+// store, not a locked read-modify-write.  Snapshot reads them from
+// another thread, which is why they are atomic at all.  A thread's
+// block is folded into the retired sums when it exits.  Blocks are
+// allocated on first use, so threads that never talk to a mapper do
+// not pay for them.
+
+namespace Cody {
+
+unsigned Histogram::Bucket (uint64_t value)
+{
+  if (value < 16)
+    return unsigned (value);
+
+  // The top 4 bits of the value select the sub bucket
+  unsigned shift = 60 - unsigned (__builtin_clzll (value));
+  return 16 + (shift - 1) * 8 + unsigned ((value >> shift) & 7);
+}
+
+uint64_t Histogram::Value (unsigned bucket)
+{
+  if (bucket < 16)
+    return bucket;
+
+  unsigned shift = (bucket - 16) / 8 + 1;
+  uint64_t base = uint64_t (8 + (bucket - 16) % 8) << shift;
+  return base + ((uint64_t (1) << shift) - 1);
+}
+
+void Histogram::Merge (Histogram const &other)
+{
+  for (unsigned ix = 0; ix != Buckets; ix++)
+    counts[ix] += other.counts[ix];
+}
+
+uint64_t Histogram::GetCount () const
+{
+  uint64_t total = 0;
+  for (unsigned ix = 0; ix != Buckets; ix++)
+    total += counts[ix];
+  return total;
+}
+
+uint64_t Histogram::GetPercentile (double rank) const
+{
+  uint64_t total = GetCount ();
+  if (!total)
+    return 0;
+
+  uint64_t target = uint64_t (rank * double (total) + 0.5);
+  target = std::max (std::min (target, total), uint64_t (1));
+  uint64_t seen = 0;
+  for (unsigned ix = 0; ix != Buckets; ix++)
+    if ((seen += counts[ix]) >= target)
+      return Value (ix);
+
+  return Value (Buckets - 1);
+}
+
+namespace Detail {
+
+class Counter
+{
+  std::atomic<uint64_t> value;
+
+public:
+  Counter ()
+    : value (0)
+  {
+  }
+
+public:
+  void Add (uint64_t n) noexcept
+  {
+    value.store (value.load (std::memory_order_relaxed) + n,
+		 std::memory_order_relaxed);
+  }
+  uint64_t Get () const noexcept
+  {
+    return value.load (std::memory_order_relaxed);
+  }
+};
+
+class LiveHistogram
+{
+  Counter counts[Histogram::Buckets];
+
+public:
+  void Record (uint64_t value) noexcept
+  {
+    counts[Histogram::Bucket (value)].Add (1);
+  }
+  void Fold (Histogram &h) const
+  {
+    for (unsigned ix = 0; ix != Histogram::Buckets; ix++)
+      if (uint64_t n = counts[ix].Get ())
+	h.Add (ix, n);
+  }
+};
+
+class Block
+{
+public:
+  struct Verb
+  {
+    Counter count;
+    Counter errors;
+    LiveHistogram latency;
+  };
+  struct IO
+  {
+    Counter calls;
+    Counter bytes;
+    Counter errors;
+    LiveHistogram latency;
+  };
+
+public:
+  Verb verbs[RC_HWM + 1];
+  IO reads;
+  IO writes;
+
+public:
+  Block ();
+  ~Block ();
+
+public:
+  void Record (IO &io, ssize_t count, int err, uint64_t ns) noexcept;
+  void Fold (Metrics &m) const;
+};
+
+class Registry
+{
+public:
+  std::mutex mutex;
+  std::vector<Block *> live;
+  Metrics retired;	///< Sums of exited threads
+};
+
+static Registry registry;
+static std::atomic<bool> enabled (true);
+
+// The block of the current thread
+class Local
+{
+  Block *block = nullptr;
+
+public:
+  ~Local ()
+  {
+    delete block;
+  }
+
+public:
+  Block *Get ()
+  {
+    if (!block)
+      block = new Block ();
+    return block;
+  }
+};
+
+static thread_local Local local;
+
+Block::Block ()
+{
+  std::lock_guard<std::mutex> lock (registry.mutex);
+  registry.live.push_back (this);
+}
+
+Block::~Block ()
+{
+  std::lock_guard<std::mutex> lock (registry.mutex);
+  Fold (registry.retired);
+  registry.live.erase (std::find (registry.live.begin (),
+				  registry.live.end (), this));
+}
+
+void Block::Record (IO &io, ssize_t count, int err, uint64_t ns) noexcept
+{
+  io.calls.Add (1);
+  if (count > 0)
+    io.bytes.Add (uint64_t (count));
+  else if (count < 0 && err != EAGAIN && err != EINTR)
+    io.errors.Add (1);
+  io.latency.Record (ns);
+}
+
+static void Fold (Metrics::IO &to, Block::IO const &from)
+{
+  to.calls += from.calls.Get ();
+  to.bytes += from.bytes.Get ();
+  to.errors += from.errors.Get ();
+  from.latency.Fold (to.latency);
+}
+
+void Block::Fold (Metrics &m) const
+{
+  for (unsigned ix = 0; ix != RC_HWM + 1; ix++)
+    {
+      m.verbs[ix].count += verbs[ix].count.Get ();
+      m.verbs[ix].errors += verbs[ix].errors.Get ();
+      verbs[ix].latency.Fold (m.verbs[ix].latency);
+    }
+  Detail::Fold (m.reads, reads);
+  Detail::Fold (m.writes, writes);
+}
+
+static uint64_t Now () noexcept
+{
+  return uint64_t (std::chrono::duration_cast<std::chrono::nanoseconds>
+		   (std::chrono::steady_clock::now ().time_since_epoch ())
+		   .count ());
+}
+
+uint64_t MetricsClock () noexcept
+{
+  return enabled.load (std::memory_order_relaxed) ? Now () : 0;
+}
+
+void RecordRequest (unsigned code, bool error, uint64_t start) noexcept
+{
+  if (!start)
+    return;
+
+  uint64_t ns = Now () - start;
+  auto &verb = local.Get ()->verbs[std::min (code, unsigned (RC_HWM))];
+  verb.count.Add (1);
+  if (error)
+    verb.errors.Add (1);
+  verb.latency.Record (ns);
+}
+
+void RecordRead (ssize_t count, int err, uint64_t start) noexcept
+{
+  if (start)
+    {
+      uint64_t ns = Now () - start;
+      Block *block = local.Get ();
+      block->Record (block->reads, count, err, ns);
+    }
+}
+
+void RecordWrite (ssize_t count, int err, uint64_t start) noexcept
+{
+  if (start)
+    {
+      uint64_t ns = Now () - start;
+      Block *block = local.Get ();
+      block->Record (block->writes, count, err, ns);
+    }
+}
+
+}
+
+static void Merge (Metrics::IO &to, Metrics::IO const &from)
+{
+  to.calls += from.calls;
+  to.bytes += from.bytes;
+  to.errors += from.errors;
+  to.latency.Merge (from.latency);
+}
+
+void Metrics::Snapshot (Metrics &m)
+{
+  m = Metrics ();
+
+  std::lock_guard<std::mutex> lock (Detail::registry.mutex);
+  auto &retired = Detail::registry.retired;
+  for (unsigned ix = 0; ix != Detail::RC_HWM + 1; ix++)
+    {
+      m.verbs[ix].count += retired.verbs[ix].count;
+      m.verbs[ix].errors += retired.verbs[ix].errors;
+      m.verbs[ix].latency.Merge (retired.verbs[ix].latency);
+    }
+  Merge (m.reads, retired.reads);
+  Merge (m.writes, retired.writes);
+
+  for (auto *block : Detail::registry.live)
+    block->Fold (m);
+}
+
+void Metrics::Enable (bool enable)
+{
+  Detail::enabled.store (enable, std::memory_order_relaxed);
+}
+
+bool Metrics::IsEnabled ()
+{
+  return Detail::enabled.load (std::memory_order_relaxed);
+}
+
+// Names are the verb, or read and write, suffixed with the counter.
+// Latencies are in nanoseconds.
+
+void Metrics::Report (std::vector<std::pair<std::string, uint64_t>> &pairs)
+  const
+{
+  auto add = [&] (std::string const &prefix, char const *suffix,
+		  uint64_t value)
+    {
+      pairs.emplace_back (prefix + suffix, value);
+    };
+  auto latencies = [&] (std::string const &prefix, Histogram const &h)
+    {
+      add (prefix, u8".p50", h.GetPercentile (0.5));
+      add (prefix, u8".p90", h.GetPercentile (0.9));
+      add (prefix, u8".p99", h.GetPercentile (0.99));
+      add (prefix, u8".max", h.GetPercentile (1));
+    };
+
+  for (unsigned ix = 0; ix != Detail::RC_HWM + 1; ix++)
+    if (verbs[ix].count)
+      {
+	std::string name (GetVerbName (ix));
+	add (name, u8".count", verbs[ix].count);
+	add (name, u8".errors", verbs[ix].errors);
+	latencies (name, verbs[ix].latency);
+      }
+
+  for (unsigned ix = 0; ix != 2; ix++)
+    {
+      std::string name (ix ? u8"write" : u8"read");
+      IO const &io = ix ? writes : reads;
+      add (name, u8".calls", io.calls);
+      add (name, u8".bytes", io.bytes);
+      add (name, u8".errors", io.errors);
+      latencies (name, io.latency);
+    }
+}
+
+}
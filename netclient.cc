@@ -10,9 +10,12 @@
 #include <cerrno>
 #include <cstring>
 // OS
+#include <fcntl.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/un.h>
 
 #ifndef AI_NUMERICSERV
@@ -23,15 +26,120 @@
 
 namespace Cody {
 
+namespace Detail {
+
+static bool SetOption (int fd, int level, int name, int value)
+{
+  return !setsockopt (fd, level, name, &value, sizeof (value));
+}
+
+int NewSocket (char const **errstr, int family, SocketOptions const &options,
+	       bool listening)
+{
+  int type = SOCK_STREAM;
+#if defined (SOCK_CLOEXEC)
+  if (options.closeOnExec)
+    type |= SOCK_CLOEXEC;
+  // A connecting socket becomes non-blocking once connected
+  if (options.nonBlocking && listening)
+    type |= SOCK_NONBLOCK;
+#endif
+
+  int fd = socket (family, type, 0);
+  if (fd < 0)
+    {
+      *errstr = "creating socket";
+      return -1;
+    }
+
+#if !defined (SOCK_CLOEXEC)
+  if (options.closeOnExec)
+    fcntl (fd, F_SETFD, FD_CLOEXEC);
+  if (options.nonBlocking && listening)
+    fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+#endif
+
+  bool inet = family == AF_INET || family == AF_INET6;
+  bool ok = true;
+  if (options.receiveBuffer)
+    ok = SetOption (fd, SOL_SOCKET, SO_RCVBUF, options.receiveBuffer);
+  if (ok && options.sendBuffer)
+    ok = SetOption (fd, SOL_SOCKET, SO_SNDBUF, options.sendBuffer);
+  if (ok && inet && options.noDelay)
+    ok = SetOption (fd, IPPROTO_TCP, TCP_NODELAY, 1);
+  if (ok && family == AF_INET6 && options.family == SocketOptions::DUAL)
+    ok = SetOption (fd, IPPROTO_IPV6, IPV6_V6ONLY, 0);
+  if (ok && inet && options.fastOpen)
+    {
+#if defined (TCP_FASTOPEN) && defined (TCP_FASTOPEN_CONNECT)
+      if (listening)
+	// The value is the queue of pending Fast Open connections
+	ok = SetOption (fd, IPPROTO_TCP, TCP_FASTOPEN,
+			options.backlog ? int (options.backlog) : SOMAXCONN);
+      else
+	ok = SetOption (fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1);
+#else
+      errno = ENOPROTOOPT;
+      ok = false;
+#endif
+    }
+
+  if (!ok)
+    {
+      int err = errno;
+      *errstr = "setting socket option";
+      close (fd);
+      errno = err;
+      return -1;
+    }
+
+  return fd;
+}
+
+socklen_t LocalAddress (sockaddr_storage &storage, char const *name,
+			bool abstract)
+{
+  auto &addr = reinterpret_cast<sockaddr_un &> (storage);
+  size_t len = strlen (name);
+
+  // An abstract name has a leading NUL, and is not NUL-terminated
+  if (len + abstract >= sizeof (addr.sun_path))
+    {
+      errno = ENAMETOOLONG;
+      return 0;
+    }
+#if !defined (__linux__)
+  if (abstract)
+    {
+      errno = EAFNOSUPPORT;
+      return 0;
+    }
+#endif
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  memcpy (addr.sun_path + abstract, name, len + !abstract);
+  if (abstract)
+    return socklen_t (offsetof (sockaddr_un, sun_path) + 1 + len);
+
+  return sizeof (addr);
+}
+
+}
+
 int OpenSocket (char const **e, sockaddr const *addr, socklen_t len)
+{
+  return OpenSocket (e, addr, len, SocketOptions::Legacy ());
+}
+
+int OpenSocket (char const **e, sockaddr const *addr, socklen_t len,
+		SocketOptions const &options)
 {
   char const *errstr = nullptr;
 
-  int fd = socket (addr->sa_family, SOCK_STREAM, 0);
+  int fd = Detail::NewSocket (&errstr, addr->sa_family, options, false);
   if (fd < 0)
     {
-      errstr = "creating socket";
-
     fail:;
       int err = errno;
       if (e)
@@ -48,27 +156,34 @@ int OpenSocket (char const **e, sockaddr const *addr, socklen_t len)
       goto fail;
     }
 
+  if (options.nonBlocking)
+    fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+
   return fd;
 }
 
 int OpenLocal (char const **e, char const *name)
 {
-  sockaddr_un addr;
-  size_t len = strlen (name);
+  return OpenLocal (e, name, SocketOptions::Legacy ());
+}
 
-  if (len >= sizeof (addr.sun_path))
-    {
-      errno = ENAMETOOLONG;
-      return -1;
-    }
+int OpenLocal (char const **e, char const *name, SocketOptions const &options)
+{
+  sockaddr_storage addr;
+  socklen_t len = Detail::LocalAddress (addr, name, options.abstract);
+  if (!len)
+    return -1;
 
-  memset (&addr, 0, offsetof (sockaddr_un, sun_path));
-  addr.sun_family = AF_UNIX;
-  memcpy (addr.sun_path, name, len + 1);
-  return OpenSocket (e, (sockaddr *)&addr, sizeof (addr));
+  return OpenSocket (e, (sockaddr *)&addr, len, options);
 }
 
 int OpenInet6 (char const **e, char const *name, int port)
+{
+  return OpenInet (e, name, port, SocketOptions::Legacy ());
+}
+
+int OpenInet (char const **e, char const *name, int port,
+	      SocketOptions const &options)
 {
   addrinfo *addrs = nullptr;
   int fd = -1;
@@ -78,13 +193,6 @@ int OpenInet6 (char const **e, char const *name, int port)
     {
       errstr = "missing server name";
       errno = EINVAL;
-      goto fail;
-    }
-
-  fd = socket (AF_INET6, SOCK_STREAM, 0);
-  if (fd < 0)
-    {
-      errstr = "socket";
 
     fail:;
       int err = errno;
@@ -100,7 +208,9 @@ int OpenInet6 (char const **e, char const *name, int port)
 
   addrinfo hints;
   hints.ai_flags = 0;
-  hints.ai_family = AF_INET6;
+  hints.ai_family = (options.family == SocketOptions::INET4 ? AF_INET
+		     : options.family == SocketOptions::INET6 ? AF_INET6
+		     : AF_UNSPEC);
   hints.ai_socktype = SOCK_STREAM;
   hints.ai_protocol = 0;
   hints.ai_addrlen = 0;
@@ -116,26 +226,42 @@ int OpenInet6 (char const **e, char const *name, int port)
       goto fail;
     }
 
-  sockaddr_in6 addr;
-  memset (&addr, 0, sizeof (addr));
-  addr.sin6_family = AF_INET6;
-
+  // Try each address in turn, with a socket of its family
+  errstr = "connecting";
   for (struct addrinfo *next = addrs; next; next = next->ai_next)
-    if (next->ai_family == AF_INET6
-	&& next->ai_socktype == SOCK_STREAM)
-      {
-	sockaddr_in6 *in6 = (sockaddr_in6 *)next->ai_addr;
-	in6->sin6_port = htons (port);
-	if (ntohs (in6->sin6_port) != port)
+    {
+      in_port_t *portp = nullptr;
+      if (next->ai_socktype != SOCK_STREAM)
+	continue;
+      else if (next->ai_family == AF_INET6)
+	portp = &((sockaddr_in6 *)next->ai_addr)->sin6_port;
+      else if (next->ai_family == AF_INET)
+	portp = &((sockaddr_in *)next->ai_addr)->sin_port;
+      else
+	continue;
+
+      *portp = htons (port);
+      if (ntohs (*portp) != port)
+	{
 	  errno = EINVAL;
-	else if (!connect (fd, next->ai_addr, next->ai_addrlen))
-	  goto done;
-      }
-  errstr = "connecting";
+	  continue;
+	}
+
+      if (fd >= 0)
+	close (fd);
+      fd = Detail::NewSocket (&errstr, next->ai_family, options, false);
+      if (fd < 0)
+	goto fail;
+      errstr = "connecting";
+      if (!connect (fd, next->ai_addr, next->ai_addrlen))
+	goto done;
+    }
   goto fail;
 
  done:;
   freeaddrinfo (addrs);
+  if (options.nonBlocking)
+    fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
 
   return fd;
 }
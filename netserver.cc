@@ -12,6 +12,7 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
 #include <sys/un.h>
 
 #ifndef AI_NUMERICSERV
@@ -24,14 +25,22 @@ namespace Cody {
 
 int ListenSocket (char const **e, sockaddr const *addr, socklen_t len,
 		  unsigned backlog)
+{
+  auto options = SocketOptions::Legacy ();
+  if (backlog)
+    options.backlog = backlog;
+
+  return ListenSocket (e, addr, len, options);
+}
+
+int ListenSocket (char const **e, sockaddr const *addr, socklen_t len,
+		  SocketOptions const &options)
 {
   char const *errstr = nullptr;
 
-  int fd = socket (addr->sa_family, SOCK_STREAM, 0);
+  int fd = Detail::NewSocket (&errstr, addr->sa_family, options, true);
   if (fd < 0)
     {
-      errstr = "creating socket";
-
     fail:;
       int err = errno;
       if (e)
@@ -48,7 +57,7 @@ int ListenSocket (char const **e, sockaddr const *addr, socklen_t len,
       goto fail;
     }
 
-  if (listen (fd, backlog ? backlog : 17) < 0)
+  if (listen (fd, options.backlog ? int (options.backlog) : SOMAXCONN) < 0)
     {
       errstr = "listening socket";
       goto fail;
@@ -59,33 +68,44 @@ int ListenSocket (char const **e, sockaddr const *addr, socklen_t len,
 
 int ListenLocal (char const **e, char const *name, unsigned backlog)
 {
-  sockaddr_un addr;
-  size_t len = strlen (name);
+  auto options = SocketOptions::Legacy ();
+  if (backlog)
+    options.backlog = backlog;
 
-  if (len >= sizeof (addr.sun_path))
-    {
-      errno = ENAMETOOLONG;
-      return -1;
-    }
+  return ListenLocal (e, name, options);
+}
 
-  memset (&addr, 0, offsetof (sockaddr_un, sun_path));
-  addr.sun_family = AF_UNIX;
-  memcpy (addr.sun_path, name, len + 1);
+int ListenLocal (char const **e, char const *name,
+		 SocketOptions const &options)
+{
+  sockaddr_storage addr;
+  socklen_t len = Detail::LocalAddress (addr, name, options.abstract);
+  if (!len)
+    return -1;
 
-  return ListenSocket (e, (sockaddr *)&addr, sizeof (addr), backlog);
+  return ListenSocket (e, (sockaddr *)&addr, len, options);
 }
 
 int ListenInet6 (char const **e, char const *name, int port, unsigned backlog)
+{
+  auto options = SocketOptions::Legacy ();
+  if (backlog)
+    options.backlog = backlog;
+
+  return ListenInet (e, name, port, options);
+}
+
+int ListenInet (char const **e, char const *name, int port,
+		SocketOptions const &options)
 {
   addrinfo *addrs = nullptr;
   int fd = -1;
   char const *errstr = nullptr;
 
-  fd = socket (AF_INET6, SOCK_STREAM, 0);
+  int family = options.family == SocketOptions::INET4 ? AF_INET : AF_INET6;
+  fd = Detail::NewSocket (&errstr, family, options, true);
   if (fd < 0)
     {
-      errstr = "creating socket";
-
     fail:;
       int err = errno;
       if (e)
@@ -100,7 +120,7 @@ int ListenInet6 (char const **e, char const *name, int port, unsigned backlog)
 
   addrinfo hints;
   hints.ai_flags = AI_NUMERICSERV;
-  hints.ai_family = AF_INET6;
+  hints.ai_family = family;
   hints.ai_socktype = SOCK_STREAM;
   hints.ai_protocol = 0;
   hints.ai_addrlen = 0;
@@ -118,17 +138,15 @@ int ListenInet6 (char const **e, char const *name, int port, unsigned backlog)
       goto fail;
     }
 
-  sockaddr_in6 addr;
-  memset (&addr, 0, sizeof (addr));
-  addr.sin6_family = AF_INET6;
-
   for (struct addrinfo *next = addrs; next; next = next->ai_next)
-    if (next->ai_family == AF_INET6
+    if (next->ai_family == family
 	&& next->ai_socktype == SOCK_STREAM)
       {
-	sockaddr_in6 *in6 = (sockaddr_in6 *)next->ai_addr;
-	in6->sin6_port = htons (port);
-	if (ntohs (in6->sin6_port) != port)
+	in_port_t *portp = family == AF_INET
+	  ? &((sockaddr_in *)next->ai_addr)->sin_port
+	  : &((sockaddr_in6 *)next->ai_addr)->sin6_port;
+	*portp = htons (port);
+	if (ntohs (*portp) != port)
 	  errno = EINVAL;
 	else if (!bind (fd, next->ai_addr, next->ai_addrlen))
 	  goto listen;
@@ -139,8 +157,9 @@ int ListenInet6 (char const **e, char const *name, int port, unsigned backlog)
 
  listen:;
   freeaddrinfo (addrs);
+  addrs = nullptr;
 
-  if (listen (fd, backlog ? backlog : 17) < 0)
+  if (listen (fd, options.backlog ? int (options.backlog) : SOMAXCONN) < 0)
     {
       errstr = "listening socket";
       goto fail;
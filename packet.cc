@@ -29,6 +29,7 @@ void Packet::Destroy ()
 void Packet::Create (Packet &&t)
 {
   cat = t.cat;
+  is_timeout = t.is_timeout;
   code = t.code;
   request = t.request;
   switch (cat)
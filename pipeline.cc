@@ -0,0 +1,370 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Cody
+#include "internal.hh"
+// C++
+#include <unordered_map>
+// C
+#include <cerrno>
+#include <cstring>
+// OS
+#include <fcntl.h>
+#include <unistd.h>
+
+// Resolver pipeline code
+
+namespace Cody {
+namespace Detail {
+
+// The request codes of the stage verbs, for the ResponseCache
+static unsigned const requestCodes[] =
+  {
+    RC_MODULE_REPO,
+    RC_MODULE_EXPORT,
+    RC_MODULE_IMPORT,
+    RC_MODULE_COMPILED,
+    RC_INCLUDE_TRANSLATE,
+  };
+
+class Map
+{
+public:
+  std::unordered_map<std::string, std::string> names;
+  std::string repo;
+};
+
+// Split LINE at white space into WORDS
+
+static void Split (std::string const &line, std::vector<std::string> &words)
+{
+  words.clear ();
+  for (size_t pos = 0;;)
+    {
+      pos = line.find_first_not_of (" \t\r", pos);
+      if (pos == line.npos)
+	break;
+      size_t end = line.find_first_of (" \t\r", pos);
+      words.emplace_back (line, pos, end - pos);
+      pos = end;
+    }
+}
+
+}
+
+ResolverStage::~ResolverStage ()
+{
+}
+
+void ResolverStage::Learn (Verb, Flags, std::string const &, Packet const &)
+{
+}
+
+void ResolverStage::WaitUntilReady (Server *)
+{
+}
+
+ResolverStage::Outcome CacheStage::Resolve (Server *, Verb verb, Flags flags,
+					    std::string &name, Packet &answer)
+{
+  switch (verb)
+    {
+    case MODULE_EXPORT:
+      break;
+
+    case MODULE_COMPILED:
+      cache.Invalidate (name);
+      break;
+
+    default:
+      if (cache.Lookup (Detail::requestCodes[verb], flags,
+			name.data (), name.size (), answer))
+	return ANSWERED;
+      break;
+    }
+
+  return PASSED;
+}
+
+void CacheStage::Learn (Verb verb, Flags flags, std::string const &name,
+			Packet const &answer)
+{
+  if (verb == MODULE_EXPORT || verb == MODULE_COMPILED)
+    return;
+
+  // Only definitive answers are remembered, an error may be
+  // transient
+  unsigned code = answer.GetCode ();
+  if (code == Client::PC_PATHNAME || code == Client::PC_BOOL)
+    cache.Insert (Detail::requestCodes[verb], flags, name, answer);
+}
+
+MapStage::MapStage ()
+  : impl (new Detail::Map)
+{
+}
+
+MapStage::~MapStage ()
+{
+}
+
+void MapStage::Add (std::string const &name, std::string const &cmi)
+{
+  impl->names[name] = cmi;
+}
+
+void MapStage::SetRepo (std::string const &repo)
+{
+  impl->repo = repo;
+}
+
+size_t MapStage::GetSize () const
+{
+  return impl->names.size ();
+}
+
+int MapStage::Load (char const *path)
+{
+  int fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return errno;
+
+  std::string text;
+  char block[4096];
+  for (;;)
+    {
+      ssize_t count = read (fd, block, sizeof (block));
+      if (count < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  int err = errno;
+	  close (fd);
+	  return err;
+	}
+      if (!count)
+	break;
+      text.append (block, size_t (count));
+    }
+  close (fd);
+
+  // Check every line before adding any
+  std::vector<std::pair<std::string, std::string>> entries;
+  std::vector<std::string> words;
+  for (size_t pos = 0; pos < text.size ();)
+    {
+      size_t end = text.find ('\n', pos);
+      if (end == text.npos)
+	end = text.size ();
+      Detail::Split (text.substr (pos, end - pos), words);
+      pos = end + 1;
+
+      if (words.empty () || words[0][0] == '#')
+	continue;
+      if (words.size () != 2)
+	return EINVAL;
+      entries.emplace_back (std::move (words[0]), std::move (words[1]));
+    }
+
+  for (auto &entry : entries)
+    if (entry.first == "$root")
+      impl->repo = std::move (entry.second);
+    else
+      impl->names[entry.first] = std::move (entry.second);
+
+  return 0;
+}
+
+ResolverStage::Outcome MapStage::Resolve (Server *, Verb verb, Flags,
+					  std::string &name, Packet &answer)
+{
+  switch (verb)
+    {
+    case MODULE_REPO:
+      if (impl->repo.empty ())
+	break;
+      answer = Packet (Client::PC_PATHNAME, impl->repo);
+      return ANSWERED;
+
+    case MODULE_EXPORT:
+    case MODULE_IMPORT:
+    case INCLUDE_TRANSLATE:
+      {
+	auto iter = impl->names.find (name);
+	if (iter == impl->names.end ())
+	  break;
+	answer = Packet (Client::PC_PATHNAME, iter->second);
+	return ANSWERED;
+      }
+
+    case MODULE_COMPILED:
+      break;
+    }
+
+  return PASSED;
+}
+
+ResolverStage::Outcome RepoStage::Resolve (Server *, Verb verb, Flags,
+					   std::string &name, Packet &answer)
+{
+  switch (verb)
+    {
+    case MODULE_REPO:
+      answer = Packet (Client::PC_PATHNAME, repo);
+      return ANSWERED;
+
+    case MODULE_EXPORT:
+      // Where it will be written
+      answer = Packet (Client::PC_PATHNAME,
+		       Detail::CMIName (name, suffix.c_str ()));
+      return ANSWERED;
+
+    case MODULE_IMPORT:
+    case INCLUDE_TRANSLATE:
+      {
+	auto cmi = Detail::CMIName (name, suffix.c_str ());
+	if (!Detail::IsCMI (repo.c_str (), cmi))
+	  break;
+	answer = Packet (Client::PC_PATHNAME, std::move (cmi));
+	return ANSWERED;
+      }
+
+    case MODULE_COMPILED:
+      break;
+    }
+
+  return PASSED;
+}
+
+ResolverStage::Outcome ForwardStage::Resolve (Server *s, Verb verb,
+					      Flags flags, std::string &name,
+					      Packet &)
+{
+  int err = 0;
+  switch (verb)
+    {
+    case MODULE_REPO:
+      err = resolver->ModuleRepoRequest (s);
+      break;
+
+    case MODULE_EXPORT:
+      err = resolver->ModuleExportRequest (s, flags, name);
+      break;
+
+    case MODULE_IMPORT:
+      err = resolver->ModuleImportRequest (s, flags, name);
+      break;
+
+    case MODULE_COMPILED:
+      err = resolver->ModuleCompiledRequest (s, flags, name);
+      break;
+
+    case INCLUDE_TRANSLATE:
+      err = resolver->IncludeTranslateRequest (s, flags, name);
+      break;
+    }
+
+  // The resolver did not respond
+  if (err)
+    s->ErrorResponse (err < 0 ? u8"error processing" : strerror (err));
+
+  return RESPONDED;
+}
+
+void ForwardStage::WaitUntilReady (Server *s)
+{
+  resolver->WaitUntilReady (s);
+}
+
+ResolverPipeline::~ResolverPipeline ()
+{
+}
+
+void ResolverPipeline::WaitUntilReady (Server *s)
+{
+  for (auto *stage : stages)
+    stage->WaitUntilReady (s);
+  Resolver::WaitUntilReady (s);
+}
+
+// Ask each stage in turn.  The stages before the one that answers
+// may learn its answer.
+
+int ResolverPipeline::Resolve (Server *s, ResolverStage::Verb verb,
+			       Flags flags, std::string &name)
+{
+  Packet answer (Client::PC_ERROR);
+  for (size_t ix = 0; ix != stages.size (); ix++)
+    {
+      ResolverStage *stage = stages[ix];
+      auto outcome = stage->Resolve (s, verb, flags, name, answer);
+      if (outcome == ResolverStage::PASSED)
+	{
+	  stage->misses++;
+	  continue;
+	}
+
+      stage->hits++;
+      if (outcome == ResolverStage::ANSWERED)
+	{
+	  for (size_t jx = 0; jx != ix; jx++)
+	    stages[jx]->Learn (verb, flags, name, answer);
+	  Detail::Respond (s, answer);
+	}
+      return 0;
+    }
+
+  // Nobody knew
+  switch (verb)
+    {
+    case ResolverStage::MODULE_REPO:
+      return Resolver::ModuleRepoRequest (s);
+
+    case ResolverStage::MODULE_EXPORT:
+      return Resolver::ModuleExportRequest (s, flags, name);
+
+    case ResolverStage::MODULE_IMPORT:
+      return Resolver::ModuleImportRequest (s, flags, name);
+
+    case ResolverStage::MODULE_COMPILED:
+      return Resolver::ModuleCompiledRequest (s, flags, name);
+
+    case ResolverStage::INCLUDE_TRANSLATE:
+      return Resolver::IncludeTranslateRequest (s, flags, name);
+    }
+
+  return -1;
+}
+
+int ResolverPipeline::ModuleRepoRequest (Server *s)
+{
+  std::string empty;
+  return Resolve (s, ResolverStage::MODULE_REPO, Flags::None, empty);
+}
+
+int ResolverPipeline::ModuleExportRequest (Server *s, Flags flags,
+					   std::string &module)
+{
+  return Resolve (s, ResolverStage::MODULE_EXPORT, flags, module);
+}
+
+int ResolverPipeline::ModuleImportRequest (Server *s, Flags flags,
+					   std::string &module)
+{
+  return Resolve (s, ResolverStage::MODULE_IMPORT, flags, module);
+}
+
+int ResolverPipeline::ModuleCompiledRequest (Server *s, Flags flags,
+					     std::string &module)
+{
+  return Resolve (s, ResolverStage::MODULE_COMPILED, flags, module);
+}
+
+int ResolverPipeline::IncludeTranslateRequest (Server *s, Flags flags,
+					       std::string &include)
+{
+  return Resolve (s, ResolverStage::INCLUDE_TRANSLATE, flags, include);
+}
+
+}
@@ -0,0 +1,422 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Cody
+#include "internal.hh"
+// C++
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+// C
+#include <cerrno>
+// OS
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+// Caching proxy code
+
+// Each forwarded request is a Query, with the Servers waiting on it.
+// Identical cacheable queries are merged while one is outstanding.
+// Queries are queued for the upstream threads, which take the whole
+// queue as a block when they become idle, and hand the answered
+// block back as SubProcessPool does -- a notify pipe and Collect.
+// Only the server thread touches a query's waiters, and only the
+// upstream thread its response, until it is handed back.
+
+namespace Cody {
+namespace Detail {
+
+struct Query
+{
+  Packet response {Client::PC_ERROR};
+  std::string name;
+  std::vector<std::pair<Server *, unsigned>> waiters;  ///< Server, token
+  unsigned code;
+  Flags flags;
+  bool cacheable;
+};
+
+class Proxy
+{
+public:
+  ResponseCache cache;
+  std::vector<std::unique_ptr<Client>> upstreams;
+  std::vector<std::thread> threads;
+  int notify[2];
+
+  // Protected by lock
+  std::mutex lock;
+  std::condition_variable queuing;
+  std::condition_variable answering;
+  std::vector<Query *> queued;
+  std::vector<Query *> done;
+  bool stopping = false;
+
+  // Only touched by the server thread
+  std::unordered_map<std::string, Query *> merging;  ///< By key
+  std::vector<Query *> issued;	///< Not yet collected
+
+  std::atomic<uint64_t> hits {0};
+  std::atomic<uint64_t> misses {0};
+  std::atomic<uint64_t> forwarded {0};
+  std::atomic<uint64_t> batches {0};
+
+public:
+  Proxy ();
+  ~Proxy ();
+
+public:
+  void Run (Client *);
+
+private:
+  void Send (Client *, std::vector<Query *> &);
+};
+
+Proxy::Proxy ()
+{
+  if (pipe (notify) < 0)
+    notify[0] = notify[1] = -1;
+  else
+    for (unsigned ix = 2; ix--;)
+      {
+	fcntl (notify[ix], F_SETFL, fcntl (notify[ix], F_GETFL) | O_NONBLOCK);
+	fcntl (notify[ix], F_SETFD, FD_CLOEXEC);
+      }
+}
+
+Proxy::~Proxy ()
+{
+  {
+    std::lock_guard<std::mutex> guard (lock);
+    stopping = true;
+  }
+  queuing.notify_all ();
+
+  // Wake a thread blocked on an unresponsive upstream.  Pipes cannot
+  // be shut down, but their round trips may be limited.
+  for (auto &upstream : upstreams)
+    {
+      shutdown (upstream->GetFDRead (), SHUT_RDWR);
+      if (upstream->GetFDWrite () != upstream->GetFDRead ())
+	shutdown (upstream->GetFDWrite (), SHUT_RDWR);
+    }
+  for (auto &thread : threads)
+    thread.join ();
+
+  for (auto &upstream : upstreams)
+    {
+      close (upstream->GetFDRead ());
+      if (upstream->GetFDWrite () != upstream->GetFDRead ())
+	close (upstream->GetFDWrite ());
+    }
+  // Queued and answered queries are issued too
+  for (auto *query : issued)
+    delete query;
+  if (notify[0] >= 0)
+    {
+      close (notify[0]);
+      close (notify[1]);
+    }
+}
+
+// An upstream thread.  Take the queue as a block, whenever there is
+// one.
+
+void Proxy::Run (Client *upstream)
+{
+  std::vector<Query *> block;
+  for (;;)
+    {
+      {
+	std::unique_lock<std::mutex> guard (lock);
+	queuing.wait (guard, [this] { return stopping || !queued.empty (); });
+	if (stopping)
+	  break;
+	block.swap (queued);
+      }
+
+      Send (upstream, block);
+
+      {
+	std::lock_guard<std::mutex> guard (lock);
+	done.insert (done.end (), block.begin (), block.end ());
+      }
+      block.clear ();
+      answering.notify_all ();
+      (void)!write (notify[1], "", 1);
+    }
+}
+
+void Proxy::Send (Client *upstream, std::vector<Query *> &block)
+{
+  batches++;
+  forwarded += block.size ();
+
+  upstream->Cork ();
+  for (auto *query : block)
+    switch (query->code)
+      {
+      case RC_MODULE_REPO:
+	upstream->ModuleRepo ();
+	break;
+
+      case RC_MODULE_EXPORT:
+	upstream->ModuleExport (query->name, query->flags);
+	break;
+
+      case RC_MODULE_IMPORT:
+	upstream->ModuleImport (query->name, query->flags);
+	break;
+
+      case RC_MODULE_COMPILED:
+	upstream->ModuleCompiled (query->name, query->flags);
+	break;
+
+      case RC_INCLUDE_TRANSLATE:
+	upstream->IncludeTranslate (query->name, query->flags);
+	break;
+      }
+  auto responses = upstream->Uncork ();
+
+  if (responses.size () != block.size ())
+    {
+      // A communication error, which every query gets
+      Packet &error = responses[0];
+      for (auto *query : block)
+	query->response = Packet (error.GetCode (), error.GetString ());
+      return;
+    }
+
+  for (unsigned ix = 0; ix != block.size (); ix++)
+    block[ix]->response = std::move (responses[ix]);
+}
+
+}
+
+ProxyResolver::ProxyResolver ()
+  : impl (new Detail::Proxy)
+{
+}
+
+ProxyResolver::~ProxyResolver ()
+{
+}
+
+int ProxyResolver::AddUpstream (int from, int to, int timeout)
+{
+  std::unique_ptr<Client> upstream (new Client (from, to));
+  upstream->SetTimeout (timeout);
+  std::string ident (u8"proxy-");
+  ident.append (std::to_string (impl->upstreams.size ()));
+  auto packet = upstream->Connect (u8"cody-proxy", ident.c_str ());
+  if (packet.GetCode () != Client::PC_CONNECT)
+    return -1;
+
+  Client *client = upstream.get ();
+  Detail::Proxy *proxy = impl.get ();
+  impl->upstreams.push_back (std::move (upstream));
+  impl->threads.emplace_back ([proxy, client] () { proxy->Run (client); });
+
+  return 0;
+}
+
+ResponseCache &ProxyResolver::GetCache ()
+{
+  return impl->cache;
+}
+
+int ProxyResolver::GetNotifyFD () const
+{
+  return impl->notify[0];
+}
+
+uint64_t ProxyResolver::GetHits () const
+{
+  return impl->hits;
+}
+
+uint64_t ProxyResolver::GetMisses () const
+{
+  return impl->misses;
+}
+
+uint64_t ProxyResolver::GetForwarded () const
+{
+  return impl->forwarded;
+}
+
+uint64_t ProxyResolver::GetBatches () const
+{
+  return impl->batches;
+}
+
+// Answer from the cache, or defer and queue a query, merging it with
+// an outstanding identical one.
+
+int ProxyResolver::Forward (Server *s, unsigned code, Flags flags,
+			    std::string &name)
+{
+  bool cacheable = code != Detail::RC_MODULE_EXPORT
+    && code != Detail::RC_MODULE_COMPILED;
+  if (cacheable)
+    {
+      Packet packet (Client::PC_ERROR);
+      if (impl->cache.Lookup (code, flags, name.data (), name.size (),
+			      packet))
+	{
+	  impl->hits++;
+	  Detail::Respond (s, packet);
+	  return 0;
+	}
+    }
+  if (impl->upstreams.empty ())
+    {
+      s->ErrorResponse (u8"no upstream mapper");
+      return 0;
+    }
+
+  impl->misses++;
+  unsigned token = s->DeferResponse ();
+
+  std::string key;
+  if (cacheable)
+    {
+      key.push_back (char (code));
+      key.push_back (char (flags));
+      key.append (name);
+      auto iter = impl->merging.find (key);
+      if (iter != impl->merging.end ())
+	{
+	  iter->second->waiters.emplace_back (s, token);
+	  return 0;
+	}
+    }
+
+  auto *query = new Detail::Query;
+  query->name = name;
+  query->waiters.emplace_back (s, token);
+  query->code = code;
+  query->flags = flags;
+  query->cacheable = cacheable;
+  impl->issued.push_back (query);
+  if (cacheable)
+    impl->merging.emplace (std::move (key), query);
+
+  {
+    std::lock_guard<std::mutex> guard (impl->lock);
+    impl->queued.push_back (query);
+  }
+  impl->queuing.notify_one ();
+
+  return 0;
+}
+
+unsigned ProxyResolver::Collect ()
+{
+  std::vector<Detail::Query *> done;
+  {
+    std::lock_guard<std::mutex> guard (impl->lock);
+    done.swap (impl->done);
+  }
+
+  char drain[64];
+  while (read (impl->notify[0], drain, sizeof (drain)) > 0)
+    continue;
+
+  unsigned count = 0;
+  for (auto *query : done)
+    {
+      auto &issued = impl->issued;
+      issued.erase (std::find (issued.begin (), issued.end (), query));
+      if (query->cacheable)
+	{
+	  std::string key;
+	  key.push_back (char (query->code));
+	  key.push_back (char (query->flags));
+	  key.append (query->name);
+	  impl->merging.erase (key);
+
+	  // Only definitive answers are remembered, an error may be
+	  // transient
+	  unsigned code = query->response.GetCode ();
+	  if (code == Client::PC_PATHNAME || code == Client::PC_BOOL)
+	    impl->cache.Insert (query->code, query->flags, query->name,
+				query->response);
+	}
+      else if (query->code == Detail::RC_MODULE_COMPILED)
+	// In case a block sent meanwhile remembered the old response
+	impl->cache.Invalidate (query->name);
+
+      for (auto &waiter : query->waiters)
+	{
+	  waiter.first->BeginDeferred (waiter.second);
+	  Detail::Respond (waiter.first, query->response);
+	  waiter.first->EndDeferred ();
+	  count++;
+	}
+      delete query;
+    }
+
+  return count;
+}
+
+void ProxyResolver::Cancel (Server *s)
+{
+  for (auto *query : impl->issued)
+    {
+      auto &waiters = query->waiters;
+      waiters.erase (std::remove_if (waiters.begin (), waiters.end (),
+				     [s] (std::pair<Server *, unsigned> &w)
+				     {
+				       return w.first == s;
+				     }),
+		     waiters.end ());
+    }
+}
+
+void ProxyResolver::WaitUntilReady (Server *s)
+{
+  while (Collect (), !s->IsReady ())
+    {
+      std::unique_lock<std::mutex> guard (impl->lock);
+      impl->answering.wait (guard, [this] { return !impl->done.empty (); });
+    }
+}
+
+int ProxyResolver::ModuleRepoRequest (Server *s)
+{
+  std::string none;
+  return Forward (s, Detail::RC_MODULE_REPO, Flags::None, none);
+}
+
+int ProxyResolver::ModuleExportRequest (Server *s, Flags flags,
+					std::string &module)
+{
+  return Forward (s, Detail::RC_MODULE_EXPORT, flags, module);
+}
+
+int ProxyResolver::ModuleImportRequest (Server *s, Flags flags,
+					std::string &module)
+{
+  return Forward (s, Detail::RC_MODULE_IMPORT, flags, module);
+}
+
+int ProxyResolver::ModuleCompiledRequest (Server *s, Flags flags,
+					  std::string &module)
+{
+  impl->cache.Invalidate (module);
+  return Forward (s, Detail::RC_MODULE_COMPILED, flags, module);
+}
+
+int ProxyResolver::IncludeTranslateRequest (Server *s, Flags flags,
+					    std::string &include)
+{
+  return Forward (s, Detail::RC_INCLUDE_TRANSLATE, flags, include);
+}
+
+}
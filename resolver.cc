@@ -63,7 +63,17 @@ char const *Resolver::GetCMISuffix ()
   return "cmi";
 }
 
-std::string Resolver::GetCMIName (std::string const &module)
+char const *Resolver::GetCMIRepo ()
+{
+  return REPO_DIR;
+}
+
+namespace Detail {
+
+// The default mapping from a module or header-unit name to a CMI
+// name
+
+std::string CMIName (std::string const &module, char const *suffix)
 {
   std::string result;
 
@@ -115,7 +125,7 @@ std::string Resolver::GetCMIName (std::string const &module)
 	result[colon] = COLON_REPLACE;
     }
 
-  if (char const *suffix = GetCMISuffix ())
+  if (suffix)
     {
       result.push_back ('.');
       result.append (suffix);
@@ -124,8 +134,51 @@ std::string Resolver::GetCMIName (std::string const &module)
   return result;
 }
 
-void Resolver::WaitUntilReady (Server *)
+// Whether the CMI file exists in the REPO directory, the current
+// directory if empty
+
+bool IsCMI (char const *repo, std::string const &cmi)
 {
+  bool found = false;
+
+  // This is not the most efficient
+  struct stat statbuf;
+
+#if HAVE_FSTATAT
+  int fd_dir = open (*repo ? repo : ".",
+		     O_RDONLY | O_CLOEXEC | O_DIRECTORY);
+  if (fd_dir >= 0
+      && fstatat (fd_dir, cmi.c_str (), &statbuf, 0) == 0
+      && S_ISREG (statbuf.st_mode))
+    // Sadly can't easily check if this process has read access,
+    // except by trying to open it.
+    found = true;
+  if (fd_dir >= 0)
+    close (fd_dir);
+#else
+  std::string append = repo;
+  if (!append.empty ())
+    append.push_back (DIR_SEPARATOR);
+  append.append (cmi);
+  if (stat (append.c_str (), &statbuf) == 0
+      || S_ISREG (statbuf.st_mode))
+    found = true;
+#endif
+
+  return found;
+}
+
+}
+
+std::string Resolver::GetCMIName (std::string const &module)
+{
+  return Detail::CMIName (module, GetCMISuffix ());
+}
+
+void Resolver::WaitUntilReady (Server *s)
+{
+  if (pool)
+    pool->WaitUntilReady (s);
 }
 
 Resolver *Resolver::ConnectRequest (Server *s, unsigned version,
@@ -141,7 +194,7 @@ Resolver *Resolver::ConnectRequest (Server *s, unsigned version,
 
 int Resolver::ModuleRepoRequest (Server *s)
 {
-  s->PathnameResponse (REPO_DIR);
+  s->PathnameResponse (GetCMIRepo ());
   return 0;
 }
 
@@ -168,30 +221,8 @@ int Resolver::ModuleCompiledRequest (Server *s, Flags, std::string &)
 
 int Resolver::IncludeTranslateRequest (Server *s, Flags, std::string &include)
 {
-  bool xlate = false;
-
-  // This is not the most efficient
   auto cmi = GetCMIName (include);
-  struct stat statbuf;
-
-#if HAVE_FSTATAT
-  int fd_dir = open (REPO_DIR, O_RDONLY | O_CLOEXEC | O_DIRECTORY);
-  if (fd_dir >= 0
-      && fstatat (fd_dir, cmi.c_str (), &statbuf, 0) == 0
-      && S_ISREG (statbuf.st_mode))
-    // Sadly can't easily check if this process has read access,
-    // except by trying to open it.
-    xlate = true;
-  if (fd_dir >= 0)
-    close (fd_dir);
-#else
-  std::string append = REPO_DIR;
-  append.push_back (DIR_SEPARATOR);
-  append.append (cmi);
-  if (stat (append.c_str (), &statbuf) == 0
-      || S_ISREG (statbuf.st_mode))
-    xlate = true;
-#endif
+  bool xlate = Detail::IsCMI (GetCMIRepo (), cmi);
 
   if (xlate)
     s->PathnameResponse (cmi);
@@ -201,15 +232,33 @@ int Resolver::IncludeTranslateRequest (Server *s, Flags, std::string &include)
   return 0;
 }
 
-int Resolver::InvokeSubProcessRequest (Server *s, std::vector<std::string> &)
+int Resolver::InvokeSubProcessRequest (Server *s,
+				       std::vector<std::string> &args)
 {
+  if (pool)
+    return pool->Invoke (s, args);
+
   s->ErrorResponse ("unimplemented");
   return 0;
 }
 
+int Resolver::StatsRequest (Server *s)
+{
+  // Too big for the stack
+  std::unique_ptr<Metrics> m (new Metrics ());
+  Metrics::Snapshot (*m);
+  s->StatsResponse (*m);
+  return 0;
+}
+
 void Resolver::ErrorResponse (Server *server, std::string &&msg)
 {
   server->ErrorResponse (msg);
 }
 
+IncludeFilter const *Resolver::GetIncludeFilter ()
+{
+  return nullptr;
+}
+
 }
@@ -0,0 +1,470 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Cody
+#include "internal.hh"
+// C++
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+// C
+#include <cerrno>
+#include <cstring>
+// OS
+#include <fcntl.h>
+#include <unistd.h>
+
+// Module build scheduling
+
+// Pending builds are in a single queue, shared by the workers.  The
+// build with the most waiting Servers, and then the greatest import
+// depth, is picked.  Those rankings change as more compilers block,
+// so they are evaluated when a build is picked, rather than when
+// queued.  There are few enough pending builds that a scan is
+// cheaper than the builds it schedules.
+
+// A worker whose build is blocked on an import is not doing useful
+// work.  We allow an additional worker to run for each such blocked
+// build, otherwise deep import chains would deadlock the pool.
+
+namespace Cody {
+namespace Detail {
+
+// A queued, running or completed build
+struct Job
+{
+  std::string module;
+  std::string cmi;
+  /// Waiting servers & their deferred response tokens.  Only touched
+  /// by the server thread.
+  std::vector<std::pair<Server *, unsigned>> waiters;
+  unsigned waiting = 0;	///< Waiter count, read by workers under lock
+  unsigned depth = 0;	///< Import depth, read by workers under lock
+  int result = 0;	///< Build result, set by worker
+
+  Job (std::string const &m, std::string &&c)
+    : module (m), cmi (std::move (c))
+  {
+  }
+};
+
+class Scheduler
+{
+public:
+  BuildScheduler *owner;
+  unsigned workers;	///< Concurrent build limit
+
+  std::vector<std::thread> threads;
+
+  // Protected by lock
+  std::mutex lock;
+  std::condition_variable work;	 ///< Something for a worker to do
+  std::condition_variable completed;  ///< A job has completed
+  std::vector<Job *> queue;	///< Pending jobs, oldest first
+  std::vector<Job *> done;	///< Completed, uncollected, jobs
+  unsigned running = 0;		///< Number of running jobs
+  unsigned blocked = 0;		///< Number of jobs blocked on an import
+  bool stopping = false;
+
+  // Only touched by the server thread
+  std::map<std::string, Job *> jobs;  ///< Incomplete & uncollected jobs
+  std::map<Server *, std::string> building;  ///< What a server builds
+  std::set<Server *> stalled;  ///< Servers building a job we're running
+  std::map<Server *, std::string> idents;  ///< Connection idents
+  std::set<Server *> importing;  ///< Servers that have imported
+  DepGraph *graph = nullptr;
+
+  int notify[2];
+
+public:
+  Scheduler (BuildScheduler *o, unsigned w);
+  ~Scheduler ();
+
+public:
+  void Push (Job *);
+  void Spawn ();
+  void Stop ();
+
+private:
+  Job *Take ();
+  void Work ();
+};
+
+// The build ranking.  True if A should be built before B.
+static bool Before (Job const *a, Job const *b)
+{
+  if (a->waiting != b->waiting)
+    return a->waiting > b->waiting;
+  return a->depth > b->depth;
+}
+
+Scheduler::Scheduler (BuildScheduler *o, unsigned w)
+  : owner (o), workers (w)
+{
+  if (pipe (notify) < 0)
+    notify[0] = notify[1] = -1;
+  else
+    for (unsigned ix = 2; ix--;)
+      {
+	fcntl (notify[ix], F_SETFL, fcntl (notify[ix], F_GETFL) | O_NONBLOCK);
+	fcntl (notify[ix], F_SETFD, FD_CLOEXEC);
+      }
+}
+
+Scheduler::~Scheduler ()
+{
+  Stop ();
+
+  for (auto &pair : jobs)
+    delete pair.second;
+
+  if (notify[0] >= 0)
+    {
+      close (notify[0]);
+      close (notify[1]);
+    }
+}
+
+void Scheduler::Stop ()
+{
+  {
+    std::lock_guard<std::mutex> guard (lock);
+    stopping = true;
+  }
+  work.notify_all ();
+  for (auto &thread : threads)
+    thread.join ();
+  threads.clear ();
+}
+
+// Start another worker, if the running limit (workers plus blocked)
+// exceeds the number of threads.  Called with LOCK held.
+
+void Scheduler::Spawn ()
+{
+  if (!stopping && threads.size () < workers + blocked)
+    threads.emplace_back (&Scheduler::Work, this);
+}
+
+void Scheduler::Push (Job *job)
+{
+  std::lock_guard<std::mutex> guard (lock);
+  queue.push_back (job);
+  Spawn ();
+  work.notify_one ();
+}
+
+// Pick the most urgent job.  Called with LOCK held, so the rankings
+// are stable.
+
+Job *Scheduler::Take ()
+{
+  if (queue.empty ())
+    return nullptr;
+
+  auto best = queue.begin ();
+  for (auto iter = best; ++iter != queue.end ();)
+    if (Before (*iter, *best))
+      best = iter;
+
+  Job *job = *best;
+  queue.erase (best);
+
+  return job;
+}
+
+void Scheduler::Work ()
+{
+  std::unique_lock<std::mutex> guard (lock);
+
+  for (;;)
+    {
+      work.wait (guard, [this]
+			{
+			  return stopping
+			    || (!queue.empty () && running < workers + blocked);
+			});
+      if (stopping)
+	break;
+
+      Job *job = Take ();
+      if (!job)
+	continue;
+
+      running++;
+      guard.unlock ();
+      job->result = owner->Build (job->module, job->cmi);
+      guard.lock ();
+      running--;
+      done.push_back (job);
+
+      completed.notify_all ();
+      work.notify_one ();
+      if (notify[1] >= 0)
+	// Don't care if the pipe is full, it's readable anyway.
+	(void)!write (notify[1], "", 1);
+    }
+}
+
+}
+
+BuildScheduler::BuildScheduler (unsigned workers)
+{
+  if (!workers)
+    workers = std::thread::hardware_concurrency ();
+  impl.reset (new Detail::Scheduler (this, workers ? workers : 1));
+}
+
+BuildScheduler::~BuildScheduler ()
+{
+  impl.reset ();
+}
+
+void BuildScheduler::Shutdown ()
+{
+  impl->Stop ();
+}
+
+bool BuildScheduler::IsBuilt (std::string const &, std::string const &cmi)
+{
+  return Detail::IsCMI (GetCMIRepo (), cmi);
+}
+
+int BuildScheduler::GetNotifyFD () const
+{
+  return impl->notify[0];
+}
+
+unsigned BuildScheduler::Collect ()
+{
+  std::vector<Detail::Job *> done;
+  {
+    std::lock_guard<std::mutex> guard (impl->lock);
+    done.swap (impl->done);
+  }
+
+  if (impl->notify[0] >= 0)
+    {
+      char drain[64];
+      while (read (impl->notify[0], drain, sizeof (drain)) > 0)
+	continue;
+    }
+
+  unsigned count = 0;
+  for (auto *job : done)
+    {
+      impl->jobs.erase (job->module);
+      for (auto &waiter : job->waiters)
+	{
+	  Server *s = waiter.first;
+
+	  s->BeginDeferred (waiter.second);
+	  if (!job->result)
+	    s->PathnameResponse (job->cmi);
+	  else
+	    {
+	      std::string msg (u8"failed building '");
+	      msg.append (job->module);
+	      msg.append (u8"'");
+	      if (job->result > 0)
+		{
+		  msg.append (u8" ");
+		  msg.append (strerror (job->result));
+		}
+	      ErrorResponse (s, std::move (msg));
+	    }
+	  s->EndDeferred ();
+	  count++;
+
+	  if (s->IsReady () && impl->stalled.erase (s))
+	    {
+	      std::lock_guard<std::mutex> guard (impl->lock);
+	      impl->blocked--;
+	    }
+	}
+      delete job;
+    }
+
+  return count;
+}
+
+void BuildScheduler::SetDepGraph (DepGraph *graph)
+{
+  impl->graph = graph;
+}
+
+void BuildScheduler::Prefetch (std::vector<std::pair<std::string, unsigned>>
+			       const &modules)
+{
+  for (auto &pair : modules)
+    {
+      if (impl->jobs.count (pair.first))
+	continue;
+
+      auto cmi = GetCMIName (pair.first);
+      if (IsBuilt (pair.first, cmi))
+	continue;
+
+      auto *job = new Detail::Job (pair.first, std::move (cmi));
+      job->depth = pair.second;
+      impl->jobs[pair.first] = job;
+      impl->Push (job);
+    }
+}
+
+void BuildScheduler::Cancel (Server *s)
+{
+  for (auto &pair : impl->jobs)
+    {
+      auto *job = pair.second;
+      auto &waiters = job->waiters;
+      size_t size = waiters.size ();
+
+      for (auto iter = waiters.begin (); iter != waiters.end ();)
+	if (iter->first == s)
+	  iter = waiters.erase (iter);
+	else
+	  ++iter;
+      if (size != waiters.size ())
+	{
+	  std::lock_guard<std::mutex> guard (impl->lock);
+	  job->waiting -= unsigned (size - waiters.size ());
+	}
+    }
+
+  impl->building.erase (s);
+  impl->idents.erase (s);
+  impl->importing.erase (s);
+  if (impl->stalled.erase (s))
+    {
+      std::lock_guard<std::mutex> guard (impl->lock);
+      impl->blocked--;
+    }
+}
+
+void BuildScheduler::WaitUntilReady (Server *s)
+{
+  Resolver::WaitUntilReady (s);
+  while (Collect (), !s->IsReady ())
+    {
+      std::unique_lock<std::mutex> guard (impl->lock);
+      impl->completed.wait (guard, [this] { return !impl->done.empty (); });
+    }
+}
+
+Resolver *BuildScheduler::ConnectRequest (Server *s, unsigned version,
+					  std::string &agent,
+					  std::string &ident)
+{
+  auto *r = Resolver::ConnectRequest (s, version, agent, ident);
+
+  if (!ident.empty ())
+    {
+      impl->idents[s] = ident;
+      if (impl->graph)
+	{
+	  std::vector<std::pair<std::string, unsigned>> modules;
+	  impl->graph->Predict (ident, modules);
+	  Prefetch (modules);
+	}
+    }
+
+  return r;
+}
+
+int BuildScheduler::ModuleExportRequest (Server *s, Flags flags,
+					 std::string &module)
+{
+  impl->building[s] = module;
+  if (impl->graph)
+    {
+      auto ident = impl->idents.find (s);
+      if (ident != impl->idents.end ())
+	impl->graph->Record (ident->second, DepGraph::EXPORT, module);
+    }
+
+  return Resolver::ModuleExportRequest (s, flags, module);
+}
+
+int BuildScheduler::IncludeTranslateRequest (Server *s, Flags flags,
+					     std::string &include)
+{
+  if (impl->graph)
+    {
+      auto ident = impl->idents.find (s);
+      if (ident != impl->idents.end ())
+	impl->graph->Record (ident->second, DepGraph::INCLUDE, include);
+    }
+
+  return Resolver::IncludeTranslateRequest (s, flags, include);
+}
+
+int BuildScheduler::ModuleImportRequest (Server *s, Flags flags,
+					 std::string &module)
+{
+  if (impl->graph)
+    {
+      auto ident = impl->idents.find (s);
+      if (ident != impl->idents.end ())
+	impl->graph->Record (ident->second, DepGraph::IMPORT, module);
+      if (impl->importing.insert (s).second)
+	{
+	  // The first import, start on what it will need
+	  std::vector<std::pair<std::string, unsigned>> modules;
+	  impl->graph->PredictFrom (module, modules);
+	  Prefetch (modules);
+	}
+    }
+
+  auto cmi = GetCMIName (module);
+  if ((flags & Flags::NameOnly) != Flags::None || IsBuilt (module, cmi))
+    {
+      s->PathnameResponse (cmi);
+      return 0;
+    }
+
+  // An import from a compiler building a module we're building is
+  // one level deeper than that module.
+  unsigned depth = 0;
+  bool ours = false;
+  auto building = impl->building.find (s);
+  if (building != impl->building.end ())
+    {
+      auto outer = impl->jobs.find (building->second);
+      ours = outer != impl->jobs.end ();
+      depth = ours ? outer->second->depth + 1 : 1;
+    }
+
+  auto *&job = impl->jobs[module];
+  bool fresh = !job;
+  if (fresh)
+    job = new Detail::Job (module, std::move (cmi));
+
+  bool stalls = ours && s->IsReady ();
+  job->waiters.emplace_back (s, s->DeferResponse ());
+  if (stalls)
+    impl->stalled.insert (s);
+
+  {
+    std::lock_guard<std::mutex> guard (impl->lock);
+    job->waiting++;
+    if (depth > job->depth)
+      job->depth = depth;
+    if (stalls)
+      {
+	impl->blocked++;
+	impl->Spawn ();
+	impl->work.notify_one ();
+      }
+  }
+
+  if (fresh)
+    impl->Push (job);
+
+  return 0;
+}
+
+}
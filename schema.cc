@@ -0,0 +1,100 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Cody
+#include "internal.hh"
+// C
+#include <cstdlib>
+
+// Message schema code
+
+// Each request's verb, arguments and response, shared by the
+// Client's encoders and decoders and the Server's parser.  To add a
+// request, add its code, a row here, a Resolver function and a
+// Client function.
+
+namespace Cody {
+namespace Detail {
+
+// Must be consistently ordered with the RequestCode enum
+Schema const schemas[RC_HWM] =
+  {
+    // HELLO $version $agent [$ident [$tag]]
+    {u8"HELLO", 2, {AK_UNSIGNED, AK_WORD, AK_WORD, AK_UNSIGNED},
+     RK_CONNECT},
+    // MODULE-REPO
+    {u8"MODULE-REPO", 0, {AK_END}, RK_PATHNAME},
+    // MODULE-EXPORT $module [$flags]
+    {u8"MODULE-EXPORT", 1, {AK_NAME, AK_UNSIGNED, AK_END}, RK_PATHNAME},
+    // MODULE-IMPORT $module [$flags]
+    {u8"MODULE-IMPORT", 1, {AK_NAME, AK_UNSIGNED, AK_END}, RK_PATHNAME},
+    // MODULE-COMPILED $module [$flags]
+    {u8"MODULE-COMPILED", 1, {AK_NAME, AK_UNSIGNED, AK_END}, RK_OK},
+    // INCLUDE-TRANSLATE $header [$flags]
+    {u8"INCLUDE-TRANSLATE", 1, {AK_NAME, AK_UNSIGNED, AK_END},
+     RK_TRANSLATE},
+    // INVOKE $command $args...
+    {u8"INVOKE", 1, {AK_ARGV}, RK_OK},
+    // STATS
+    {u8"STATS", 0, {AK_END}, RK_STATS},
+  };
+
+// Return numeric value of STR as an unsigned.  Returns ~0u on error
+// (so that value is not representable).
+
+static unsigned ParseUnsigned (std::string const &str)
+{
+  char *eptr;
+  unsigned long val = strtoul (str.c_str (), &eptr, 10);
+  if (*eptr || unsigned (val) != val)
+    return ~0u;
+
+  return unsigned (val);
+}
+
+int ParseRequest (unsigned code, std::vector<std::string> const &words,
+		  unsigned (&values)[MaxArgs])
+{
+  Schema const &schema = schemas[code];
+  size_t count = words.size () - 1;
+
+  for (auto &value : values)
+    value = 0;
+  if (count < schema.required)
+    return -1;
+
+  for (unsigned ix = 0; ix != MaxArgs && ix != count; ix++)
+    {
+      std::string const &word = words[ix + 1];
+      switch (schema.args[ix])
+	{
+	case AK_END:
+	  // Too many
+	  return -1;
+
+	case AK_UNSIGNED:
+	  values[ix] = ParseUnsigned (word);
+	  if (values[ix] == ~0u)
+	    return -1;
+	  break;
+
+	case AK_WORD:
+	  break;
+
+	case AK_NAME:
+	  if (word.empty ())
+	    return -1;
+	  break;
+
+	case AK_ARGV:
+	  // Takes the remainder
+	  return word.empty () ? -1 : 0;
+	}
+    }
+
+  return count > MaxArgs ? -1 : 0;
+}
+
+}
+}
@@ -4,8 +4,6 @@
 
 // Cody
 #include "internal.hh"
-// C++
-#include <tuple>
 // C
 #include <cerrno>
 #include <cstring>
@@ -14,41 +12,62 @@
 
 namespace Cody {
 
-// These do not need to be members
+// These do not need to be members.  The request's arguments have
+// been checked against its schema, and unsigned ones parsed to VALUES.
 static Resolver *ConnectRequest (Server *, Resolver *,
-				 std::vector<std::string> &words);
+				 std::vector<std::string> &words,
+				 unsigned const *values);
 static int ModuleRepoRequest (Server *, Resolver *,
-			      std::vector<std::string> &words);
+			      std::vector<std::string> &words,
+			      unsigned const *values);
 static int ModuleExportRequest (Server *, Resolver *,
-				std::vector<std::string> &words);
+				std::vector<std::string> &words,
+				unsigned const *values);
 static int ModuleImportRequest (Server *, Resolver *,
-				std::vector<std::string> &words);
+				std::vector<std::string> &words,
+				unsigned const *values);
 static int ModuleCompiledRequest (Server *, Resolver *,
-				  std::vector<std::string> &words);
+				  std::vector<std::string> &words,
+				  unsigned const *values);
 static int IncludeTranslateRequest (Server *, Resolver *,
-				     std::vector<std::string> &words);
+				     std::vector<std::string> &words,
+				     unsigned const *values);
 static int InvokeSubProcessRequest (Server *, Resolver *,
-				     std::vector<std::string> &words);
+				     std::vector<std::string> &words,
+				     unsigned const *values);
+static int StatsRequest (Server *, Resolver *,
+			 std::vector<std::string> &words,
+			 unsigned const *values);
+static int DispatchRequest (Server *, unsigned code,
+			    std::vector<std::string> &words,
+			    unsigned const *values);
 
 namespace {
-using RequestFn = int (Server *, Resolver *, std::vector<std::string> &);
-using RequestPair = std::tuple<char const *, RequestFn *>;
-static RequestPair
+using RequestFn = int (Server *, Resolver *, std::vector<std::string> &,
+		       unsigned const *);
+static RequestFn *
   const requestTable[Detail::RC_HWM] =
   {
-    // Same order as enum RequestCode
-    RequestPair {u8"HELLO", nullptr},
-    RequestPair {u8"MODULE-REPO", ModuleRepoRequest},
-    RequestPair {u8"MODULE-EXPORT", ModuleExportRequest},
-    RequestPair {u8"MODULE-IMPORT", ModuleImportRequest},
-    RequestPair {u8"MODULE-COMPILED", ModuleCompiledRequest},
-    RequestPair {u8"INCLUDE-TRANSLATE", IncludeTranslateRequest},
-    RequestPair {u8"INVOKE", InvokeSubProcessRequest},
+    // Same order as enum RequestCode, verbs are in Detail::schemas
+    nullptr,
+    ModuleRepoRequest,
+    ModuleExportRequest,
+    ModuleImportRequest,
+    ModuleCompiledRequest,
+    IncludeTranslateRequest,
+    InvokeSubProcessRequest,
+    StatsRequest,
   };
 }
 
+char const *Metrics::GetVerbName (unsigned code)
+{
+  return code < Detail::RC_HWM ? Detail::schemas[code].verb
+    : u8"unrecognized";
+}
+
 Server::Server (Resolver *r)
-  : resolver (r), direction (READING)
+  : resolver (r), dispatcher (&DispatchRequest), direction (READING)
 {
   PrepareToRead ();
 }
@@ -56,23 +75,55 @@ Server::Server (Resolver *r)
 Server::Server (Server &&src)
   : write (std::move (src.write)),
     read (std::move (src.read)),
+    deferred (std::move (src.deferred)),
+    slots (std::move (src.slots)),
+    deferrals (std::move (src.deferrals)),
     resolver (src.resolver),
+    dispatcher (src.dispatcher),
+    tracer (src.tracer),
+    capture (src.capture),
+    captureId (src.captureId),
+    ident (std::move (src.ident)),
+    traceStart (src.traceStart),
+    traceRequests (src.traceRequests),
+    pending (src.pending),
+    filling (src.filling),
+    filterTag (src.filterTag),
+    dispatching (src.dispatching),
     is_connected (src.is_connected),
     direction (src.direction)
 {
   fd.from = src.fd.from;
   fd.to = src.fd.to;
+  src.capture = nullptr;
 }
 
 Server::~Server ()
 {
+  if (capture)
+    capture->Write (Capture::CLOSE, captureId, nullptr, 0);
 }
 
 Server &Server::operator= (Server &&src)
 {
   write = std::move (src.write);
   read = std::move (src.read);
+  deferred = std::move (src.deferred);
+  slots = std::move (src.slots);
+  deferrals = std::move (src.deferrals);
   resolver = src.resolver;
+  dispatcher = src.dispatcher;
+  tracer = src.tracer;
+  capture = src.capture;
+  captureId = src.captureId;
+  src.capture = nullptr;
+  ident = std::move (src.ident);
+  traceStart = src.traceStart;
+  traceRequests = src.traceRequests;
+  pending = src.pending;
+  filling = src.filling;
+  filterTag = src.filterTag;
+  dispatching = src.dispatching;
   is_connected = src.is_connected;
   direction = src.direction;
   fd.from = src.fd.from;
@@ -89,32 +140,105 @@ void Server::DirectProcess (Detail::MessageBuffer &from,
   ProcessRequests ();
   resolver->WaitUntilReady (this);
   write.PrepareToWrite ();
+  if (traceStart)
+    TraceBlock ();
+  if (capture)
+    capture->Write (Capture::RESPONSES, captureId,
+		    write.GetData (), write.GetSize ());
   std::swap (to, write);
 }
 
+void Server::SetCapture (Capture *c)
+{
+  capture = c;
+  if (capture)
+    captureId = capture->Connect ();
+}
+
+void Server::SetIdent (std::string const &i)
+{
+  ident = i;
+  if (tracer)
+    tracer->NameTrack (ident, this);
+}
+
+// The block's event spans from processing to the last deferred
+// response
+
+void Server::TraceBlock ()
+{
+  if (tracer)
+    tracer->Event (u8"block", u8"server", ident, this, traceStart,
+		   traceRequests);
+  traceStart = 0;
+}
+
 void Server::ProcessRequests (void)
 {
-  std::vector<std::string> words;
+  BeginProcessing ();
+  ProcessLines ();
+}
+
+bool Server::ProcessRequests (unsigned limit)
+{
+  if (direction != PROCESSING)
+    BeginProcessing ();
+  ProcessLines (limit);
 
+  return !read.HasLine ();
+}
+
+void Server::BeginProcessing ()
+{
   direction = PROCESSING;
-  while (!read.IsAtEnd ())
+  if (capture)
+    capture->Write (Capture::REQUESTS, captureId,
+		    read.GetData (), read.GetSize ());
+}
+
+// Lines earlier in the block may already have been processed
+
+unsigned Server::ProcessLines (unsigned limit)
+{
+  if (!limit || !read.HasLine ())
+    return 0;
+
+  std::vector<std::string> words;
+  unsigned values[Detail::MaxArgs];
+
+  if (tracer && !traceStart)
+    {
+      traceStart = Tracer::Now ();
+      traceRequests = 0;
+    }
+  unsigned count = 0;
+  while (count != limit && read.HasLine ())
     {
+      count++;
       int err = 0;
       unsigned ix = Detail::RC_HWM;
+      uint64_t start = Detail::MetricsClock ();
+      uint64_t traced = tracer ? Tracer::Now () : 0;
       if (!read.Lex (words))
 	{
 	  Assert (!words.empty ());
+	  CODY_PROBE2 (request, words[0].c_str (), ident.c_str ());
 	  while (ix--)
 	    {
-	      if (words[0] != std::get<0> (requestTable[ix]))
+	      if (words[0] != Detail::schemas[ix].verb)
 		continue; // not this one
 
-	      if (ix == Detail::RC_CONNECT)
+	      dispatching = ix;
+
+	      if (Detail::ParseRequest (ix, words, values))
+		err = -1;
+	      else if (ix == Detail::RC_CONNECT)
 		{
 		  // CONNECT
 		  if (IsConnected ())
 		    err = -1;
-		  else if (auto *r = ConnectRequest (this, resolver, words))
+		  else if (auto *r = ConnectRequest (this, resolver,
+						     words, values))
 		    resolver = r;
 		  else
 		    err = -1;
@@ -123,10 +247,10 @@ void Server::ProcessRequests (void)
 		{
 		  if (!IsConnected ())
 		    err = -1;
-		  else if (int res = (std::get<1> (requestTable[ix])
-				      (this, resolver, words)))
+		  else if (int res = dispatcher (this, ix, words, values))
 		    err = res;
 		}
+	      dispatching = Detail::RC_HWM;
 	      break;
 	    }
 	}
@@ -156,123 +280,84 @@ void Server::ProcessRequests (void)
 	    }
 	  resolver->ErrorResponse (this, std::move (msg));
 	}
+      CODY_PROBE3 (response, ix, err, ident.c_str ());
+      Detail::RecordRequest (ix, err || ix >= Detail::RC_HWM, start);
+      if (traced && tracer)
+	{
+	  tracer->Event (Metrics::GetVerbName (ix), u8"resolver", ident, this,
+			 traced);
+	  traceRequests++;
+	}
     }
-}
 
-// Return numeric value of STR as an unsigned.  Returns ~0u on error
-// (so that value is not representable).
-static unsigned ParseUnsigned (std::string &str)
-{
-  char *eptr;
-  unsigned long val = strtoul (str.c_str (), &eptr, 10);
-  if (*eptr || unsigned (val) != val)
-    return ~0u;
-
-  return unsigned (val);
+  return count;
 }
 
 Resolver *ConnectRequest (Server *s, Resolver *r,
-			  std::vector<std::string> &words)
+			  std::vector<std::string> &words,
+			  unsigned const *values)
 {
-  if (words.size () < 3 || words.size () > 4)
-    return nullptr;
-
   if (words.size () == 3)
     words.emplace_back (u8"");
-  unsigned version = ParseUnsigned (words[1]);
-  if (version == ~0u)
-    return nullptr;
 
-  return r->ConnectRequest (s, version, words[2], words[3]);
+  s->SetIdent (words[3]);
+  if (words.size () == 5)
+    // Client wants the include filter
+    s->WantIncludeFilter (values[3]);
+
+  return r->ConnectRequest (s, values[0], words[2], words[3]);
 }
 
-int ModuleRepoRequest (Server *s, Resolver *r,std::vector<std::string> &words)
+int DispatchRequest (Server *s, unsigned code,
+		     std::vector<std::string> &words, unsigned const *values)
 {
-  if (words.size () != 1)
-    return -1;
+  return requestTable[code] (s, s->GetResolver (), words, values);
+}
 
+int ModuleRepoRequest (Server *s, Resolver *r, std::vector<std::string> &,
+		       unsigned const *)
+{
   return r->ModuleRepoRequest (s);
 }
 
-int ModuleExportRequest (Server *s, Resolver *r, std::vector<std::string> &words)
+int ModuleExportRequest (Server *s, Resolver *r, std::vector<std::string> &words,
+			 unsigned const *values)
 {
-  if (words.size () < 2 || words.size () > 3 || words[1].empty ())
-    return -1;
-
-  Flags flags = Flags::None;
-  if (words.size () == 3)
-    {
-      unsigned val = ParseUnsigned (words[2]);
-      if (val == ~0u)
-	return -1;
-      flags = Flags (val);
-    }
-
-  return r->ModuleExportRequest (s, flags, words[1]);
+  return r->ModuleExportRequest (s, Flags (values[1]), words[1]);
 }
 
-int ModuleImportRequest (Server *s, Resolver *r, std::vector<std::string> &words)
+int ModuleImportRequest (Server *s, Resolver *r, std::vector<std::string> &words,
+			 unsigned const *values)
 {
-  if (words.size () < 2 || words.size () > 3 || words[1].empty ())
-    return -1;
-
-  Flags flags = Flags::None;
-  if (words.size () == 3)
-    {
-      unsigned val = ParseUnsigned (words[2]);
-      if (val == ~0u)
-	return -1;
-      flags = Flags (val);
-    }
-
-  return r->ModuleImportRequest (s, flags, words[1]);
+  return r->ModuleImportRequest (s, Flags (values[1]), words[1]);
 }
 
 int ModuleCompiledRequest (Server *s, Resolver *r,
-			   std::vector<std::string> &words)
+			   std::vector<std::string> &words,
+			   unsigned const *values)
 {
-  if (words.size () < 2 || words.size () > 3 || words[1].empty ())
-    return -1;
-
-  Flags flags = Flags::None;
-  if (words.size () == 3)
-    {
-      unsigned val = ParseUnsigned (words[2]);
-      if (val == ~0u)
-	return -1;
-      flags = Flags (val);
-    }
-
-  return r->ModuleCompiledRequest (s, flags, words[1]);
+  return r->ModuleCompiledRequest (s, Flags (values[1]), words[1]);
 }
 
 int IncludeTranslateRequest (Server *s, Resolver *r,
-			     std::vector<std::string> &words)
+			     std::vector<std::string> &words,
+			     unsigned const *values)
 {
-  if (words.size () < 2 || words.size () > 3 || words[1].empty ())
-    return -1;
-
-  Flags flags = Flags::None;
-  if (words.size () == 3)
-    {
-      unsigned val = ParseUnsigned (words[2]);
-      if (val == ~0u)
-	return -1;
-      flags = Flags (val);
-    }
-
-  return r->IncludeTranslateRequest (s, flags, words[1]);
+  return r->IncludeTranslateRequest (s, Flags (values[1]), words[1]);
 }
 
 int InvokeSubProcessRequest (Server *s, Resolver *r,
-			     std::vector<std::string> &args)
+			     std::vector<std::string> &args, unsigned const *)
 {
-  if (args.size () < 2 || args[1].empty ())
-    return -1;
-
   return r->InvokeSubProcessRequest (s, args);
 }
 
+int StatsRequest (Server *s, Resolver *r, std::vector<std::string> &,
+		  unsigned const *)
+{
+  return r->StatsRequest (s);
+}
+
 void Server::ErrorResponse (char const *error, size_t elen)
 {
   write.BeginLine ();
@@ -281,6 +366,55 @@ void Server::ErrorResponse (char const *error, size_t elen)
   write.EndLine ();
 }
 
+// The placeholder is an error response, so that an unfilled deferral
+// is reported to the client, rather than corrupting the block.
+unsigned Server::DeferResponse ()
+{
+  write.BeginLine ();
+  size_t pos = write.GetSize ();
+  write.AppendWord (u8"ERROR");
+  write.AppendWord (u8"response pending", true);
+  write.EndLine ();
+  slots.emplace_back (pos, write.GetSize () - pos);
+  deferrals.emplace_back (tracer ? Tracer::Now () : 0, dispatching);
+  pending++;
+
+  return unsigned (slots.size () - 1);
+}
+
+void Server::BeginDeferred (unsigned token)
+{
+  Assert (filling == ~0u && token < slots.size ()
+	  && slots[token].second != ~size_t (0));
+  filling = token;
+  std::swap (write, deferred);
+}
+
+void Server::EndDeferred ()
+{
+  Assert (filling < slots.size ());
+  std::swap (write, deferred);
+
+  auto &slot = slots[filling];
+  size_t pos = slot.first;
+  size_t len = slot.second;
+  size_t size = deferred.GetSize ();
+  write.Splice (pos, len, deferred);
+  slot.second = ~size_t (0);
+  // Later placeholders have moved
+  for (auto &other : slots)
+    if (other.first > pos)
+      other.first = other.first + size - len;
+
+  auto &deferral = deferrals[filling];
+  if (deferral.first && tracer)
+    tracer->Event (Metrics::GetVerbName (deferral.second), u8"deferred",
+		   ident, this, deferral.first);
+
+  filling = ~0u;
+  pending--;
+}
+
 void Server::OKResponse ()
 {
   write.BeginLine ();
@@ -296,6 +430,19 @@ void Server::ConnectResponse (char const *agent, size_t alen)
   write.AppendWord (u8"HELLO");
   write.AppendInteger (Version);
   write.AppendWord (agent, true, alen);
+  if (filterTag != ~0u)
+    if (auto *filter = resolver->GetIncludeFilter ())
+      if (filter->IsValid ())
+	{
+	  write.AppendInteger (0);
+	  write.AppendInteger (filter->GetTag ());
+	  if (filter->GetTag () != filterTag)
+	    {
+	      std::string word;
+	      filter->Encode (word);
+	      write.AppendWord (word);
+	    }
+	}
   write.EndLine ();
 }
 
@@ -315,4 +462,51 @@ void Server::BoolResponse (bool truthiness)
   write.EndLine ();
 }
 
+void Server::StatsResponse (Metrics const &m)
+{
+  std::vector<std::pair<std::string, uint64_t>> pairs;
+  m.Report (pairs);
+
+  write.BeginLine ();
+  write.AppendWord (u8"STATS");
+  for (auto &pair : pairs)
+    {
+      write.AppendWord (pair.first);
+      write.AppendWord (std::to_string (pair.second));
+    }
+  write.EndLine ();
+}
+
+namespace Detail {
+
+// Provide a RESPONSE, received from a Client, to S
+
+void Respond (Server *s, Packet const &response)
+{
+  switch (response.GetCode ())
+    {
+    case Client::PC_PATHNAME:
+      s->PathnameResponse (response.GetString ());
+      break;
+
+    case Client::PC_BOOL:
+      s->BoolResponse (response.GetInteger () != 0);
+      break;
+
+    case Client::PC_OK:
+      s->OKResponse ();
+      break;
+
+    case Client::PC_ERROR:
+      s->ErrorResponse (response.GetString ());
+      break;
+
+    default:
+      s->ErrorResponse (u8"unexpected response");
+      break;
+    }
+}
+
+}
+
 }
@@ -0,0 +1,269 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Cody
+#include "internal.hh"
+// C++
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+// C
+#include <cstring>
+
+// Thread-safe client code
+
+// There is no thread of our own.  A caller queues its request, and
+// if no block is in progress, it sends every queued request as one,
+// then hands each its response.  Otherwise it waits, and one of the
+// waiters sends the next block when the current one is answered.  So
+// requests arriving during a round trip are batched, and a lone
+// request costs only a lock.  Only the sender touches the Client.
+
+namespace Cody {
+namespace Detail {
+
+struct Call
+{
+  Packet response {Client::PC_ERROR};
+  std::string name;
+  std::vector<std::string> args;
+  unsigned code;
+  Flags flags;
+  bool done = false;
+};
+
+class Shared
+{
+public:
+  Client client;
+
+  // Protected by lock
+  std::mutex lock;
+  std::condition_variable answered;
+  std::vector<Call *> queued;
+  bool busy = false;	///< A block is in progress
+
+  std::atomic<uint64_t> requests {0};
+  std::atomic<uint64_t> blocks {0};
+
+public:
+  Shared (Client &&c)
+    : client (std::move (c))
+  {
+  }
+
+public:
+  Packet Issue (Call &);
+  Packet Exclusive (char const *agent, char const *ident,
+		    size_t alen, size_t ilen);
+
+private:
+  void Send (std::vector<Call *> &);
+};
+
+// Queue CALL, and wait for its response, sending the block it is in
+// if nobody else is.
+
+Packet Shared::Issue (Call &call)
+{
+  std::unique_lock<std::mutex> guard (lock);
+  queued.push_back (&call);
+  requests++;
+  while (!call.done)
+    if (busy)
+      answered.wait (guard);
+    else
+      {
+	std::vector<Call *> block;
+	block.swap (queued);
+	busy = true;
+	guard.unlock ();
+
+	Send (block);
+
+	guard.lock ();
+	for (auto *sent : block)
+	  sent->done = true;
+	busy = false;
+	answered.notify_all ();
+      }
+
+  return std::move (call.response);
+}
+
+void Shared::Send (std::vector<Call *> &block)
+{
+  blocks++;
+
+  client.Cork ();
+  for (auto *call : block)
+    switch (call->code)
+      {
+      case RC_INVOKE:
+	{
+	  std::vector<char const *> argv;
+	  for (auto &arg : call->args)
+	    argv.push_back (arg.c_str ());
+	  client.InvokeSubProcess (argv);
+	}
+	break;
+
+      case RC_STATS:
+	client.Stats ();
+	break;
+
+      case RC_MODULE_REPO:
+	client.ModuleRepo ();
+	break;
+
+      case RC_MODULE_EXPORT:
+	client.ModuleExport (call->name, call->flags);
+	break;
+
+      case RC_MODULE_IMPORT:
+	client.ModuleImport (call->name, call->flags);
+	break;
+
+      case RC_MODULE_COMPILED:
+	client.ModuleCompiled (call->name, call->flags);
+	break;
+
+      case RC_INCLUDE_TRANSLATE:
+	client.IncludeTranslate (call->name, call->flags);
+	break;
+      }
+  auto responses = client.Uncork ();
+
+  if (responses.size () != block.size ())
+    {
+      // A communication error, which every call gets
+      Packet &error = responses[0];
+      for (auto *call : block)
+	call->response = Packet (error.GetCode (), error.GetString ());
+      return;
+    }
+
+  for (unsigned ix = 0; ix != block.size (); ix++)
+    block[ix]->response = std::move (responses[ix]);
+}
+
+// The handshake, once any block in progress is answered.  Calls
+// queued meanwhile are sent by one of their waiters afterwards.
+
+Packet Shared::Exclusive (char const *agent, char const *ident,
+			  size_t alen, size_t ilen)
+{
+  std::unique_lock<std::mutex> guard (lock);
+  answered.wait (guard, [this] { return !busy; });
+  busy = true;
+  guard.unlock ();
+
+  requests++;
+  blocks++;
+  Packet packet = client.Connect (agent, ident, alen, ilen);
+
+  guard.lock ();
+  busy = false;
+  answered.notify_all ();
+
+  return packet;
+}
+
+}
+
+SharedClient::SharedClient (Server *s)
+  : impl (new Detail::Shared (Client (s)))
+{
+}
+
+SharedClient::SharedClient (int from, int to)
+  : impl (new Detail::Shared (Client (from, to)))
+{
+}
+
+SharedClient::~SharedClient ()
+{
+}
+
+Client &SharedClient::GetClient ()
+{
+  return impl->client;
+}
+
+uint64_t SharedClient::GetRequests () const
+{
+  return impl->requests;
+}
+
+uint64_t SharedClient::GetBlocks () const
+{
+  return impl->blocks;
+}
+
+Packet SharedClient::Connect (char const *agent, char const *ident,
+			      size_t alen, size_t ilen)
+{
+  return impl->Exclusive (agent, ident, alen, ilen);
+}
+
+Packet SharedClient::InvokeSubProcess (char const *const *argv, size_t argc)
+{
+  Detail::Call call;
+  call.code = Detail::RC_INVOKE;
+  call.args.assign (argv, argv + argc);
+
+  return impl->Issue (call);
+}
+
+Packet SharedClient::Stats ()
+{
+  Detail::Call call;
+  call.code = Detail::RC_STATS;
+
+  return impl->Issue (call);
+}
+
+Packet SharedClient::ModuleRepo ()
+{
+  Detail::Call call;
+  call.code = Detail::RC_MODULE_REPO;
+
+  return impl->Issue (call);
+}
+
+// The requests naming a module or header
+
+static Packet Named (Detail::Shared *impl, unsigned code,
+		     char const *str, Flags flags, size_t len)
+{
+  Detail::Call call;
+  call.code = code;
+  call.flags = flags;
+  call.name.assign (str, len == ~size_t (0) ? strlen (str) : len);
+
+  return impl->Issue (call);
+}
+
+Packet SharedClient::ModuleExport (char const *str, Flags flags, size_t len)
+{
+  return Named (impl.get (), Detail::RC_MODULE_EXPORT, str, flags, len);
+}
+
+Packet SharedClient::ModuleImport (char const *str, Flags flags, size_t len)
+{
+  return Named (impl.get (), Detail::RC_MODULE_IMPORT, str, flags, len);
+}
+
+Packet SharedClient::ModuleCompiled (char const *str, Flags flags, size_t len)
+{
+  return Named (impl.get (), Detail::RC_MODULE_COMPILED, str, flags, len);
+}
+
+Packet SharedClient::IncludeTranslate (char const *str, Flags flags,
+				       size_t len)
+{
+  return Named (impl.get (), Detail::RC_INCLUDE_TRANSLATE, str, flags, len);
+}
+
+}
@@ -0,0 +1,536 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Cody
+#include "internal.hh"
+// C++
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+// C
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+// OS
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+// Sub process invocation
+
+// A single thread spawns the processes, reads their output and reaps
+// them, so the Server thread never blocks on a child.  Completed
+// invocations are handed back as with the BuildScheduler -- a notify
+// pipe and Collect.
+
+// With a GNU make jobserver, we implicitly own one job slot, as make
+// ran us.  Each concurrent invocation beyond the first needs a token
+// read from the jobserver, which is written back on completion.  A
+// jobserver pipe is shared with make and its other children, so we
+// must not make it non-blocking.  We reopen it, to get a non-blocking
+// file description of our own, and do without the jobserver if we
+// cannot -- a blocking read could wait for another process's token
+// indefinitely.
+
+// The lock is not held while taking a token or spawning a process,
+// so the Server thread can queue and collect meanwhile.
+
+namespace Cody {
+namespace Detail {
+
+// Captured output beyond this is discarded
+constexpr size_t OutputLimit = 16384;
+
+// Take a jobserver token, if one is available.  FD is our own
+// non-blocking description of the jobserver.
+
+static bool TakeSlot (int fd, char &slot)
+{
+  ssize_t count;
+  while ((count = read (fd, &slot, 1)) < 0 && errno == EINTR)
+    continue;
+
+  return count == 1;
+}
+
+// A queued, running or completed invocation
+struct Invocation
+{
+  std::vector<std::string> args;
+  Server *server;	///< Null if cancelled
+  unsigned token;	///< Deferred response token
+  pid_t pid = -1;
+  int out = -1;		///< Output pipe
+  std::string output;	///< Captured stdout & stderr
+  int status = 0;	///< Wait status
+  int err = 0;		///< Failed to spawn
+  char slot = 0;	///< Jobserver token
+  bool has_slot = false;
+
+  Invocation (Server *s, unsigned t, std::vector<std::string> &&a)
+    : args (std::move (a)), server (s), token (t)
+  {
+  }
+};
+
+class Spawner
+{
+public:
+  unsigned limit;	///< Concurrency limit
+  int jobRead = -1;	///< Jobserver token source
+  int jobWrite = -1;	///< Jobserver token sink
+  std::thread thread;
+  int wake[2];		///< Wake the spawner thread
+  int notify[2];	///< Completion notification
+
+  // Protected by lock
+  std::mutex lock;
+  std::condition_variable completed;
+  std::deque<Invocation *> queued;
+  std::vector<Invocation *> done;
+  bool stopping = false;
+
+  // Only touched by the spawner thread
+  std::vector<Invocation *> running;
+
+  // Only touched by the server thread
+  std::map<Server *, unsigned> outstanding;
+  std::vector<Invocation *> issued;	///< Not yet collected
+
+public:
+  Spawner (unsigned l);
+  ~Spawner ();
+
+public:
+  void Push (Invocation *);
+  void Stop ();
+
+private:
+  void Run ();
+  Invocation *Next ();
+  bool Start (Invocation *);
+  void Finish (Invocation *);
+};
+
+static void Pipe (int fds[2])
+{
+  if (pipe (fds) < 0)
+    fds[0] = fds[1] = -1;
+  else
+    for (unsigned ix = 2; ix--;)
+      {
+	fcntl (fds[ix], F_SETFL, fcntl (fds[ix], F_GETFL) | O_NONBLOCK);
+	fcntl (fds[ix], F_SETFD, FD_CLOEXEC);
+      }
+}
+
+Spawner::Spawner (unsigned l)
+  : limit (l)
+{
+  Pipe (wake);
+  Pipe (notify);
+}
+
+Spawner::~Spawner ()
+{
+  Stop ();
+
+  for (int *fds : {wake, notify})
+    if (fds[0] >= 0)
+      {
+	close (fds[0]);
+	close (fds[1]);
+      }
+  if (jobRead >= 0)
+    close (jobRead);
+  if (jobWrite >= 0 && jobWrite != jobRead)
+    close (jobWrite);
+}
+
+void Spawner::Push (Invocation *invocation)
+{
+  {
+    std::lock_guard<std::mutex> guard (lock);
+    queued.push_back (invocation);
+    if (!thread.joinable ())
+      thread = std::thread (&Spawner::Run, this);
+  }
+  (void)!write (wake[1], "", 1);
+}
+
+void Spawner::Stop ()
+{
+  {
+    std::lock_guard<std::mutex> guard (lock);
+    stopping = true;
+  }
+  (void)!write (wake[1], "", 1);
+  if (thread.joinable ())
+    thread.join ();
+
+  for (auto *invocation : queued)
+    delete invocation;
+  queued.clear ();
+}
+
+// Spawn an invocation, with stdout & stderr to a pipe, and stdin
+// from /dev/null.  Returns false if it failed to start.
+
+bool Spawner::Start (Invocation *invocation)
+{
+  std::vector<char *> argv;
+  for (auto iter = invocation->args.begin () + 1;
+       iter != invocation->args.end (); ++iter)
+    argv.push_back (&(*iter)[0]);
+  argv.push_back (nullptr);
+
+  int out[2];
+  if (pipe (out) < 0)
+    {
+      invocation->err = errno;
+      return false;
+    }
+  fcntl (out[0], F_SETFD, FD_CLOEXEC);
+  fcntl (out[0], F_SETFL, fcntl (out[0], F_GETFL) | O_NONBLOCK);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init (&actions);
+  posix_spawn_file_actions_addopen (&actions, 0, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_adddup2 (&actions, out[1], 1);
+  posix_spawn_file_actions_adddup2 (&actions, out[1], 2);
+  posix_spawn_file_actions_addclose (&actions, out[1]);
+
+  int err = posix_spawnp (&invocation->pid, argv[0], &actions, nullptr,
+			  argv.data (), environ);
+  posix_spawn_file_actions_destroy (&actions);
+  close (out[1]);
+
+  if (err)
+    {
+      close (out[0]);
+      invocation->err = err;
+      return false;
+    }
+
+  invocation->out = out[0];
+  return true;
+}
+
+// Reap a completed invocation, and return its jobserver token.
+
+void Spawner::Finish (Invocation *invocation)
+{
+  if (invocation->out >= 0)
+    close (invocation->out);
+  invocation->out = -1;
+
+  if (invocation->pid > 0)
+    while (waitpid (invocation->pid, &invocation->status, 0) < 0
+	   && errno == EINTR)
+      continue;
+
+  if (invocation->has_slot)
+    (void)!write (jobWrite, &invocation->slot, 1);
+
+  {
+    std::lock_guard<std::mutex> guard (lock);
+    done.push_back (invocation);
+  }
+  completed.notify_all ();
+  (void)!write (notify[1], "", 1);
+}
+
+// The next queued invocation, if another may run.  Only this thread
+// removes invocations from the queue, so it remains at the front.
+
+Invocation *Spawner::Next ()
+{
+  if (running.size () >= limit)
+    return nullptr;
+
+  std::lock_guard<std::mutex> guard (lock);
+  if (stopping || queued.empty ())
+    return nullptr;
+
+  return queued.front ();
+}
+
+void Spawner::Run ()
+{
+  std::vector<pollfd> fds;
+
+  for (;;)
+    {
+      {
+	std::lock_guard<std::mutex> guard (lock);
+	if (stopping && running.empty ())
+	  break;
+      }
+
+      bool wantSlot = false;
+      while (Invocation *invocation = Next ())
+	{
+	  if (!running.empty () && jobRead >= 0)
+	    {
+	      // Need a token
+	      if (!TakeSlot (jobRead, invocation->slot))
+		{
+		  wantSlot = true;
+		  break;
+		}
+	      invocation->has_slot = true;
+	    }
+
+	  {
+	    std::lock_guard<std::mutex> guard (lock);
+	    queued.pop_front ();
+	  }
+	  if (Start (invocation))
+	    running.push_back (invocation);
+	  else
+	    {
+	      invocation->pid = -1;
+	      Finish (invocation);
+	    }
+	}
+
+      fds.clear ();
+      fds.push_back ({wake[0], POLLIN, 0});
+      if (wantSlot)
+	fds.push_back ({jobRead, POLLIN, 0});
+      for (auto *invocation : running)
+	fds.push_back ({invocation->out, POLLIN, 0});
+
+      if (poll (fds.data (), fds.size (), -1) < 0)
+	continue;
+
+      char drain[4096];
+      if (fds[0].revents)
+	while (read (wake[0], drain, sizeof (drain)) > 0)
+	  continue;
+
+      size_t first = wantSlot ? 2 : 1;
+      for (size_t ix = running.size (); ix--;)
+	if (fds[first + ix].revents)
+	  {
+	    auto *invocation = running[ix];
+	    ssize_t count = read (invocation->out, drain, sizeof (drain));
+	    if (count > 0)
+	      {
+		size_t room = OutputLimit - invocation->output.size ();
+		invocation->output.append (drain,
+					   std::min (size_t (count), room));
+	      }
+	    else if (!count || (errno != EAGAIN && errno != EINTR))
+	      {
+		running.erase (running.begin () + ix);
+		Finish (invocation);
+	      }
+	  }
+    }
+}
+
+}
+
+SubProcessPool::SubProcessPool (unsigned limit)
+{
+  if (!limit)
+    limit = std::thread::hardware_concurrency ();
+  impl.reset (new Detail::Spawner (limit ? limit : 1));
+}
+
+SubProcessPool::~SubProcessPool ()
+{
+  impl->Stop ();
+  for (auto *invocation : impl->done)
+    delete invocation;
+}
+
+// MAKEFLAGS contains --jobserver-auth=R,W or --jobserver-auth=fifo:PATH
+// (--jobserver-fds=R,W before make 4.2).  The last one is current.
+
+int SubProcessPool::UseJobServer (char const *makeflags)
+{
+  if (!makeflags)
+    makeflags = getenv ("MAKEFLAGS");
+  if (!makeflags)
+    return ENOENT;
+
+  std::string flags (makeflags);
+  size_t pos = flags.npos;
+  for (char const *opt : {"--jobserver-auth=", "--jobserver-fds="})
+    {
+      size_t p = flags.rfind (opt);
+      if (p != flags.npos && (pos == flags.npos || p > pos))
+	pos = p + strlen (opt);
+    }
+  if (pos == flags.npos)
+    return ENOENT;
+
+  std::string auth (flags, pos, flags.find (' ', pos) - pos);
+  int rfd = -1, wfd = -1;
+  if (!auth.compare (0, 5, u8"fifo:"))
+    {
+      rfd = open (&auth[5], O_RDWR | O_NONBLOCK | O_CLOEXEC);
+      if (rfd < 0)
+	return errno;
+      wfd = rfd;
+    }
+  else
+    {
+      char *eptr;
+      long r = strtol (auth.c_str (), &eptr, 10);
+      if (*eptr != ',')
+	return EINVAL;
+      long w = strtol (eptr + 1, &eptr, 10);
+      if (*eptr || r < 0 || w < 0)
+	return EINVAL;
+
+      // Make does not pass the pipe to recipes it does not consider
+      // to be sub-makes.
+      if (fcntl (int (r), F_GETFD) < 0 || fcntl (int (w), F_GETFD) < 0)
+	return EBADF;
+
+      // Reopen, so we can be non-blocking, without affecting others.
+      // Without that, a read could block indefinitely.
+      std::string self (u8"/proc/self/fd/");
+      self.append (std::to_string (r));
+      rfd = open (self.c_str (), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+      if (rfd < 0)
+	return errno;
+      wfd = fcntl (int (w), F_DUPFD_CLOEXEC, 0);
+      if (rfd < 0 || wfd < 0)
+	{
+	  int err = errno;
+	  if (rfd >= 0)
+	    close (rfd);
+	  return err;
+	}
+    }
+
+  std::lock_guard<std::mutex> guard (impl->lock);
+  if (impl->thread.joinable ())
+    {
+      // The spawner thread uses the jobserver without the lock
+      close (rfd);
+      if (wfd != rfd)
+	close (wfd);
+      return EBUSY;
+    }
+  if (impl->jobRead >= 0)
+    {
+      close (impl->jobRead);
+      if (impl->jobWrite != impl->jobRead)
+	close (impl->jobWrite);
+    }
+  impl->jobRead = rfd;
+  impl->jobWrite = wfd;
+
+  return 0;
+}
+
+int SubProcessPool::Invoke (Server *s, std::vector<std::string> &args)
+{
+  if (args.size () < 2)
+    return -1;
+
+  impl->outstanding[s]++;
+  auto *invocation = new Detail::Invocation (s, s->DeferResponse (),
+					     std::move (args));
+  impl->issued.push_back (invocation);
+  impl->Push (invocation);
+
+  return 0;
+}
+
+int SubProcessPool::GetNotifyFD () const
+{
+  return impl->notify[0];
+}
+
+unsigned SubProcessPool::Collect ()
+{
+  std::vector<Detail::Invocation *> done;
+  {
+    std::lock_guard<std::mutex> guard (impl->lock);
+    done.swap (impl->done);
+  }
+
+  char drain[64];
+  while (read (impl->notify[0], drain, sizeof (drain)) > 0)
+    continue;
+
+  unsigned count = 0;
+  for (auto *invocation : done)
+    {
+      auto &issued = impl->issued;
+      issued.erase (std::find (issued.begin (), issued.end (), invocation));
+
+      if (Server *s = invocation->server)
+	{
+	  if (!--impl->outstanding[s])
+	    impl->outstanding.erase (s);
+
+	  s->BeginDeferred (invocation->token);
+	  int status = invocation->status;
+	  if (!invocation->err && WIFEXITED (status) && !WEXITSTATUS (status))
+	    s->OKResponse ();
+	  else
+	    {
+	      std::string msg (u8"'");
+	      msg.append (invocation->args[1]);
+	      msg.append (u8"' ");
+	      if (invocation->err)
+		msg.append (strerror (invocation->err));
+	      else if (WIFEXITED (status))
+		{
+		  msg.append (u8"exited with status ");
+		  msg.append (std::to_string (WEXITSTATUS (status)));
+		}
+	      else
+		{
+		  msg.append (u8"killed by signal ");
+		  msg.append (std::to_string (WTERMSIG (status)));
+		}
+	      if (!invocation->output.empty ())
+		{
+		  msg.push_back ('\n');
+		  msg.append (invocation->output);
+		}
+	      s->ErrorResponse (msg);
+	    }
+	  s->EndDeferred ();
+	  count++;
+	}
+      delete invocation;
+    }
+
+  return count;
+}
+
+void SubProcessPool::Cancel (Server *s)
+{
+  for (auto *invocation : impl->issued)
+    if (invocation->server == s)
+      invocation->server = nullptr;
+  impl->outstanding.erase (s);
+}
+
+void SubProcessPool::WaitUntilReady (Server *s)
+{
+  while (Collect (), impl->outstanding.count (s))
+    {
+      std::unique_lock<std::mutex> guard (impl->lock);
+      impl->completed.wait (guard, [this] { return !impl->done.empty (); });
+    }
+}
+
+}
@@ -0,0 +1,84 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Test statically dispatching server
+// RUN: $subdir$stem |& ezio $test
+// RUN-END:
+
+// CHECK-NEXT: ^connect:1$
+// CHECK-NEXT: ^repo:5 cmi.cache$
+// CHECK-NEXT: ^resolver:import foo 0$
+// CHECK-NEXT: ^import:5 foo.cmi$
+// CHECK-NEXT: ^resolver:import bar 1$
+// CHECK-NEXT: ^import:5 bar.cmi$
+// CHECK-NEXT: ^resolver:include ./hdr.h$
+// CHECK-NEXT: ^include:4 1$
+// CHECK-NEXT: ^ERROR 'malformed \\'MODULE-IMPORT\\''$
+// CHECK-NEXT: ^ERROR 'malformed \\'MODULE-EXPORT baz frob\\''$
+// CHECK-NEXT: ^ERROR 'unrecognized \\'BOGUS\\''$
+// CHECK-NEXT: ^PATHNAME baz.cmi$
+// CHECK-NEXT: $EOF
+
+// Cody
+#include "cody.hh"
+// C++
+#include <iostream>
+
+using namespace Cody;
+
+class Noisy final : public Resolver
+{
+public:
+  virtual int ModuleImportRequest (Server *s, Flags flags,
+				   std::string &module)
+  {
+    std::cerr << "resolver:import " << module << ' ' << unsigned (flags)
+	      << '\n';
+    return Resolver::ModuleImportRequest (s, flags, module);
+  }
+  virtual int IncludeTranslateRequest (Server *s, Flags,
+				       std::string &include)
+  {
+    std::cerr << "resolver:include " << include << '\n';
+    s->BoolResponse (true);
+    return 0;
+  }
+};
+
+int main (int, char *[])
+{
+  Noisy r;
+  BasicServer<Noisy> server (&r);
+  Client client (&server);
+
+  auto p = client.Connect ("TEST", "IDENT");
+  std::cerr << "connect:" << p.GetCode () << '\n';
+  p = client.ModuleRepo ();
+  std::cerr << "repo:" << p.GetCode () << ' ' << p.GetString () << '\n';
+  p = client.ModuleImport ("foo");
+  std::cerr << "import:" << p.GetCode () << ' ' << p.GetString () << '\n';
+  p = client.ModuleImport ("bar", Flags::NameOnly);
+  std::cerr << "import:" << p.GetCode () << ' ' << p.GetString () << '\n';
+  p = client.IncludeTranslate ("./hdr.h");
+  std::cerr << "include:" << p.GetCode () << ' ' << p.GetInteger () << '\n';
+
+  // Malformed requests are diagnosed as by Server
+  Detail::MessageBuffer from, to;
+  for (auto words : {"MODULE-IMPORT", "MODULE-EXPORT baz frob", "BOGUS",
+		     "MODULE-EXPORT baz"})
+    {
+      from.PrepareToRead ();
+      from.Append (words);
+      from.PrepareToWrite ();
+      to.PrepareToRead ();
+      server.DirectProcess (from, to);
+      std::string line;
+      std::vector<std::string> lexed;
+      to.Lex (lexed);
+      to.LexedLine (line);
+      std::cerr << line << '\n';
+    }
+
+  return 0;
+}
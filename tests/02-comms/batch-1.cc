@@ -0,0 +1,90 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Test automatic corking
+// RUN: $subdir$stem |& ezio $test
+// RUN-END:
+
+// CHECK-NEXT: ^connect:1$
+// CHECK-NEXT: ^queued:0 0 0$
+// CHECK-NEXT: ^count:1 1 1$
+// CHECK-NEXT: ^a.cmi b.cmi c.cmi$
+// CHECK-NEXT: ^needed:d.cmi 2$
+// CHECK-NEXT: ^bytes:0 1 3$
+// CHECK-NEXT: ^deadline:1 0 -1 1$
+// CHECK-NEXT: ^dropped:g.cmi 5$
+// CHECK-NEXT: ^taken:1 0$
+// CHECK-NEXT: ^counts:9 5$
+// CHECK-NEXT: $EOF
+
+// Cody
+#include "cody.hh"
+// C++
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+
+using namespace Cody;
+
+int main (int, char *[])
+{
+  Resolver r;
+  Server server (&r);
+  BatchClient client (&server);
+
+  auto p = client.Connect ("TEST", "IDENT");
+  std::cerr << "connect:" << p.GetCode () << '\n';
+
+  // Sent at the third
+  client.SetLimits (3, 0, 0);
+  auto a = client.ModuleImport ("a");
+  auto b = client.ModuleImport ("b");
+  std::cerr << "queued:" << a.IsReady () << ' ' << b.IsReady () << ' '
+	    << client.GetBlocks () << '\n';
+  auto c = client.ModuleImport ("c");
+  std::cerr << "count:" << a.IsReady () << ' ' << c.IsReady () << ' '
+	    << client.GetBlocks () << '\n';
+  std::cerr << a.Get ().GetString () << ' ' << b.Get ().GetString () << ' '
+	    << c.Get ().GetString () << '\n';
+
+  // Sent when needed
+  auto d = client.ModuleImport ("d");
+  std::cerr << "needed:" << d.Get ().GetString () << ' '
+	    << client.GetBlocks () << '\n';
+
+  // Sent at the second, each being 30 bytes
+  client.SetLimits (0, 50, 0);
+  auto e1 = client.ModuleImport ("eeeeeeeeeeeeeee");
+  bool early = e1.IsReady ();
+  auto e2 = client.ModuleImport ("fffffffffffffff");
+  std::cerr << "bytes:" << early << ' ' << e1.IsReady () << ' '
+	    << client.GetBlocks () << '\n';
+
+  // Sent by Poll, once the oldest has waited
+  client.SetLimits (0, 0, 1000);
+  auto f = client.ModuleImport ("f");
+  int remaining = client.Poll ();
+  early = f.IsReady ();
+  std::this_thread::sleep_for (std::chrono::milliseconds (2));
+  std::cerr << "deadline:" << (remaining > 0 && remaining <= 1000) << ' '
+	    << early << ' ' << client.Poll () << ' ' << f.IsReady () << '\n';
+
+  // A destroyed Future's response is discarded
+  client.SetLimits (0, 0, 0);
+  client.ModuleImport ("dropped");
+  auto g = client.ModuleImport ("g");
+  std::cerr << "dropped:" << g.Get ().GetString () << ' '
+	    << client.GetBlocks () << '\n';
+
+  // A response is only taken once
+  p = g.Get ();
+  std::cerr << "taken:" << (p.GetCode () == Client::PC_ERROR) << ' '
+	    << g.IsValid () << '\n';
+
+  std::cerr << "counts:" << client.GetRequests () << ' '
+	    << client.GetBlocks () << '\n';
+
+  return 0;
+}
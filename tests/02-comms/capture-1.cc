@@ -0,0 +1,90 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Test capture log
+// RUN: $subdir$stem |& ezio $test
+// RUN-END:
+
+// CHECK-NEXT: ^open:0$
+// CHECK-NEXT: ^read:0 9$
+// CHECK-NEXT: ^0 1:$
+// CHECK-NEXT: ^0 2:$
+// CHECK-NEXT: ^1 1:HELLO 1 TEST one$
+// CHECK-NEXT: ^2 1:HELLO 1 default$
+// CHECK-NEXT: ^1 2:HELLO 1 TEST two$
+// CHECK-NEXT: ^2 2:HELLO 1 default$
+// CHECK-NEXT: ^1 1:MODULE-REPO ;\\nMODULE-IMPORT foo$
+// CHECK-NEXT: ^2 1:PATHNAME cmi.cache ;\\nPATHNAME foo.cmi$
+// CHECK-NEXT: ^3 1:$
+// CHECK-NEXT: ^times:ok$
+// CHECK-NEXT: ^malformed:22$
+// CHECK-NEXT: $EOF
+
+// Cody
+#include "cody.hh"
+// C++
+#include <fstream>
+#include <iostream>
+// OS
+#include <unistd.h>
+
+using namespace Cody;
+
+int main (int, char *[])
+{
+  char const *path = "capture-1.log";
+
+  Resolver r;
+  Capture capture;
+  std::cerr << "open:" << capture.Open (path) << '\n';
+
+  {
+    Server one (&r), two (&r);
+    one.SetCapture (&capture);
+    two.SetCapture (&capture);
+    Client c1 (&one), c2 (&two);
+    c1.Connect ("TEST", "one");
+    c2.Connect ("TEST", "two");
+    c1.Cork ();
+    c1.ModuleRepo ();
+    c1.ModuleImport ("foo");
+    c1.Uncork ();
+    // Stop capturing the second
+    two.SetCapture (nullptr);
+  }
+  capture.Close ();
+
+  std::vector<Capture::Record> records;
+  int err = Capture::Read (path, records);
+  std::cerr << "read:" << err << ' ' << records.size () << '\n';
+  bool ordered = true;
+  for (auto &record : records)
+    {
+      std::string text;
+      for (char c : record.text)
+	if (c == '\n')
+	  text.append ("\\n");
+	else
+	  text.push_back (c);
+      // Drop the final newline
+      if (text.size () >= 2)
+	text.resize (text.size () - 2);
+      std::cerr << record.kind << ' ' << record.connection
+		<< ':' << text << '\n';
+      if (&record != &records[0] && record.time < (&record)[-1].time)
+	ordered = false;
+    }
+  std::cerr << "times:" << (ordered ? "ok" : "bad") << '\n';
+
+  {
+    // Truncated
+    std::ofstream (path, std::ios::app) << "junk";
+    records.clear ();
+    std::cerr << "malformed:" << Capture::Read (path, records) << '\n';
+  }
+
+  unlink (path);
+
+  return 0;
+}
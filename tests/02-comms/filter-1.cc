@@ -0,0 +1,113 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Test include filter at handshake, and local include translation
+// RUN: $subdir$stem |& ezio $test
+// RUN-END:
+
+// CHECK-NEXT: ^connect:1 tag:3$
+// CHECK-NEXT: ^server:./hdr.h$
+// CHECK-NEXT: ^./hdr.h:5$
+// CHECK-NEXT: ^./other.h:4 0$
+// CHECK-NEXT: ^server:./textual.h$
+// CHECK-NEXT: ^./textual.h:4 1$
+// CHECK-NEXT: ^server:./hdr.h$
+// CHECK-NEXT: ^corked:5 4 5$
+// CHECK-NEXT: ^reconnect:1 tag:3$
+// CHECK-NEXT: ^stale:1 tag:0$
+// CHECK-NEXT: $EOF
+
+// Cody
+#include "cody.hh"
+// C++
+#include <iostream>
+
+using namespace Cody;
+
+class Translator : public Resolver
+{
+public:
+  IncludeFilter filter;
+
+public:
+  Translator ()
+  {
+    filter.Reset (3, 2);
+    filter.Add ("./hdr.h");
+    // Not translated, but not FALSE either
+    filter.Add ("./textual.h");
+  }
+
+public:
+  virtual IncludeFilter const *GetIncludeFilter ()
+  {
+    return &filter;
+  }
+  virtual int IncludeTranslateRequest (Server *s, Flags, std::string &inc)
+  {
+    std::cerr << "server:" << inc << '\n';
+    if (inc == "./textual.h")
+      s->BoolResponse (true);
+    else
+      s->PathnameResponse (inc + ".cmi");
+    return 0;
+  }
+};
+
+int main (int, char *[])
+{
+  Translator r;
+  IncludeFilter filter;
+
+  {
+    Server server (&r);
+    Client client (&server);
+    client.SetIncludeFilter (&filter);
+
+    auto t = client.Connect ("TEST", "IDENT");
+    std::cerr << "connect:" << t.GetCode ()
+	      << " tag:" << filter.GetTag () << '\n';
+
+    auto p = client.IncludeTranslate ("./hdr.h");
+    std::cerr << "./hdr.h:" << p.GetCode () << '\n';
+    p = client.IncludeTranslate ("./other.h");
+    std::cerr << "./other.h:" << p.GetCode () << ' ' << p.GetInteger () << '\n';
+    p = client.IncludeTranslate ("./textual.h");
+    std::cerr << "./textual.h:" << p.GetCode () << ' ' << p.GetInteger ()
+	      << '\n';
+
+    client.Cork ();
+    client.IncludeTranslate ("./hdr.h");
+    client.IncludeTranslate ("./other.h");
+    client.ModuleRepo ();
+    auto results = client.Uncork ();
+    std::cerr << "corked:";
+    for (auto &result : results)
+      std::cerr << (&result == &results[0] ? "" : " ") << result.GetCode ();
+    std::cerr << '\n';
+  }
+
+  {
+    // Current filter is not resent
+    Server server (&r);
+    Client client (&server);
+    client.SetIncludeFilter (&filter);
+    auto t = client.Connect ("TEST", "IDENT");
+    std::cerr << "reconnect:" << t.GetCode ()
+	      << " tag:" << filter.GetTag () << '\n';
+  }
+
+  {
+    // Server with no filter
+    Resolver plain;
+    Server server (&plain);
+    Client client (&server);
+    client.SetIncludeFilter (&filter);
+    auto t = client.Connect ("TEST", "IDENT");
+    std::cerr << "stale:" << t.GetCode ()
+	      << " tag:" << filter.GetTag () << '\n';
+  }
+
+  return 0;
+}
@@ -0,0 +1,116 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Test server loop, with immediate and deferred responses
+// RUN: $subdir$stem |& ezio $test
+// RUN-END:
+
+// CHECK-NEXT: ^connected$
+// CHECK-NEXT: ^connected$
+// CHECK-NEXT: ^repo:5 cmi.cache$
+// CHECK-NEXT: ^invoke:3$
+// CHECK-NEXT: ^corked:5 3 5$
+// CHECK-NEXT: ^disconnected$
+// CHECK-NEXT: ^pipe:5 foo.cmi$
+// CHECK-NEXT: ^disconnected$
+// CHECK-NEXT: ^run:0 0$
+// CHECK-NEXT: $EOF
+
+// Cody
+#include "cody.hh"
+// C++
+#include <iostream>
+#include <thread>
+// C
+#include <csignal>
+// OS
+#include <unistd.h>
+
+using namespace Cody;
+
+class Loop : public ServerLoop
+{
+  SubProcessPool *pool;
+
+public:
+  Loop (Resolver *r, SubProcessPool *p)
+    : ServerLoop (r), pool (p)
+  {
+    AddNotifier (pool->GetNotifyFD ());
+  }
+
+protected:
+  virtual void Connected (Server *)
+  {
+    std::cerr << "connected\n";
+  }
+  virtual void Disconnected (Server *s)
+  {
+    pool->Cancel (s);
+    std::cerr << "disconnected\n";
+  }
+  virtual void Notify (int)
+  {
+    pool->Collect ();
+  }
+};
+
+int main (int, char *[])
+{
+  signal (SIGPIPE, SIG_IGN);
+
+  Resolver r;
+  SubProcessPool pool (2);
+  r.SetSubProcessPool (&pool);
+  Loop loop (&r, &pool);
+
+  int sock[2], up[2], down[2];
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, sock) < 0
+      || pipe (up) < 0 || pipe (down) < 0)
+    return 1;
+  loop.AddConnection (sock[0]);
+  loop.AddConnection (up[0], down[1]);
+
+  // The clients take turns, so the output is ordered
+  std::thread compilers ([&] ()
+    {
+      {
+	Client client (sock[1]);
+	client.Connect ("TEST", "IDENT");
+	auto p = client.ModuleRepo ();
+	std::cerr << "repo:" << p.GetCode () << ' ' << p.GetString () << '\n';
+
+	std::vector<char const *> args {"sleep", "0.1"};
+	p = client.InvokeSubProcess (args);
+	std::cerr << "invoke:" << p.GetCode () << '\n';
+
+	client.Cork ();
+	client.ModuleRepo ();
+	client.InvokeSubProcess (args);
+	client.ModuleRepo ();
+	auto results = client.Uncork ();
+	std::cerr << "corked:";
+	for (auto &result : results)
+	  std::cerr << (&result == &results[0] ? "" : " ") << result.GetCode ();
+	std::cerr << '\n';
+	close (sock[1]);
+      }
+      // Wait for the disconnection to be seen
+      usleep (100000);
+      {
+	Client client (down[0], up[1]);
+	client.Connect ("TEST", "IDENT");
+	auto p = client.ModuleImport ("foo");
+	std::cerr << "pipe:" << p.GetCode () << ' ' << p.GetString () << '\n';
+	close (up[1]);
+	close (down[0]);
+      }
+    });
+
+  int err = loop.Run ();
+  compilers.join ();
+  std::cerr << "run:" << err << ' ' << loop.GetConnectionCount () << '\n';
+
+  return 0;
+}
@@ -0,0 +1,88 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Test server loop buffer memory accounting
+// RUN: $subdir$stem |& ezio $test
+// RUN-END:
+
+// CHECK-NEXT: ^HELLO 1 default$
+// CHECK-NEXT: ^idle:0 0$
+// CHECK-NEXT: ^reading:1 1$
+// CHECK-NEXT: ^PATHNAME cmi.cache$
+// CHECK-NEXT: ^idle:0 0$
+// CHECK-NEXT: ^trim:0$
+// CHECK-NEXT: ^limit:1 0$
+// CHECK-NEXT: $EOF
+
+// Cody
+#include "cody.hh"
+// C++
+#include <iostream>
+#include <string>
+// C
+#include <csignal>
+// OS
+#include <unistd.h>
+
+using namespace Cody;
+
+// Send TEXT to the loop, and step it once
+static void Send (ServerLoop &loop, int fd, std::string const &text)
+{
+  (void)!write (fd, text.data (), text.size ());
+  loop.Step (1000);
+}
+
+// Print the response
+static void Receive (int fd)
+{
+  char buffer[200];
+  ssize_t count = read (fd, buffer, sizeof (buffer) - 1);
+  std::string line (buffer, count > 1 ? size_t (count - 1) : 0);
+  std::cerr << line << '\n';
+}
+
+int main (int, char *[])
+{
+  signal (SIGPIPE, SIG_IGN);
+
+  Resolver r;
+  ServerLoop loop (&r);
+
+  int sock[2];
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, sock) < 0)
+    return 1;
+  Server *s = loop.AddConnection (sock[0]);
+
+  Send (loop, sock[1], "HELLO 1 TEST IDENT\n");
+  Receive (sock[1]);
+  // Buffers go back to the pool after the turn
+  std::cerr << "idle:" << loop.GetMemoryUsage (s) << ' '
+	    << ServerLoop::GetMemoryUsage () << '\n';
+
+  // Part of a request
+  Send (loop, sock[1], "MODULE-REPO");
+  std::cerr << "reading:" << (loop.GetMemoryUsage (s) != 0) << ' '
+	    << (ServerLoop::GetMemoryUsage () == loop.GetMemoryUsage (s))
+	    << '\n';
+  Send (loop, sock[1], "\n");
+  Receive (sock[1]);
+  std::cerr << "idle:" << loop.GetMemoryUsage (s) << ' '
+	    << ServerLoop::GetMemoryUsage () << '\n';
+
+  // Wakes to trim the pool, rather than waiting for ever
+  loop.SetIdleTimeout (0);
+  std::cerr << "trim:" << loop.Step (-1) << '\n';
+
+  // A read over the limit closes the connection
+  ServerLoop::SetMemoryLimit (64);
+  Send (loop, sock[1], std::string (300, 'x'));
+  ServerLoop::SetMemoryLimit (0);
+  char c;
+  std::cerr << "limit:" << (read (sock[1], &c, 1) <= 0) << ' '
+	    << loop.GetConnectionCount () << '\n';
+  close (sock[1]);
+
+  return 0;
+}
@@ -0,0 +1,79 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Test server loop processes lines as they arrive
+// RUN: $subdir$stem |& ezio $test
+// RUN-END:
+
+// CHECK-NEXT: ^resolver:repo$
+// CHECK-NEXT: ^held:1$
+// CHECK-NEXT: ^resolver:import foo$
+// CHECK-NEXT: ^HELLO 1 default ;$
+// CHECK-NEXT: ^PATHNAME cmi.cache ;$
+// CHECK-NEXT: ^PATHNAME foo.cmi$
+// CHECK-NEXT: $EOF
+
+// Cody
+#include "cody.hh"
+// C++
+#include <iostream>
+#include <string>
+// C
+#include <cerrno>
+#include <csignal>
+// OS
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace Cody;
+
+class Noisy : public Resolver
+{
+public:
+  virtual int ModuleRepoRequest (Server *s)
+  {
+    std::cerr << "resolver:repo\n";
+    return Resolver::ModuleRepoRequest (s);
+  }
+  virtual int ModuleImportRequest (Server *s, Flags flags,
+				   std::string &module)
+  {
+    std::cerr << "resolver:import " << module << '\n';
+    return Resolver::ModuleImportRequest (s, flags, module);
+  }
+};
+
+int main (int, char *[])
+{
+  signal (SIGPIPE, SIG_IGN);
+
+  Noisy r;
+  ServerLoop loop (&r);
+
+  int sock[2];
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, sock) < 0)
+    return 1;
+  fcntl (sock[1], F_SETFL, fcntl (sock[1], F_GETFL) | O_NONBLOCK);
+  loop.AddConnection (sock[0]);
+
+  // The block is incomplete, but its first lines are processed
+  std::string part = "HELLO 1 TEST IDENT ;\nMODULE-REPO ;\nMODULE-IMP";
+  (void)!write (sock[1], part.data (), part.size ());
+  loop.Step (1000);
+
+  // Responses are held until the block ends
+  char buffer[200];
+  ssize_t count = read (sock[1], buffer, sizeof (buffer));
+  std::cerr << "held:" << (count < 0 && errno == EAGAIN) << '\n';
+
+  part = "ORT foo\n";
+  (void)!write (sock[1], part.data (), part.size ());
+  loop.Step (1000);
+
+  count = read (sock[1], buffer, sizeof (buffer));
+  std::cerr << std::string (buffer, count > 0 ? size_t (count) : 0);
+  close (sock[1]);
+
+  return 0;
+}
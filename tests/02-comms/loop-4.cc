@@ -0,0 +1,138 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Test server loop with the io_uring backend, or its fallback
+// RUN: $subdir$stem |& ezio $test
+// RUN-END:
+
+// CHECK-NEXT: ^backend:1 1$
+// CHECK-NEXT: ^connected$
+// CHECK-NEXT: ^connected$
+// CHECK-NEXT: ^repo:5 cmi.cache$
+// CHECK-NEXT: ^corked:5 5 3$
+// CHECK-NEXT: ^large:5 64$
+// CHECK-NEXT: ^disconnected$
+// CHECK-NEXT: ^pipe:5 foo.cmi$
+// CHECK-NEXT: ^disconnected$
+// CHECK-NEXT: ^run:0 0 1$
+// CHECK-NEXT: $EOF
+
+// Cody
+#include "cody.hh"
+// C++
+#include <iostream>
+#include <thread>
+// C
+#include <cerrno>
+#include <csignal>
+// OS
+#include <unistd.h>
+
+using namespace Cody;
+
+class Loop : public ServerLoop
+{
+  SubProcessPool *pool;
+
+public:
+  Loop (Resolver *r, SubProcessPool *p)
+    : ServerLoop (r), pool (p)
+  {
+  }
+
+public:
+  int Start ()
+  {
+    int err = SetBackend (URING);
+    AddNotifier (pool->GetNotifyFD ());
+    return err;
+  }
+
+protected:
+  virtual void Connected (Server *)
+  {
+    std::cerr << "connected\n";
+  }
+  virtual void Disconnected (Server *s)
+  {
+    pool->Cancel (s);
+    std::cerr << "disconnected\n";
+  }
+  virtual void Notify (int)
+  {
+    pool->Collect ();
+  }
+};
+
+int main (int, char *[])
+{
+  signal (SIGPIPE, SIG_IGN);
+
+  Resolver r;
+  SubProcessPool pool (2);
+  r.SetSubProcessPool (&pool);
+  Loop loop (&r, &pool);
+
+  // Either io_uring is in use, or the loop fell back to poll
+  int err = loop.Start ();
+  std::cerr << "backend:" << (!err || loop.GetBackend () == Loop::POLL)
+	    << ' ' << (loop.SetBackend (Loop::POLL) == (err ? 0 : EBUSY))
+	    << '\n';
+
+  int sock[2], up[2], down[2];
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, sock) < 0
+      || pipe (up) < 0 || pipe (down) < 0)
+    return 1;
+  loop.AddConnection (sock[0]);
+  loop.AddConnection (up[0], down[1]);
+
+  std::thread compilers ([&] ()
+    {
+      {
+	Client client (sock[1]);
+	client.Connect ("TEST", "IDENT");
+	auto p = client.ModuleRepo ();
+	std::cerr << "repo:" << p.GetCode () << ' ' << p.GetString () << '\n';
+
+	// A deferred response in the middle of the block
+	std::vector<char const *> args {"sleep", "0.1"};
+	client.Cork ();
+	client.ModuleRepo ();
+	client.ModuleRepo ();
+	client.InvokeSubProcess (args);
+	auto results = client.Uncork ();
+	std::cerr << "corked:";
+	for (auto &result : results)
+	  std::cerr << (&result == &results[0] ? "" : " ") << result.GetCode ();
+	std::cerr << '\n';
+
+	// More than one read's worth
+	client.Cork ();
+	std::string name (1000, 'm');
+	for (unsigned ix = 0; ix != 64; ix++)
+	  client.ModuleImport (name.c_str ());
+	results = client.Uncork ();
+	std::cerr << "large:" << results[0].GetCode () << ' '
+		  << results.size () << '\n';
+	close (sock[1]);
+      }
+      // Wait for the disconnection to be seen
+      usleep (100000);
+      {
+	Client client (down[0], up[1]);
+	client.Connect ("TEST", "IDENT");
+	auto p = client.ModuleImport ("foo");
+	std::cerr << "pipe:" << p.GetCode () << ' ' << p.GetString () << '\n';
+	close (up[1]);
+	close (down[0]);
+      }
+    });
+
+  err = loop.Run ();
+  compilers.join ();
+  std::cerr << "run:" << err << ' ' << loop.GetConnectionCount () << ' '
+	    << (loop.GetSyscallCount () != 0) << '\n';
+
+  return 0;
+}
@@ -0,0 +1,154 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Test server loop processes large blocks in slices
+// RUN: $subdir$stem |& ezio $test
+// RUN-END:
+
+// CHECK-NEXT: ^interleaved:1$
+// CHECK-NEXT: ^responses:1001 2$
+// CHECK-NEXT: ^slices:1 1 0$
+// CHECK-NEXT: ^weight:3 1$
+// CHECK-NEXT: ^weighted:1$
+// CHECK-NEXT: $EOF
+
+// Cody
+#include "cody.hh"
+// C++
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+// C
+#include <cerrno>
+#include <csignal>
+// OS
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace Cody;
+
+// Remembers the order of imports
+
+class Recorder : public Resolver
+{
+public:
+  std::vector<std::string> order;
+
+public:
+  virtual int ModuleImportRequest (Server *s, Flags flags,
+				   std::string &module)
+  {
+    order.push_back (module);
+    return Resolver::ModuleImportRequest (s, flags, module);
+  }
+};
+
+// A corked block of COUNT imports, named by PREFIX
+
+static void Send (int fd, char const *prefix, unsigned count)
+{
+  std::string block ("HELLO 1 TEST IDENT");
+  for (unsigned ix = 0; ix != count; ix++)
+    {
+      block.append (" ;\nMODULE-IMPORT ");
+      block.append (prefix);
+      block.append (std::to_string (ix));
+    }
+  block.push_back ('\n');
+  (void)!write (fd, block.data (), block.size ());
+}
+
+// Read a response block, stepping LOOP until it is written, and
+// return its lines
+
+static unsigned Receive (ServerLoop &loop, int fd)
+{
+  std::string text;
+  char buffer[4096];
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+  while (text.size () < 2 || text.back () != '\n'
+	 || text[text.size () - 2] == ';')
+    {
+      ssize_t count = read (fd, buffer, sizeof (buffer));
+      if (count > 0)
+	text.append (buffer, count);
+      else if (count < 0 && errno == EAGAIN)
+	loop.Step (0);
+      else
+	break;
+    }
+
+  return unsigned (std::count (text.begin (), text.end (), '\n'));
+}
+
+static size_t Position (std::vector<std::string> const &order,
+			char const *name)
+{
+  return std::find (order.begin (), order.end (), name) - order.begin ();
+}
+
+int main (int, char *[])
+{
+  signal (SIGPIPE, SIG_IGN);
+
+  {
+    // A small block is answered while a large one, already read, is
+    // processed
+    Recorder r;
+    ServerLoop loop (&r);
+    loop.SetSliceLines (10);
+    int a[2], b[2];
+    if (socketpair (AF_UNIX, SOCK_STREAM, 0, a) < 0
+	|| socketpair (AF_UNIX, SOCK_STREAM, 0, b) < 0)
+      return 1;
+    loop.AddConnection (a[0]);
+    loop.AddConnection (b[0]);
+
+    Send (a[1], "a", 1000);
+    while (!loop.GetQueueDepth ())
+      loop.Step (0);
+    Send (b[1], "b", 1);
+    while (r.order.size () != 1001 || loop.GetQueueDepth ())
+      loop.Step (0);
+    std::cerr << "interleaved:" << (Position (r.order, "b0") < 500) << '\n';
+    std::cerr << "responses:" << Receive (loop, a[1]) << ' '
+	      << Receive (loop, b[1]) << '\n';
+    std::cerr << "slices:" << (loop.GetSliceCount () >= 50) << ' '
+	      << (loop.GetMaxQueueDepth () >= 1) << ' '
+	      << loop.GetQueueDepth () << '\n';
+    close (a[1]);
+    close (b[1]);
+  }
+
+  {
+    // A heavier connection gets more of each turn
+    Recorder r;
+    ServerLoop loop (&r);
+    loop.SetSliceLines (10);
+    int a[2], c[2];
+    if (socketpair (AF_UNIX, SOCK_STREAM, 0, a) < 0
+	|| socketpair (AF_UNIX, SOCK_STREAM, 0, c) < 0)
+      return 1;
+    loop.AddConnection (a[0]);
+    Server *heavy = loop.AddConnection (c[0]);
+    loop.SetWeight (heavy, 3);
+    std::cerr << "weight:" << loop.GetWeight (heavy) << ' '
+	      << loop.GetWeight (nullptr) << '\n';
+
+    Send (a[1], "a", 600);
+    Send (c[1], "c", 600);
+    while (r.order.size () != 1200 || loop.GetQueueDepth ())
+      loop.Step (0);
+    std::cerr << "weighted:"
+	      << (Position (r.order, "c599") < Position (r.order, "a400"))
+	      << '\n';
+    Receive (loop, a[1]);
+    Receive (loop, c[1]);
+    close (a[1]);
+    close (c[1]);
+  }
+
+  return 0;
+}
@@ -0,0 +1,114 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Test response cache, shared between clients
+// RUN: $subdir$stem |& ezio $test
+// RUN-END:
+
+// CHECK-NEXT: ^server:import foo$
+// CHECK-NEXT: ^foo:5 foo.cmi$
+// CHECK-NEXT: ^foo:5 foo.cmi$
+// CHECK-NEXT: ^server:include ./hdr.h$
+// CHECK-NEXT: ^server:include ./hdr.h$
+// CHECK-NEXT: ^server:import bar$
+// CHECK-NEXT: ^corked:4 5 4$
+// CHECK-NEXT: ^corked:4 5 5 4$
+// CHECK-NEXT: ^server:import foo$
+// CHECK-NEXT: ^invalidated:5 foo.cmi$
+// CHECK-NEXT: ^server:import baz$
+// CHECK-NEXT: ^server:import baz$
+// CHECK-NEXT: ^error:2 2$
+// CHECK-NEXT: $EOF
+
+// Cody
+#include "cody.hh"
+// C++
+#include <iostream>
+
+using namespace Cody;
+
+class Noisy : public Resolver
+{
+public:
+  virtual int ModuleImportRequest (Server *s, Flags, std::string &module)
+  {
+    std::cerr << "server:import " << module << '\n';
+    if (module == "baz")
+      s->ErrorResponse ("no baz");
+    else
+      s->PathnameResponse (module + ".cmi");
+    return 0;
+  }
+  virtual int IncludeTranslateRequest (Server *s, Flags flags,
+				       std::string &inc)
+  {
+    std::cerr << "server:include " << inc << '\n';
+    s->BoolResponse (flags == Flags::None);
+    return 0;
+  }
+};
+
+static void Print (char const *what, std::vector<Packet> const &results)
+{
+  std::cerr << what << ':';
+  for (auto &result : results)
+    std::cerr << (&result == &results[0] ? "" : " ") << result.GetCode ();
+  std::cerr << '\n';
+}
+
+int main (int, char *[])
+{
+  Noisy r;
+  ResponseCache cache;
+
+  {
+    Server server (&r);
+    Client client (&server);
+    client.SetResponseCache (&cache);
+    client.Connect ("TEST", "IDENT");
+
+    auto p = client.ModuleImport ("foo");
+    std::cerr << "foo:" << p.GetCode () << ' ' << p.GetString () << '\n';
+    p = client.ModuleImport ("foo");
+    std::cerr << "foo:" << p.GetCode () << ' ' << p.GetString () << '\n';
+
+    // Flags are part of the key
+    client.IncludeTranslate ("./hdr.h");
+    client.IncludeTranslate ("./hdr.h", Flags::NameOnly);
+    client.IncludeTranslate ("./hdr.h");
+
+    client.Cork ();
+    client.IncludeTranslate ("./hdr.h");
+    client.ModuleImport ("bar");
+    client.IncludeTranslate ("./hdr.h", Flags::NameOnly);
+    Print ("corked", client.Uncork ());
+  }
+
+  {
+    // A second connection sees the first's responses
+    Server server (&r);
+    Client client (&server);
+    client.SetResponseCache (&cache);
+    client.Connect ("TEST", "IDENT");
+
+    client.Cork ();
+    client.IncludeTranslate ("./hdr.h");
+    client.ModuleImport ("bar");
+    client.ModuleImport ("foo");
+    client.IncludeTranslate ("./hdr.h", Flags::NameOnly);
+    Print ("corked", client.Uncork ());
+
+    cache.Invalidate ("foo");
+    auto p = client.ModuleImport ("foo");
+    std::cerr << "invalidated:" << p.GetCode ()
+	      << ' ' << p.GetString () << '\n';
+
+    // Errors are not remembered
+    auto e1 = client.ModuleImport ("baz");
+    auto e2 = client.ModuleImport ("baz");
+    std::cerr << "error:" << e1.GetCode () << ' ' << e2.GetCode () << '\n';
+  }
+
+  return 0;
+}
@@ -0,0 +1,79 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Test memory resources
+// RUN: $subdir$stem |& ezio $test
+// RUN-END:
+
+// CHECK-NEXT: ^pool:reused 1$
+// CHECK-NEXT: ^arena:next 1$
+// CHECK-NEXT: ^arena:aligned 1$
+// CHECK-NEXT: ^arena:reset 1$
+// CHECK-NEXT: ^turn:0 5 foo.cmi$
+// CHECK-NEXT: ^turn:1 5 foo.cmi$
+// CHECK-NEXT: ^turn:2 5 foo.cmi$
+// CHECK-NEXT: ^resource:1$
+// CHECK-NEXT: $EOF
+
+// Cody
+#include "cody.hh"
+// C++
+#include <iostream>
+// C
+#include <cstdint>
+
+using namespace Cody;
+
+int main (int, char *[])
+{
+  {
+    PoolResource pool;
+    void *a = pool.Allocate (100, 8);
+    pool.Deallocate (a, 100, 8);
+    // Same size class
+    void *b = pool.Allocate (120, 8);
+    std::cerr << "pool:reused " << (a == b) << '\n';
+    pool.Deallocate (b, 120, 8);
+  }
+
+  {
+    ArenaResource arena (256);
+    char *a = static_cast<char *> (arena.Allocate (10, 1));
+    char *b = static_cast<char *> (arena.Allocate (10, 1));
+    std::cerr << "arena:next " << (b == a + 10) << '\n';
+    void *c = arena.Allocate (8, 8);
+    std::cerr << "arena:aligned " << !(uintptr_t (c) & 7) << '\n';
+    // Overflows the first chunk, the second is kept
+    void *d = arena.Allocate (1000, 8);
+    arena.Allocate (1, 1);
+    arena.Reset ();
+    void *e = arena.Allocate (1000, 8);
+    std::cerr << "arena:reset " << (d == e) << '\n';
+  }
+
+  {
+    // A connection whose buffers come from an arena reset each turn
+    ArenaResource arena;
+    Resolver r;
+    Server server (&r);
+    Client client (&server);
+    server.SetMemoryResource (&arena);
+    client.SetMemoryResource (&arena);
+    client.Connect ("TEST", "IDENT");
+    for (unsigned turn = 0; turn != 3; turn++)
+      {
+	auto p = client.ModuleImport ("foo");
+	std::cerr << "turn:" << turn << ' ' << p.GetCode () << ' '
+		  << p.GetString () << '\n';
+	server.SetMemoryResource (&arena);
+	client.SetMemoryResource (&arena);
+	arena.Reset ();
+      }
+
+    Detail::MessageBuffer buffer (&arena);
+    std::cerr << "resource:" << (buffer.GetResource () == &arena) << '\n';
+  }
+
+  return 0;
+}
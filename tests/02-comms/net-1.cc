@@ -0,0 +1,207 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Test socket options, and latency over loopback
+// RUN: $subdir$stem |& ezio $test
+// RUN-END:
+
+// CHECK-NEXT: ^options:1 1 1 1 1$
+// CHECK-NEXT: ^inet4:1 1$
+// CHECK-NEXT: ^inet4:PATHNAME ok$
+// CHECK-NEXT: ^dual:1 1$
+// CHECK-NEXT: ^dual:PATHNAME ok$
+// CHECK-NEXT: ^abstract:1 1$
+// CHECK-NEXT: ^abstract:PATHNAME ok$
+// CHECK-NEXT: ^file:0$
+// CHECK-NEXT: ^long:36$
+// CHECK-NEXT: ^legacy:0 0 0$
+// CHECK-NEXT: $EOF
+
+// Cody
+#include "cody.hh"
+// C++
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+// C
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+// OS
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+using namespace Cody;
+using Clock = std::chrono::steady_clock;
+
+// Serve one connection until end of file
+
+static void Serve (Resolver *r, int fd)
+{
+  Server server (r, fd);
+
+  for (;;)
+    {
+      int err;
+      server.PrepareToRead ();
+      while ((err = server.Read ()) == EAGAIN || err == EINTR)
+	continue;
+      if (err)
+	break;
+      server.ProcessRequests ();
+      server.PrepareToWrite ();
+      while ((err = server.Write ()) == EAGAIN || err == EINTR)
+	continue;
+      if (err)
+	break;
+    }
+  close (fd);
+}
+
+static int GetOption (int fd, int level, int name)
+{
+  int value = 0;
+  socklen_t len = sizeof (value);
+  getsockopt (fd, level, name, &value, &len);
+
+  return value;
+}
+
+// Accept a connection on LISTENER, made by CONNECTOR, and time
+// round trips of a block sent as two writes.  Without TCP_NODELAY,
+// the second waits for the first's acknowledgment, which the peer
+// delays.
+
+template<typename T>
+static void RoundTrips (char const *name, int listener, T connector)
+{
+  Resolver r;
+  int fd = listener >= 0 ? connector () : -1;
+  int server = fd >= 0 ? accept (listener, nullptr, nullptr) : -1;
+  std::cerr << name << ':' << (listener >= 0) << ' ' << (server >= 0) << '\n';
+  if (server < 0)
+    return;
+
+  std::thread thread (Serve, &r, server);
+  std::string code;
+  Clock::duration slowest {};
+  char buffer[100];
+  (void)!write (fd, "HELLO 1 TEST\n", 13);
+  (void)!read (fd, buffer, sizeof (buffer));
+  for (unsigned ix = 0; ix != 20; ix++)
+    {
+      auto start = Clock::now ();
+      (void)!write (fd, "MODULE-REPO ;\n", 14);
+      (void)!write (fd, "MODULE-IMPORT foo\n", 18);
+      ssize_t count = read (fd, buffer, sizeof (buffer));
+      slowest = std::max (slowest, Clock::now () - start);
+      code.assign (buffer, count > 0 ? strcspn (buffer, " ") : 0);
+    }
+  close (fd);
+  thread.join ();
+  close (listener);
+
+  // Delayed acknowledgments take tens of milliseconds
+  std::cerr << name << ':' << code << ' '
+	    << (slowest < std::chrono::milliseconds (20) ? "ok" : "slow") << '\n';
+}
+
+int main (int, char *[])
+{
+  signal (SIGPIPE, SIG_IGN);
+
+  {
+    SocketOptions options;
+    options.family = SocketOptions::INET4;
+    options.nonBlocking = true;
+    options.receiveBuffer = 65536;
+    options.sendBuffer = 65536;
+    options.backlog = 4;
+    int listener = ListenInet (nullptr, "127.0.0.1", 0, options);
+    sockaddr_in addr;
+    socklen_t len = sizeof (addr);
+    getsockname (listener, (sockaddr *)&addr, &len);
+
+    // The listener is non-blocking, the connection is not
+    int fd = -1;
+    options.nonBlocking = false;
+    RoundTrips ("inet4", listener, [&] ()
+		{
+		  fd = OpenInet (nullptr, "127.0.0.1", ntohs (addr.sin_port),
+				 options);
+		  std::cerr << "options:"
+			    << GetOption (fd, IPPROTO_TCP, TCP_NODELAY)
+			    << ' ' << (GetOption (fd, SOL_SOCKET, SO_RCVBUF)
+				       >= 65536)
+			    << ' ' << bool (fcntl (fd, F_GETFD) & FD_CLOEXEC)
+			    << ' ' << !(fcntl (fd, F_GETFL) & O_NONBLOCK)
+			    << ' ' << bool (fcntl (listener, F_GETFL)
+					    & O_NONBLOCK)
+			    << '\n';
+		  return fd;
+		});
+  }
+
+  {
+    // An IPv6 listener accepting IPv4 connections, with Fast Open
+    SocketOptions options;
+    options.family = SocketOptions::DUAL;
+    options.fastOpen = true;
+    int listener = ListenInet (nullptr, "::", 0, options);
+    sockaddr_in6 addr;
+    socklen_t len = sizeof (addr);
+    getsockname (listener, (sockaddr *)&addr, &len);
+    options.family = SocketOptions::INET4;
+    RoundTrips ("dual", listener, [&] ()
+		{
+		  return OpenInet (nullptr, "127.0.0.1",
+				   ntohs (addr.sin6_port), options);
+		});
+  }
+
+  {
+    SocketOptions options;
+    options.abstract = true;
+    std::string name ("cody-net-1-");
+    name.append (std::to_string (getpid ()));
+    int listener = ListenLocal (nullptr, name.c_str (), options);
+    RoundTrips ("abstract", listener, [&] ()
+		{
+		  return OpenLocal (nullptr, name.c_str (), options);
+		});
+    // There is no file to remove
+    std::cerr << "file:" << access (name.c_str (), F_OK) + 1 << '\n';
+
+    std::string huge (200, 'x');
+    std::cerr << "long:" << (OpenLocal (nullptr, huge.c_str (), options) < 0
+			     ? errno : 0) << '\n';
+  }
+
+  {
+    // The functions without options keep their original settings
+    std::string name ("net-1.sock-");
+    name.append (std::to_string (getpid ()));
+    int local = ListenLocal (nullptr, name.c_str ());
+    int fd = OpenLocal (nullptr, name.c_str ());
+    sockaddr_in addr;
+    memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    int inet = ListenSocket (nullptr, (sockaddr *)&addr, sizeof (addr), 0);
+    socklen_t len = sizeof (addr);
+    getsockname (inet, (sockaddr *)&addr, &len);
+    int tcp = OpenSocket (nullptr, (sockaddr *)&addr, len);
+    std::cerr << "legacy:" << bool (fcntl (local, F_GETFD) & FD_CLOEXEC)
+	      << ' ' << bool (fcntl (fd, F_GETFD) & FD_CLOEXEC)
+	      << ' ' << GetOption (tcp, IPPROTO_TCP, TCP_NODELAY) << '\n';
+    for (int ix : {local, fd, inet, tcp})
+      close (ix);
+    unlink (name.c_str ());
+  }
+
+  return 0;
+}
@@ -0,0 +1,54 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Test requests are checked against their schema
+// RUN: $subdir$stem |& ezio $test
+// RUN-END:
+
+// CHECK-NEXT: ^ERROR 'malformed \\'HELLO 1\\''$
+// CHECK-NEXT: ^ERROR 'malformed \\'HELLO one TEST\\''$
+// CHECK-NEXT: ^ERROR 'malformed \\'HELLO 1 TEST IDENT tag\\''$
+// CHECK-NEXT: ^HELLO 1 default$
+// CHECK-NEXT: ^ERROR 'malformed \\'MODULE-REPO foo\\''$
+// CHECK-NEXT: ^ERROR 'malformed \\'MODULE-IMPORT foo bar\\''$
+// CHECK-NEXT: ^ERROR 'malformed \\'MODULE-COMPILED foo 1 2\\''$
+// CHECK-NEXT: ^ERROR 'malformed \\'INCLUDE-TRANSLATE \\'\\'\\''$
+// CHECK-NEXT: ^ERROR 'malformed \\'INVOKE\\''$
+// CHECK-NEXT: ^ERROR 'malformed \\'STATS foo\\''$
+// CHECK-NEXT: ^PATHNAME foo.cmi$
+// CHECK-NEXT: $EOF
+
+// Cody
+#include "cody.hh"
+// C++
+#include <iostream>
+
+using namespace Cody;
+
+int main (int, char *[])
+{
+  Resolver r;
+  Server server (&r);
+  Detail::MessageBuffer from, to;
+
+  for (auto words : {"HELLO 1", "HELLO one TEST", "HELLO 1 TEST IDENT tag",
+		     "HELLO 1 TEST IDENT",
+		     "MODULE-REPO foo", "MODULE-IMPORT foo bar",
+		     "MODULE-COMPILED foo 1 2", "INCLUDE-TRANSLATE ''",
+		     "INVOKE", "STATS foo", "MODULE-IMPORT foo 0"})
+    {
+      from.PrepareToRead ();
+      from.Append (words);
+      from.PrepareToWrite ();
+      to.PrepareToRead ();
+      server.DirectProcess (from, to);
+      std::string line;
+      std::vector<std::string> lexed;
+      to.Lex (lexed);
+      to.LexedLine (line);
+      std::cerr << line << '\n';
+    }
+
+  return 0;
+}
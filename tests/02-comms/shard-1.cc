@@ -0,0 +1,143 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Test sharding a client's requests across backends
+// RUN: $subdir$stem |& ezio $test
+// RUN-END:
+
+// CHECK-NEXT: ^1:hello$
+// CHECK-NEXT: ^2:hello$
+// CHECK-NEXT: ^0:hello$
+// CHECK-NEXT: ^connect:1 3$
+// CHECK-NEXT: ^import:5 [012]/foo.cmi 1$
+// CHECK-NEXT: ^corked:11 1$
+// CHECK-NEXT: ^balanced:1$
+// CHECK-NEXT: ^stable:1$
+// CHECK-NEXT: ^broken:0 1$
+// CHECK-NEXT: $EOF
+
+// Cody
+#include "cody.hh"
+// C++
+#include <iostream>
+#include <string>
+// C
+#include <csignal>
+// OS
+#include <unistd.h>
+
+using namespace Cody;
+
+class Backend final : public Resolver
+{
+  unsigned id;
+
+public:
+  Backend (unsigned i)
+    : id (i)
+  {
+  }
+
+protected:
+  virtual std::string GetCMIName (std::string const &module)
+  {
+    return std::to_string (id) + '/' + Resolver::GetCMIName (module);
+  }
+
+public:
+  virtual Resolver *ConnectRequest (Server *s, unsigned version,
+				    std::string &agent, std::string &ident)
+  {
+    std::cerr << id << ":hello\n";
+    return Resolver::ConnectRequest (s, version, agent, ident);
+  }
+};
+
+int main (int, char *[])
+{
+  signal (SIGPIPE, SIG_IGN);
+
+  Backend r0 (0), r1 (1), r2 (2);
+  Server s0 (&r0), s1 (&r1), s2 (&r2);
+  Client client (&s0);
+  client.AddShard (&s1);
+  client.AddShard (&s2);
+
+  auto p = client.Connect ("TEST", "IDENT");
+  std::cerr << "connect:" << p.GetCode () << ' ' << client.GetShardCount ()
+	    << '\n';
+
+  // Answered by the backend the name routes to
+  p = client.ModuleImport ("foo");
+  std::cerr << "import:" << p.GetCode () << ' ' << p.GetString () << ' '
+	    << (p.GetString ()[0] - '0' == int (client.GetShard ("foo")))
+	    << '\n';
+
+  // A corked block is split, and the responses merged in order
+  std::vector<std::string> names;
+  for (unsigned ix = 0; ix != 10; ix++)
+    names.push_back ("m" + std::to_string (ix));
+  client.Cork ();
+  client.ModuleRepo ();
+  for (auto &name : names)
+    client.ModuleImport (name);
+  auto packets = client.Uncork ();
+  bool ordered = packets[0].GetString () == "cmi.cache";
+  for (unsigned ix = 0; ix != names.size (); ix++)
+    ordered = ordered && (packets[ix + 1].GetString ()
+			  == (std::to_string (client.GetShard (names[ix]))
+			      + '/' + names[ix] + ".cmi"));
+  std::cerr << "corked:" << packets.size () << ' ' << ordered << '\n';
+
+  // Names are spread evenly
+  unsigned counts[3] = {0, 0, 0};
+  for (unsigned ix = 0; ix != 3000; ix++)
+    counts[client.GetShard ("n" + std::to_string (ix))]++;
+  bool balanced = true;
+  for (auto count : counts)
+    balanced = balanced && count > 700 && count < 1300;
+  std::cerr << "balanced:" << balanced << '\n';
+
+  // Another backend only takes names, it does not move the others
+  Backend r3 (3);
+  Server s3 (&r3);
+  Client wider (&s0);
+  wider.AddShard (&s1);
+  wider.AddShard (&s2);
+  wider.AddShard (&s3);
+  bool stable = true;
+  unsigned moved = 0;
+  for (unsigned ix = 0; ix != 3000; ix++)
+    {
+      std::string name ("n" + std::to_string (ix));
+      unsigned was = client.GetShard (name), is = wider.GetShard (name);
+      if (was != is)
+	{
+	  stable = stable && is == 3;
+	  moved++;
+	}
+    }
+  std::cerr << "stable:" << (stable && moved > 500 && moved < 1000) << '\n';
+
+  // A failed shard's requests get its error, the others are answered
+  int fds[2];
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    return 1;
+  close (fds[1]);
+  Client broken (&s0);
+  broken.AddShard (fds[0]);
+  std::string local, remote;
+  for (unsigned ix = 0; local.empty () || remote.empty (); ix++)
+    (broken.GetShard ("n" + std::to_string (ix)) ? remote : local)
+      = "n" + std::to_string (ix);
+  broken.Cork ();
+  broken.ModuleImport (local);
+  broken.ModuleImport (remote);
+  packets = broken.Uncork ();
+  std::cerr << "broken:" << (packets[0].GetCode () != Client::PC_PATHNAME)
+	    << ' ' << (packets[1].GetCode () == Client::PC_ERROR) << '\n';
+  close (fds[0]);
+
+  return 0;
+}
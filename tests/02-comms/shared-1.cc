@@ -0,0 +1,156 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Test a client shared by threads
+// RUN: $subdir$stem |& ezio $test
+// RUN-END:
+
+// CHECK-NEXT: ^connect:1$
+// CHECK-NEXT: ^block:1$
+// CHECK-NEXT: ^block:8$
+// CHECK-NEXT: ^routed:1$
+// CHECK-NEXT: ^counts:10 3$
+// CHECK-NEXT: ^closed:1 1$
+// CHECK-NEXT: $EOF
+
+// Cody
+#include "cody.hh"
+// C++
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <thread>
+// C
+#include <cerrno>
+#include <csignal>
+// OS
+#include <unistd.h>
+
+using namespace Cody;
+
+// Holds the first import until the gate is opened
+
+class Gated final : public Resolver
+{
+  int gate;
+
+public:
+  unsigned imports = 0;
+
+public:
+  Gated (int g)
+    : gate (g)
+  {
+  }
+
+public:
+  virtual int ModuleImportRequest (Server *s, Flags flags,
+				   std::string &module)
+  {
+    imports++;
+    if (gate >= 0)
+      {
+	char c;
+	(void)!read (gate, &c, 1);
+	gate = -1;
+      }
+    return Resolver::ModuleImportRequest (s, flags, module);
+  }
+};
+
+// Serve one connection until end of file, noting each block of
+// imports
+
+static void Serve (Gated *r, int fd)
+{
+  Server server (r, fd);
+
+  for (;;)
+    {
+      int err;
+      server.PrepareToRead ();
+      while ((err = server.Read ()) == EAGAIN || err == EINTR)
+	continue;
+      if (err)
+	break;
+      unsigned imports = r->imports;
+      server.ProcessRequests ();
+      if (r->imports != imports)
+	std::cerr << "block:" << r->imports - imports << '\n';
+      server.PrepareToWrite ();
+      while ((err = server.Write ()) == EAGAIN || err == EINTR)
+	continue;
+      if (err)
+	break;
+    }
+  close (fd);
+}
+
+int main (int, char *[])
+{
+  signal (SIGPIPE, SIG_IGN);
+
+  int fds[2], gate[2];
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) < 0 || pipe (gate) < 0)
+    return 1;
+  Gated r (gate[0]);
+  std::thread server (Serve, &r, fds[1]);
+
+  SharedClient client (fds[0]);
+  auto p = client.Connect ("TEST", "IDENT");
+  std::cerr << "connect:" << p.GetCode () << '\n';
+
+  // The first goes alone, and is held.  The others are queued
+  // meanwhile, and go together.
+  std::vector<std::thread> threads;
+  bool routed[9];
+  for (unsigned ix = 0; ix != 9; ix++)
+    {
+      auto import = [&, ix] ()
+	{
+	  std::string name ("m" + std::to_string (ix));
+	  auto packet = client.ModuleImport (name);
+	  routed[ix] = packet.GetCode () == Client::PC_PATHNAME
+	    && packet.GetString () == name + ".cmi";
+	};
+      threads.emplace_back (import);
+      if (!ix)
+	while (client.GetBlocks () != 2)
+	  std::this_thread::yield ();
+    }
+  while (client.GetRequests () != 10)
+    std::this_thread::yield ();
+  (void)!write (gate[1], "!", 1);
+  for (auto &thread : threads)
+    thread.join ();
+
+  bool all = true;
+  for (auto ok : routed)
+    all = all && ok;
+  std::cerr << "routed:" << all << '\n';
+  std::cerr << "counts:" << client.GetRequests () << ' '
+	    << client.GetBlocks () << '\n';
+
+  // Every waiter gets the error
+  shutdown (fds[0], SHUT_WR);
+  server.join ();
+  threads.clear ();
+  std::atomic<unsigned> errors {0};
+  for (unsigned ix = 0; ix != 4; ix++)
+    threads.emplace_back ([&] ()
+			  {
+			    if (client.ModuleRepo ().GetCode ()
+				== Client::PC_ERROR)
+			      errors++;
+			  });
+  for (auto &thread : threads)
+    thread.join ();
+  std::cerr << "closed:" << (errors == 4) << ' '
+	    << (client.GetBlocks () >= 4) << '\n';
+  close (fds[0]);
+  close (gate[0]);
+  close (gate[1]);
+
+  return 0;
+}
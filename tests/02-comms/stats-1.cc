@@ -0,0 +1,103 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Test request metrics and STATS
+// RUN: $subdir$stem |& ezio $test
+// RUN-END:
+
+// CHECK-NEXT: ^histogram:ok$
+// CHECK-NEXT: ^HELLO.count 1$
+// CHECK-NEXT: ^HELLO.errors 0$
+// CHECK-NEXT: ^MODULE-REPO.count 2$
+// CHECK-NEXT: ^MODULE-REPO.errors 0$
+// CHECK-NEXT: ^unrecognized.count 1$
+// CHECK-NEXT: ^unrecognized.errors 1$
+// CHECK-NEXT: ^read.calls 1$
+// CHECK-NEXT: ^read.bytes 6$
+// CHECK-NEXT: ^read.errors 0$
+// CHECK-NEXT: ^write.calls 2$
+// CHECK-NEXT: ^write.bytes 37$
+// CHECK-NEXT: ^write.errors 0$
+// CHECK-NEXT: ^snapshot:1 2$
+// CHECK-NEXT: ^disabled:2$
+// CHECK-NEXT: $EOF
+
+// Cody
+#include "cody.hh"
+// C++
+#include <iostream>
+// OS
+#include <unistd.h>
+
+using namespace Cody;
+
+int main (int, char *[])
+{
+  bool ok = true;
+  for (uint64_t v = 1; v < (uint64_t (1) << 40); v = v * 3 + 1)
+    {
+      uint64_t top = Histogram::Value (Histogram::Bucket (v));
+      if (top < v || top - v > v / 8)
+	ok = false;
+    }
+  Histogram h;
+  for (unsigned ix = 1; ix <= 100; ix++)
+    h.Record (ix);
+  if (h.GetCount () != 100 || h.GetPercentile (0.1) != 10
+      || h.GetPercentile (1) < 100)
+    ok = false;
+  std::cerr << "histogram:" << (ok ? "ok" : "bad") << '\n';
+
+  Resolver r;
+
+  {
+    // Over pipes, the server rejects an unknown request
+    int p[2], q[2];
+    if (pipe (p) || pipe (q))
+      return 1;
+    Server server (&r, p[0], q[1]);
+    Detail::MessageBuffer request, response;
+    request.BeginLine ();
+    request.AppendWord ("BOGUS");
+    request.EndLine ();
+    request.PrepareToWrite ();
+    request.Write (p[1]);
+    server.Read ();
+    server.ProcessRequests ();
+    server.PrepareToWrite ();
+    server.Write ();
+  }
+
+  Server server (&r);
+  Client client (&server);
+  client.Connect ("TEST", "IDENT");
+  client.ModuleRepo ();
+  client.ModuleRepo ();
+
+  auto stats = client.Stats ();
+  auto &words = stats.GetVector ();
+  for (size_t ix = 0; ix + 1 < words.size (); ix += 2)
+    {
+      auto dot = words[ix].rfind ('.');
+      auto suffix = words[ix].substr (dot + 1);
+      if (suffix != "count" && suffix != "errors"
+	  && suffix != "calls" && suffix != "bytes")
+	continue;
+      std::cerr << words[ix] << ' ' << words[ix + 1] << '\n';
+    }
+
+  // The STATS request is counted once answered
+  std::unique_ptr<Metrics> m (new Metrics ());
+  Metrics::Snapshot (*m);
+  std::cerr << "snapshot:" << m->verbs[Detail::RC_STATS].count
+	    << ' ' << m->verbs[Detail::RC_MODULE_REPO].count << '\n';
+
+  Metrics::Enable (false);
+  client.ModuleRepo ();
+  Metrics::Enable (true);
+  Metrics::Snapshot (*m);
+  std::cerr << "disabled:" << m->verbs[Detail::RC_MODULE_REPO].count << '\n';
+
+  return 0;
+}
@@ -0,0 +1,156 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Test round trip timeouts, and recovery from them
+// RUN: $subdir$stem |& ezio $test
+// RUN-END:
+
+// CHECK-NEXT: ^connect:1$
+// CHECK-NEXT: ^slow:1 1$
+// CHECK-NEXT: ^stuck:1$
+// CHECK-NEXT: ^recovered:fast.cmi$
+// CHECK-NEXT: ^corked:1 1$
+// CHECK-NEXT: ^after:after.cmi$
+// CHECK-NEXT: ^broken:0$
+// CHECK-NEXT: ^reconnect:1 other.cmi$
+// CHECK-NEXT: $EOF
+
+// Cody
+#include "cody.hh"
+// C++
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+// C
+#include <cerrno>
+#include <csignal>
+// OS
+#include <unistd.h>
+#include <sys/socket.h>
+
+using namespace Cody;
+using Clock = std::chrono::steady_clock;
+
+// Holds each import of "slow" until the gate is opened
+
+class Gated final : public Resolver
+{
+  int gate;
+
+public:
+  Gated (int g)
+    : gate (g)
+  {
+  }
+
+public:
+  virtual int ModuleImportRequest (Server *s, Flags flags,
+				   std::string &module)
+  {
+    if (module == "slow")
+      {
+	char c;
+	(void)!read (gate, &c, 1);
+      }
+    return Resolver::ModuleImportRequest (s, flags, module);
+  }
+};
+
+// Serve one connection until end of file
+
+static void Serve (Resolver *r, int fd)
+{
+  Server server (r, fd);
+
+  for (;;)
+    {
+      int err;
+      server.PrepareToRead ();
+      while ((err = server.Read ()) == EAGAIN || err == EINTR)
+	continue;
+      if (err)
+	break;
+      server.ProcessRequests ();
+      server.PrepareToWrite ();
+      while ((err = server.Write ()) == EAGAIN || err == EINTR)
+	continue;
+      if (err)
+	break;
+    }
+  close (fd);
+}
+
+int main (int, char *[])
+{
+  signal (SIGPIPE, SIG_IGN);
+
+  int fds[2], gate[2];
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) < 0 || pipe (gate) < 0)
+    return 1;
+  Gated r (gate[0]);
+  std::thread server (Serve, &r, fds[1]);
+
+  Client client (fds[0]);
+  auto p = client.Connect ("TEST", "IDENT");
+  std::cerr << "connect:" << p.GetCode () << '\n';
+
+  // The server does not answer in time
+  client.SetTimeout (20);
+  auto start = Clock::now ();
+  p = client.ModuleImport ("slow");
+  std::cerr << "slow:" << Client::IsTimedOut (p) << ' '
+	    << (Clock::now () - start < std::chrono::seconds (1)) << '\n';
+
+  // Nor the late response
+  p = client.ModuleImport ("fast");
+  std::cerr << "stuck:" << Client::IsTimedOut (p) << '\n';
+
+  // Which is discarded when it comes
+  (void)!write (gate[1], "!", 1);
+  client.SetTimeout (-1);
+  client.SetDeadline (5000);
+  p = client.ModuleImport ("fast");
+  std::cerr << "recovered:" << p.GetString () << '\n';
+
+  // A block's deadline, the block gets one error
+  client.SetDeadline (20);
+  client.Cork ();
+  client.ModuleImport ("slow");
+  client.ModuleImport ("other");
+  auto packets = client.Uncork ();
+  std::cerr << "corked:" << packets.size () << ' '
+	    << Client::IsTimedOut (packets[0]) << '\n';
+  (void)!write (gate[1], "!", 1);
+  p = client.ModuleImport ("after");
+  std::cerr << "after:" << p.GetString () << '\n';
+
+  // A stuck server is abandoned for another
+  client.SetTimeout (20);
+  client.ModuleImport ("slow");
+  int other[2];
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, other) < 0)
+    return 1;
+  Resolver fresh;
+  std::thread replacement (Serve, &fresh, other[1]);
+  client.Reconnect (other[0]);
+  p = client.ModuleImport ("other");
+  std::cerr << "broken:" << (p.GetCode () == Client::PC_PATHNAME) << '\n';
+  p = client.Connect ("TEST", "IDENT");
+  std::cerr << "reconnect:" << p.GetCode () << ' ';
+  p = client.ModuleImport ("other");
+  std::cerr << p.GetString () << '\n';
+
+  (void)!write (gate[1], "!", 1);
+  shutdown (fds[0], SHUT_WR);
+  shutdown (other[0], SHUT_WR);
+  server.join ();
+  replacement.join ();
+  close (fds[0]);
+  close (other[0]);
+  close (gate[0]);
+  close (gate[1]);
+
+  return 0;
+}
@@ -0,0 +1,207 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Test round trips interrupted by signals, or broken part way
+// RUN: $subdir$stem |& ezio $test
+// RUN-END:
+
+// CHECK-NEXT: ^connect:1$
+// CHECK-NEXT: ^limited:slow.cmi fast.cmi 1 0$
+// CHECK-NEXT: ^unlimited:slow.cmi fast.cmi$
+// CHECK-NEXT: ^broken:1 0$
+// CHECK-NEXT: ^refused:1$
+// CHECK-NEXT: ^reconnect:1 other.cmi$
+// CHECK-NEXT: $EOF
+
+// Cody
+#include "cody.hh"
+// C++
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+// C
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+// OS
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+using namespace Cody;
+
+static volatile sig_atomic_t alarms;
+
+static void Alarm (int)
+{
+  alarms++;
+}
+
+// Holds each import of "slow" until the gate is opened
+
+class Gated final : public Resolver
+{
+  int gate;
+
+public:
+  Gated (int g)
+    : gate (g)
+  {
+  }
+
+public:
+  virtual int ModuleImportRequest (Server *s, Flags flags,
+				   std::string &module)
+  {
+    if (module == "slow")
+      {
+	char c;
+	(void)!read (gate, &c, 1);
+      }
+    return Resolver::ModuleImportRequest (s, flags, module);
+  }
+};
+
+// Serve one connection until end of file
+
+static void Serve (Resolver *r, int fd)
+{
+  Server server (r, fd);
+
+  for (;;)
+    {
+      int err;
+      server.PrepareToRead ();
+      while ((err = server.Read ()) == EAGAIN || err == EINTR)
+	continue;
+      if (err)
+	break;
+      server.ProcessRequests ();
+      server.PrepareToWrite ();
+      while ((err = server.Write ()) == EAGAIN || err == EINTR)
+	continue;
+      if (err)
+	break;
+    }
+  close (fd);
+}
+
+// Read a request, and hang up without answering it
+
+static void HangUp (int fd)
+{
+  char buffer[256];
+  (void)!read (fd, buffer, sizeof (buffer));
+  close (fd);
+}
+
+// Open the gate after a while, during which the client is
+// interrupted
+
+static void Open (int gate)
+{
+  std::this_thread::sleep_for (std::chrono::milliseconds (50));
+  (void)!write (gate, "!", 1);
+}
+
+// An import of "slow" interrupted by signals, and the one after it
+
+static void Interrupted (Client &client, int gate)
+{
+  std::thread opener (Open, gate);
+  auto p = client.ModuleImport ("slow");
+  opener.join ();
+  auto q = client.ModuleImport ("fast");
+  std::cerr << p.GetString () << ' ' << q.GetString ();
+}
+
+int main (int, char *[])
+{
+  signal (SIGPIPE, SIG_IGN);
+
+  // Only this thread is interrupted
+  sigset_t alarm;
+  sigemptyset (&alarm);
+  sigaddset (&alarm, SIGALRM);
+  pthread_sigmask (SIG_BLOCK, &alarm, nullptr);
+
+  int fds[2], gate[2];
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) < 0 || pipe (gate) < 0)
+    return 1;
+  Gated r (gate[0]);
+  std::thread server (Serve, &r, fds[1]);
+
+  int hung[2];
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, hung) < 0)
+    return 1;
+  std::thread hanger (HangUp, hung[1]);
+
+  struct sigaction action;
+  memset (&action, 0, sizeof (action));
+  action.sa_handler = Alarm;
+  sigaction (SIGALRM, &action, nullptr);
+  pthread_sigmask (SIG_UNBLOCK, &alarm, nullptr);
+  itimerval timer;
+  timer.it_interval.tv_sec = timer.it_value.tv_sec = 0;
+  timer.it_interval.tv_usec = timer.it_value.tv_usec = 5000;
+  setitimer (ITIMER_REAL, &timer, nullptr);
+
+  Client client (fds[0]);
+  auto p = client.Connect ("TEST", "IDENT");
+  std::cerr << "connect:" << p.GetCode () << '\n';
+
+  // Signals do not end a round trip, and the FDs stay blocking
+  client.SetTimeout (5000);
+  std::cerr << "limited:";
+  Interrupted (client, gate[1]);
+  std::cerr << ' ' << (alarms > 0) << ' '
+	    << !!(fcntl (fds[0], F_GETFL) & O_NONBLOCK) << '\n';
+
+  client.SetTimeout (-1);
+  std::cerr << "unlimited:";
+  Interrupted (client, gate[1]);
+  std::cerr << '\n';
+
+  timer.it_interval.tv_usec = timer.it_value.tv_usec = 0;
+  setitimer (ITIMER_REAL, &timer, nullptr);
+
+  // A server that hangs up part way breaks the connection
+  client.Reconnect (hung[0]);
+  client.SetTimeout (5000);
+  p = client.ModuleImport ("lost");
+  std::cerr << "broken:" << (p.GetCode () == Client::PC_ERROR) << ' '
+	    << Client::IsTimedOut (p) << '\n';
+  hanger.join ();
+  p = client.ModuleImport ("refused");
+  std::cerr << "refused:"
+	    << (p.GetString ().find (strerror (ENOTCONN)) != std::string::npos)
+	    << '\n';
+
+  // Until it is given another
+  int other[2];
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, other) < 0)
+    return 1;
+  Resolver fresh;
+  std::thread replacement (Serve, &fresh, other[1]);
+  client.Reconnect (other[0]);
+  p = client.Connect ("TEST", "IDENT");
+  std::cerr << "reconnect:" << p.GetCode () << ' ';
+  p = client.ModuleImport ("other");
+  std::cerr << p.GetString () << '\n';
+
+  shutdown (fds[0], SHUT_WR);
+  shutdown (other[0], SHUT_WR);
+  server.join ();
+  replacement.join ();
+  close (fds[0]);
+  close (hung[0]);
+  close (other[0]);
+  close (gate[0]);
+  close (gate[1]);
+
+  return 0;
+}
@@ -0,0 +1,119 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Test round trips that time out before sending, and server errors
+// that look like timeouts
+// RUN: $subdir$stem |& ezio $test
+// RUN-END:
+
+// CHECK-NEXT: ^full:1$
+// CHECK-NEXT: ^server:MODULE-IMPORT second|$
+// CHECK-NEXT: ^intact:second.cmi$
+// CHECK-NEXT: ^server:MODULE-IMPORT third|$
+// CHECK-NEXT: ^remote:1 0 timed out$
+// CHECK-NEXT: $EOF
+
+// Cody
+#include "cody.hh"
+// C++
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <thread>
+// C
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+// OS
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+using namespace Cody;
+
+// Read a request line, print it with its line break as '|', and
+// answer it with REPLY
+
+static void Answer (int fd, char const *reply)
+{
+  std::string text;
+  char buffer[100];
+  while (text.empty () || text.back () != '\n')
+    {
+      ssize_t count = read (fd, buffer, sizeof (buffer));
+      if (count <= 0)
+	return;
+      text.append (buffer, size_t (count));
+    }
+  for (auto &c : text)
+    if (c == '\n')
+      c = '|';
+  std::cerr << "server:" << text << '\n';
+  (void)!write (fd, reply, strlen (reply));
+}
+
+// Discard the FILLED bytes, then answer two requests
+
+static void Serve (int fd, size_t filled)
+{
+  char buffer[4096];
+  while (filled)
+    {
+      ssize_t count = read (fd, buffer,
+			    std::min (filled, sizeof (buffer)));
+      if (count <= 0)
+	return;
+      filled -= size_t (count);
+    }
+  Answer (fd, "PATHNAME second.cmi\n");
+  Answer (fd, "ERROR 'timed out'\n");
+}
+
+int main (int, char *[])
+{
+  signal (SIGPIPE, SIG_IGN);
+
+  int fds[2];
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    return 1;
+
+  // Fill the send buffer, so nothing more can be written
+  size_t filled = 0;
+  int flags = fcntl (fds[0], F_GETFL);
+  fcntl (fds[0], F_SETFL, flags | O_NONBLOCK);
+  char block[4096];
+  memset (block, '#', sizeof (block));
+  for (size_t size = sizeof (block); size; size /= 2)
+    for (;;)
+      {
+	ssize_t count = write (fds[0], block, size);
+	if (count <= 0)
+	  break;
+	filled += size_t (count);
+      }
+  fcntl (fds[0], F_SETFL, flags);
+
+  // Times out before any of it is sent, so it is dropped
+  Client client (fds[0]);
+  client.SetTimeout (50);
+  auto p = client.ModuleImport ("first");
+  std::cerr << "full:" << Client::IsTimedOut (p) << '\n';
+
+  // The next request goes alone
+  std::thread server (Serve, fds[1], filled);
+  client.SetTimeout (5000);
+  p = client.ModuleImport ("second");
+  std::cerr << "intact:" << p.GetString () << '\n';
+
+  // A server's error is not a local timeout, whatever its text
+  p = client.ModuleImport ("third");
+  std::cerr << "remote:" << (p.GetCode () == Client::PC_ERROR) << ' '
+	    << Client::IsTimedOut (p) << ' ' << p.GetString () << '\n';
+
+  server.join ();
+  close (fds[0]);
+  close (fds[1]);
+
+  return 0;
+}
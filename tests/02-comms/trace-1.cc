@@ -0,0 +1,102 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Test trace events
+// RUN: $subdir$stem |& ezio $test
+// RUN-END:
+
+// CHECK-NEXT: ^open:0$
+// CHECK-NEXT: ^\[$
+// CHECK-NEXT: ^\{"name":"thread_name","ph":"M","args":\{"name":"ma\\"in.cc"}},$
+// CHECK-NEXT: ^\{"name":"thread_name","ph":"M","args":\{"name":"ma\\"in.cc"}},$
+// CHECK-NEXT: ^\{"name":"HELLO","cat":"resolver","ph":"X","args":\{"ident":"ma\\"in.cc"}},$
+// CHECK-NEXT: ^\{"name":"block","cat":"server","ph":"X","args":\{"ident":"ma\\"in.cc","requests":1}},$
+// CHECK-NEXT: ^\{"name":"HELLO","cat":"client","ph":"X","args":\{"ident":"ma\\"in.cc"}},$
+// CHECK-NEXT: ^\{"name":"MODULE-IMPORT","cat":"resolver","ph":"X","args":\{"ident":"ma\\"in.cc"}},$
+// CHECK-NEXT: ^\{"name":"MODULE-REPO","cat":"resolver","ph":"X","args":\{"ident":"ma\\"in.cc"}},$
+// CHECK-NEXT: ^\{"name":"MODULE-IMPORT","cat":"deferred","ph":"X","args":\{"ident":"ma\\"in.cc"}},$
+// CHECK-NEXT: ^\{"name":"block","cat":"server","ph":"X","args":\{"ident":"ma\\"in.cc","requests":2}},$
+// CHECK-NEXT: ^\{"name":"block","cat":"client","ph":"X","args":\{"ident":"ma\\"in.cc","requests":2}},$
+// CHECK-NEXT: ^tracks:1$
+// CHECK-NEXT: $EOF
+
+// Cody
+#include "cody.hh"
+// C++
+#include <fstream>
+#include <iostream>
+#include <set>
+// OS
+#include <unistd.h>
+
+using namespace Cody;
+
+// Defers imports, completing them when waited for
+class Deferring : public Resolver
+{
+  std::vector<std::pair<unsigned, std::string>> imports;
+
+public:
+  virtual int ModuleImportRequest (Server *s, Flags, std::string &module)
+  {
+    imports.emplace_back (s->DeferResponse (), module);
+    return 0;
+  }
+  virtual void WaitUntilReady (Server *s)
+  {
+    for (auto &import : imports)
+      {
+	s->BeginDeferred (import.first);
+	s->PathnameResponse (import.second + ".cmi");
+	s->EndDeferred ();
+      }
+    imports.clear ();
+  }
+};
+
+int main (int, char *[])
+{
+  char const *path = "trace-1.json";
+  unlink (path);
+
+  Tracer tracer;
+  std::cerr << "open:" << tracer.Open (path) << '\n';
+
+  {
+    Deferring r;
+    Server server (&r);
+    server.SetTracer (&tracer);
+    Client client (&server);
+    client.SetTracer (&tracer);
+    client.Connect ("TEST", "ma\"in.cc");
+    client.Cork ();
+    client.ModuleImport ("foo");
+    client.ModuleRepo ();
+    client.Uncork ();
+  }
+  tracer.Close ();
+
+  // Drop the times, process and track, which vary
+  std::ifstream file (path);
+  std::set<std::string> tracks;
+  for (std::string line; std::getline (file, line);)
+    {
+      auto pid = line.find (",\"pid\":");
+      auto ts = line.find (",\"ts\":");
+      auto args = line.find (",\"args\":");
+      if (pid != line.npos && args != line.npos)
+	{
+	  auto tid = line.find (",\"tid\":", pid);
+	  tracks.insert (line.substr (tid, args - tid));
+	  auto from = ts < pid ? ts : pid;
+	  line.erase (from, args - from);
+	}
+      std::cerr << line << '\n';
+    }
+  std::cerr << "tracks:" << tracks.size () << '\n';
+
+  unlink (path);
+
+  return 0;
+}
@@ -0,0 +1,145 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Test dependency graph persistence & prediction
+// RUN: $subdir$stem |& ezio $test
+// RUN-END:
+
+// CHECK-NEXT: ^open:0$
+// CHECK-NEXT: ^reopen:0$
+// CHECK-NEXT: ^main.cc:./hdr.h 2$
+// CHECK-NEXT: ^main.cc:bar 2$
+// CHECK-NEXT: ^main.cc:foo 1$
+// CHECK-NEXT: ^foo:./hdr.h 1$
+// CHECK-NEXT: ^foo:bar 1$
+// CHECK-NEXT: ^rebuilt:bar 1$
+// CHECK-NEXT: ^truncated:0 0$
+// CHECK-NEXT: ^appended:bar 3$
+// CHECK-NEXT: ^appended:baz 2$
+// CHECK-NEXT: ^appended:./hdr.h 1$
+// CHECK-NEXT: ^appended:foo 1$
+// CHECK-NEXT: ^foreign:22 notes$
+// CHECK-NEXT: ^switched:beta 1$
+// CHECK-NEXT: ^forgotten:0$
+// CHECK-NEXT: $EOF
+
+// Cody
+#include "cody.hh"
+// C++
+#include <iostream>
+// OS
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace Cody;
+
+static void Show (char const *what,
+		  std::vector<std::pair<std::string, unsigned>> const &v)
+{
+  for (auto &pair : v)
+    std::cerr << what << ":" << pair.first << ' ' << pair.second << '\n';
+}
+
+int main (int, char *[])
+{
+  char const *path = "depgraph-1.journal";
+
+  unlink (path);
+  {
+    DepGraph graph;
+    std::cerr << "open:" << graph.Open (path) << '\n';
+    graph.Record ("main.cc", DepGraph::IMPORT, "foo");
+    graph.Record ("main.cc", DepGraph::INCLUDE, "./hdr.h");
+    graph.Record ("main.cc", DepGraph::INCLUDE, "<vector>");
+    graph.Record ("foo.cc", DepGraph::EXPORT, "foo");
+    graph.Record ("foo.cc", DepGraph::IMPORT, "bar");
+    graph.Record ("foo.cc", DepGraph::IMPORT, "./hdr.h");
+    graph.Record ("hdr.cc", DepGraph::EXPORT, "./hdr.h");
+    graph.Record ("bar.cc", DepGraph::EXPORT, "bar");
+  }
+
+  DepGraph graph;
+  std::cerr << "reopen:" << graph.Open (path) << '\n';
+
+  std::vector<std::pair<std::string, unsigned>> modules;
+  graph.Predict ("main.cc", modules);
+  Show ("main.cc", modules);
+
+  modules.clear ();
+  graph.PredictFrom ("foo", modules);
+  Show ("foo", modules);
+
+  // A new build of foo.cc forgets its old edges
+  graph.Record ("foo.cc", DepGraph::EXPORT, "foo");
+  graph.Record ("foo.cc", DepGraph::IMPORT, "bar");
+  modules.clear ();
+  graph.PredictFrom ("foo", modules);
+  Show ("rebuilt", modules);
+  graph.Close ();
+
+  // A line truncated by a crash is not glued to the next record
+  {
+    int fd = open (path, O_WRONLY | O_APPEND);
+    (void)!write (fd, "N fo", 4);
+    close (fd);
+    DepGraph crashed;
+    int err = crashed.Open (path);
+    crashed.Record ("foo.cc", DepGraph::EXPORT, "foo");
+    crashed.Record ("foo.cc", DepGraph::IMPORT, "baz");
+    crashed.Record ("baz.cc", DepGraph::EXPORT, "baz");
+    crashed.Record ("baz.cc", DepGraph::IMPORT, "bar");
+    crashed.Close ();
+    DepGraph reloaded;
+    std::cerr << "truncated:" << err << ' ' << reloaded.Open (path) << '\n';
+    modules.clear ();
+    reloaded.Predict ("main.cc", modules);
+    Show ("appended", modules);
+  }
+  unlink (path);
+
+  // Other files are not overwritten
+  {
+    int fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    (void)!write (fd, "notes\n", 6);
+    close (fd);
+    DepGraph foreign;
+    int err = foreign.Open (path);
+    char buffer[16] = "";
+    fd = open (path, O_RDONLY);
+    (void)!read (fd, buffer, 5);
+    close (fd);
+    std::cerr << "foreign:" << err << ' ' << buffer << '\n';
+  }
+  unlink (path);
+
+  // Another journal replaces the graph, rather than adding to it
+  {
+    char const *other = "depgraph-1.other";
+    unlink (other);
+    {
+      DepGraph first;
+      first.Open (path);
+      first.Record ("tu1", DepGraph::IMPORT, "alpha");
+    }
+    {
+      DepGraph second;
+      second.Open (other);
+      second.Record ("tu2", DepGraph::IMPORT, "beta");
+    }
+    DepGraph both;
+    both.Open (path);
+    both.Close ();
+    both.Open (other);
+    modules.clear ();
+    both.Predict ("tu2", modules);
+    Show ("switched", modules);
+    modules.clear ();
+    both.Predict ("tu1", modules);
+    std::cerr << "forgotten:" << modules.size () << '\n';
+    unlink (other);
+  }
+  unlink (path);
+
+  return 0;
+}
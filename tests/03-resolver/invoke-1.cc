@@ -0,0 +1,95 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Test sub process invocation, with a jobserver
+// RUN: $subdir$stem |& ezio $test
+// RUN-END:
+
+// CHECK-NEXT: ^jobserver:0$
+// CHECK-NEXT: ^true:3$
+// CHECK-NEXT: ^sh:2 'sh' exited with status 3$
+// CHECK-NEXT: ^oops$
+// CHECK-NEXT: ^corked:3 2 3 3$
+// CHECK-NEXT: ^missing:'no-such-command-for-cody' No such file or directory$
+// CHECK-NEXT: ^tokens:1$
+// CHECK-NEXT: ^busy:1$
+// CHECK-NEXT: ^default:2 unimplemented$
+// CHECK-NEXT: $EOF
+
+// Cody
+#include "cody.hh"
+// C++
+#include <iostream>
+// C
+#include <cerrno>
+// OS
+#include <unistd.h>
+
+using namespace Cody;
+
+int main (int, char *[])
+{
+  // A jobserver with one token, so two invocations run at once
+  int js[2];
+  if (pipe (js) < 0 || write (js[1], "+", 1) != 1)
+    return 1;
+  std::string makeflags (" -j2 --jobserver-auth=");
+  makeflags.append (std::to_string (js[0])).append (",")
+    .append (std::to_string (js[1]));
+
+  Resolver r;
+  SubProcessPool pool (4);
+  std::cerr << "jobserver:" << pool.UseJobServer (makeflags.c_str ()) << '\n';
+  r.SetSubProcessPool (&pool);
+
+  {
+    Server server (&r);
+    Client client (&server);
+    client.Connect ("TEST", "IDENT");
+
+    std::vector<char const *> truth {"true"};
+    auto p = client.InvokeSubProcess (truth);
+    std::cerr << "true:" << p.GetCode () << '\n';
+
+    std::vector<char const *> failing {"sh", "-c", "echo oops; exit 3"};
+    p = client.InvokeSubProcess (failing);
+    std::cerr << "sh:" << p.GetCode () << ' ' << p.GetString ();
+
+    std::vector<char const *> sleeper {"sleep", "0.1"};
+    client.Cork ();
+    client.InvokeSubProcess (sleeper);
+    client.InvokeSubProcess (failing);
+    client.InvokeSubProcess (sleeper);
+    client.InvokeSubProcess (truth);
+    auto results = client.Uncork ();
+    std::cerr << "corked:";
+    for (auto &result : results)
+      std::cerr << (&result == &results[0] ? "" : " ") << result.GetCode ();
+    std::cerr << '\n';
+
+    std::vector<char const *> missing {"no-such-command-for-cody"};
+    p = client.InvokeSubProcess (missing);
+    std::cerr << "missing:" << p.GetString () << '\n';
+  }
+
+  // The token has been returned
+  char token;
+  std::cerr << "tokens:" << read (js[0], &token, 1) << '\n';
+
+  // The jobserver cannot be changed once invocations have started
+  std::cerr << "busy:" << (pool.UseJobServer (makeflags.c_str ()) == EBUSY)
+	    << '\n';
+
+  {
+    Resolver plain;
+    Server server (&plain);
+    Client client (&server);
+    client.Connect ("TEST", "IDENT");
+    std::vector<char const *> truth {"true"};
+    auto p = client.InvokeSubProcess (truth);
+    std::cerr << "default:" << p.GetCode () << ' ' << p.GetString () << '\n';
+  }
+
+  return 0;
+}
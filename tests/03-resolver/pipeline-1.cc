@@ -0,0 +1,154 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Test resolver pipeline stages
+// RUN: $subdir$stem |& ezio $test
+// RUN-END:
+
+// CHECK-NEXT: ^load:0 2 22 1$
+// CHECK-NEXT: ^repo:mapped.cache$
+// CHECK-NEXT: ^map:foo-mapped.cmi foo-mapped.cmi$
+// CHECK-NEXT: ^file:bar.cmi$
+// CHECK-NEXT: ^upstream:import baz$
+// CHECK-NEXT: ^upstream:import baz$
+// CHECK-NEXT: ^forward:baz.cmi baz.cmi$
+// CHECK-NEXT: ^uncached:2$
+// CHECK-NEXT: ^upstream:translate ./quux.h$
+// CHECK-NEXT: ^translate:1 0$
+// CHECK-NEXT: ^upstream:compiled foo$
+// CHECK-NEXT: ^compiled:1 foo-mapped.cmi$
+// CHECK-NEXT: ^cache:1 9$
+// CHECK-NEXT: ^map:4 5$
+// CHECK-NEXT: ^file:1 4$
+// CHECK-NEXT: ^forward:4 0$
+// CHECK-NEXT: ^default:x.cmi cmi.cache$
+// CHECK-NEXT: $EOF
+
+// Cody
+#include "cody.hh"
+// C++
+#include <iostream>
+// C
+#include <cerrno>
+#include <cstring>
+// OS
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace Cody;
+
+class Upstream final : public Resolver
+{
+public:
+  virtual int ModuleImportRequest (Server *s, Flags flags,
+				   std::string &module)
+  {
+    std::cerr << "upstream:import " << module << '\n';
+    return Resolver::ModuleImportRequest (s, flags, module);
+  }
+  virtual int ModuleCompiledRequest (Server *s, Flags flags,
+				     std::string &module)
+  {
+    std::cerr << "upstream:compiled " << module << '\n';
+    return Resolver::ModuleCompiledRequest (s, flags, module);
+  }
+  virtual int IncludeTranslateRequest (Server *s, Flags flags,
+				       std::string &include)
+  {
+    std::cerr << "upstream:translate " << include << '\n';
+    return Resolver::IncludeTranslateRequest (s, flags, include);
+  }
+};
+
+static void WriteFile (char const *path, char const *text)
+{
+  int fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  (void)!write (fd, text, strlen (text));
+  close (fd);
+}
+
+int main (int, char *[])
+{
+  char const *map = "pipeline-1.map";
+  char const *bad = "pipeline-1.bad";
+  char const *repo = "pipeline-1.cache";
+  char const *cmi = "pipeline-1.cache/bar.cmi";
+  mkdir (repo, 0777);
+  WriteFile (cmi, "");
+  WriteFile (map, "# Mapped modules\n$root mapped.cache\n\n"
+	     "foo foo-mapped.cmi\n  ./hdr.h\thdr-mapped.cmi\n");
+  WriteFile (bad, "foo\n");
+
+  CacheStage cache;
+  MapStage mapper;
+  RepoStage file (repo);
+  Upstream upstream;
+  ForwardStage forward (&upstream);
+
+  int ok = mapper.Load (map);
+  size_t size = mapper.GetSize ();
+  std::cerr << "load:" << ok << ' ' << size << ' ' << mapper.Load (bad)
+	    << ' ' << (mapper.Load ("pipeline-1.none") == ENOENT) << '\n';
+
+  ResolverPipeline pipeline;
+  pipeline.AddStage (&cache);
+  pipeline.AddStage (&mapper);
+  pipeline.AddStage (&file);
+  pipeline.AddStage (&forward);
+  Server server (&pipeline);
+  Client client (&server);
+  client.Connect ("TEST", "IDENT");
+
+  // The cheap stages answer first
+  auto p = client.ModuleRepo ();
+  std::cerr << "repo:" << p.GetString () << '\n';
+  p = client.ModuleImport ("foo");
+  auto q = client.ModuleImport ("foo");
+  std::cerr << "map:" << p.GetString () << ' ' << q.GetString () << '\n';
+  p = client.ModuleImport ("bar");
+  std::cerr << "file:" << p.GetString () << '\n';
+
+  // Deferred to upstream, and not learnt, so the cache misses both
+  uint64_t misses = cache.GetMisses ();
+  p = client.ModuleImport ("baz");
+  q = client.ModuleImport ("baz");
+  std::cerr << "forward:" << p.GetString () << ' ' << q.GetString () << '\n';
+  std::cerr << "uncached:" << cache.GetMisses () - misses << '\n';
+  p = client.IncludeTranslate ("./hdr.h");
+  q = client.IncludeTranslate ("./quux.h");
+  std::cerr << "translate:" << (p.GetString () == "hdr-mapped.cmi") << ' '
+	    << q.GetInteger () << '\n';
+
+  // Compilation forgets the cached answer
+  p = client.ModuleCompiled ("foo");
+  q = client.ModuleImport ("foo");
+  std::cerr << "compiled:" << (p.GetCode () == Client::PC_OK) << ' '
+	    << q.GetString () << '\n';
+
+  std::cerr << "cache:" << cache.GetHits () << ' ' << cache.GetMisses ()
+	    << '\n';
+  std::cerr << "map:" << mapper.GetHits () << ' ' << mapper.GetMisses ()
+	    << '\n';
+  std::cerr << "file:" << file.GetHits () << ' ' << file.GetMisses ()
+	    << '\n';
+  std::cerr << "forward:" << forward.GetHits () << ' '
+	    << forward.GetMisses () << '\n';
+
+  // Without stages, Resolver's defaults
+  ResolverPipeline empty;
+  Server other (&empty);
+  Client direct (&other);
+  direct.Connect ("TEST", "IDENT");
+  p = direct.ModuleImport ("x");
+  q = direct.ModuleRepo ();
+  std::cerr << "default:" << p.GetString () << ' ' << q.GetString () << '\n';
+
+  unlink (cmi);
+  rmdir (repo);
+  unlink (map);
+  unlink (bad);
+
+  return 0;
+}
@@ -0,0 +1,273 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Test caching proxy, in front of an upstream mapper process
+// RUN: $subdir$stem |& ezio $test
+// RUN-END:
+
+// CHECK-NEXT: ^upstream:block$
+// CHECK-NEXT: ^upstream:hello cody-proxy proxy-0$
+// CHECK-NEXT: ^add:0$
+// CHECK-NEXT: ^HELLO 1 default$
+// CHECK-NEXT: ^upstream:block$
+// CHECK-NEXT: ^upstream:import foo$
+// CHECK-NEXT: ^upstream:block$
+// CHECK-NEXT: ^upstream:import bar$
+// CHECK-NEXT: ^upstream:repo$
+// CHECK-NEXT: ^1:PATHNAME bar.cmi$
+// CHECK-NEXT: ^0:PATHNAME foo.cmi$
+// CHECK-NEXT: ^2:PATHNAME bar.cmi$
+// CHECK-NEXT: ^3:PATHNAME cmi.cache ;|PATHNAME foo.cmi$
+// CHECK-NEXT: ^0:PATHNAME foo.cmi$
+// CHECK-NEXT: ^upstream:block$
+// CHECK-NEXT: ^upstream:compiled foo$
+// CHECK-NEXT: ^1:OK$
+// CHECK-NEXT: ^upstream:block$
+// CHECK-NEXT: ^upstream:import foo$
+// CHECK-NEXT: ^2:PATHNAME foo.cmi$
+// CHECK-NEXT: ^counts:1 7 5 4$
+// CHECK-NEXT: ^upstream:0$
+// CHECK-NEXT: ^stuck:1 1$
+// CHECK-NEXT: $EOF
+
+// Cody
+#include "cody.hh"
+// C++
+#include <iostream>
+#include <thread>
+// C
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+// OS
+#include <unistd.h>
+#include <sys/wait.h>
+
+using namespace Cody;
+
+class Upstream final : public Resolver
+{
+public:
+  virtual Resolver *ConnectRequest (Server *s, unsigned version,
+				    std::string &agent, std::string &ident)
+  {
+    std::cerr << "upstream:hello " << agent << ' ' << ident << '\n';
+    return Resolver::ConnectRequest (s, version, agent, ident);
+  }
+  virtual int ModuleRepoRequest (Server *s)
+  {
+    std::cerr << "upstream:repo\n";
+    return Resolver::ModuleRepoRequest (s);
+  }
+  virtual int ModuleImportRequest (Server *s, Flags flags,
+				   std::string &module)
+  {
+    std::cerr << "upstream:import " << module << '\n';
+    return Resolver::ModuleImportRequest (s, flags, module);
+  }
+  virtual int ModuleCompiledRequest (Server *s, Flags flags,
+				     std::string &module)
+  {
+    std::cerr << "upstream:compiled " << module << '\n';
+    return Resolver::ModuleCompiledRequest (s, flags, module);
+  }
+};
+
+// The upstream mapper process.  It waits on GATE before answering
+// its second block, so the proxy queues requests meanwhile.
+
+static int Serve (int fd, int gate)
+{
+  Upstream r;
+  Server server (&r, fd);
+
+  for (unsigned blocks = 0;; blocks++)
+    {
+      int err;
+      server.PrepareToRead ();
+      while ((err = server.Read ()) == EAGAIN || err == EINTR)
+	continue;
+      if (err)
+	return err < 0 ? 0 : err;
+      std::cerr << "upstream:block\n";
+      if (blocks == 1)
+	{
+	  char c;
+	  (void)!read (gate, &c, 1);
+	}
+      server.ProcessRequests ();
+      server.PrepareToWrite ();
+      while ((err = server.Write ()) == EAGAIN || err == EINTR)
+	continue;
+      if (err)
+	return err;
+    }
+}
+
+// An upstream mapper that answers the handshake, and nothing else
+
+static void Stall (int fd)
+{
+  Resolver r;
+  Server server (&r, fd);
+  int err;
+  server.PrepareToRead ();
+  while ((err = server.Read ()) == EAGAIN || err == EINTR)
+    continue;
+  server.ProcessRequests ();
+  server.PrepareToWrite ();
+  while ((err = server.Write ()) == EAGAIN || err == EINTR)
+    continue;
+
+  // Until the proxy hangs up
+  char buffer[100];
+  while (read (fd, buffer, sizeof (buffer)) > 0)
+    continue;
+  close (fd);
+}
+
+class Loop : public ServerLoop
+{
+  ProxyResolver *proxy;
+
+public:
+  Loop (ProxyResolver *p)
+    : ServerLoop (p), proxy (p)
+  {
+    AddNotifier (p->GetNotifyFD ());
+  }
+
+protected:
+  virtual void Disconnected (Server *s)
+  {
+    proxy->Cancel (s);
+  }
+  virtual void Notify (int)
+  {
+    proxy->Collect ();
+  }
+};
+
+static void Send (int fd, char const *text)
+{
+  (void)!write (fd, text, strlen (text));
+}
+
+// Print a response block, with its line breaks as '|'
+
+static void Receive (int fd, int ix)
+{
+  char buffer[200];
+  ssize_t count = read (fd, buffer, sizeof (buffer));
+  std::string text (buffer, count > 1 ? size_t (count - 1) : 0);
+  for (auto &c : text)
+    if (c == '\n')
+      c = '|';
+  std::cerr << ix << ':' << text << '\n';
+}
+
+int main (int, char *[])
+{
+  signal (SIGPIPE, SIG_IGN);
+
+  int up[2], gate[2];
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, up) < 0 || pipe (gate) < 0)
+    return 1;
+  pid_t pid = fork ();
+  if (!pid)
+    {
+      close (up[0]);
+      close (gate[1]);
+      _exit (Serve (up[1], gate[0]));
+    }
+  close (up[1]);
+  close (gate[0]);
+
+  {
+    ProxyResolver proxy;
+    int err = proxy.AddUpstream (up[0]);
+    std::cerr << "add:" << err << '\n';
+
+    Loop loop (&proxy);
+    int fds[4];
+    for (auto &fd : fds)
+      {
+	int pair[2];
+	if (socketpair (AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+	  return 1;
+	loop.AddConnection (pair[0]);
+	fd = pair[1];
+      }
+    std::thread thread ([&] () { loop.Run (); });
+
+    for (unsigned ix = 0; ix != 4; ix++)
+      {
+	Send (fds[ix], "HELLO 1 TEST IDENT\n");
+	char buffer[100];
+	ssize_t count = read (fds[ix], buffer, sizeof (buffer));
+	if (!ix)
+	  std::cerr << std::string (buffer, count > 1 ? size_t (count - 1) : 0)
+		    << '\n';
+      }
+
+    // Goes upstream alone, and is held there
+    Send (fds[0], "MODULE-IMPORT foo\n");
+    while (proxy.GetForwarded () != 1)
+      std::this_thread::yield ();
+
+    // Queue as one block, with the second bar and foo merged
+    Send (fds[1], "MODULE-IMPORT bar\n");
+    Send (fds[2], "MODULE-IMPORT bar\n");
+    Send (fds[3], "MODULE-REPO ;\nMODULE-IMPORT foo\n");
+    while (proxy.GetMisses () != 5)
+      std::this_thread::yield ();
+    Send (gate[1], "!");
+    // The second block's response is last upstream
+    for (unsigned ix : {1, 0, 2, 3})
+      Receive (fds[ix], ix);
+
+    // Cached
+    Send (fds[0], "MODULE-IMPORT foo\n");
+    Receive (fds[0], 0);
+
+    // Rebuilt, so asked again
+    Send (fds[1], "MODULE-COMPILED foo\n");
+    Receive (fds[1], 1);
+    Send (fds[2], "MODULE-IMPORT foo\n");
+    Receive (fds[2], 2);
+
+    std::cerr << "counts:" << proxy.GetHits () << ' ' << proxy.GetMisses ()
+	      << ' ' << proxy.GetForwarded () << ' ' << proxy.GetBatches ()
+	      << '\n';
+
+    for (auto fd : fds)
+      close (fd);
+    thread.join ();
+  }
+
+  int status;
+  waitpid (pid, &status, 0);
+  std::cerr << "upstream:" << (WIFEXITED (status) ? WEXITSTATUS (status) : -1)
+	    << '\n';
+
+  // Destroying the proxy abandons a block the upstream does not answer
+  int stuck[2];
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, stuck) < 0)
+    return 1;
+  std::thread staller (Stall, stuck[1]);
+  {
+    ProxyResolver proxy;
+    int err = proxy.AddUpstream (stuck[0]);
+    Server server (&proxy);
+    std::string name ("never");
+    proxy.ModuleImportRequest (&server, Flags::None, name);
+    while (proxy.GetForwarded () != 1)
+      std::this_thread::yield ();
+    std::cerr << "stuck:" << !err << ' ';
+  }
+  staller.join ();
+  std::cerr << 1 << '\n';
+
+  return 0;
+}
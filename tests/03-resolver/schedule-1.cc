@@ -0,0 +1,83 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Test build scheduling & deferred responses
+/*
+  RUN:<<HELLO 1 TEST IDENT ;
+  RUN:<<MODULE-IMPORT foo ;
+  RUN:<<MODULE-IMPORT bar ;
+  RUN:<<MODULE-REPO ;
+  RUN:<<MODULE-IMPORT foo ;
+  RUN:<<MODULE-IMPORT baz 1
+*/
+// RUN: $subdir$stem | ezio -p OUT $test |& ezio -p ERR $test
+// RUN-END:
+
+/*
+  OUT-NEXT: ^HELLO 1 default ;
+  OUT-NEXT: ^PATHNAME foo.cmi ;
+  OUT-NEXT: ^ERROR 'failed building \'bar\' No such file or directory' ;
+  OUT-NEXT: ^PATHNAME cmi.cache ;
+  OUT-NEXT: ^PATHNAME foo.cmi ;
+  OUT-NEXT: ^PATHNAME baz.cmi
+*/
+// OUT-NEXT:$EOF
+
+// ERR-NEXT:builds:2$
+// ERR-NEXT:$EOF
+
+// Cody
+#include "cody.hh"
+// C++
+#include <atomic>
+#include <iostream>
+
+using namespace Cody;
+
+class Builder : public BuildScheduler
+{
+public:
+  std::atomic<unsigned> builds {0};
+
+public:
+  Builder ()
+    : BuildScheduler (2)
+  {
+  }
+  ~Builder ()
+  {
+    Shutdown ();
+  }
+
+private:
+  virtual bool IsBuilt (std::string const &, std::string const &)
+  {
+    return false;
+  }
+  virtual int Build (std::string const &module, std::string const &)
+  {
+    builds++;
+    return module == "bar" ? ENOENT : 0;
+  }
+};
+
+int main (int, char *[])
+{
+  Builder r;
+  Server server (&r, 0, 1);
+
+  while (int e = server.Read ())
+    if (e != EAGAIN && e != EINTR)
+      break;
+
+  server.ProcessRequests ();
+  r.WaitUntilReady (&server);
+  server.PrepareToWrite ();
+
+  while (int e = server.Write ())
+    if (e != EAGAIN && e != EINTR)
+      break;
+
+  std::cerr << "builds:" << r.builds << '\n';
+}
@@ -0,0 +1,163 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Cody
+#include "internal.hh"
+// C++
+#include <chrono>
+// C
+#include <cerrno>
+#include <cstdio>
+// OS
+#include <fcntl.h>
+#include <unistd.h>
+
+// Trace event code
+
+// Each event is written with a single write to an O_APPEND FD, so
+// events from several threads and processes do not interleave.  The
+// file's creator writes the opening '['.  Events are complete ('X')
+// events, so a Server need not remember anything between a block's
+// begin and end beyond its start time.
+
+namespace Cody {
+
+int Tracer::Open (char const *path)
+{
+  Close ();
+
+  bool created = true;
+  int f = open (path, O_WRONLY | O_APPEND | O_CREAT | O_EXCL | O_CLOEXEC,
+		0666);
+  if (f < 0 && errno == EEXIST)
+    {
+      created = false;
+      f = open (path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    }
+  if (f < 0)
+    return errno;
+
+  if (created && write (f, "[\n", 2) != 2)
+    {
+      int err = errno;
+      close (f);
+      return err;
+    }
+
+  fd = f;
+  pid = unsigned (getpid ());
+
+  return 0;
+}
+
+void Tracer::Close ()
+{
+  if (fd >= 0)
+    close (fd);
+  fd = -1;
+}
+
+uint64_t Tracer::Now ()
+{
+  return uint64_t (std::chrono::duration_cast<std::chrono::nanoseconds>
+		   (std::chrono::steady_clock::now ().time_since_epoch ())
+		   .count ());
+}
+
+// A compilation's track is a hash of its ident, so the same ident
+// has the same track in every process.  Connections without one get
+// a track of their own.
+
+static unsigned Track (std::string const &ident, void const *owner)
+{
+  uint32_t hash = 2166136261u;
+  if (ident.empty ())
+    {
+      auto bits = uintptr_t (owner);
+      for (unsigned ix = sizeof (bits); ix--; bits >>= 8)
+	hash = (hash ^ (bits & 0xff)) * 16777619u;
+    }
+  else
+    for (unsigned char c : ident)
+      hash = (hash ^ c) * 16777619u;
+
+  return hash & 0x7fffffff;
+}
+
+static void AppendString (std::string &json, char const *str)
+{
+  json.push_back ('"');
+  for (; *str; str++)
+    {
+      unsigned char c = *str;
+      if (c == '"' || c == '\\')
+	{
+	  json.push_back ('\\');
+	  json.push_back (c);
+	}
+      else if (c < 0x20)
+	{
+	  char escape[8];
+	  snprintf (escape, sizeof (escape), "\\u%04x", c);
+	  json.append (escape);
+	}
+      else
+	json.push_back (c);
+    }
+  json.push_back ('"');
+}
+
+void Tracer::NameTrack (std::string const &ident, void const *owner)
+{
+  if (fd < 0)
+    return;
+
+  std::string json (u8"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":");
+  json.append (std::to_string (pid));
+  json.append (u8",\"tid\":");
+  json.append (std::to_string (Track (ident, owner)));
+  json.append (u8",\"args\":{\"name\":");
+  AppendString (json, ident.empty () ? u8"(anonymous)" : ident.c_str ());
+  json.append (u8"}},\n");
+
+  (void)!write (fd, json.data (), json.size ());
+}
+
+void Tracer::Event (char const *name, char const *cat,
+		    std::string const &ident, void const *owner,
+		    uint64_t start, unsigned count)
+{
+  if (fd < 0)
+    return;
+
+  uint64_t end = Now ();
+  char times[64];
+  snprintf (times, sizeof (times), ",\"ts\":%llu.%03u,\"dur\":%llu.%03u",
+	    (unsigned long long)(start / 1000), unsigned (start % 1000),
+	    (unsigned long long)((end - start) / 1000),
+	    unsigned ((end - start) % 1000));
+
+  std::string json (u8"{\"name\":");
+  AppendString (json, name);
+  json.append (u8",\"cat\":");
+  AppendString (json, cat);
+  json.append (u8",\"ph\":\"X\"");
+  json.append (times);
+  json.append (u8",\"pid\":");
+  json.append (std::to_string (pid));
+  json.append (u8",\"tid\":");
+  json.append (std::to_string (Track (ident, owner)));
+  json.append (u8",\"args\":{\"ident\":");
+  AppendString (json, ident.c_str ());
+  if (count)
+    {
+      json.append (u8",\"requests\":");
+      json.append (std::to_string (count));
+    }
+  json.append (u8"}},\n");
+
+  (void)!write (fd, json.data (), json.size ());
+}
+
+}
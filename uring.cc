@@ -0,0 +1,333 @@
+// CODYlib		-*- mode:c++ -*-
+// Copyright (C) 2020 Nathan Sidwell, nathan@acm.org
+// License: Apache v2.0
+
+// Cody
+#include "internal.hh"
+#if CODY_NETWORKING
+// C++
+#include <algorithm>
+// C
+#include <cerrno>
+#include <cstring>
+// OS
+#if defined (__linux__) && defined (__has_include)
+#if __has_include (<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+// Multishot accept is the newest feature used
+#if defined (IORING_ACCEPT_MULTISHOT)
+#define HAVE_URING 1
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#else
+#define HAVE_URING 0
+#endif
+
+// io_uring code
+
+// The ring is driven with raw system calls, rather than liburing.
+// The kernel and we share the rings' heads and tails, so they are
+// accessed atomically, acquiring what the other side released.
+
+namespace Cody {
+namespace Detail {
+
+#if HAVE_URING
+static unsigned Load (unsigned const *ptr)
+{
+  return __atomic_load_n (ptr, __ATOMIC_ACQUIRE);
+}
+
+static void Store (unsigned *ptr, unsigned val)
+{
+  __atomic_store_n (ptr, val, __ATOMIC_RELEASE);
+}
+#endif
+
+Ring::~Ring ()
+{
+#if HAVE_URING
+  if (fd >= 0)
+    close (fd);
+  if (rings)
+    munmap (rings, ringsSize);
+  if (sqes)
+    munmap (sqes, sqesSize);
+  if (slots)
+    munmap (slots, slotCount * SlotSize);
+#endif
+}
+
+int Ring::Open (unsigned entries_, unsigned slots_)
+{
+#if HAVE_URING
+  io_uring_params params;
+  memset (&params, 0, sizeof (params));
+  int f = int (syscall (__NR_io_uring_setup, entries_, &params));
+  if (f < 0)
+    return errno;
+  fd = f;
+
+  // Timed waits, single mapping and no dropped completions
+  unsigned needed = IORING_FEAT_EXT_ARG | IORING_FEAT_SINGLE_MMAP
+    | IORING_FEAT_NODROP;
+  if ((params.features & needed) != needed)
+    return ENOSYS;
+
+  ringsSize = std::max (params.sq_off.array
+			+ params.sq_entries * sizeof (unsigned),
+			params.cq_off.cqes
+			+ params.cq_entries * sizeof (io_uring_cqe));
+  rings = mmap (nullptr, ringsSize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (rings == MAP_FAILED)
+    {
+      rings = nullptr;
+      return errno;
+    }
+  sqesSize = params.sq_entries * sizeof (io_uring_sqe);
+  sqes = mmap (nullptr, sqesSize, PROT_READ | PROT_WRITE,
+	       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+    {
+      sqes = nullptr;
+      return errno;
+    }
+
+  char *base = static_cast<char *> (rings);
+  sqHead = reinterpret_cast<unsigned *> (base + params.sq_off.head);
+  sqTail = reinterpret_cast<unsigned *> (base + params.sq_off.tail);
+  sqArray = reinterpret_cast<unsigned *> (base + params.sq_off.array);
+  sqMask = *reinterpret_cast<unsigned *> (base + params.sq_off.ring_mask);
+  cqHead = reinterpret_cast<unsigned *> (base + params.cq_off.head);
+  cqTail = reinterpret_cast<unsigned *> (base + params.cq_off.tail);
+  cqMask = *reinterpret_cast<unsigned *> (base + params.cq_off.ring_mask);
+  cqes = base + params.cq_off.cqes;
+  entries = params.sq_entries;
+
+  // The read buffers.  Registering them saves mapping them on each
+  // read, but counts against the locked memory limit.  Without that,
+  // they are used for plain reads.
+  void *region = mmap (nullptr, slots_ * SlotSize, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED)
+    return errno;
+  slots = static_cast<char *> (region);
+  slotCount = slots_;
+  std::vector<iovec> iovs (slotCount);
+  for (unsigned ix = 0; ix != slotCount; ix++)
+    {
+      iovs[ix].iov_base = slots + ix * SlotSize;
+      iovs[ix].iov_len = SlotSize;
+    }
+  registered = !syscall (__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS,
+			 iovs.data (), slotCount);
+  for (unsigned ix = slotCount; ix--;)
+    freeSlots.push_back (ix);
+
+  return 0;
+#else
+  (void)entries_;
+  (void)slots_;
+  return ENOSYS;
+#endif
+}
+
+bool Ring::GetSlot (unsigned &slot)
+{
+  if (freeSlots.empty ())
+    return false;
+
+  slot = freeSlots.back ();
+  freeSlots.pop_back ();
+
+  return true;
+}
+
+int Ring::Enter (unsigned submit, unsigned wait, unsigned flags,
+		 void const *arg, size_t argSize)
+{
+#if HAVE_URING
+  calls++;
+  int res = int (syscall (__NR_io_uring_enter, fd, submit, wait, flags,
+			  arg, argSize));
+  if (res < 0)
+    return errno;
+  queued -= unsigned (res) < queued ? unsigned (res) : queued;
+  return 0;
+#else
+  (void)submit;
+  (void)wait;
+  (void)flags;
+  (void)arg;
+  (void)argSize;
+  return ENOSYS;
+#endif
+}
+
+// A zeroed submission entry, submitting the queue first if it is
+// full.
+
+void *Ring::GetSqe ()
+{
+#if HAVE_URING
+  unsigned tail = *sqTail;
+  if (tail - Load (sqHead) == entries)
+    Enter (queued, 0, 0);
+
+  auto *sqe = static_cast<io_uring_sqe *> (sqes) + (tail & sqMask);
+  memset (sqe, 0, sizeof (*sqe));
+  sqArray[tail & sqMask] = tail & sqMask;
+  Store (sqTail, tail + 1);
+  queued++;
+
+  return sqe;
+#else
+  return nullptr;
+#endif
+}
+
+void Ring::Accept (int f, uint64_t tag, bool multishot)
+{
+#if HAVE_URING
+  auto *sqe = static_cast<io_uring_sqe *> (GetSqe ());
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = f;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  if (multishot)
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = tag;
+#else
+  (void)f;
+  (void)tag;
+  (void)multishot;
+#endif
+}
+
+void Ring::Poll (int f, uint64_t tag, bool multishot)
+{
+#if HAVE_URING
+  auto *sqe = static_cast<io_uring_sqe *> (GetSqe ());
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = f;
+  sqe->poll32_events = POLLIN;
+  if (multishot)
+    sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = tag;
+#else
+  (void)f;
+  (void)tag;
+  (void)multishot;
+#endif
+}
+
+void Ring::Read (int f, unsigned slot, uint64_t tag)
+{
+#if HAVE_URING
+  auto *sqe = static_cast<io_uring_sqe *> (GetSqe ());
+  sqe->opcode = registered ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  sqe->fd = f;
+  // The current position, as pipes and sockets have no offset
+  sqe->off = ~uint64_t (0);
+  sqe->addr = uint64_t (uintptr_t (slots + slot * SlotSize));
+  sqe->len = SlotSize;
+  if (registered)
+    sqe->buf_index = uint16_t (slot);
+  sqe->user_data = tag;
+#else
+  (void)f;
+  (void)slot;
+  (void)tag;
+#endif
+}
+
+void Ring::Write (int f, void const *data, size_t len, uint64_t tag)
+{
+#if HAVE_URING
+  auto *sqe = static_cast<io_uring_sqe *> (GetSqe ());
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = f;
+  sqe->off = ~uint64_t (0);
+  sqe->addr = uint64_t (uintptr_t (data));
+  sqe->len = uint32_t (len);
+  sqe->user_data = tag;
+#else
+  (void)f;
+  (void)data;
+  (void)len;
+  (void)tag;
+#endif
+}
+
+// The cancellation's own completion has a zero tag, and is ignored
+
+void Ring::Cancel (uint64_t tag)
+{
+#if HAVE_URING
+  auto *sqe = static_cast<io_uring_sqe *> (GetSqe ());
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = tag;
+#else
+  (void)tag;
+#endif
+}
+
+int Ring::Wait (int timeout, std::vector<Completion> &done)
+{
+#if HAVE_URING
+  // Don't wait if there are completions already
+  bool ready = Load (cqTail) != *cqHead;
+  if (ready || !timeout)
+    {
+      if (int err = Submit ())
+	return err;
+    }
+  else if (timeout < 0)
+    {
+      if (int err = Enter (queued, 1, IORING_ENTER_GETEVENTS))
+	return err;
+    }
+  else
+    {
+      __kernel_timespec ts;
+      ts.tv_sec = timeout / 1000;
+      ts.tv_nsec = (timeout % 1000) * 1000000;
+      io_uring_getevents_arg arg;
+      memset (&arg, 0, sizeof (arg));
+      arg.ts = uint64_t (uintptr_t (&ts));
+      int err = Enter (queued, 1, IORING_ENTER_GETEVENTS
+		       | IORING_ENTER_EXT_ARG, &arg, sizeof (arg));
+      if (err && err != ETIME)
+	return err;
+    }
+
+  unsigned head = *cqHead;
+  unsigned tail = Load (cqTail);
+  for (; head != tail; head++)
+    {
+      auto const *cqe = static_cast<io_uring_cqe const *> (cqes)
+	+ (head & cqMask);
+      if (cqe->user_data)
+	done.push_back (Completion {cqe->user_data, cqe->res,
+				    bool (cqe->flags & IORING_CQE_F_MORE)});
+    }
+  Store (cqHead, head);
+
+  return 0;
+#else
+  (void)timeout;
+  (void)done;
+  return ENOSYS;
+#endif
+}
+
+}
+}
+#endif